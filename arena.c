@@ -0,0 +1,154 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "mem.h"
+#include "stats.h"
+#include "config.h"
+
+/* Slot alignment, one cache line. */
+#define ARENA_ALIGN		64
+
+#define ARENA_ROUND(x, a)	(((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/* Adds a slot of len bytes to the plan, returns the planned total. */
+size_t
+arena_plan(arena_t *a, size_t len)
+{
+	a->planned += ARENA_ROUND(len, ARENA_ALIGN);
+	return a->planned;
+}
+
+/*
+ * Bytes arena_reserve() would have to map on top of the current
+ * reservation to satisfy the plan.
+ */
+size_t
+arena_growth(const arena_t *a)
+{
+	if (NULL == a->base)
+		return a->planned;
+	return a->size >= a->planned ? 0 : a->planned - a->size;
+}
+
+/*
+ * Reserves the planned amount in one mapping. Large plans first try
+ * explicit huge pages and otherwise ask for transparent ones. Pages
+ * are only faulted in when the slots get written.
+ */
+int
+arena_reserve(arena_t *a)
+{
+	size_t size;
+
+	if (NULL != a->base && a->size >= a->planned)
+		return 0;
+	arena_release(a);
+
+	size = a->planned ? a->planned : ARENA_ALIGN;
+	a->huge = 0;
+	a->base = MAP_FAILED;
+	if (size >= ARENA_HUGE_PAGE_SIZE &&
+	    mem_fits(ARENA_ROUND(size, ARENA_HUGE_PAGE_SIZE))) {
+		size = ARENA_ROUND(size, ARENA_HUGE_PAGE_SIZE);
+		a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		               -1, 0);
+		a->huge = MAP_FAILED != a->base;
+	}
+	if (MAP_FAILED == a->base) {
+		a->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (MAP_FAILED == a->base) {
+		perror("Failed to reserve buffer arena");
+		a->base = NULL;
+		return 1;
+	}
+	if (0 != mem_charge(size)) {
+		fprintf(stderr, "Buffer arena of %zu bytes exceeds the memory "
+		        "budget!\n", size);
+		munmap(a->base, size);
+		a->base = NULL;
+		return 1;
+	}
+#ifdef MADV_HUGEPAGE
+	if (!a->huge && size >= ARENA_HUGE_PAGE_SIZE)
+		madvise(a->base, size, MADV_HUGEPAGE);
+#endif
+
+	a->size = size;
+	a->used = 0;
+	stats_alloc(size);
+
+	return 0;
+}
+
+/* Hands out the next slot, callers must stay within their plan. */
+void *
+arena_alloc(arena_t *a, size_t len)
+{
+	void *p;
+
+	len = ARENA_ROUND(len, ARENA_ALIGN);
+	if (NULL == a->base || a->size - a->used < len) {
+		fprintf(stderr, "Buffer arena exhausted!\n");
+		return NULL;
+	}
+
+	p = a->base + a->used;
+	a->used += len;
+
+	return p;
+}
+
+/* Starts a new plan, keeping the mapping for reuse when it is big enough. */
+void
+arena_reset(arena_t *a)
+{
+	a->planned = 0;
+	a->used = 0;
+}
+
+void
+arena_release(arena_t *a)
+{
+	if (NULL != a->base) {
+		if (0 != munmap(a->base, a->size))
+			perror("Failed to release buffer arena");
+		mem_uncharge(a->size);
+	}
+	a->base = NULL;
+	a->size = a->used = 0;
+	a->huge = 0;
+}
@@ -27,21 +27,29 @@
  * SUCH DAMAGE.
  */
 
+#include <sys/stat.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
 
 #include "boost.h"
+#include "arena.h"
+#include "check.h"
+#include "extract.h"
+#include "layout.h"
+#include "manifest.h"
+#include "mem.h"
+#include "optimize.h"
+#include "pool.h"
+#include "squeeze.h"
+#include "stats.h"
 #include "util.h"
+#include "verify.h"
 #include "config.h"
 
-#define IS_ARM_BRANCH(ins) (((ins) & (0xea << 24)) | \
-                            ((ins) & (0xeb << 24)))
-
-#define OFFSET_2_BRANCHL(off) ((0xeb << 24) | \
-	(((off - 8) >> 2) & 0x00ffffff))
-#define BRANCHL_2_OFFSET(br) (((br & 0x00ffffff) << 2) + 8)
-
 #define OFFSET_2_BRANCH(off) ((0xea << 24) | \
 	(((off + 248) >> 2) & 0x00ffffff))
 #define BRANCH_2_OFFSET(br) (((br & 0x00ffffff) << 2) - 248)
@@ -49,12 +57,18 @@
 /* Forward declarations of local functions */
 int  boost_create_adv(const char *, const image_create_args_t *);
 int  boost_create_simple(const char *, const image_create_args_t *);
-int  boost_extract_new(const uint32_t *, size_t);
-int  boost_extract_legacy(const uint32_t *, size_t);
-void boost_setup_header(boost_hdr_t *, const uint32_t *, size_t, const image_create_args_t *);
-int  boost_is_legacy(const boost_hdr_t *hdr);
+int  boost_compress(const segment_t *, size_t, const image_create_args_t *,
+                    void *, size_t, size_t *, uint32_t *, uint32_t *);
+size_t boost_chunks_space(const image_create_args_t *, size_t);
+size_t boost_put_chunks(char *, size_t, const image_create_args_t *, size_t,
+                        const uint32_t *);
+int  boost_write_stream(const char *, const segment_t *, size_t, int,
+                        const image_create_args_t *);
 int  bcode_check(uint32_t);
 
+/* Buffers of create, kept mapped so batches of images reuse them. */
+static arena_t create_arena;
+
 void
 boost_print_info(boost_hdr_t hdr)
 {
@@ -116,59 +130,127 @@ boost_print_info(boost_hdr_t hdr)
 	}
 }
 
-int
-boost_extract(boost_hdr_t hdr, void *data)
+/*
+ * Lays out the payload of a new image as segments, segs must have room
+ * for ramdisk_nsegs + 5 of them. Returns their number.
+ */
+static size_t
+boost_payload_segs(const image_create_args_t *cargs, const uint32_t *startup,
+                   const uint32_t *bcode, size_t payload_len,
+                   segment_t *segs)
 {
-	uint32_t first_instr = 0;
-	size_t len = 0;
-	int rv = 0;
-
-	if (0 != boost_check(hdr, data)) {
-		return 1;
+	size_t nsegs = 0, i;
+
+	/* Components are laid out at 4 byte granularity. */
+	segs[nsegs].data = (char *)startup;
+	segs[nsegs++].len = STARTUP_BYTES;
+	segs[nsegs].data = (char *)cargs->kernel;
+	segs[nsegs++].len = cargs->kernel_len & ~3UL;
+	segs[nsegs].data = (char *)bcode;
+	segs[nsegs++].len = cargs->bcode_len & ~3UL;
+	if (NULL != cargs->ramdisk_segs) {
+		for (i = 0; i < cargs->ramdisk_nsegs; i++)
+			segs[nsegs++] = cargs->ramdisk_segs[i];
+	} else if (NULL != cargs->ramdisk) {
+		segs[nsegs].data = (char *)cargs->ramdisk;
+		segs[nsegs++].len = cargs->ramdisk_len;
 	}
+	/* Slack left by unaligned component sizes. */
+	segs[nsegs].data = NULL;
+	segs[nsegs].len = payload_len - segs_len(segs, nsegs);
+	nsegs++;
 
-	if (hdr.flags & BOOST_FLAG_ZLIB) {
-		// Actual zlib stream begins 4 bytes into the data section
-		data = zlib_decompress(data + 4, hdr.image_size, &len);
-		if (data == NULL) {
-			return 1;
-		}
-		printf("Zlib unpack\t: OK\n");
-	} else {
-		len = hdr.image_size;
+	return nsegs;
+}
+
+/* Fails create once the image is known to exceed --max-size. */
+static int
+boost_check_size(const image_create_args_t *cargs, size_t len)
+{
+	if (0 == cargs->max_size || len <= cargs->max_size)
+		return 0;
+
+	fprintf(stderr, "Image of %zu bytes exceeds --max-size of %zu "
+	        "bytes!\n", len, cargs->max_size);
+	return 1;
+}
+
+/*
+ * create --estimate, predicts the image size from a sample of the
+ * payload instead of compressing all of it, see zlib_estimate(). Level
+ * 9 stands in for the slow encoders.
+ */
+static int
+boost_estimate(const image_create_args_t *cargs)
+{
+	zlib_estimate_t est;
+	zlib_params_t params;
+	segment_t *segs, kernel_seg;
+	size_t payload_len, nsegs, fixed;
+	int rv = 1;
+
+	if (NULL == cargs->bcode && !cargs->use_zlib) {
+		fixed = sizeof(boost_hdr_t) + cargs->kernel_len;
+		printf("Image size\t: %zu bytes (uncompressed)\n", fixed);
+		return boost_check_size(cargs, fixed);
 	}
 
-	first_instr = ((uint32_t *)(data))[0];
-	if (IS_ARM_BRANCH(first_instr)) {
-		if (boost_is_legacy(&hdr)) {
-			rv = boost_extract_legacy(data, len);
-		} else {
-			rv = boost_extract_new(data, len);
-		}
+	segs = mem_alloc((cargs->ramdisk_nsegs + 5) * sizeof(segment_t));
+	if (NULL == segs)
+		return 1;
+	if (NULL != cargs->bcode) {
+		payload_len = STARTUP_BYTES + cargs->kernel_len +
+		              cargs->bcode_len + cargs->ramdisk_len;
+		nsegs = boost_payload_segs(cargs, NULL, cargs->bcode,
+		                           payload_len, segs);
 	} else {
-		printf("Warning: unknown image format!\n");
-		if (0 != write_to_file(data, len, "payload.bin")) {
-			printf("Writing payload.bin\t: Failed\n");
-			rv = 1;
-			goto extract_cleanup;
-		}
-		printf("Writing payload.bin\t: OK\n");
+		kernel_seg.data = (char *)cargs->kernel;
+		kernel_seg.len = payload_len = cargs->kernel_len;
+		segs[0] = kernel_seg;
+		nsegs = 1;
 	}
 
-extract_cleanup:
-	if (hdr.flags & BOOST_FLAG_ZLIB) {
-		free(data);
+	zlib_default_params(&params);
+	if (cargs->squeeze || cargs->optimize)
+		params.level = 9;
+	if (0 != zlib_estimate(segs, nsegs, &params, ESTIMATE_BLOCK,
+	                       ESTIMATE_SAMPLES, &est)) {
+		fprintf(stderr, "Failed to estimate image size!\n");
+		goto estimate_failed;
 	}
 
+	fixed = sizeof(boost_hdr_t) + sizeof(uint32_t) +
+	        boost_chunks_space(cargs, payload_len);
+	printf("Payload\t\t: %zu bytes, %zu blocks of %zukB sampled\n",
+	       payload_len, est.nsamples, (size_t)ESTIMATE_BLOCK / 1024);
+	printf("Image size\t: %zu bytes estimated (95%%: %zu - %zu)\n",
+	       fixed + est.size, fixed + est.low, fixed + est.high);
+	rv = boost_check_size(cargs, fixed + est.size);
+
+estimate_failed:
+	mem_free(segs);
+
 	return rv;
 }
 
 int boost_create(const char *outfile, const image_create_args_t *cargs)
 {
-	if (cargs->kernel && cargs->bcode) {
-		return boost_create_adv(outfile, cargs);
-	} else if (cargs->kernel && !cargs->bcode && !cargs->ramdisk) {
-		return boost_create_simple(outfile, cargs);
+	image_create_args_t args = *cargs;
+
+	/* The slow encoders need several copies of the payload at once. */
+	if (mem_budget() && (args.squeeze || args.optimize)) {
+		fprintf(stderr, "Memory budget set, using default "
+		        "compression instead of -Z/--optimize\n");
+		args.squeeze = 0;
+		args.optimize = 0;
+	}
+
+	if (args.estimate && args.kernel && (args.bcode || !args.ramdisk)) {
+		return boost_estimate(&args);
+	} else if (args.kernel && args.bcode) {
+		return boost_create_adv(outfile, &args);
+	} else if (args.kernel && !args.bcode && !args.ramdisk) {
+		return boost_create_simple(outfile, &args);
 	} else {
 		fprintf(stderr, "Unsupported input arguments combination!\n");
 		return 1;
@@ -177,15 +259,25 @@ int boost_create(const char *outfile, const image_create_args_t *cargs)
 
 int boost_create_adv(const char *outfile, const image_create_args_t *cargs)
 {
-	uint32_t *image_buf = NULL, *copy_ptr = NULL, *image_data = NULL;
+	uint32_t startup[STARTUP_BYTES / sizeof(uint32_t)];
+	uint32_t *image_data = NULL, *bcode_buf = NULL;
 	boost_hdr_t *boost_hdr = NULL;
 	bcode_hdr_t *bcode_hdr = NULL;
-	void *zlib_data = NULL;
-	size_t zlib_data_len;
-	size_t buf_len, payload_len;
-	uint32_t branch_offset;
+	segment_t *segs = NULL;
+	zlib_params_t params;
+	create_verify_t verify;
+	create_digest_t digests;
+	size_t zlib_data_len, zlib_cap, nsegs;
+	size_t buf_len, payload_len, bcode_buf_len, chunks_len;
+	uint32_t image_data_len, *offsets = NULL;
+	uint32_t branch_offset, data_crc;
+	uint64_t start;
+	int streaming;
 	int rv = 1;
 
+	memset(&verify, 0, sizeof(create_verify_t));
+	memset(&digests, 0, sizeof(create_digest_t));
+
 	if (0 == bcode_check(cargs->bcode[0])) {
 		return 1;
 	}
@@ -194,266 +286,752 @@ int boost_create_adv(const char *outfile, const image_create_args_t *cargs)
 	buf_len += STARTUP_BYTES; /* Initial branch instruction */
 	payload_len = buf_len;
 
-	image_buf = malloc(buf_len);
-	if (NULL == image_buf) {
+	/*
+	 * The payload is handed to the compressor as segments. Only the
+	 * branch and the patched bootcode are assembled in memory, kernel
+	 * and ramdisk come straight from their mappings, with zero runs
+	 * of the ramdisk left unmaterialised.
+	 */
+	bcode_buf_len = cargs->bcode_len > sizeof(bcode_hdr_t) ?
+	                cargs->bcode_len : sizeof(bcode_hdr_t);
+	if (cargs->chunk_size)
+		zlib_cap = zlib_chunks_bound(payload_len, cargs->chunk_size);
+	else
+		zlib_cap = zlib_compress_bound(payload_len);
+	chunks_len = boost_chunks_space(cargs, payload_len);
+	zlib_default_params(&params);
+
+	/* Patched bootcode, then the final image the compressor writes into. */
+	arena_reset(&create_arena);
+	arena_plan(&create_arena, bcode_buf_len);
+	arena_plan(&create_arena, sizeof(boost_hdr_t) + sizeof(uint32_t) +
+	           zlib_cap + chunks_len);
+	streaming = !mem_fits(arena_growth(&create_arena) +
+	                      zlib_deflate_mem(&params) +
+	                      (cargs->verify ? boost_check_deep_mem() : 0));
+
+	start = stats_begin();
+	segs = mem_alloc((cargs->ramdisk_nsegs + 5) * sizeof(segment_t));
+	if (NULL == segs) {
 		fprintf(stderr, "Failed to allocate output buffer!\n");
-		return 1;
+		goto create_failed;
+	}
+	if (streaming) {
+		bcode_buf = mem_alloc(bcode_buf_len);
+	} else if (0 == arena_reserve(&create_arena)) {
+		bcode_buf = arena_alloc(&create_arena, bcode_buf_len);
+		boost_hdr = arena_alloc(&create_arena, sizeof(boost_hdr_t) +
+		                        sizeof(uint32_t) + zlib_cap +
+		                        chunks_len);
+	}
+	if (NULL == bcode_buf || (!streaming && NULL == boost_hdr)) {
+		fprintf(stderr, "Failed to allocate output buffer!\n");
+		goto create_failed;
 	}
 
 	branch_offset = STARTUP_BYTES + cargs->kernel_len + sizeof(bcode_hdr_t);
-	image_buf[0] = OFFSET_2_BRANCHL(branch_offset);
-
-	copy_ptr = image_buf + STARTUP_BYTES / sizeof(uint32_t);
-	memcpy(copy_ptr, cargs->kernel, cargs->kernel_len);
+	memset(startup, 0, STARTUP_BYTES);
+	startup[0] = OFFSET_2_BRANCHL(branch_offset);
 
-	copy_ptr += (cargs->kernel_len / sizeof(uint32_t));
-	bcode_hdr = (bcode_hdr_t *)(copy_ptr);
-	memcpy(copy_ptr, cargs->bcode, cargs->bcode_len);
-
-	copy_ptr += (cargs->bcode_len / sizeof(uint32_t));
-	if (NULL != cargs->ramdisk)
-		memcpy(copy_ptr, cargs->ramdisk, cargs->ramdisk_len);
+	memset(bcode_buf, 0, bcode_buf_len);
+	memcpy(bcode_buf, cargs->bcode, cargs->bcode_len);
+	bcode_hdr = (bcode_hdr_t *)bcode_buf;
 
 	/* Set bootcode configuration fields. */
 	bcode_hdr->bcode_off = branch_offset - sizeof(bcode_hdr_t);
 	bcode_hdr->ramdisk_size = cargs->ramdisk_len;
-#if 0
-	if (0 != write_to_file((char *)image_buf, buf_len, "payload.bin")) {
-		fprintf(stderr, "Failed to write payload.bin!\n");
+
+	nsegs = boost_payload_segs(cargs, startup, bcode_buf, payload_len,
+	                           segs);
+	stats_end(STATS_ASSEMBLE, start, bcode_buf_len, bcode_buf_len);
+	if (cargs->manifest)
+		create_digest_start(&digests, cargs, segs, nsegs);
+
+	if (streaming) {
+		rv = boost_write_stream(outfile, segs, nsegs, 1, cargs);
+		if (0 == rv && cargs->manifest)
+			rv = create_digest_finish(&digests, cargs->manifest,
+			                          outfile, NULL, 0);
 		goto create_failed;
 	}
-#endif
-	zlib_data = zlib_compress((char *)image_buf, buf_len, &zlib_data_len);
-	if (NULL == zlib_data) {
+
+	/* Data section CRC covers the length prefix and the zlib stream. */
+	image_data_len = swap_bytes_be(payload_len);
+	data_crc = cksum_update(0, (char *)&image_data_len, sizeof(uint32_t));
+	image_data = (uint32_t *)(boost_hdr + 1);
+	image_data[0] = image_data_len;
+	if (cargs->chunk_size) {
+		offsets = mem_alloc(zlib_chunks_count(payload_len,
+		                    cargs->chunk_size) * sizeof(uint32_t));
+		if (NULL == offsets)
+			goto create_failed;
+	}
+	if (0 != boost_compress(segs, nsegs, cargs, image_data + 1, zlib_cap,
+	                        &zlib_data_len, &data_crc, offsets)) {
 		fprintf(stderr, "Failed to compress image!\n");
 		goto create_failed;
 	}
-
-	free(image_buf);
-	image_buf = NULL;
-	copy_ptr = NULL;
-	bcode_hdr = NULL;
 #if 0
-	if (0 != write_to_file((char *)zlib_data, zlib_data_len, "payload.zlib")) {
+	if (0 != write_to_file((char *)(image_data + 1), zlib_data_len,
+	                       "payload.zlib")) {
 		fprintf(stderr, "Failed to write payload.zlib!\n");
 		goto create_failed;
 	}
 #endif
 	buf_len = zlib_data_len + sizeof(boost_hdr_t) + sizeof(uint32_t);
-	image_buf = malloc(buf_len);
-	if (NULL == image_buf) {
-		fprintf(stderr, "Failed to allocate output buffer!\n");
-		goto create_failed;
-	}
-
-	boost_hdr = (boost_hdr_t *)image_buf;
-	image_data = image_buf + sizeof(boost_hdr_t) / sizeof(uint32_t);
-	image_data[0] = swap_bytes_be(payload_len);
-	memcpy(image_data + 1, zlib_data, zlib_data_len);
-
-	free(zlib_data);
-	zlib_data = NULL;
 
-	boost_setup_header(boost_hdr, image_data, buf_len - sizeof(boost_hdr_t), cargs);
+	boost_setup_header(boost_hdr,
+	                   cksum_final(data_crc, buf_len - sizeof(boost_hdr_t)),
+	                   buf_len - sizeof(boost_hdr_t), cargs);
+	if (cargs->chunk_size)
+		buf_len = boost_put_chunks((char *)boost_hdr, buf_len, cargs,
+		                           payload_len, offsets);
 
-	if (0 != write_to_file((char *)image_buf, buf_len, outfile)) {
+	if (0 != boost_check_size(cargs, buf_len))
+		goto create_failed;
+	if (cargs->dry_run) {
+		printf("Image size\t: %zu bytes\n", buf_len);
+		rv = 0;
+		goto create_failed;
+	}
+	if (cargs->verify)
+		create_verify_start(&verify, (char *)(image_data + 1),
+		                    zlib_data_len, 1, segs, nsegs);
+	if (0 != write_to_file((char *)boost_hdr, buf_len, outfile)) {
 		fprintf(stderr, "Failed to write %s\n", outfile);
 		goto create_failed;
 	}
+	if (cargs->verify &&
+	    0 != create_verify_finish(&verify, outfile, boost_hdr)) {
+		unlink(outfile);
+		goto create_failed;
+	}
+	if (cargs->manifest &&
+	    0 != create_digest_finish(&digests, cargs->manifest, outfile,
+	                              (char *)boost_hdr, buf_len))
+		goto create_failed;
 
 	rv = 0;
 
 create_failed:
-	if (NULL != image_buf) {
-		free(image_buf);
+	create_verify_wait(&verify);
+	create_digest_wait(&digests);
+	if (streaming) {
+		mem_free(bcode_buf);
 	}
-	if (NULL != zlib_data) {
-		free(zlib_data);
+	mem_free(offsets);
+	mem_free(segs);
+
+	return rv;
+}
+
+/*
+ * Image creation of create --watch. The components are deflated one by
+ * one and kept in pieces, a rebuild only deflates again the kernel or
+ * ramdisk if changed says so. Startup bytes, the patched bootcode and
+ * the slack depend on the component sizes and are always redone, they
+ * are small. The image checksum follows from those of the pieces.
+ * Kernel only images have nothing to keep and are created in full.
+ */
+int
+boost_create_pieces(const char *outfile, const image_create_args_t *cargs,
+                    unsigned changed, boost_pieces_t *bp)
+{
+	uint32_t startup[STARTUP_BYTES / sizeof(uint32_t)];
+	zlib_piece_t *pc = bp->piece;
+	char head[ZLIB_HDR_LEN], tail[sizeof(uint32_t)];
+	uint32_t *bcode_buf = NULL, branch_offset, len_be, data_crc;
+	bcode_hdr_t *bcode_hdr;
+	segment_t *segs = NULL;
+	zlib_params_t params;
+	boost_hdr_t hdr;
+	size_t payload_len, bcode_buf_len, data_len, nsegs, i;
+	int fd = -1;
+	int rv = 1;
+
+	if (NULL == cargs->bcode) {
+		bp->deflated = cargs->kernel_len;
+		return boost_create_simple(outfile, cargs);
+	}
+	if (0 == bcode_check(cargs->bcode[0])) {
+		return 1;
 	}
 
+	payload_len = STARTUP_BYTES + cargs->kernel_len + cargs->bcode_len +
+	              cargs->ramdisk_len;
+	bcode_buf_len = cargs->bcode_len > sizeof(bcode_hdr_t) ?
+	                cargs->bcode_len : sizeof(bcode_hdr_t);
+	bcode_buf = mem_alloc(bcode_buf_len);
+	segs = mem_alloc((cargs->ramdisk_nsegs + 5) * sizeof(segment_t));
+	if (NULL == bcode_buf || NULL == segs) {
+		fprintf(stderr, "Failed to allocate output buffer!\n");
+		goto pieces_failed;
+	}
+
+	branch_offset = STARTUP_BYTES + cargs->kernel_len + sizeof(bcode_hdr_t);
+	memset(startup, 0, STARTUP_BYTES);
+	startup[0] = OFFSET_2_BRANCHL(branch_offset);
+	memset(bcode_buf, 0, bcode_buf_len);
+	memcpy(bcode_buf, cargs->bcode, cargs->bcode_len);
+	bcode_hdr = (bcode_hdr_t *)bcode_buf;
+	bcode_hdr->bcode_off = branch_offset - sizeof(bcode_hdr_t);
+	bcode_hdr->ramdisk_size = cargs->ramdisk_len;
+	nsegs = boost_payload_segs(cargs, startup, bcode_buf, payload_len,
+	                           segs);
+
+	/* One piece per segment, the ramdisk ones go together. */
+	for (i = 0; i < 3; i++) {
+		pc[i].segs = segs + i;
+		pc[i].nsegs = 1;
+	}
+	pc[3].segs = segs + 3;
+	pc[3].nsegs = nsegs - 4;
+	pc[4].segs = segs + nsegs - 1;
+	pc[4].nsegs = 1;
+	pc[0].stale = pc[2].stale = pc[4].stale = 1;
+	pc[1].stale |= !!(changed & BOOST_PART(INDEX_KERNEL));
+	pc[3].stale |= !!(changed & BOOST_PART(INDEX_RAMDISK));
+	for (bp->deflated = 0, i = 0; i < BOOST_PIECES; i++) {
+		pc[i].stale |= NULL == pc[i].data;
+		if (pc[i].stale)
+			bp->deflated += segs_len(pc[i].segs, pc[i].nsegs);
+	}
+
+	zlib_default_params(&params);
+	if (0 != zlib_compress_pieces(pc, BOOST_PIECES, &params)) {
+		fprintf(stderr, "Failed to compress image!\n");
+		goto pieces_failed;
+	}
+
+	len_be = swap_bytes_be(payload_len);
+	data_crc = cksum_update(0, (char *)&len_be, sizeof(uint32_t));
+	data_len = sizeof(uint32_t) +
+	           zlib_join_pieces(pc, BOOST_PIECES, &params, head, tail,
+	                            &data_crc);
+	boost_setup_header(&hdr, cksum_final(data_crc, data_len), data_len,
+	                   cargs);
+	if (0 != boost_check_size(cargs, sizeof(boost_hdr_t) + data_len))
+		goto pieces_failed;
+
+	fd = create_file(outfile);
+	if (-1 == fd ||
+	    0 != write_all(fd, (char *)&hdr, sizeof(boost_hdr_t)) ||
+	    0 != write_all(fd, (char *)&len_be, sizeof(uint32_t)) ||
+	    0 != write_all(fd, head, ZLIB_HDR_LEN)) {
+		goto pieces_failed;
+	}
+	for (i = 0; i < BOOST_PIECES; i++) {
+		if (0 != write_all(fd, pc[i].data, pc[i].len))
+			goto pieces_failed;
+	}
+	if (0 != write_all(fd, tail, sizeof(uint32_t)))
+		goto pieces_failed;
+	rv = 0;
+
+pieces_failed:
+	if (-1 != fd) {
+		if (0 != close(fd)) {
+			perror("Close failed");
+			rv = 1;
+		}
+		if (rv) {
+			fprintf(stderr, "Failed to write %s\n", outfile);
+			unlink(outfile);
+		}
+	}
+	mem_free(segs);
+	mem_free(bcode_buf);
+
 	return rv;
 }
 
 int
 boost_create_simple(const char *outfile, const image_create_args_t *cargs)
 {
-	uint32_t *data = NULL, *image_buf = NULL, *copy_dest = NULL;
-	size_t data_len = 0, image_buf_len = 0;
+	uint32_t *image_buf = NULL, *copy_dest = NULL;
+	size_t data_len = 0, data_cap, image_buf_len = 0, chunks_len;
+	uint32_t data_crc = 0, kernel_len_be, *offsets = NULL;
+	segment_t kernel_seg = { (char *)cargs->kernel, cargs->kernel_len };
+	zlib_params_t params;
+	create_verify_t verify;
+	create_digest_t digests;
 	boost_hdr_t *hdr = NULL;
+	uint64_t start;
 	int rv = 1;
 
-	if (cargs->use_zlib) {
-		data = zlib_compress((char *)cargs->kernel, cargs->kernel_len, &data_len);
-		if (NULL == data) {
-			fprintf(stderr, "Failed to compress image!\n");
-			goto create_simple_failed;
-		}
-		data_len += 4; /* Unpacked data size field. */
-	} else {
-		data = cargs->kernel;
-		data_len = cargs->kernel_len;
+	memset(&verify, 0, sizeof(create_verify_t));
+	memset(&digests, 0, sizeof(create_digest_t));
+
+	/* Header and data section, the compressor writes in place. */
+	zlib_default_params(&params);
+	if (cargs->use_zlib && cargs->chunk_size)
+		data_cap = sizeof(uint32_t) +
+		           zlib_chunks_bound(cargs->kernel_len,
+		                             cargs->chunk_size);
+	else if (cargs->use_zlib)
+		data_cap = sizeof(uint32_t) +
+		           zlib_compress_bound(cargs->kernel_len);
+	else
+		data_cap = cargs->kernel_len;
+	chunks_len = boost_chunks_space(cargs, cargs->kernel_len);
+	if (cargs->manifest)
+		create_digest_start(&digests, cargs, &kernel_seg, 1);
+
+	arena_reset(&create_arena);
+	arena_plan(&create_arena, sizeof(boost_hdr_t) + data_cap + chunks_len);
+	if (!mem_fits(arena_growth(&create_arena) +
+	              (cargs->use_zlib ? zlib_deflate_mem(&params) : 0) +
+	              (cargs->verify ? boost_check_deep_mem() : 0))) {
+		rv = boost_write_stream(outfile, &kernel_seg, 1,
+		                        cargs->use_zlib, cargs);
+		if (0 == rv && cargs->manifest)
+			rv = create_digest_finish(&digests, cargs->manifest,
+			                          outfile, NULL, 0);
+		goto simple_failed;
 	}
-
-	image_buf_len = sizeof(boost_hdr_t) + data_len;
-	image_buf = malloc(image_buf_len);
-	if (NULL == image_buf) {
+	if (0 != arena_reserve(&create_arena)) {
 		fprintf(stderr, "Failed to allocate image buffer\n");
-		goto create_simple_failed;
+		goto simple_failed;
+	}
+	image_buf = arena_alloc(&create_arena, sizeof(boost_hdr_t) + data_cap +
+	                        chunks_len);
+	if (NULL == image_buf) {
+		goto simple_failed;
+	}
+	if (cargs->use_zlib && cargs->chunk_size) {
+		offsets = mem_alloc(zlib_chunks_count(cargs->kernel_len,
+		                    cargs->chunk_size) * sizeof(uint32_t));
+		if (NULL == offsets)
+			goto simple_failed;
 	}
 
 	hdr = (boost_hdr_t *)image_buf;
 	copy_dest = (image_buf + sizeof(boost_hdr_t) / 4);
 
 	if (cargs->use_zlib) {
-		memcpy(copy_dest + 1, data, data_len - 4);
-		copy_dest[0] = swap_bytes_be(cargs->kernel_len);
+		kernel_len_be = swap_bytes_be(cargs->kernel_len);
+		data_crc = cksum_update(0, (char *)&kernel_len_be,
+		                        sizeof(uint32_t));
+		copy_dest[0] = kernel_len_be;
+		if (0 != boost_compress(&kernel_seg, 1, cargs, copy_dest + 1,
+		                        data_cap - sizeof(uint32_t), &data_len,
+		                        &data_crc, offsets)) {
+			fprintf(stderr, "Failed to compress image!\n");
+			goto simple_failed;
+		}
+		data_len += 4; /* Unpacked data size field. */
 	} else {
-		memcpy(copy_dest, data, data_len);
+		start = stats_begin();
+		data_len = cargs->kernel_len;
+		memcpy_cksum(copy_dest, cargs->kernel, data_len, &data_crc);
+		stats_end(STATS_ASSEMBLE, start, data_len, data_len);
 	}
+	image_buf_len = sizeof(boost_hdr_t) + data_len;
 
-	boost_setup_header(hdr, copy_dest, data_len, cargs);
-
+	boost_setup_header(hdr, cksum_final(data_crc, data_len), data_len, cargs);
+	if (NULL != offsets)
+		image_buf_len = boost_put_chunks((char *)image_buf,
+		                                 image_buf_len, cargs,
+		                                 cargs->kernel_len, offsets);
+
+	if (0 != boost_check_size(cargs, image_buf_len))
+		goto simple_failed;
+	if (cargs->dry_run) {
+		printf("Image size\t: %zu bytes\n", image_buf_len);
+		rv = 0;
+		goto simple_failed;
+	}
+	if (cargs->verify && cargs->use_zlib)
+		create_verify_start(&verify, (char *)(copy_dest + 1),
+		                    data_len - sizeof(uint32_t), 1,
+		                    &kernel_seg, 1);
+	else if (cargs->verify)
+		create_verify_start(&verify, (char *)copy_dest, data_len, 0,
+		                    &kernel_seg, 1);
 	if (0 != write_to_file((char *)image_buf, image_buf_len, outfile)) {
 		fprintf(stderr, "Failed to write %s\n", outfile);
-		goto create_simple_failed;
+		goto simple_failed;
+	}
+	if (cargs->verify && 0 != create_verify_finish(&verify, outfile, hdr)) {
+		unlink(outfile);
+		goto simple_failed;
 	}
+	if (cargs->manifest &&
+	    0 != create_digest_finish(&digests, cargs->manifest, outfile,
+	                              (char *)image_buf, image_buf_len))
+		goto simple_failed;
 
 	rv = 0;
 
-create_simple_failed:
-	if (data && cargs->use_zlib) {
-		free(data);
-		data = NULL;
+simple_failed:
+	create_verify_wait(&verify);
+	create_digest_wait(&digests);
+	mem_free(offsets);
+
+	return rv;
+}
+
+/* Write sink to the file descriptor at ctx, -1 for a dry run. */
+int
+boost_stream_write(void *ctx, const char *buf, size_t len)
+{
+	uint64_t start;
+	int rv;
+
+	/* Dry runs only count the bytes. */
+	if (-1 == *(int *)ctx)
+		return 0;
+	start = stats_begin();
+	rv = write_all(*(int *)ctx, buf, len);
+	stats_end(STATS_WRITE, start, len, rv ? 0 : len);
+
+	return rv;
+}
+
+/*
+ * Low memory variant of image creation. A placeholder header goes out
+ * first, the data section is streamed after it through a small buffer
+ * and the real header is written last. Deflate settings are scaled
+ * down until they fit into what is left of the memory budget.
+ */
+int
+boost_write_stream(const char *outfile, const segment_t *segs, size_t nsegs,
+                   int compress, const image_create_args_t *cargs)
+{
+	zlib_params_t params;
+	boost_hdr_t hdr;
+	uint32_t len_be, data_crc;
+	size_t data_len, avail, state, i;
+	char *buf = NULL;
+	int fd = -1;
+	int rv = 1;
+
+	if (cargs->chunk_size) {
+		fprintf(stderr, "Memory budget set, writing image without "
+		        "chunk table\n");
+	}
+	zlib_default_params(&params);
+	if (compress) {
+		avail = mem_available();
+		state = zlib_deflate_mem(&params);
+		if (avail < STREAM_BUF_SIZE ||
+		    0 != zlib_fit_params(&params, avail - STREAM_BUF_SIZE)) {
+			fprintf(stderr, "Memory budget too small to compress "
+			        "the image!\n");
+			return 1;
+		}
+		if (zlib_deflate_mem(&params) < state) {
+			fprintf(stderr, "Memory budget: deflate window %u "
+			        "bytes, memLevel %d\n",
+			        1U << params.window_bits, params.mem_level);
+		}
+		buf = mem_alloc(STREAM_BUF_SIZE);
+		if (NULL == buf)
+			return 1;
+	}
+
+	memset(&hdr, 0, sizeof(boost_hdr_t));
+	if (!cargs->dry_run) {
+		fd = create_file(outfile);
+		if (-1 == fd) {
+			goto stream_failed;
+		}
+		if (0 != write_all(fd, (char *)&hdr, sizeof(boost_hdr_t))) {
+			goto stream_failed;
+		}
+	}
+
+	data_crc = 0;
+	if (compress) {
+		len_be = swap_bytes_be(segs_len(segs, nsegs));
+		data_crc = cksum_update(0, (char *)&len_be, sizeof(uint32_t));
+		if (0 != boost_stream_write(&fd, (char *)&len_be,
+		                            sizeof(uint32_t)) ||
+		    0 != zlib_compress_stream(segs, nsegs, &params, buf,
+		                              STREAM_BUF_SIZE,
+		                              boost_stream_write, &fd,
+		                              &data_len, &data_crc)) {
+			fprintf(stderr, "Failed to compress image!\n");
+			goto stream_failed;
+		}
+		data_len += sizeof(uint32_t);
+	} else {
+		/* Uncompressed images consist of mapped data only. */
+		for (data_len = 0, i = 0; i < nsegs; i++) {
+			data_crc = cksum_update(data_crc, segs[i].data,
+			                        segs[i].len);
+			if (0 != boost_stream_write(&fd, segs[i].data,
+			                            segs[i].len))
+				goto stream_failed;
+			data_len += segs[i].len;
+		}
+	}
+
+	if (0 != boost_check_size(cargs, sizeof(boost_hdr_t) + data_len))
+		goto stream_failed;
+	if (cargs->dry_run) {
+		printf("Image size\t: %zu bytes\n",
+		       sizeof(boost_hdr_t) + data_len);
+		rv = 0;
+		goto stream_failed;
+	}
+	boost_setup_header(&hdr, cksum_final(data_crc, data_len), data_len,
+	                   cargs);
+	if (-1 == lseek(fd, 0, SEEK_SET) ||
+	    0 != write_all(fd, (char *)&hdr, sizeof(boost_hdr_t))) {
+		perror("Failed to write image header");
+		goto stream_failed;
 	}
-	if (image_buf) {
-		free(image_buf);
-		image_buf = NULL;
+	rv = 0;
+
+stream_failed:
+	mem_free(buf);
+	if (-1 != fd) {
+		if (0 != close(fd)) {
+			perror("Close failed");
+			rv = 1;
+		}
+		/* Nothing is kept in memory, the image is read back. */
+		if (0 == rv && cargs->verify)
+			rv = create_verify_file(outfile, &hdr, segs, nsegs,
+			                        compress);
+		if (rv) {
+			fprintf(stderr, "Failed to write %s\n", outfile);
+			unlink(outfile);
+		}
 	}
 
 	return rv;
 }
 
+/*
+ * Compresses the payload into out with default zlib settings or, when
+ * requested, with the maximum compression encoder, the best parameters
+ * found by the parallel search or in parallel decodable chunks, whose
+ * offsets go to offsets.
+ */
 int
-boost_check(boost_hdr_t hdr, const void *data)
+boost_compress(const segment_t *segs, size_t nsegs,
+               const image_create_args_t *cargs, void *out, size_t cap,
+               size_t *out_len, uint32_t *crc, uint32_t *offsets)
 {
-	uint32_t data_crc = 0;
-	uint32_t hdr_crc = 0;
-	int rv = 0;
+	zlib_params_t params;
+	void *tmp = NULL;
+	char *data;
+	size_t len;
+	int rv = 1;
 
-	data_crc = cksum(data, hdr.image_size);
-	hdr_crc = cksum((const char *)&hdr, BOOST_HEADER_CRC_BYTES);
+	if (cargs->chunk_size) {
+		zlib_default_params(&params);
+		return zlib_compress_chunks(segs, nsegs, &params,
+		                            cargs->chunk_size, out, cap,
+		                            out_len, crc, offsets);
+	} else if (!cargs->squeeze && !cargs->optimize) {
+		zlib_default_params(&params);
+		return zlib_compress_into(segs, nsegs, &params, out, cap,
+		                          out_len, crc);
+	}
 
-	if (hdr_crc == hdr.checksum) {
-		printf("Header checksum\t: OK\n");
+	if (cargs->squeeze) {
+		/*
+		 * -Z takes a flat copy of the payload. Its matches reach
+		 * back across segment boundaries anywhere in the window,
+		 * and its run length table already makes zero runs cheap.
+		 * The copy is small next to its per byte match cache.
+		 */
+		data = segs_flatten(segs, nsegs, &len);
+		if (NULL == data)
+			return 1;
+		tmp = squeeze_compress(data, len, out_len);
+		mem_free(data);
 	} else {
-		printf("Header checksum\t: Failed (expected %u, got %u)\n",
-		       hdr.checksum, hdr_crc);
-		rv = 1;
+		tmp = zlib_optimize(segs, nsegs, cargs->optimize, &params,
+		                    out_len);
 	}
+	if (NULL == tmp)
+		return 1;
 
-	if (data_crc == hdr.image_checksum) {
-		printf("Image checksum\t: OK\n");
+	if (*out_len > cap) {
+		fprintf(stderr, "Compressed data exceeds planned size!\n");
 	} else {
-		printf("Image checksu\t: Failed (expected %u, got %u)\n",
-		       hdr.image_checksum, data_crc);
-		rv = 1;
+		memcpy_cksum(out, tmp, *out_len, crc);
+		rv = 0;
 	}
+	mem_free(tmp);
 
 	return rv;
 }
 
 int
-boost_extract_new(const uint32_t *data, size_t len)
+boost_check(boost_hdr_t hdr, const void *data)
 {
-	uint32_t kern_off, bcode_off, rdisk_off;
-	size_t kern_size, bcode_size, rdisk_size;
-	bcode_hdr_t *hdr;
-
-	kern_off = STARTUP_BYTES;
-	bcode_off = BRANCHL_2_OFFSET(data[0]) - sizeof(bcode_hdr_t);
-	kern_size = bcode_off - kern_off;
-
-	hdr = (bcode_hdr_t *)(data + bcode_off / sizeof(uint32_t));
+	return boost_check_crc(hdr, cksum(data, hdr.image_size));
+}
 
-	bcode_size = (len - hdr->ramdisk_size) - bcode_off;
-	rdisk_off = len - hdr->ramdisk_size;
-	rdisk_size = hdr->ramdisk_size;
+/*
+ * Checks the image file of len bytes at image. With digest set, the
+ * SHA-256 of the file is computed in the same pass as the checksum.
+ */
+int
+boost_check_image(const char *image, size_t len, uint8_t *digest)
+{
+	const boost_hdr_t *hdr = (const boost_hdr_t *)image;
+	crc_job_t crc_job;
 
-	printf("Kernel image\t: offset = 0x%08x, size = %zdkB\n",
-	        kern_off, kern_size/1024);
-	if (0 != write_to_file(((char *)data) + kern_off, kern_size, "Image")) {
-		printf("Writing uImage\t: Failed\n");
+	if (NULL == digest)
+		return boost_check(*hdr, image + sizeof(boost_hdr_t));
+	if (hdr->image_size > len - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image data exceeds the file!\n");
 		return 1;
 	}
-	printf("Writing uImage\t: OK\n");
 
-	printf("Bootstrap image\t: offset = 0x%08x, size = %zdB\n",
-	       bcode_off, bcode_size);
-	if (0 != write_to_file(((char *)data) + bcode_off, bcode_size, "bcode")) {
-		printf("Writing bcode\t: Failed\n");
-		return 1;
-	}
-	printf("Writing bcode\t: OK\n");
+	memset(&crc_job, 0, sizeof(crc_job_t));
+	crc_job.data = image + sizeof(boost_hdr_t);
+	crc_job.len = hdr->image_size;
+	crc_job_hash(&crc_job, image, len);
+	crc_job_run(&crc_job);
+	sha256_final(&crc_job.sha, digest);
 
-	printf("RAM disk image\t: offset = 0x%08x, size = %zdkB\n",
-	       rdisk_off, rdisk_size/1024);
-	if (0 != write_to_file(((char *)data) + rdisk_off, rdisk_size, "initrd.ext2")) {
-		printf("Writing initrd\t: Failed\n");
+	return boost_check_crc(*hdr, crc_job.crc);
+}
+
+/*
+ * Checks an image with a chunk table. Next to the checksums all chunks
+ * are inflated at once, which proves the table and the stream agree.
+ * Without the memory for that only the checksums are checked.
+ */
+int
+boost_check_chunks(const char *image, size_t len,
+                   const zlib_chunks_t *chunks, uint8_t *digest)
+{
+	arena_t arena = { NULL, 0, 0, 0, 0 };
+	boost_hdr_t hdr = *(const boost_hdr_t *)image;
+	const char *data = image + sizeof(boost_hdr_t);
+	crc_job_t crc_job;
+	size_t total, out;
+	int rv;
+
+	if (hdr.image_size < sizeof(uint32_t))
+		return boost_check_image(image, len, digest);
+	total = swap_bytes_be(((const uint32_t *)data)[0]);
+	if (0 == total || total > MAX_IMAGE_BUF_SIZE ||
+	    !mem_fits(total + pool_default_threads() * zlib_inflate_mem()))
+		return boost_check_image(image, len, digest);
+
+	arena_plan(&arena, total);
+	if (0 != arena_reserve(&arena))
 		return 1;
-	}
-	printf("Writing initrd\t: OK\n");
 
-	return 0;
+	memset(&crc_job, 0, sizeof(crc_job_t));
+	if (NULL != digest)
+		crc_job_hash(&crc_job, image, len);
+	crc_job_start(&crc_job, data, hdr.image_size);
+	rv = zlib_decompress_chunks(data + 4, hdr.image_size - 4, chunks,
+	                            arena_alloc(&arena, total), total, &out);
+	if (0 != crc_job_finish(&crc_job, hdr))
+		rv = 1;
+	else if (0 == rv)
+		printf("Zlib unpack\t: OK (%zu chunks)\n", chunks->nchunks);
+	if (NULL != digest)
+		sha256_final(&crc_job.sha, digest);
+	arena_release(&arena);
+
+	return rv;
+}
+
+/* Room the chunk table of a payload of len bytes takes behind the image. */
+size_t
+boost_chunks_space(const image_create_args_t *cargs, size_t len)
+{
+	if (0 == cargs->chunk_size)
+		return 0;
+
+	return sizeof(uint32_t) - 1 + sizeof(boost_chunk_trailer_t) +
+	       zlib_chunks_count(len, cargs->chunk_size) * sizeof(uint32_t);
+}
+
+/*
+ * Appends the chunk table to the image of len bytes in image, which
+ * has boost_chunks_space() bytes room left. Returns the new length.
+ */
+size_t
+boost_put_chunks(char *image, size_t len, const image_create_args_t *cargs,
+                 size_t payload_len, const uint32_t *offsets)
+{
+	const boost_hdr_t *hdr = (const boost_hdr_t *)image;
+	boost_chunk_trailer_t trailer;
+	size_t table, table_len;
+
+	table = (len + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+	memset(image + len, 0, table - len);
+	memset(&trailer, 0, sizeof(boost_chunk_trailer_t));
+	trailer.image_checksum = hdr->image_checksum;
+	trailer.chunk_size = cargs->chunk_size;
+	trailer.nchunks = zlib_chunks_count(payload_len, cargs->chunk_size);
+	trailer.magic = BOOST_CHUNKS_MAGIC;
+	table_len = trailer.nchunks * sizeof(uint32_t);
+
+	memcpy(image + table, offsets, table_len);
+	memcpy(image + table + table_len, &trailer, sizeof(trailer));
+	trailer.table_crc = cksum(image + table, table_len +
+	                          offsetof(boost_chunk_trailer_t, table_crc));
+	memcpy(image + table + table_len, &trailer, sizeof(trailer));
+
+	return table + table_len + sizeof(trailer);
 }
 
+/*
+ * Looks for the chunk table at the end of the image file of len bytes
+ * at image. Returns 0 and fills chunks in when there is one matching
+ * the image.
+ */
 int
-boost_extract_legacy(const uint32_t *data, size_t len)
+boost_find_chunks(boost_hdr_t hdr, const void *image, size_t len,
+                  zlib_chunks_t *chunks)
 {
-	uint32_t kern_off, bcode_off, rdisk_off;
-	size_t kern_size, bcode_size, rdisk_size;
-
-	kern_off = 4;
-	bcode_off = BRANCHL_2_OFFSET(data[0]) - LEGACY_BCODE_START_OFFSET;
-	kern_size = bcode_off - kern_off;
-	bcode_size = LEGACY_BCODE_SIZE;
-	rdisk_off = bcode_off + bcode_size;
-	rdisk_size = len - rdisk_off;
-
-	printf("Kernel image\t: offset = 0x%08x, size = %zdkB\n",
-	        kern_off, kern_size/1024);
-	if (0 != write_to_file(((char *)data) + kern_off, kern_size, "Image")) {
-		printf("Writing uImage\t: Failed\n");
+	boost_chunk_trailer_t trailer;
+	const char *table;
+	size_t data_end;
+
+	data_end = sizeof(boost_hdr_t) + hdr.image_size;
+	if (!(hdr.flags & BOOST_FLAG_ZLIB) ||
+	    len < data_end + sizeof(boost_chunk_trailer_t))
 		return 1;
-	}
-	printf("Writing uImage\t: OK\n");
 
-	printf("Bootstrap image\t: offset = 0x%08x, size = %zdB\n",
-	       bcode_off, bcode_size);
-	if (0 != write_to_file(((char *)data) + bcode_off, bcode_size, "bcode-legacy")) {
-		printf("Writing bcode\t: Failed\n");
+	memcpy(&trailer, (const char *)image + len - sizeof(trailer),
+	       sizeof(trailer));
+	if (BOOST_CHUNKS_MAGIC != trailer.magic)
 		return 1;
-	}
-	printf("Writing bcode\t: OK\n");
 
-	printf("RAM disk image\t: offset = 0x%08x, size = %zdkB\n",
-	       rdisk_off, rdisk_size/1024);
-	if (0 != write_to_file(((char *)data) + rdisk_off, rdisk_size, "initrd.ext2")) {
-		printf("Writing initrd\t: Failed\n");
+	table = (const char *)image + ((data_end + sizeof(uint32_t) - 1) &
+	                               ~(sizeof(uint32_t) - 1));
+	if (trailer.image_checksum != hdr.image_checksum ||
+	    0 == trailer.chunk_size || 0 == trailer.nchunks ||
+	    table + (size_t)trailer.nchunks * sizeof(uint32_t) !=
+	    (const char *)image + len - sizeof(trailer) ||
+	    trailer.table_crc != cksum(table, trailer.nchunks *
+	                               sizeof(uint32_t) +
+	                               offsetof(boost_chunk_trailer_t,
+	                                        table_crc))) {
+		fprintf(stderr, "Ignoring damaged chunk table\n");
 		return 1;
 	}
-	printf("Writing initrd\t: OK\n");
+
+	chunks->chunk_size = trailer.chunk_size;
+	chunks->nchunks = trailer.nchunks;
+	chunks->offsets = (const uint32_t *)table;
 
 	return 0;
 }
 
-void boost_setup_header(boost_hdr_t *hdr, const uint32_t *data, size_t data_len,
+void boost_setup_header(boost_hdr_t *hdr, uint32_t data_crc, size_t data_len,
                         const  image_create_args_t *ic)
 {
 	memset(hdr, 0, sizeof(boost_hdr_t));
 
 	hdr->branch_offset = OFFSET_2_BRANCH(0);
 	hdr->image_size = data_len;
-	hdr->image_checksum = cksum((char *)data, data_len);
+	hdr->image_checksum = data_crc;
 	hdr->load_offset = ic->load_offset;
 
 	hdr->flags |= BOOST_FLAG_RAM_IMG;
@@ -464,8 +1042,10 @@ void boost_setup_header(boost_hdr_t *hdr, const uint32_t *data, size_t data_len,
 
 	memcpy(&(hdr->platform_id), "nBk2", 4);
 	memcpy(hdr->target_filename, "nBkProOs.img", 12);
-	strncpy(hdr->image_description, ic->image_descr, 64);
-	strncpy(hdr->image_version, ic->image_version, 64);
+	memcpy(hdr->image_description, ic->image_descr,
+	       strnlen(ic->image_descr, sizeof(hdr->image_description)));
+	memcpy(hdr->image_version, ic->image_version,
+	       strnlen(ic->image_version, sizeof(hdr->image_version)));
 
 	hdr->checksum = cksum((const char *)hdr, BOOST_HEADER_CRC_BYTES);
 }
@@ -31,6 +31,10 @@
 #define _BOOST_H_
 
 #include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "index.h"
 
 /* RAM image */
 #define BOOST_FLAG_RAM_IMG	(1<<0)
@@ -75,6 +79,13 @@
 
 #define STARTUP_BYTES		16
 
+/* Marks the chunk table trailer of parallel decodable images. */
+#define BOOST_CHUNKS_MAGIC	0x52415042 /* BPAR */
+
+/* Component selection of extract, bits are INDEX_KERNEL and friends. */
+#define BOOST_PART(i)		(1U << (i))
+#define BOOST_ALL_PARTS		((1U << INDEX_PARTS) - 1)
+
 typedef struct boost_header
 {
 	uint32_t	branch_offset;
@@ -102,8 +113,18 @@ typedef struct image_create_args
 	size_t		bcode_len;
 	uint32_t	*ramdisk;
 	size_t		ramdisk_len;
+	const segment_t	*ramdisk_segs;	/* sparse layout, NULL = dense */
+	size_t		ramdisk_nsegs;
 	uint32_t	load_offset;
 	int		use_zlib;
+	unsigned	optimize;	/* search budget [s], 0 = off */
+	int		squeeze;	/* maximum compression encoder */
+	size_t		chunk_size;	/* parallel decodable chunks, 0 = off */
+	int		verify;		/* round trip check after writing */
+	int		dry_run;	/* nothing is written */
+	int		estimate;	/* sample instead of compressing */
+	size_t		max_size;	/* image size limit, 0 = none */
+	const char	*manifest;	/* SHA-256 manifest file, NULL = none */
 	const char	*image_descr;
 	const char	*image_version;
 } image_create_args_t;
@@ -116,9 +137,63 @@ typedef struct bcode_header
 	uint32_t	reserved;
 } bcode_hdr_t;
 
+/*
+ * Images with parallel decodable data carry the stream offsets of
+ * their chunks behind the data section, 4 byte aligned, followed by
+ * this trailer. The boot loader ignores both.
+ */
+typedef struct boost_chunk_trailer
+{
+	uint32_t	image_checksum;	/* of the image the table belongs to */
+	uint32_t	chunk_size;
+	uint32_t	nchunks;
+	uint32_t	table_crc;	/* cksum of the offsets and the above */
+	uint32_t	magic;
+} boost_chunk_trailer_t;
+
+/* Startup bytes, kernel, bootcode, ramdisk and slack of a new image. */
+#define BOOST_PIECES		5
+
+/* Deflated components create --watch keeps between rebuilds. */
+typedef struct boost_pieces
+{
+	zlib_piece_t	piece[BOOST_PIECES];
+	size_t		deflated;	/* input bytes the last build deflated */
+} boost_pieces_t;
+
+/* Image whose digests extract --manifest writes, see sha256_manifest(). */
+typedef struct boost_manifest
+{
+	const char	*path;		/* manifest file */
+	const char	*image;		/* image name listed in it */
+	const char	*addr;		/* the image file, header first */
+	size_t		len;
+} boost_manifest_t;
+
+/* Reads len payload bytes at off, see boost_layout_read(). */
+typedef int (*payload_read_t)(void *ctx, uint64_t off, void *buf, size_t len);
+
 void boost_print_info(boost_hdr_t);
-int  boost_extract(boost_hdr_t, void *);
+int  boost_extract(boost_hdr_t, void *, const zlib_chunks_t *, unsigned, int);
+int  boost_extract_store(const char *, size_t, const char *, const char *,
+                         unsigned, int);
+int  boost_extract_manifest(const boost_manifest_t *, unsigned, int);
 int  boost_create(const char *, const image_create_args_t *);
+int  boost_create_pieces(const char *, const image_create_args_t *, unsigned,
+                         boost_pieces_t *);
+void boost_setup_header(boost_hdr_t *, uint32_t, size_t,
+                        const image_create_args_t *);
 int  boost_check(boost_hdr_t, const void *);
+int  boost_check_image(const char *, size_t, uint8_t *);
+int  boost_check_chunks(const char *, size_t, const zlib_chunks_t *,
+                        uint8_t *);
+int  boost_find_chunks(boost_hdr_t, const void *, size_t, zlib_chunks_t *);
+int  boost_stream_write(void *, const char *, size_t);
+int  boost_index(boost_hdr_t, const void *, size_t, const char *);
+int  boost_extract_index(boost_hdr_t, const void *, const image_index_t *,
+                         unsigned, int);
+int  boost_layout_read(const boost_hdr_t *, uint64_t, payload_read_t, void *,
+                       image_layout_t *);
+const char *boost_part_filename(uint32_t, int);
 
 #endif /* _BOOST_H_ */
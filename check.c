@@ -0,0 +1,249 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "check.h"
+#include "layout.h"
+#include "mem.h"
+#include "stream.h"
+#include "util.h"
+#include "config.h"
+
+/* Prints the checksum lines of a check to out, 1 when either fails. */
+static int
+check_crc_print(FILE *out, boost_hdr_t hdr, uint32_t data_crc)
+{
+	uint32_t hdr_crc = 0;
+	int rv = 0;
+
+	hdr_crc = cksum((const char *)&hdr, BOOST_HEADER_CRC_BYTES);
+
+	if (hdr_crc == hdr.checksum) {
+		fprintf(out, "Header checksum\t: OK\n");
+	} else {
+		fprintf(out, "Header checksum\t: Failed (expected %u, got %u)\n",
+		        hdr.checksum, hdr_crc);
+		rv = 1;
+	}
+
+	if (data_crc == hdr.image_checksum) {
+		fprintf(out, "Image checksum\t: OK\n");
+	} else {
+		fprintf(out, "Image checksu\t: Failed (expected %u, got %u)\n",
+		        hdr.image_checksum, data_crc);
+		rv = 1;
+	}
+
+	return rv;
+}
+
+/* Same as boost_check() but with the data CRC already at hand. */
+int
+boost_check_crc(boost_hdr_t hdr, uint32_t data_crc)
+{
+	return check_crc_print(stdout, hdr, data_crc);
+}
+
+/* State of the deep check of one image. */
+typedef struct deep_check
+{
+	extract_stream_t es;
+	int		bad_layout;	/* rest of the payload only inflated */
+} deep_check_t;
+
+/* Components are only bounds checked, their bytes are not needed. */
+static int
+deep_check_part(void *ctx, int part, uint64_t off, const char *buf,
+                size_t len)
+{
+	(void)ctx;
+	(void)part;
+	(void)off;
+	(void)buf;
+	(void)len;
+
+	return 0;
+}
+
+static int
+deep_check_sink(void *ctx, const char *buf, size_t len)
+{
+	deep_check_t *dc = ctx;
+
+	/* A broken layout must not hide a broken stream behind it. */
+	if (!dc->bad_layout && 0 != extract_stream_sink(&dc->es, buf, len))
+		dc->bad_layout = 1;
+
+	return 0;
+}
+
+/* Prints the layout lines of a deep check, 1 when it is not sound. */
+static int
+deep_check_layout(FILE *out, const deep_check_t *dc)
+{
+	const image_layout_t *l = &dc->es.layout;
+	const bcode_hdr_t *b = &dc->es.cap.bcode;
+
+	if (dc->bad_layout || 0 != dc->es.pending) {
+		fprintf(out, "Layout\t\t: Failed (component bounds)\n");
+		return 1;
+	}
+	if (INDEX_LAYOUT_UNKNOWN == l->type) {
+		fprintf(out, "Layout\t\t: unknown (no bootcode), %llu bytes\n",
+		        (unsigned long long)l->parts[INDEX_KERNEL].len);
+		return 0;
+	}
+	fprintf(out, "Layout\t\t: %s, kernel %lluB, bcode %lluB, "
+	        "ramdisk %lluB\n",
+	        INDEX_LAYOUT_LEGACY == l->type ? "legacy" : "new",
+	        (unsigned long long)l->parts[INDEX_KERNEL].len,
+	        (unsigned long long)l->parts[INDEX_BCODE].len,
+	        (unsigned long long)l->parts[INDEX_RAMDISK].len);
+	if (INDEX_LAYOUT_LEGACY == l->type)
+		return 0;
+
+	/* The capture still holds the bootcode header, the last one. */
+	if ((b->magic & BCODE_MAGIC_MASK) != BCODE_MAGIC) {
+		fprintf(out, "Bootcode\t: Failed (magic 0x%08x)\n", b->magic);
+		return 1;
+	}
+	if ((b->magic & BCODE_VERSION_MASK) != 1) {
+		fprintf(out, "Bootcode\t: Failed (unsupported version %u)\n",
+		        b->magic & BCODE_VERSION_MASK);
+		return 1;
+	}
+	if (b->bcode_off != l->parts[INDEX_BCODE].off) {
+		fprintf(out, "Bootcode\t: Failed (offset 0x%08x, branch "
+		        "to 0x%08llx)\n", b->bcode_off,
+		        (unsigned long long)l->parts[INDEX_BCODE].off);
+		return 1;
+	}
+	fprintf(out, "Bootcode\t: OK (version 1)\n");
+
+	return 0;
+}
+
+/* Buffer memory one deep check takes, next to the image itself. */
+size_t
+boost_check_deep_mem(void)
+{
+	return STREAM_BUF_SIZE + zlib_inflate_mem();
+}
+
+/*
+ * Checks everything about an image of len bytes that can be checked
+ * without the target, in a single pass through a small buffer: both
+ * checksums, the zlib stream including its adler32, the unpacked size
+ * against its big-endian prefix, the branch, bootcode magic, version
+ * and offset, and the bounds of all components. The report goes to
+ * out so checks of several images can run at once.
+ */
+int
+boost_check_deep(const char *image, size_t len, FILE *out)
+{
+	const char *data = image + sizeof(boost_hdr_t);
+	deep_check_t dc;
+	boost_hdr_t hdr;
+	uint32_t crc = 0;
+	size_t total, out_len = 0;
+	char *buf;
+	int rv = 0;
+
+	if (len < sizeof(boost_hdr_t)) {
+		fprintf(out, "Header\t\t: Failed (file too short)\n");
+		return 1;
+	}
+	memcpy(&hdr, image, sizeof(boost_hdr_t));
+	if (hdr.image_size > len - sizeof(boost_hdr_t)) {
+		fprintf(out, "Image size\t: Failed (%u bytes, file holds "
+		        "%zu)\n", hdr.image_size, len - sizeof(boost_hdr_t));
+		return 1;
+	}
+
+	memset(&dc, 0, sizeof(deep_check_t));
+	dc.es.pending = BOOST_ALL_PARTS;
+	dc.es.cap_off = 0;
+	dc.es.cap_len = sizeof(uint32_t);
+	dc.es.sink = deep_check_part;
+	dc.es.strict = 1;
+
+	if (!(hdr.flags & BOOST_FLAG_ZLIB)) {
+		dc.es.total = hdr.image_size;
+		extract_stream_begin(&dc.es, &hdr, data, NULL);
+		crc = cksum(data, hdr.image_size);
+		deep_check_sink(&dc, data, hdr.image_size);
+		rv = deep_check_layout(out, &dc);
+		return check_crc_print(out, hdr, crc) || rv;
+	}
+
+	if (hdr.image_size < sizeof(uint32_t)) {
+		fprintf(out, "Zlib stream\t: Failed (no size prefix)\n");
+		check_crc_print(out, hdr, cksum(data, hdr.image_size));
+		return 1;
+	}
+	total = swap_bytes_be(((const uint32_t *)data)[0]);
+	dc.es.total = total;
+
+	buf = mem_alloc(STREAM_BUF_SIZE);
+	if (NULL == buf) {
+		fprintf(out, "Zlib stream\t: Failed (out of memory)\n");
+		return 1;
+	}
+	extract_stream_begin(&dc.es, &hdr, data, buf);
+	crc = cksum_update(crc, data, sizeof(uint32_t));
+	if (0 != zlib_decompress_stream(data + 4, hdr.image_size - 4, buf,
+	                                STREAM_BUF_SIZE, deep_check_sink, &dc,
+	                                &out_len, &crc)) {
+		fprintf(out, "Zlib stream\t: Failed after %zu bytes\n",
+		        out_len);
+		rv = 1;
+	} else if (out_len != total) {
+		fprintf(out, "Zlib stream\t: Failed (unpacked %zu bytes, "
+		        "prefix says %zu)\n", out_len, total);
+		rv = 1;
+	} else {
+		fprintf(out, "Zlib stream\t: OK (%zu bytes, adler32 OK)\n",
+		        out_len);
+	}
+	crc = cksum_final(crc, hdr.image_size);
+	if (!dc.bad_layout && 0 != extract_stream_end(&dc.es))
+		dc.bad_layout = 1;
+	extract_stream_free(&dc.es);
+	mem_free(buf);
+
+	/* A truncated payload has no bounds to speak of. */
+	if (0 == rv || dc.bad_layout)
+		rv |= deep_check_layout(out, &dc);
+	rv |= check_crc_print(out, hdr, crc);
+
+	return rv;
+}
@@ -28,16 +28,61 @@
  */
 
 #include <sys/stat.h>
-#include <sys/mman.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 
 #include "boost.h"
+#include "check.h"
+#include "delta.h"
+#include "diff.h"
+#include "ext2.h"
+#include "loader.h"
+#include "mem.h"
+#include "patch.h"
+#include "pool.h"
+#include "scan.h"
+#include "sparse.h"
+#include "stats.h"
 #include "cmd.h"
+#include "mount.h"
+#include "watch.h"
 
 
+/* Loads a whole input file, its descriptor is not needed afterwards. */
+static int
+cmd_load(const char *filename, loaded_t *file)
+{
+	struct stat f_stat;
+	int fd;
+	int rv = 1;
+
+	memset(file, 0, sizeof(loaded_t));
+	fd = open(filename, O_RDONLY);
+	if (-1 == fd) {
+		fprintf(stderr, "Failed to open %s: %s\n", filename,
+		        strerror(errno));
+		return 1;
+	}
+	if (0 != fstat(fd, &f_stat)) {
+		perror("Failed to read file stat");
+	} else if (0 != loader_load(fd, f_stat.st_size, file)) {
+		fprintf(stderr, "Failed to load %s\n", filename);
+	} else {
+		rv = 0;
+	}
+
+	if (0 != close(fd)) {
+		perror("Failed to close input file");
+	}
+
+	return rv;
+}
+
 int
 cmd_info(const char *filename)
 {
@@ -71,17 +116,30 @@ info_fail:
 int
 cmd_create(create_args_t *args)
 {
-	void *k_addr = MAP_FAILED, *b_addr = MAP_FAILED, *r_addr = MAP_FAILED;
+	loaded_t k_file, b_file, r_file;
 	int k_fd = -1, b_fd = -1, r_rd = -1;
 	struct stat k_stat, b_stat, r_stat;
 	image_create_args_t components;
+	sparse_map_t r_map;
+	ext2_image_t r_tree;
+	size_t scrubbed;
+	uint64_t start;
 	int rv = 1;
 
+	memset(&r_map, 0, sizeof(sparse_map_t));
+	memset(&r_tree, 0, sizeof(ext2_image_t));
+	memset(&k_file, 0, sizeof(loaded_t));
+	memset(&b_file, 0, sizeof(loaded_t));
+	memset(&r_file, 0, sizeof(loaded_t));
 	memset(&k_stat, 0, sizeof(struct stat));
 	memset(&b_stat, 0, sizeof(struct stat));
 	memset(&r_stat, 0, sizeof(struct stat));
 	memset(&components, 0, sizeof(image_create_args_t));
 
+	if (args->watch)
+		return watch_create(args);
+
+	start = stats_begin();
 	k_fd = open(args->kernel, O_RDONLY);
 	if (-1 == k_fd) {
 		perror("Failed to open kernel file");
@@ -91,12 +149,11 @@ cmd_create(create_args_t *args)
 		perror("Failed to read kernel stat");
 		goto create_fail;
 	}
-	k_addr = mmap(NULL, k_stat.st_size, PROT_READ, MAP_PRIVATE, k_fd, 0);
-	if (MAP_FAILED == k_addr) {
-		perror("Failed to memory map kernel file");
+	if (0 != loader_load(k_fd, k_stat.st_size, &k_file)) {
+		fprintf(stderr, "Failed to load kernel file\n");
 		goto create_fail;
 	}
-	components.kernel = k_addr;
+	components.kernel = (uint32_t *)k_file.addr;
 	components.kernel_len = k_stat.st_size;
 
 	if (args->bcode) {
@@ -109,12 +166,11 @@ cmd_create(create_args_t *args)
 			perror("Failed to read bootcode stat");
 			goto create_fail;
 		}
-		b_addr = mmap(NULL, b_stat.st_size, PROT_READ, MAP_PRIVATE, b_fd, 0);
-		if (MAP_FAILED == b_addr) {
-			perror("Failed to memory map bootcode file");
+		if (0 != loader_load(b_fd, b_stat.st_size, &b_file)) {
+			fprintf(stderr, "Failed to load bootcode file\n");
 			goto create_fail;
 		}
-		components.bcode = b_addr;
+		components.bcode = (uint32_t *)b_file.addr;
 		components.bcode_len = b_stat.st_size;
 	}
 
@@ -128,17 +184,50 @@ cmd_create(create_args_t *args)
 			perror("Failed to read ramdisk stat");
 			goto create_fail;
 		}
-		r_addr = mmap(NULL, r_stat.st_size, PROT_READ, MAP_PRIVATE, r_rd, 0);
-		if (MAP_FAILED == r_addr) {
-			perror("Failed to memory map ramdisk file");
+		if (0 != loader_load(r_rd, r_stat.st_size, &r_file)) {
+			fprintf(stderr, "Failed to load ramdisk file\n");
 			goto create_fail;
 		}
 
-		components.ramdisk = r_addr;
+		components.ramdisk = (uint32_t *)r_file.addr;
 		components.ramdisk_len = r_stat.st_size;
 	}
+	stats_end(STATS_LOAD, start, components.kernel_len +
+	          components.bcode_len + components.ramdisk_len, 0);
+
+	/* Ramdisks are mostly free blocks, keep their zeros out of RAM. */
+	if (NULL != r_file.addr) {
+		if (0 != sparse_map(r_rd, r_file.addr, r_stat.st_size, &r_map))
+			goto create_fail;
+		if (args->scrub_ramdisk) {
+			if (0 != ext2_scrub(r_file.addr, r_stat.st_size,
+			                    &r_map, &scrubbed))
+				goto create_fail;
+			printf("Ramdisk scrub\t: %zu kB of stale free space "
+			       "zeroed\n", scrubbed / 1024);
+		}
+		components.ramdisk_segs = r_map.segs;
+		components.ramdisk_nsegs = r_map.nsegs;
+	}
+
+	/* Ramdisk laid out from a tree, mostly straight from the files. */
+	if (args->ramdisk_dir) {
+		if (0 != ext2_build(args->ramdisk_dir, &r_tree))
+			goto create_fail;
+		components.ramdisk_segs = r_tree.map.segs;
+		components.ramdisk_nsegs = r_tree.map.nsegs;
+		components.ramdisk_len = r_tree.len;
+	}
 
 	components.use_zlib = args->use_zlib;
+	components.optimize = args->optimize;
+	components.squeeze = args->squeeze;
+	components.chunk_size = args->chunk_size;
+	components.verify = args->verify;
+	components.dry_run = args->dry_run;
+	components.estimate = args->estimate;
+	components.max_size = args->max_size;
+	components.manifest = args->manifest;
 	components.load_offset = args->load_offset;
 	components.image_descr = args->image_descr;
 	components.image_version = args->image_version;
@@ -146,21 +235,11 @@ cmd_create(create_args_t *args)
 	rv = boost_create(args->outfile, &components);
 
 create_fail:
-	if (MAP_FAILED != k_addr) {
-		if (-1 == munmap(k_addr, k_stat.st_size)) {
-			perror("Failed to unmap kernel from memory");
-		}
-	}
-	if (MAP_FAILED != b_addr) {
-		if (-1 == munmap(b_addr, b_stat.st_size)) {
-			perror("Failed to unmap bootcode from memory");
-		}
-	}
-	if (MAP_FAILED != r_addr) {
-		if (-1 == munmap(r_addr, r_stat.st_size)) {
-			perror("Failed to unmap ramdisk from memory");
-		}
-	}
+	sparse_free(&r_map);
+	ext2_free(&r_tree);
+	loader_unload(&k_file);
+	loader_unload(&b_file);
+	loader_unload(&r_file);
 
 	if (-1 != k_fd) {
 		if (0 != close(k_fd)) {
@@ -182,17 +261,26 @@ create_fail:
 }
 
 int
-cmd_extract(const char *filename)
+cmd_extract(const char *filename, unsigned parts, int verify,
+            const char *store, const char *manifest)
 {
+	char idx_name[PATH_MAX];
+	boost_manifest_t man;
 	struct stat f_stat;
+	image_index_t idx;
+	zlib_chunks_t chunks;
 	boost_hdr_t hdr;
 	ssize_t len;
-	void *addr = NULL;
+	loaded_t image;
+	uint64_t start;
 	int fd;
 	int rv = 0;
 
 	memset(&f_stat, 0, sizeof(struct stat));
+	memset(&image, 0, sizeof(loaded_t));
+	memset(&idx, 0, sizeof(image_index_t));
 
+	start = stats_begin();
 	fd = open(filename, O_RDONLY);
 	if (-1 == fd) {
 		perror("Failed to open image file");
@@ -202,6 +290,7 @@ cmd_extract(const char *filename)
 	len = read(fd, &hdr, sizeof(boost_hdr_t));
 	if (len != sizeof(boost_hdr_t)) {
 		fprintf(stderr, "Failed to read BooSt header!\n");
+		rv = 1;
 		goto extract_fail;
 	}
 
@@ -210,22 +299,58 @@ cmd_extract(const char *filename)
 		goto extract_fail;
 	}
 
-	addr = mmap(NULL, f_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (MAP_FAILED == addr) {
-		perror("Failed to memory map image");
+	if (0 != loader_load(fd, f_stat.st_size, &image)) {
+		fprintf(stderr, "Failed to load image\n");
+		rv = 1;
 		goto extract_fail;
 	}
+	stats_end(STATS_LOAD, start, f_stat.st_size, 0);
 
-	rv = boost_extract(hdr, addr + sizeof(boost_hdr_t));
+	if (hdr.image_size > f_stat.st_size - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image file is truncated!\n");
+		rv = 1;
+		goto extract_fail;
+	}
 
-extract_fail:
-	if (MAP_FAILED != addr) {
-		if (-1 == munmap(addr, hdr.image_size)) {
-			perror("Failed to unmap image from memory");
-			rv = 1;
+	if (store) {
+		rv = boost_extract_store(image.addr, f_stat.st_size, filename,
+		                         store, parts, verify);
+		goto extract_fail;
+	}
+
+	/* Digests come from the streamed split, in the same pass. */
+	if (manifest) {
+		man.path = manifest;
+		man.image = filename;
+		man.addr = image.addr;
+		man.len = f_stat.st_size;
+		rv = boost_extract_manifest(&man, parts, verify);
+		goto extract_fail;
+	}
+
+	/* A matching sidecar index lets each component inflate on its own. */
+	if (0 == index_path(filename, idx_name, sizeof(idx_name)) &&
+	    0 == access(idx_name, F_OK) && 0 == index_load(idx_name, &idx)) {
+		if (idx.image_checksum == hdr.image_checksum &&
+		    idx.image_size == hdr.image_size &&
+		    (hdr.flags & BOOST_FLAG_ZLIB)) {
+			rv = boost_extract_index(hdr,
+			                         image.addr + sizeof(boost_hdr_t),
+			                         &idx, parts, verify);
+			goto extract_fail;
 		}
+		fprintf(stderr, "Ignoring stale index %s\n", idx_name);
 	}
 
+	rv = boost_extract(hdr, image.addr + sizeof(boost_hdr_t),
+	                   0 == boost_find_chunks(hdr, image.addr,
+	                                          f_stat.st_size, &chunks) ?
+	                   &chunks : NULL, parts, verify);
+
+extract_fail:
+	index_free(&idx);
+	loader_unload(&image);
+
 	if (0 != close(fd)) {
 		perror("Failed to close image file");
 		return 1;
@@ -234,18 +359,39 @@ extract_fail:
 	return rv;
 }
 
+/* Mounts filename on dir, see mount_image(). */
+int
+cmd_mount(const char *filename, const char *dir, int foreground)
+{
+	loaded_t image;
+	int rv;
+
+	if (0 != cmd_load(filename, &image))
+		return 1;
+	rv = mount_image(image.addr, image.len, filename, dir, foreground);
+	loader_unload(&image);
+
+	return rv;
+}
+
 int
-cmd_check(const char *filename)
+cmd_check(const char *filename, int sha256)
 {
+	uint8_t digest[SHA256_LEN];
+	char hex[SHA256_HEX_LEN];
 	struct stat f_stat;
+	zlib_chunks_t chunks;
 	boost_hdr_t hdr;
 	ssize_t len;
-	void *addr = NULL;
+	loaded_t image;
+	uint64_t start;
 	int fd;
 	int rv = 0;
 
 	memset(&f_stat, 0, sizeof(struct stat));
+	memset(&image, 0, sizeof(loaded_t));
 
+	start = stats_begin();
 	fd = open(filename, O_RDONLY);
 	if (-1 == fd) {
 		perror("Failed to open image file");
@@ -255,6 +401,7 @@ cmd_check(const char *filename)
 	len = read(fd, &hdr, sizeof(boost_hdr_t));
 	if (len != sizeof(boost_hdr_t)) {
 		fprintf(stderr, "Failed to read BooSt header!\n");
+		rv = 1;
 		goto check_fail;
 	}
 
@@ -263,22 +410,200 @@ cmd_check(const char *filename)
 		goto check_fail;
 	}
 
-	addr = mmap(NULL, f_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (MAP_FAILED == addr) {
-		perror("Failed to memory map image");
+	if (0 != loader_load(fd, f_stat.st_size, &image)) {
+		fprintf(stderr, "Failed to load image\n");
+		rv = 1;
+		goto check_fail;
+	}
+	stats_end(STATS_LOAD, start, f_stat.st_size, 0);
+
+	if (hdr.image_size > f_stat.st_size - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image file is truncated!\n");
+		rv = 1;
 		goto check_fail;
 	}
 
-	rv = boost_check(hdr, addr + sizeof(boost_hdr_t));
+	if (0 == boost_find_chunks(hdr, image.addr, f_stat.st_size, &chunks))
+		rv = boost_check_chunks(image.addr, f_stat.st_size, &chunks,
+		                        sha256 ? digest : NULL);
+	else
+		rv = boost_check_image(image.addr, f_stat.st_size,
+		                       sha256 ? digest : NULL);
+	if (0 == rv && sha256) {
+		sha256_hex(digest, hex);
+		printf("Image SHA-256\t: %s\n", hex);
+	}
 
 check_fail:
-	if (MAP_FAILED != addr) {
-		if (-1 == munmap(addr, hdr.image_size)) {
-			perror("Failed to unmap image from memory");
+	loader_unload(&image);
+
+	if (0 != close(fd)) {
+		perror("Failed to close image file");
+		return 1;
+	}
+
+	return rv;
+}
+
+/* One image of a deep check, its report is held until all are done. */
+typedef struct deep_job
+{
+	const char	*filename;
+	char		*report;
+	size_t		report_len;
+	int		rv;
+} deep_job_t;
+
+static void
+deep_job_run(void *arg)
+{
+	deep_job_t *job = arg;
+	loaded_t image;
+	FILE *out;
+
+	job->rv = 1;
+	out = open_memstream(&job->report, &job->report_len);
+	if (NULL == out) {
+		perror("Failed to buffer check report");
+		return;
+	}
+	if (0 == cmd_load(job->filename, &image)) {
+		job->rv = boost_check_deep(image.addr, image.len, out);
+		loader_unload(&image);
+	}
+	if (0 != fclose(out)) {
+		perror("Failed to buffer check report");
+		job->rv = 1;
+	}
+}
+
+/*
+ * Deep checks nfiles images at once, as many at a time as there are
+ * threads and, under --max-memory, as the budget has room for. The
+ * reports are printed in argument order. Returns 1 if any fails.
+ */
+int
+cmd_check_deep(int nfiles, char *files[])
+{
+	deep_job_t *jobs;
+	pool_t *pool = NULL;
+	size_t per_job;
+	int threads, i;
+	int rv = 0;
+
+	jobs = calloc(nfiles, sizeof(deep_job_t));
+	if (NULL == jobs) {
+		perror("Failed to allocate check jobs");
+		return 1;
+	}
+
+	threads = pool_default_threads();
+	per_job = boost_check_deep_mem();
+	if (0 != mem_budget() && mem_available() / per_job < (size_t)threads)
+		threads = mem_available() / per_job;
+	if (nfiles < threads)
+		threads = nfiles;
+	if (threads > 1)
+		pool = pool_create(threads);
+
+	for (i = 0; i < nfiles; i++) {
+		jobs[i].filename = files[i];
+		if (NULL == pool || 0 != pool_submit(pool, deep_job_run,
+		                                     &jobs[i]))
+			deep_job_run(&jobs[i]);
+	}
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		if (nfiles > 1)
+			printf("%s%s:\n", i ? "\n" : "", jobs[i].filename);
+		if (NULL != jobs[i].report)
+			fwrite(jobs[i].report, 1, jobs[i].report_len, stdout);
+		free(jobs[i].report);
+		rv |= jobs[i].rv;
+	}
+	if (nfiles > 1)
+		printf("\nDeep check\t: %s\n", rv ? "Failed" : "OK");
+	free(jobs);
+
+	return rv;
+}
+
+/* Tells the layout of each image from its contents, see boost_scan(). */
+int
+cmd_scan(int nfiles, char *files[])
+{
+	loaded_t image;
+	int i, rv = 0;
+
+	for (i = 0; i < nfiles; i++) {
+		if (nfiles > 1)
+			printf("%s%s:\n", i ? "\n" : "", files[i]);
+		if (0 != cmd_load(files[i], &image)) {
 			rv = 1;
+			continue;
 		}
+		rv |= boost_scan(image.addr, image.len);
+		loader_unload(&image);
+	}
+
+	return rv;
+}
+
+int
+cmd_index(const char *filename, size_t span)
+{
+	char idx_name[PATH_MAX];
+	struct stat f_stat;
+	boost_hdr_t hdr;
+	ssize_t len;
+	loaded_t image;
+	uint64_t start;
+	int fd;
+	int rv = 1;
+
+	memset(&f_stat, 0, sizeof(struct stat));
+	memset(&image, 0, sizeof(loaded_t));
+
+	if (0 != index_path(filename, idx_name, sizeof(idx_name)))
+		return 1;
+
+	start = stats_begin();
+	fd = open(filename, O_RDONLY);
+	if (-1 == fd) {
+		perror("Failed to open image file");
+		return 1;
+	}
+
+	len = read(fd, &hdr, sizeof(boost_hdr_t));
+	if (len != sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		goto index_fail;
 	}
 
+	if (0 != fstat(fd, &f_stat)) {
+		perror("Failed to read image stat");
+		goto index_fail;
+	}
+	if (hdr.image_size > f_stat.st_size - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image file is truncated!\n");
+		goto index_fail;
+	}
+
+	if (0 != loader_load(fd, f_stat.st_size, &image)) {
+		fprintf(stderr, "Failed to load image\n");
+		goto index_fail;
+	}
+	stats_end(STATS_LOAD, start, f_stat.st_size, 0);
+
+	rv = boost_index(hdr, image.addr + sizeof(boost_hdr_t), span, idx_name);
+
+index_fail:
+	loader_unload(&image);
+
 	if (0 != close(fd)) {
 		perror("Failed to close image file");
 		return 1;
@@ -286,3 +611,74 @@ check_fail:
 
 	return rv;
 }
+
+int
+cmd_diff(const char *a_name, const char *b_name)
+{
+	loaded_t a_file, b_file;
+	uint64_t start;
+	int rv = 1;
+
+	memset(&b_file, 0, sizeof(loaded_t));
+	start = stats_begin();
+	if (0 != cmd_load(a_name, &a_file) ||
+	    0 != cmd_load(b_name, &b_file))
+		goto diff_fail;
+	stats_end(STATS_LOAD, start, a_file.len + b_file.len, 0);
+
+	rv = boost_diff(a_file.addr, a_file.len, b_file.addr, b_file.len);
+
+diff_fail:
+	loader_unload(&a_file);
+	loader_unload(&b_file);
+
+	return rv;
+}
+
+int
+cmd_delta(const char *old_name, const char *new_name, const char *outfile)
+{
+	loaded_t old_file, new_file;
+	uint64_t start;
+	int rv = 1;
+
+	memset(&new_file, 0, sizeof(loaded_t));
+	start = stats_begin();
+	if (0 != cmd_load(old_name, &old_file) ||
+	    0 != cmd_load(new_name, &new_file))
+		goto delta_fail;
+	stats_end(STATS_LOAD, start, old_file.len + new_file.len, 0);
+
+	rv = boost_delta(old_file.addr, old_file.len, new_file.addr,
+	                 new_file.len, outfile);
+
+delta_fail:
+	loader_unload(&old_file);
+	loader_unload(&new_file);
+
+	return rv;
+}
+
+int
+cmd_patch(const char *old_name, const char *delta_name, const char *outfile)
+{
+	loaded_t old_file, delta_file;
+	uint64_t start;
+	int rv = 1;
+
+	memset(&delta_file, 0, sizeof(loaded_t));
+	start = stats_begin();
+	if (0 != cmd_load(old_name, &old_file) ||
+	    0 != cmd_load(delta_name, &delta_file))
+		goto patch_fail;
+	stats_end(STATS_LOAD, start, old_file.len + delta_file.len, 0);
+
+	rv = boost_patch(old_file.addr, old_file.len, delta_file.addr,
+	                 delta_file.len, outfile);
+
+patch_fail:
+	loader_unload(&old_file);
+	loader_unload(&delta_file);
+
+	return rv;
+}
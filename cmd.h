@@ -30,6 +30,7 @@
 #ifndef _CMD_H_
 #define _CMD_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct _create_args
@@ -37,16 +38,34 @@ typedef struct _create_args
 	const char	*kernel;
 	const char	*bcode;
 	const char	*ramdisk;
+	const char	*ramdisk_dir;
+	int		scrub_ramdisk;
 	const char	*outfile;
 	const char	*image_descr;
 	const char	*image_version;
 	uint32_t	load_offset;
 	int		use_zlib;
+	unsigned	optimize;
+	int		squeeze;
+	size_t		chunk_size;
+	int		verify;
+	int		dry_run;
+	int		estimate;
+	size_t		max_size;
+	const char	*manifest;
+	int		watch;
 } create_args_t;
 
 int cmd_info(const char *);
 int cmd_create(create_args_t *);
-int cmd_extract(const char *);
-int cmd_check(const char *);
+int cmd_extract(const char *, unsigned, int, const char *, const char *);
+int cmd_check(const char *, int);
+int cmd_mount(const char *, const char *, int);
+int cmd_check_deep(int, char *[]);
+int cmd_scan(int, char *[]);
+int cmd_index(const char *, size_t);
+int cmd_diff(const char *, const char *);
+int cmd_delta(const char *, const char *, const char *);
+int cmd_patch(const char *, const char *, const char *);
 
 #endif /* _CMD_H_ */
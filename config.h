@@ -48,4 +48,54 @@
 /* Maximum possible image size to create/extract. */
 #define MAX_IMAGE_BUF_SIZE	(15*1024*1024)
 
+/* Default wall-clock budget of create --optimize, in seconds. */
+#define DEFAULT_OPTIMIZE_BUDGET	30
+
+/* Huge page size buffer arenas are rounded up to when large enough. */
+#define ARENA_HUGE_PAGE_SIZE	(2*1024*1024)
+
+/* Output buffer of streaming create and extract under --max-memory. */
+#define STREAM_BUF_SIZE	(64*1024)
+
+/* Payload bytes per chunk of create --chunks. */
+#define DEFAULT_CHUNK_SIZE	(1024*1024)
+
+/* Block size and number of blocks create --estimate deflates. */
+#define ESTIMATE_BLOCK		(64*1024)
+#define ESTIMATE_SAMPLES	64
+
+/* Payload bytes between checkpoints of the index command. */
+#define DEFAULT_INDEX_SPAN	(1024*1024)
+
+/* Granularity at which diff reports changed ranges. */
+#define DIFF_BLOCK		(4*1024)
+
+/* Changed ranges diff lists per component. */
+#define DIFF_MAX_RUNS		8
+
+/* Serial link speed delta transfer times are reported for. */
+#define DELTA_LINK_BAUD		115200
+
+/* Quiet time after an input change before create --watch rebuilds. */
+#define WATCH_DEBOUNCE_MS	200
+
+/* Free blocks and inodes on create -R ramdisks, percent and minimum. */
+#define RAMDISK_FREE_PERCENT	10
+#define RAMDISK_FREE_MIN	64
+
+/* Components extract --store hashes in memory before writing them. */
+#define STORE_MEM_MAX		(16*1024*1024)
+
+/* Inflated blocks a mounted image keeps cached, least recently used go. */
+#define MOUNT_CACHE_SIZE	(64*1024*1024)
+
+/* Input files up to this size are read rather than mapped. */
+#define LOADER_SMALL_FILE	(64*1024)
+
+/* Unit of read-ahead and of read requests of the read loaders. */
+#define LOADER_CHUNK		(1024*1024)
+
+/* Chunk reads kept in flight by the io_uring loader. */
+#define LOADER_URING_DEPTH	8
+
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,686 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "delta.h"
+#include "mem.h"
+#include "pool.h"
+#include "stats.h"
+#include "util.h"
+
+#define DELTA_MAGIC	"BDLT"
+#define DELTA_VERSION	1
+
+/* Length of the seeds matches are looked up by. */
+#define DELTA_SEED	32
+
+/* Distance of the old payload offsets seeds are indexed at. */
+#define DELTA_STEP	8
+
+/* Candidates compared per seed. */
+#define DELTA_CHAIN	32
+
+/* New payload bytes matched by one job. */
+#define DELTA_BLOCK	(1024*1024)
+
+/* How far a match is extended over mismatching bytes. */
+#define DELTA_FUZZ	4096
+
+/* Multiplier of the rolling seed hash. */
+#define DELTA_HASH_MUL	0x01000193U
+
+/* Largest seed index, in bits of the bucket number. */
+#define DELTA_HASH_MAX_BITS	24
+
+/* Delta file layout, in host byte order like the image header. */
+typedef struct delta_file_hdr
+{
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	old_checksum;
+	uint32_t	old_size;
+	uint32_t	new_checksum;
+	uint32_t	new_size;
+	uint32_t	mode;
+	uint32_t	chunk_size;
+	char		backend[16];
+	uint64_t	payload_len;
+	uint64_t	prefix_len;
+	uint64_t	suffix_len;
+	uint64_t	nops;
+	uint64_t	ndiff;
+	uint64_t	nextra;
+	uint64_t	ctrl_len;
+	uint64_t	diff_len;
+	uint64_t	extra_len;
+} delta_file_hdr_t;
+
+/* Control record, see delta_t. */
+typedef struct delta_op
+{
+	uint32_t	extra_len;
+	uint32_t	diff_len;
+	uint32_t	old_off;
+} delta_op_t;
+
+/* Seeds of the old payload by hash, chained newest first. */
+typedef struct delta_hash
+{
+	const unsigned char *old;
+	size_t		old_len;
+	uint32_t	*head;		/* bucket -> seed number + 1 */
+	uint32_t	*next;		/* seed number -> older seed + 1 */
+	int		bits;
+	uint32_t	pow;		/* DELTA_HASH_MUL ^ DELTA_SEED */
+} delta_hash_t;
+
+/* Matching of one block of the new payload. */
+typedef struct delta_job
+{
+	const delta_hash_t *hash;
+	const unsigned char *cur;
+	delta_region_t	region;
+	unsigned char	*diff;		/* region.len bytes each */
+	unsigned char	*extra;
+	size_t		ndiff;
+	size_t		nextra;
+	delta_op_t	*ops;
+	size_t		nops;
+	size_t		alloc;
+	int		failed;
+} delta_job_t;
+
+static uint32_t
+delta_seed_hash(const unsigned char *p)
+{
+	uint32_t h = 0;
+	int i;
+
+	for (i = 0; i < DELTA_SEED; i++)
+		h = h * DELTA_HASH_MUL + p[i];
+
+	return h;
+}
+
+static uint32_t
+delta_bucket(const delta_hash_t *hash, uint32_t h)
+{
+	return (h * 0x9e3779b1U) >> (32 - hash->bits);
+}
+
+static int
+delta_hash_build(delta_hash_t *hash, const char *old, size_t old_len)
+{
+	size_t nseeds, i;
+	uint32_t b;
+	int j;
+
+	memset(hash, 0, sizeof(delta_hash_t));
+	hash->old = (const unsigned char *)old;
+	hash->old_len = old_len;
+	hash->pow = 1;
+	for (j = 0; j < DELTA_SEED; j++)
+		hash->pow *= DELTA_HASH_MUL;
+
+	nseeds = old_len >= DELTA_SEED ?
+	         (old_len - DELTA_SEED) / DELTA_STEP + 1 : 0;
+	hash->bits = 10;
+	while (((size_t)1 << hash->bits) < nseeds &&
+	       hash->bits < DELTA_HASH_MAX_BITS)
+		hash->bits++;
+
+	hash->head = mem_alloc(sizeof(uint32_t) << hash->bits);
+	hash->next = mem_alloc((nseeds ? nseeds : 1) * sizeof(uint32_t));
+	if (NULL == hash->head || NULL == hash->next) {
+		fprintf(stderr, "Out of memory while indexing old payload!\n");
+		return 1;
+	}
+	memset(hash->head, 0, sizeof(uint32_t) << hash->bits);
+
+	for (i = 0; i < nseeds; i++) {
+		b = delta_bucket(hash, delta_seed_hash(hash->old +
+		                                       i * DELTA_STEP));
+		hash->next[i] = hash->head[b];
+		hash->head[b] = i + 1;
+	}
+
+	return 0;
+}
+
+static void
+delta_hash_free(delta_hash_t *hash)
+{
+	mem_free(hash->head);
+	mem_free(hash->next);
+}
+
+/*
+ * Length by which a match is worth extending over bytes that differ,
+ * as bsdiff does: as long as at least half of them still agree, the
+ * differences stay cheaper than literal bytes.
+ */
+static size_t
+delta_fuzz(const unsigned char *old, size_t old_len,
+           const unsigned char *cur, size_t len)
+{
+	size_t i, best = 0;
+	long score = 0, best_score = 0;
+
+	if (len > old_len)
+		len = old_len;
+	if (len > DELTA_FUZZ)
+		len = DELTA_FUZZ;
+	for (i = 0; i < len; i++) {
+		score += old[i] == cur[i] ? 1 : -1;
+		if (score > best_score) {
+			best_score = score;
+			best = i + 1;
+		}
+	}
+
+	return best;
+}
+
+/* Takes extra_len literal bytes at lit, then diff_len bytes at old_off. */
+static int
+delta_emit(delta_job_t *job, size_t lit, size_t extra_len, size_t old_off,
+           size_t diff_len)
+{
+	const unsigned char *old = job->hash->old + old_off;
+	const unsigned char *cur = job->cur + lit + extra_len;
+	delta_op_t *tmp;
+	size_t i;
+
+	if (job->nops == job->alloc) {
+		job->alloc = job->alloc ? 2 * job->alloc : 64;
+		tmp = mem_realloc(job->ops, job->alloc * sizeof(delta_op_t));
+		if (NULL == tmp)
+			return 1;
+		job->ops = tmp;
+	}
+	job->ops[job->nops].extra_len = extra_len;
+	job->ops[job->nops].diff_len = diff_len;
+	job->ops[job->nops].old_off = old_off;
+	job->nops++;
+
+	memcpy(job->extra + job->nextra, job->cur + lit, extra_len);
+	job->nextra += extra_len;
+	for (i = 0; i < diff_len; i++)
+		job->diff[job->ndiff + i] = cur[i] - old[i];
+	job->ndiff += diff_len;
+
+	return 0;
+}
+
+/*
+ * Greedy matching of one block: at every offset the indexed seeds with
+ * the same hash are tried, the longest match wins, and those within
+ * the preferred old range win ties by a seed length. A match grows
+ * backwards into the pending literals and forwards over differing
+ * bytes while that pays off.
+ */
+static void
+delta_job_run(void *arg)
+{
+	delta_job_t *job = arg;
+	const delta_hash_t *hash = job->hash;
+	const unsigned char *old = hash->old, *cur = job->cur;
+	const delta_region_t *r = &job->region;
+	size_t pos = r->off, end = r->off + r->len, lit = r->off;
+	size_t off, len, best_off = 0, best_len, best_score, score, back;
+	uint32_t h = 0, c;
+	int hashed = 0, n;
+
+	while (pos + DELTA_SEED <= end) {
+		if (!hashed) {
+			h = delta_seed_hash(cur + pos);
+			hashed = 1;
+		}
+		best_len = best_score = 0;
+		c = hash->head[delta_bucket(hash, h)];
+		for (n = 0; c && n < DELTA_CHAIN; c = hash->next[c - 1], n++) {
+			off = (size_t)(c - 1) * DELTA_STEP;
+			if (0 != memcmp(old + off, cur + pos, DELTA_SEED))
+				continue;
+			len = DELTA_SEED;
+			while (pos + len < end && off + len < hash->old_len &&
+			       old[off + len] == cur[pos + len])
+				len++;
+			score = len;
+			if (off >= r->old_off && off < r->old_off + r->old_len)
+				score += DELTA_SEED;
+			if (score > best_score) {
+				best_score = score;
+				best_len = len;
+				best_off = off;
+			}
+			if (pos + len == end && score > len)
+				break;
+		}
+
+		if (0 == best_len) {
+			if (pos + DELTA_SEED < end)
+				h = h * DELTA_HASH_MUL + cur[pos + DELTA_SEED] -
+				    hash->pow * cur[pos];
+			pos++;
+			continue;
+		}
+
+		for (back = 0; pos - back > lit && best_off > back &&
+		     old[best_off - back - 1] == cur[pos - back - 1]; back++)
+			;
+		pos -= back;
+		best_off -= back;
+		best_len += back;
+		best_len += delta_fuzz(old + best_off + best_len,
+		                       hash->old_len - best_off - best_len,
+		                       cur + pos + best_len,
+		                       end - pos - best_len);
+		if (0 != delta_emit(job, lit, pos - lit, best_off, best_len)) {
+			job->failed = 1;
+			return;
+		}
+		pos += best_len;
+		lit = pos;
+		hashed = 0;
+	}
+
+	if (lit < end && 0 != delta_emit(job, lit, end - lit, 0, 0))
+		job->failed = 1;
+}
+
+/* Deflates one delta stream into a buffer of its own. */
+static int
+delta_pack(const void *data, size_t len, char **out, size_t *out_len)
+{
+	segment_t seg = { data, len };
+	zlib_params_t params;
+	size_t cap = zlib_compress_bound(len);
+
+	zlib_default_params(&params);
+	params.level = Z_BEST_COMPRESSION;
+	*out = mem_alloc(cap);
+	if (NULL == *out)
+		return 1;
+
+	return zlib_compress_into(&seg, 1, &params, *out, cap, out_len, NULL);
+}
+
+static void *
+delta_unpack(const char *data, size_t len, size_t expect)
+{
+	size_t out_len = 0;
+	char *out;
+
+	out = mem_alloc(expect + 1);
+	if (NULL == out)
+		return NULL;
+	if (0 != zlib_decompress_into(data, len, out, expect + 1, &out_len,
+	                              NULL) || out_len != expect) {
+		fprintf(stderr, "Corrupt delta stream!\n");
+		mem_free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+/*
+ * Computes the difference of the cur payload to the old one. The
+ * regions have to cover cur in order, they are matched in blocks on
+ * all cores against a shared index of the old payload.
+ */
+int
+delta_encode(const char *old, size_t old_len, const char *cur,
+             size_t cur_len, const delta_region_t *regions,
+             size_t nregions, delta_t *d)
+{
+	delta_hash_t hash;
+	delta_job_t *jobs = NULL;
+	unsigned char *diff = NULL, *extra = NULL;
+	delta_op_t *ops = NULL;
+	pool_t *pool = NULL;
+	size_t njobs = 0, pos = 0, i;
+	uint64_t off, start;
+	int rv = 1;
+
+	memset(d, 0, sizeof(delta_t));
+	d->owned = 1;
+	for (i = 0; i < nregions; i++) {
+		if (regions[i].off != pos) {
+			fprintf(stderr, "Delta regions do not cover the "
+			        "payload!\n");
+			return 1;
+		}
+		pos += regions[i].len;
+		njobs += (regions[i].len + DELTA_BLOCK - 1) / DELTA_BLOCK;
+	}
+	if (pos != cur_len) {
+		fprintf(stderr, "Delta regions do not cover the payload!\n");
+		return 1;
+	}
+
+	start = stats_begin();
+	if (0 != delta_hash_build(&hash, old, old_len))
+		goto encode_failed;
+	jobs = mem_alloc((njobs ? njobs : 1) * sizeof(delta_job_t));
+	diff = mem_alloc(cur_len + 1);
+	extra = mem_alloc(cur_len + 1);
+	if (NULL == jobs || NULL == diff || NULL == extra) {
+		fprintf(stderr, "Out of memory while matching payloads!\n");
+		goto encode_failed;
+	}
+	memset(jobs, 0, (njobs ? njobs : 1) * sizeof(delta_job_t));
+
+	for (njobs = 0, i = 0; i < nregions; i++) {
+		for (off = 0; off < regions[i].len; off += DELTA_BLOCK) {
+			jobs[njobs].hash = &hash;
+			jobs[njobs].cur = (const unsigned char *)cur;
+			jobs[njobs].region = regions[i];
+			jobs[njobs].region.off += off;
+			jobs[njobs].region.len = regions[i].len - off <
+			                         DELTA_BLOCK ?
+			                         regions[i].len - off :
+			                         DELTA_BLOCK;
+			if (jobs[njobs].region.old_off > old_len)
+				jobs[njobs].region.old_off = old_len;
+			jobs[njobs].diff = diff + jobs[njobs].region.off;
+			jobs[njobs].extra = extra + jobs[njobs].region.off;
+			njobs++;
+		}
+	}
+
+	pool = pool_create(0);
+	for (i = 0; i < njobs; i++) {
+		if (NULL == pool || 0 != pool_submit(pool, delta_job_run,
+		                                     &jobs[i]))
+			delta_job_run(&jobs[i]);
+	}
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	/* Join the block results, each stream moves towards its start. */
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].failed) {
+			fprintf(stderr, "Out of memory while matching "
+			        "payloads!\n");
+			goto encode_failed;
+		}
+		d->nops += jobs[i].nops;
+	}
+	ops = mem_alloc((d->nops ? d->nops : 1) * sizeof(delta_op_t));
+	if (NULL == ops)
+		goto encode_failed;
+	for (d->nops = 0, i = 0; i < njobs; i++) {
+		memcpy(ops + d->nops, jobs[i].ops,
+		       jobs[i].nops * sizeof(delta_op_t));
+		d->nops += jobs[i].nops;
+		memmove(diff + d->ndiff, jobs[i].diff, jobs[i].ndiff);
+		d->ndiff += jobs[i].ndiff;
+		memmove(extra + d->nextra, jobs[i].extra, jobs[i].nextra);
+		d->nextra += jobs[i].nextra;
+	}
+	stats_end(STATS_MATCH, start, cur_len, d->nops * sizeof(delta_op_t) +
+	          d->ndiff + d->nextra);
+
+	if (0 != delta_pack(ops, d->nops * sizeof(delta_op_t), &d->ctrl,
+	                    &d->ctrl_len) ||
+	    0 != delta_pack(diff, d->ndiff, &d->diff, &d->diff_len) ||
+	    0 != delta_pack(extra, d->nextra, &d->extra, &d->extra_len)) {
+		fprintf(stderr, "Failed to compress delta!\n");
+		goto encode_failed;
+	}
+	rv = 0;
+
+encode_failed:
+	for (i = 0; jobs && i < njobs; i++)
+		mem_free(jobs[i].ops);
+	mem_free(jobs);
+	mem_free(ops);
+	mem_free(diff);
+	mem_free(extra);
+	delta_hash_free(&hash);
+	if (rv)
+		delta_free(d);
+
+	return rv;
+}
+
+/* Rebuilds the out_len bytes payload the delta was computed for. */
+int
+delta_decode(const char *old, size_t old_len, const delta_t *d, char *out,
+             size_t out_len)
+{
+	const delta_op_t *ops = NULL;
+	const unsigned char *diff = NULL, *extra = NULL;
+	size_t pos = 0, dpos = 0, epos = 0, i, j;
+	uint64_t start;
+	int rv = 1;
+
+	start = stats_begin();
+	ops = delta_unpack(d->ctrl, d->ctrl_len,
+	                   d->nops * sizeof(delta_op_t));
+	diff = delta_unpack(d->diff, d->diff_len, d->ndiff);
+	extra = delta_unpack(d->extra, d->extra_len, d->nextra);
+	if (NULL == ops || NULL == diff || NULL == extra)
+		goto decode_failed;
+
+	for (i = 0; i < d->nops; i++) {
+		if (ops[i].extra_len > d->nextra - epos ||
+		    ops[i].diff_len > d->ndiff - dpos ||
+		    ops[i].extra_len + (size_t)ops[i].diff_len >
+		    out_len - pos || ops[i].old_off > old_len ||
+		    ops[i].diff_len > old_len - ops[i].old_off) {
+			fprintf(stderr, "Corrupt delta control record!\n");
+			goto decode_failed;
+		}
+		memcpy(out + pos, extra + epos, ops[i].extra_len);
+		pos += ops[i].extra_len;
+		epos += ops[i].extra_len;
+		for (j = 0; j < ops[i].diff_len; j++)
+			out[pos + j] = old[ops[i].old_off + j] + diff[dpos + j];
+		pos += ops[i].diff_len;
+		dpos += ops[i].diff_len;
+	}
+	if (pos != out_len || dpos != d->ndiff || epos != d->nextra) {
+		fprintf(stderr, "Delta does not match payload size!\n");
+		goto decode_failed;
+	}
+	rv = 0;
+
+decode_failed:
+	stats_end(STATS_ASSEMBLE, start, d->ndiff + d->nextra, pos);
+	mem_free((void *)ops);
+	mem_free((void *)diff);
+	mem_free((void *)extra);
+
+	return rv;
+}
+
+/*
+ * Writes the delta to filename. It goes to a temporary file first
+ * which is renamed over any previous file once complete.
+ */
+int
+delta_save(const delta_image_t *img, const delta_t *d, const char *filename)
+{
+	delta_file_hdr_t fh;
+	char tmp_name[PATH_MAX];
+	int fd = -1;
+	int rv = 1;
+
+	if ((size_t)snprintf(tmp_name, sizeof(tmp_name), "%s.tmp",
+	                     filename) >= sizeof(tmp_name)) {
+		fprintf(stderr, "Delta file name too long!\n");
+		return 1;
+	}
+
+	memset(&fh, 0, sizeof(delta_file_hdr_t));
+	memcpy(fh.magic, DELTA_MAGIC, sizeof(fh.magic));
+	fh.version = DELTA_VERSION;
+	fh.old_checksum = img->old_checksum;
+	fh.old_size = img->old_size;
+	fh.new_checksum = img->new_checksum;
+	fh.new_size = img->new_size;
+	fh.mode = img->mode;
+	fh.chunk_size = img->chunk_size;
+	memcpy(fh.backend, img->backend, sizeof(fh.backend));
+	fh.payload_len = img->payload_len;
+	fh.prefix_len = img->prefix_len;
+	fh.suffix_len = img->suffix_len;
+	fh.nops = d->nops;
+	fh.ndiff = d->ndiff;
+	fh.nextra = d->nextra;
+	fh.ctrl_len = d->ctrl_len;
+	fh.diff_len = d->diff_len;
+	fh.extra_len = d->extra_len;
+
+	unlink(tmp_name);
+	fd = create_file(tmp_name);
+	if (-1 == fd)
+		goto save_failed;
+	if (0 != write_all(fd, (char *)&fh, sizeof(delta_file_hdr_t)) ||
+	    0 != write_all(fd, img->prefix, img->prefix_len) ||
+	    0 != write_all(fd, img->suffix, img->suffix_len) ||
+	    0 != write_all(fd, d->ctrl, d->ctrl_len) ||
+	    0 != write_all(fd, d->diff, d->diff_len) ||
+	    0 != write_all(fd, d->extra, d->extra_len))
+		goto save_failed;
+
+	if (0 != close(fd)) {
+		perror("Close failed");
+		fd = -1;
+		goto save_failed;
+	}
+	fd = -1;
+	if (0 != rename(tmp_name, filename)) {
+		perror("Failed to rename delta file");
+		goto save_failed;
+	}
+	rv = 0;
+
+save_failed:
+	if (-1 != fd)
+		close(fd);
+	if (rv)
+		unlink(tmp_name);
+
+	return rv;
+}
+
+/* Size of the file delta_save() writes. */
+size_t
+delta_size(const delta_image_t *img, const delta_t *d)
+{
+	return sizeof(delta_file_hdr_t) + img->prefix_len + img->suffix_len +
+	       d->ctrl_len + d->diff_len + d->extra_len;
+}
+
+/*
+ * Reads a delta file of len bytes at data. The prefix, suffix and
+ * streams keep pointing into data.
+ */
+int
+delta_parse(const char *data, size_t len, delta_image_t *img, delta_t *d)
+{
+	delta_file_hdr_t fh;
+	uint64_t pos;
+
+	memset(img, 0, sizeof(delta_image_t));
+	memset(d, 0, sizeof(delta_t));
+	if (len < sizeof(delta_file_hdr_t)) {
+		fprintf(stderr, "Delta file too short!\n");
+		return 1;
+	}
+	memcpy(&fh, data, sizeof(delta_file_hdr_t));
+	if (0 != memcmp(fh.magic, DELTA_MAGIC, sizeof(fh.magic)) ||
+	    DELTA_VERSION != fh.version) {
+		fprintf(stderr, "Unsupported delta file!\n");
+		return 1;
+	}
+
+	pos = sizeof(delta_file_hdr_t);
+	if (fh.prefix_len > len || fh.suffix_len > len ||
+	    fh.ctrl_len > len || fh.diff_len > len || fh.extra_len > len ||
+	    pos + fh.prefix_len + fh.suffix_len + fh.ctrl_len +
+	    fh.diff_len + fh.extra_len != len ||
+	    fh.nops > SIZE_MAX / sizeof(delta_op_t) ||
+	    fh.ndiff > fh.payload_len || fh.nextra > fh.payload_len) {
+		fprintf(stderr, "Malformed delta file!\n");
+		return 1;
+	}
+
+	img->old_checksum = fh.old_checksum;
+	img->old_size = fh.old_size;
+	img->new_checksum = fh.new_checksum;
+	img->new_size = fh.new_size;
+	img->mode = fh.mode;
+	img->chunk_size = fh.chunk_size;
+	memcpy(img->backend, fh.backend, sizeof(img->backend));
+	img->backend[sizeof(img->backend) - 1] = '\0';
+	img->payload_len = fh.payload_len;
+	img->prefix = data + pos;
+	img->prefix_len = fh.prefix_len;
+	pos += fh.prefix_len;
+	img->suffix = data + pos;
+	img->suffix_len = fh.suffix_len;
+	pos += fh.suffix_len;
+
+	d->nops = fh.nops;
+	d->ndiff = fh.ndiff;
+	d->nextra = fh.nextra;
+	d->ctrl = (char *)data + pos;
+	d->ctrl_len = fh.ctrl_len;
+	pos += fh.ctrl_len;
+	d->diff = (char *)data + pos;
+	d->diff_len = fh.diff_len;
+	pos += fh.diff_len;
+	d->extra = (char *)data + pos;
+	d->extra_len = fh.extra_len;
+
+	return 0;
+}
+
+void
+delta_free(delta_t *d)
+{
+	if (d->owned) {
+		mem_free(d->ctrl);
+		mem_free(d->diff);
+		mem_free(d->extra);
+	}
+	memset(d, 0, sizeof(delta_t));
+}
@@ -0,0 +1,99 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* How the new image is rebuilt around its patched payload. */
+#define DELTA_RAW	0	/* the payload is the whole image file */
+#define DELTA_STORED	1	/* the data section is the payload */
+#define DELTA_ZLIB	2	/* length prefixed zlib stream */
+#define DELTA_CHUNKS	3	/* the same, deflated in chunks */
+
+/*
+ * Stretch of the new payload and the range of the old payload its
+ * matches are preferably taken from, usually the same component.
+ */
+typedef struct delta_region
+{
+	uint64_t	off;
+	uint64_t	len;
+	uint64_t	old_off;
+	uint64_t	old_len;
+} delta_region_t;
+
+/*
+ * bsdiff style difference of two payloads. Every control record takes
+ * extra_len bytes from the extra stream, then diff_len bytes of the
+ * old payload at old_off with the diff stream added bytewise. All
+ * three streams are kept deflated.
+ */
+typedef struct delta
+{
+	char		*ctrl;
+	size_t		ctrl_len;
+	char		*diff;
+	size_t		diff_len;
+	char		*extra;
+	size_t		extra_len;
+	uint64_t	nops;		/* unpacked stream sizes */
+	uint64_t	ndiff;
+	uint64_t	nextra;
+	int		owned;		/* streams allocated, not loaded */
+} delta_t;
+
+/* What besides the payload difference it takes to rebuild an image. */
+typedef struct delta_image
+{
+	uint32_t	old_checksum;	/* cksum of the old image file */
+	uint32_t	old_size;
+	uint32_t	new_checksum;	/* cksum of the new image file */
+	uint32_t	new_size;
+	uint32_t	mode;		/* DELTA_* */
+	uint32_t	chunk_size;	/* of DELTA_CHUNKS */
+	char		backend[16];	/* compressor of DELTA_ZLIB */
+	uint64_t	payload_len;	/* new payload */
+	const char	*prefix;	/* new image bytes before the payload */
+	size_t		prefix_len;
+	const char	*suffix;	/* and after it */
+	size_t		suffix_len;
+} delta_image_t;
+
+int  delta_encode(const char *, size_t, const char *, size_t,
+                  const delta_region_t *, size_t, delta_t *);
+int  delta_decode(const char *, size_t, const delta_t *, char *, size_t);
+int  delta_save(const delta_image_t *, const delta_t *, const char *);
+size_t delta_size(const delta_image_t *, const delta_t *);
+int  delta_parse(const char *, size_t, delta_image_t *, delta_t *);
+void delta_free(delta_t *);
+
+#endif /* _DELTA_H_ */
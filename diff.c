@@ -0,0 +1,439 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "diff.h"
+#include "layout.h"
+#include "mem.h"
+#include "pool.h"
+#include "sha256.h"
+#include "stream.h"
+#include "util.h"
+#include "config.h"
+
+/* Header fields compared by diff, strings are printed as such. */
+typedef struct hdr_field
+{
+	const char	*name;
+	size_t		off;
+	size_t		len;
+	int		str;
+} hdr_field_t;
+
+#define HDR_FIELD(f, str) \
+	{ #f, offsetof(boost_hdr_t, f), sizeof(((boost_hdr_t *)0)->f), str }
+
+static const hdr_field_t hdr_fields[] = {
+	HDR_FIELD(branch_offset, 0),
+	HDR_FIELD(unknown_1, 0),
+	HDR_FIELD(image_id, 0),
+	HDR_FIELD(platform_id, 0),
+	HDR_FIELD(image_size, 0),
+	HDR_FIELD(image_checksum, 0),
+	HDR_FIELD(load_offset, 0),
+	HDR_FIELD(flags, 0),
+	HDR_FIELD(target_filename, 1),
+	HDR_FIELD(unknown_2, 0),
+	HDR_FIELD(image_description, 1),
+	HDR_FIELD(image_version, 1),
+	HDR_FIELD(mutex_bits, 0),
+	HDR_FIELD(unknown_3, 0),
+	HDR_FIELD(checksum, 0),
+};
+
+/* Digest of one component of a streamed diff. */
+typedef struct diff_part
+{
+	uint64_t	len;
+	sha256_t	sha;		/* whole component */
+	uint8_t		digest[SHA256_LEN];
+	uint32_t	block_crc;	/* block being hashed */
+	uint32_t	*blocks;	/* cksum of each DIFF_BLOCK bytes */
+	size_t		nblocks;
+	uint64_t	want;		/* block to capture, UINT64_MAX none */
+	char		*cap;		/* DIFF_BLOCK bytes */
+	size_t		cap_len;
+} diff_part_t;
+
+/* One image of a diff, inflated on a thread of its own. */
+typedef struct diff_side
+{
+	boost_hdr_t	hdr;
+	const char	*data;		/* data section */
+	extract_stream_t es;
+	diff_part_t	parts[INDEX_PARTS];
+	int		refine;		/* only capturing, stop when done */
+	int		stopped;
+	int		failed;
+} diff_side_t;
+
+static int
+diff_part_sink(void *ctx, int part, uint64_t off, const char *buf, size_t len)
+{
+	diff_side_t *s = ctx;
+	diff_part_t *p = &s->parts[part];
+	size_t n, i;
+
+	if (0 == off && !s->refine) {
+		p->len = s->es.layout.parts[part].len;
+		p->blocks = mem_alloc((p->len / DIFF_BLOCK + 1) *
+		                      sizeof(uint32_t));
+		if (NULL == p->blocks)
+			return 1;
+	}
+
+	for (; len > 0; off += n, buf += n, len -= n) {
+		n = DIFF_BLOCK - off % DIFF_BLOCK;
+		n = n < len ? n : len;
+		if (off / DIFF_BLOCK == p->want) {
+			memcpy(p->cap + off % DIFF_BLOCK, buf, n);
+			p->cap_len += n;
+		}
+		if (s->refine)
+			continue;
+		sha256_update(&p->sha, buf, n);
+		p->block_crc = cksum_update(p->block_crc, buf, n);
+		if (0 == (off + n) % DIFF_BLOCK) {
+			p->blocks[p->nblocks++] = cksum_final(p->block_crc,
+			                                      DIFF_BLOCK);
+			p->block_crc = 0;
+		}
+	}
+
+	if (!s->refine)
+		return 0;
+
+	/* Ends the inflate once every wanted block is in. */
+	for (i = 0; i < INDEX_PARTS; i++) {
+		p = &s->parts[i];
+		if (UINT64_MAX != p->want &&
+		    p->cap_len < DIFF_BLOCK &&
+		    p->want * DIFF_BLOCK + p->cap_len < p->len)
+			return 0;
+	}
+	s->stopped = 1;
+
+	return 1;
+}
+
+static void
+diff_side_run(void *arg)
+{
+	diff_side_t *s = arg;
+	size_t len = 0, total;
+	char *buf;
+	int rv;
+
+	memset(&s->es, 0, sizeof(extract_stream_t));
+	s->es.pending = BOOST_ALL_PARTS;
+	s->es.cap_off = 0;
+	s->es.cap_len = sizeof(uint32_t);
+	s->es.sink = diff_part_sink;
+	s->es.sink_ctx = s;
+
+	if (!(s->hdr.flags & BOOST_FLAG_ZLIB)) {
+		s->es.total = s->hdr.image_size;
+		extract_stream_begin(&s->es, &s->hdr, s->data, NULL);
+		rv = extract_stream_sink(&s->es, s->data, s->hdr.image_size);
+		s->failed = rv && !s->es.done && !s->stopped;
+		return;
+	}
+
+	total = s->hdr.image_size >= sizeof(uint32_t) ?
+	        swap_bytes_be(((const uint32_t *)s->data)[0]) : 0;
+	if (total < sizeof(uint32_t)) {
+		fprintf(stderr, "Invalid unpacked image size!\n");
+		s->failed = 1;
+		return;
+	}
+	s->es.total = total;
+
+	buf = mem_alloc(STREAM_BUF_SIZE);
+	if (NULL == buf) {
+		s->failed = 1;
+		return;
+	}
+	extract_stream_begin(&s->es, &s->hdr, s->data, buf);
+	rv = zlib_decompress_stream(s->data + 4, s->hdr.image_size - 4, buf,
+	                            STREAM_BUF_SIZE, extract_stream_sink,
+	                            &s->es, &len, NULL);
+	if (!rv)
+		rv = extract_stream_end(&s->es);
+	s->failed = rv && !s->es.done && !s->stopped;
+	if (!rv && len != total) {
+		fprintf(stderr, "Unpacked size mismatch!\n");
+		s->failed = 1;
+	}
+	extract_stream_free(&s->es);
+	mem_free(buf);
+}
+
+/* Streams both images at once, each on a worker thread. */
+static int
+diff_run(diff_side_t *a, diff_side_t *b)
+{
+	pool_t *pool;
+
+	pool = pool_create(2);
+	if (NULL == pool || 0 != pool_submit(pool, diff_side_run, a))
+		diff_side_run(a);
+	if (NULL == pool || 0 != pool_submit(pool, diff_side_run, b))
+		diff_side_run(b);
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	return a->failed || b->failed;
+}
+
+static void
+diff_finish(diff_side_t *s)
+{
+	diff_part_t *p;
+	int i;
+
+	for (i = 0; i < INDEX_PARTS; i++) {
+		p = &s->parts[i];
+		if (p->len % DIFF_BLOCK)
+			p->blocks[p->nblocks++] = cksum_final(p->block_crc,
+			                                      p->len % DIFF_BLOCK);
+		sha256_final(&p->sha, p->digest);
+	}
+}
+
+static int
+diff_part_same(const diff_part_t *a, const diff_part_t *b)
+{
+	return a->len == b->len &&
+	       0 == memcmp(a->digest, b->digest, SHA256_LEN);
+}
+
+static int
+diff_block_differs(const diff_part_t *a, const diff_part_t *b, size_t i)
+{
+	return i >= a->nblocks || i >= b->nblocks ||
+	       a->blocks[i] != b->blocks[i];
+}
+
+static int
+diff_headers(const boost_hdr_t *a, const boost_hdr_t *b)
+{
+	const char *fa, *fb;
+	uint32_t va, vb;
+	size_t i;
+	int n = 0;
+
+	for (i = 0; i < sizeof(hdr_fields) / sizeof(hdr_fields[0]); i++) {
+		fa = (const char *)a + hdr_fields[i].off;
+		fb = (const char *)b + hdr_fields[i].off;
+		if (0 == memcmp(fa, fb, hdr_fields[i].len))
+			continue;
+		if (0 == n++)
+			printf("Header\t\t: differs\n");
+		if (hdr_fields[i].str) {
+			printf("  %-18s: \"%.*s\" -> \"%.*s\"\n",
+			       hdr_fields[i].name,
+			       (int)strnlen(fa, hdr_fields[i].len), fa,
+			       (int)strnlen(fb, hdr_fields[i].len), fb);
+		} else if (sizeof(uint32_t) == hdr_fields[i].len) {
+			memcpy(&va, fa, sizeof(uint32_t));
+			memcpy(&vb, fb, sizeof(uint32_t));
+			printf("  %-18s: 0x%08x -> 0x%08x\n",
+			       hdr_fields[i].name, va, vb);
+		} else {
+			printf("  %-18s: differs\n", hdr_fields[i].name);
+		}
+	}
+	if (0 == n)
+		printf("Header\t\t: identical\n");
+
+	return n;
+}
+
+/* Prints the runs of differing blocks of one component. */
+static void
+diff_print_blocks(const diff_part_t *a, const diff_part_t *b)
+{
+	size_t n = a->nblocks > b->nblocks ? a->nblocks : b->nblocks;
+	size_t i, start, runs = 0;
+	uint64_t len = a->len > b->len ? a->len : b->len;
+
+	for (i = 0; i < n; i++) {
+		if (!diff_block_differs(a, b, i))
+			continue;
+		for (start = i; i + 1 < n && diff_block_differs(a, b, i + 1);)
+			i++;
+		if (runs++ < DIFF_MAX_RUNS)
+			printf("  changed\t: 0x%08llx-0x%08llx\n",
+			       (unsigned long long)start * DIFF_BLOCK,
+			       (unsigned long long)((i + 1) * DIFF_BLOCK <
+			       len ? (i + 1) * DIFF_BLOCK : len) - 1);
+	}
+	if (runs > DIFF_MAX_RUNS)
+		printf("  changed\t: %zu more ranges\n", runs - DIFF_MAX_RUNS);
+}
+
+/*
+ * Compares two images without extracting them. The headers are
+ * compared field by field and the components by size and SHA-256,
+ * with both images inflated at the same time through small buffers.
+ * Each DIFF_BLOCK bytes of a component also get a cksum, used only to
+ * locate the changed ranges. Finding the exact first difference takes
+ * a second pass, which stops once the first differing block of each
+ * component has been captured.
+ * Returns 0 for identical images, 1 otherwise.
+ */
+int
+boost_diff(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+	diff_side_t *sa = NULL, *sb = NULL;
+	const part_name_t *name;
+	diff_part_t *pa, *pb;
+	size_t i, j, n;
+	uint64_t first;
+	int differ = 0;
+	int rv = 1;
+
+	if (a_len < sizeof(boost_hdr_t) || b_len < sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		return 1;
+	}
+
+	sa = mem_alloc(sizeof(diff_side_t));
+	sb = mem_alloc(sizeof(diff_side_t));
+	if (NULL == sa || NULL == sb)
+		goto diff_failed;
+	memset(sa, 0, sizeof(diff_side_t));
+	memset(sb, 0, sizeof(diff_side_t));
+	memcpy(&sa->hdr, a, sizeof(boost_hdr_t));
+	memcpy(&sb->hdr, b, sizeof(boost_hdr_t));
+	if (sa->hdr.image_size > a_len - sizeof(boost_hdr_t) ||
+	    sb->hdr.image_size > b_len - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image file is truncated!\n");
+		goto diff_failed;
+	}
+	sa->data = a + sizeof(boost_hdr_t);
+	sb->data = b + sizeof(boost_hdr_t);
+	for (i = 0; i < INDEX_PARTS; i++) {
+		sa->parts[i].want = sb->parts[i].want = UINT64_MAX;
+		sha256_init(&sa->parts[i].sha);
+		sha256_init(&sb->parts[i].sha);
+	}
+
+	differ = 0 != diff_headers(&sa->hdr, &sb->hdr);
+
+	if (0 != diff_run(sa, sb))
+		goto diff_failed;
+	diff_finish(sa);
+	diff_finish(sb);
+
+	/* Capture the first differing block of each changed component. */
+	for (i = 0; i < INDEX_PARTS; i++) {
+		pa = &sa->parts[i];
+		pb = &sb->parts[i];
+		if (diff_part_same(pa, pb))
+			continue;
+		for (j = 0; !diff_block_differs(pa, pb, j); j++)
+			;
+		if ((uint64_t)j * DIFF_BLOCK >= pa->len ||
+		    (uint64_t)j * DIFF_BLOCK >= pb->len)
+			continue;
+		pa->cap = mem_alloc(DIFF_BLOCK);
+		pb->cap = mem_alloc(DIFF_BLOCK);
+		if (NULL == pa->cap || NULL == pb->cap)
+			goto diff_failed;
+		pa->want = pb->want = j;
+		sa->refine = sb->refine = 1;
+	}
+	if (sa->refine && 0 != diff_run(sa, sb))
+		goto diff_failed;
+
+	for (i = 0; i < INDEX_PARTS; i++) {
+		pa = &sa->parts[i];
+		pb = &sb->parts[i];
+		name = &part_names[sa->es.layout.type][i];
+		if (0 == pa->len && 0 == pb->len)
+			continue;
+		printf("%s\t: ", name->descr ? name->descr : name->filename);
+		if (diff_part_same(pa, pb)) {
+			printf("identical, %llu bytes\n",
+			       (unsigned long long)pa->len);
+			continue;
+		}
+		differ = 1;
+		if (pa->len == pb->len)
+			printf("differs, %llu bytes\n",
+			       (unsigned long long)pa->len);
+		else
+			printf("differs, %llu -> %llu bytes\n",
+			       (unsigned long long)pa->len,
+			       (unsigned long long)pb->len);
+
+		/* Without a captured block the shorter one is a prefix. */
+		first = pa->len < pb->len ? pa->len : pb->len;
+		if (UINT64_MAX != pa->want) {
+			n = pa->cap_len < pb->cap_len ? pa->cap_len :
+			    pb->cap_len;
+			for (j = 0; j < n && pa->cap[j] == pb->cap[j]; j++)
+				;
+			first = pa->want * DIFF_BLOCK + j;
+		}
+		printf("  first at\t: 0x%08llx\n", (unsigned long long)first);
+		diff_print_blocks(pa, pb);
+	}
+	if (sa->es.layout.type != sb->es.layout.type) {
+		printf("Layout\t\t: differs\n");
+		differ = 1;
+	}
+
+	printf("Images %s\n", differ ? "differ" : "are identical");
+	rv = differ;
+
+diff_failed:
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (NULL != sa) {
+			mem_free(sa->parts[i].blocks);
+			mem_free(sa->parts[i].cap);
+		}
+		if (NULL != sb) {
+			mem_free(sb->parts[i].blocks);
+			mem_free(sb->parts[i].cap);
+		}
+	}
+	mem_free(sa);
+	mem_free(sb);
+
+	return rv;
+}
@@ -0,0 +1,1211 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ext2.h"
+#include "loader.h"
+#include "mem.h"
+#include "stats.h"
+
+/*
+ * Revision 1 ext2 with 1k blocks, the smallest unit a ramdisk file can
+ * take on the target. Groups span one bitmap block worth of blocks.
+ */
+#define EXT2_BLOCK		1024
+#define EXT2_PTRS		(EXT2_BLOCK / sizeof(uint32_t))
+#define EXT2_GROUP		(EXT2_BLOCK * 8)
+#define EXT2_INODE		128
+#define EXT2_INODES_BLOCK	(EXT2_BLOCK / EXT2_INODE)
+#define EXT2_NDIR		12
+#define EXT2_ROOT_INO		2
+#define EXT2_FIRST_INO		11
+#define EXT2_FAST_LINK		60
+#define EXT2_MAX_NAME		255
+#define EXT2_MAX_FILE		0x7fffffffUL	/* without large_file */
+#define EXT2_MAGIC		0xEF53
+#define EXT2_FTYPE		0x0002		/* incompat, dirent types */
+#define EXT2_SPARSE_SUPER	0x0001		/* ro_compat */
+#define EXT2_LARGE_FILE		0x0002		/* ro_compat */
+#define EXT2_VALID_FS		0x0001
+
+#define DIV_UP(a, b)	(((a) + (b) - 1) / (b))
+
+typedef struct ext2_super
+{
+	uint32_t	s_inodes_count;
+	uint32_t	s_blocks_count;
+	uint32_t	s_r_blocks_count;
+	uint32_t	s_free_blocks_count;
+	uint32_t	s_free_inodes_count;
+	uint32_t	s_first_data_block;
+	uint32_t	s_log_block_size;
+	uint32_t	s_log_frag_size;
+	uint32_t	s_blocks_per_group;
+	uint32_t	s_frags_per_group;
+	uint32_t	s_inodes_per_group;
+	uint32_t	s_mtime;
+	uint32_t	s_wtime;
+	uint16_t	s_mnt_count;
+	uint16_t	s_max_mnt_count;
+	uint16_t	s_magic;
+	uint16_t	s_state;
+	uint16_t	s_errors;
+	uint16_t	s_minor_rev_level;
+	uint32_t	s_lastcheck;
+	uint32_t	s_checkinterval;
+	uint32_t	s_creator_os;
+	uint32_t	s_rev_level;
+	uint16_t	s_def_resuid;
+	uint16_t	s_def_resgid;
+	uint32_t	s_first_ino;
+	uint16_t	s_inode_size;
+	uint16_t	s_block_group_nr;
+	uint32_t	s_feature_compat;
+	uint32_t	s_feature_incompat;
+	uint32_t	s_feature_ro_compat;
+	uint8_t		s_uuid[16];
+	char		s_volume_name[16];
+	uint8_t		s_reserved[888];
+} ext2_super_t;
+
+typedef struct ext2_group
+{
+	uint32_t	bg_block_bitmap;
+	uint32_t	bg_inode_bitmap;
+	uint32_t	bg_inode_table;
+	uint16_t	bg_free_blocks_count;
+	uint16_t	bg_free_inodes_count;
+	uint16_t	bg_used_dirs_count;
+	uint16_t	bg_pad;
+	uint32_t	bg_reserved[3];
+} ext2_group_t;
+
+typedef struct ext2_inode
+{
+	uint16_t	i_mode;
+	uint16_t	i_uid;
+	uint32_t	i_size;
+	uint32_t	i_atime;
+	uint32_t	i_ctime;
+	uint32_t	i_mtime;
+	uint32_t	i_dtime;
+	uint16_t	i_gid;
+	uint16_t	i_links_count;
+	uint32_t	i_blocks;	/* in 512 byte sectors */
+	uint32_t	i_flags;
+	uint32_t	i_osd1;
+	uint32_t	i_block[15];
+	uint32_t	i_generation;
+	uint32_t	i_file_acl;
+	uint32_t	i_dir_acl;
+	uint32_t	i_faddr;
+	uint8_t		i_osd2[12];
+} ext2_inode_t;
+
+typedef struct ext2_dirent
+{
+	uint32_t	inode;
+	uint16_t	rec_len;
+	uint8_t		name_len;
+	uint8_t		file_type;
+	char		name[];
+} ext2_dirent_t;
+
+/* Directory tree entry, in breadth first order. */
+struct ext2_node
+{
+	char		*path;
+	const char	*name;		/* last component of path */
+	size_t		parent;
+	size_t		first;		/* children of directories */
+	size_t		nchild;
+	struct stat	st;
+	uint32_t	ino;
+	uint32_t	links;
+	uint64_t	size;
+	int		hardlink;	/* inode belongs to an earlier node */
+	uint32_t	nblocks;	/* data blocks */
+	uint32_t	nmeta;		/* indirect blocks */
+	uint32_t	mapped;		/* data blocks allocated so far */
+	uint32_t	block[15];
+	char		*data;		/* directory blocks or link target */
+	loaded_t	file;
+};
+
+typedef struct ext2_node ext2_node_t;
+
+/* Image bytes starting at a block, padded with zeros to whole blocks. */
+typedef struct ext2_extent
+{
+	uint32_t	blk;
+	const char	*data;
+	size_t		len;
+} ext2_extent_t;
+
+/* Byte range of an image. */
+typedef struct ext2_range
+{
+	uint64_t	off;
+	uint64_t	len;
+} ext2_range_t;
+
+/* Free space of an image found by ext2_scrub(). */
+typedef struct ext2_free
+{
+	ext2_range_t	*r;
+	size_t		n;
+	size_t		alloc;
+} ext2_free_t;
+
+/* Block group buffers. */
+typedef struct ext2_grp
+{
+	uint8_t		*bbitmap;
+	uint8_t		*ibitmap;
+	ext2_super_t	*sb;		/* backup groups only */
+	char		*itable;	/* up to the last used inode */
+	uint32_t	dirs;
+} ext2_grp_t;
+
+/* Layout state of ext2_build(). */
+typedef struct ext2_fs
+{
+	ext2_image_t	*img;
+	ext2_extent_t	*ext;
+	size_t		next;
+	size_t		ext_alloc;
+	ext2_grp_t	*grp;
+	ext2_group_t	*gdt;
+	uint32_t	ngroups;
+	uint32_t	blocks_count;
+	uint32_t	ipg;		/* inodes per group */
+	uint32_t	itable_blocks;
+	uint32_t	gdt_blocks;
+	uint32_t	next_ino;
+	uint32_t	next_block;
+	uint32_t	newest;		/* mtime, for the superblock */
+	uint64_t	in_bytes;
+} ext2_fs_t;
+
+static void *
+ext2_buf(ext2_image_t *img, size_t len)
+{
+	void **tmp;
+	void *buf;
+
+	if (img->nbufs == img->bufs_alloc) {
+		img->bufs_alloc = img->bufs_alloc ? img->bufs_alloc * 2 : 64;
+		tmp = mem_realloc(img->bufs, img->bufs_alloc * sizeof(void *));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate ramdisk buffers!\n");
+			return NULL;
+		}
+		img->bufs = tmp;
+	}
+	buf = mem_alloc(len);
+	if (NULL == buf) {
+		fprintf(stderr, "Failed to allocate ramdisk buffers!\n");
+		return NULL;
+	}
+	memset(buf, 0, len);
+	img->bufs[img->nbufs++] = buf;
+
+	return buf;
+}
+
+static int
+ext2_extent(ext2_fs_t *fs, uint32_t blk, const char *data, size_t len)
+{
+	ext2_extent_t *last = fs->next ? &fs->ext[fs->next - 1] : NULL;
+	ext2_extent_t *tmp;
+
+	/* Whole blocks followed by the next bytes of the same buffer. */
+	if (last && 0 == last->len % EXT2_BLOCK &&
+	    last->blk + last->len / EXT2_BLOCK == blk &&
+	    last->data + last->len == data) {
+		last->len += len;
+		return 0;
+	}
+
+	if (fs->next == fs->ext_alloc) {
+		fs->ext_alloc = fs->ext_alloc ? fs->ext_alloc * 2 : 256;
+		tmp = mem_realloc(fs->ext, fs->ext_alloc *
+		                  sizeof(ext2_extent_t));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate ramdisk layout!\n");
+			return 1;
+		}
+		fs->ext = tmp;
+	}
+	fs->ext[fs->next].blk = blk;
+	fs->ext[fs->next].data = data;
+	fs->ext[fs->next].len = len;
+	fs->next++;
+
+	return 0;
+}
+
+static void
+ext2_set_bit(uint8_t *bitmap, uint32_t bit)
+{
+	bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+/* Groups 0, 1 and powers of 3, 5 and 7 keep superblock backups. */
+static int
+ext2_has_super(uint32_t g)
+{
+	uint32_t p, n;
+
+	if (g <= 1)
+		return 1;
+	for (p = 3; p <= 7; p += 2) {
+		for (n = p; n < g; n *= p)
+			;
+		if (n == g)
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t
+ext2_group_start(uint32_t g)
+{
+	return 1 + g * EXT2_GROUP;
+}
+
+/* Superblock, descriptors, bitmaps and inode table of a group. */
+static uint32_t
+ext2_group_meta(const ext2_fs_t *fs, uint32_t g)
+{
+	return (ext2_has_super(g) ? 1 + fs->gdt_blocks : 0) + 2 +
+	       fs->itable_blocks;
+}
+
+static uint32_t
+ext2_group_size(const ext2_fs_t *fs, uint32_t g)
+{
+	if (g + 1 < fs->ngroups)
+		return EXT2_GROUP;
+	return fs->blocks_count - ext2_group_start(g);
+}
+
+/* Indirect blocks mapping n data blocks. */
+static uint32_t
+ext2_meta_blocks(uint32_t n)
+{
+	uint32_t meta = 1;
+
+	if (n <= EXT2_NDIR)
+		return 0;
+	n -= EXT2_NDIR;
+	if (n <= EXT2_PTRS)
+		return meta;
+	n -= EXT2_PTRS;
+	if (n <= EXT2_PTRS * EXT2_PTRS)
+		return meta + 1 + DIV_UP(n, EXT2_PTRS);
+	n -= EXT2_PTRS * EXT2_PTRS;
+	meta += 1 + EXT2_PTRS;
+
+	return meta + 1 + DIV_UP(n, EXT2_PTRS * EXT2_PTRS) +
+	       DIV_UP(n, EXT2_PTRS);
+}
+
+static uint8_t
+ext2_file_type(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return 1;
+	if (S_ISDIR(mode))
+		return 2;
+	if (S_ISCHR(mode))
+		return 3;
+	if (S_ISBLK(mode))
+		return 4;
+	if (S_ISFIFO(mode))
+		return 5;
+	if (S_ISSOCK(mode))
+		return 6;
+	return 7;
+}
+
+/*
+ * Packs the entries of a directory into blocks, the last entry of each
+ * block stretches to its end. Only counts the blocks when buf is NULL.
+ */
+static uint32_t
+ext2_dir_fill(const ext2_fs_t *fs, const ext2_node_t *d, char *buf)
+{
+	const ext2_node_t *c = NULL;
+	ext2_dirent_t *de = NULL;
+	size_t i, len, rec, pos = 0;
+	uint32_t blocks = 1;
+	const char *name;
+
+	for (i = 0; i < d->nchild + 2; i++) {
+		if (0 == i) {
+			name = ".";
+		} else if (1 == i) {
+			name = "..";
+		} else {
+			c = &fs->img->nodes[d->first + i - 2];
+			name = c->name;
+		}
+		len = strlen(name);
+		rec = (sizeof(ext2_dirent_t) + len + 3) & ~3UL;
+		if (pos + rec > EXT2_BLOCK) {
+			if (buf)
+				de->rec_len = htole16(le16toh(de->rec_len) +
+				                      EXT2_BLOCK - pos);
+			blocks++;
+			pos = 0;
+		}
+		if (buf) {
+			de = (ext2_dirent_t *)(buf + (blocks - 1) *
+			                       EXT2_BLOCK + pos);
+			if (i < 2) {
+				de->inode = htole32(0 == i ? d->ino :
+				            fs->img->nodes[d->parent].ino);
+				de->file_type = 2;
+			} else {
+				de->inode = htole32(c->ino);
+				de->file_type = ext2_file_type(c->st.st_mode);
+			}
+			de->rec_len = htole16(rec);
+			de->name_len = len;
+			memcpy(de->name, name, len);
+		}
+		pos += rec;
+	}
+	if (buf)
+		de->rec_len = htole16(le16toh(de->rec_len) + EXT2_BLOCK - pos);
+
+	return blocks;
+}
+
+static int
+ext2_load_file(ext2_node_t *n)
+{
+	int fd, rv = 0;
+
+	fd = open(n->path, O_RDONLY);
+	if (-1 == fd) {
+		fprintf(stderr, "Failed to open %s: %s\n", n->path,
+		        strerror(errno));
+		return 1;
+	}
+	if (0 != loader_load(fd, n->size, &n->file)) {
+		fprintf(stderr, "Failed to load %s\n", n->path);
+		rv = 1;
+	}
+	if (0 != close(fd)) {
+		perror("Failed to close ramdisk file");
+		rv = 1;
+	}
+
+	return rv;
+}
+
+/*
+ * Appends the entry name of directory parent, with its attributes
+ * given in st or read from the input tree when st is NULL.
+ */
+static int
+ext2_add_node(ext2_fs_t *fs, size_t parent, const char *name,
+              const struct stat *st)
+{
+	ext2_image_t *img = fs->img;
+	ext2_node_t *n, *tmp;
+	size_t plen, i;
+	ssize_t len;
+
+	if (strlen(name) > EXT2_MAX_NAME) {
+		fprintf(stderr, "Name too long for ext2: %s\n", name);
+		return 1;
+	}
+	if (img->nnodes == img->nodes_alloc) {
+		img->nodes_alloc = img->nodes_alloc ? img->nodes_alloc * 2 : 64;
+		tmp = mem_realloc(img->nodes, img->nodes_alloc *
+		                  sizeof(ext2_node_t));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate ramdisk tree!\n");
+			return 1;
+		}
+		img->nodes = tmp;
+	}
+	n = &img->nodes[img->nnodes];
+	memset(n, 0, sizeof(ext2_node_t));
+
+	plen = strlen(img->nodes[parent].path);
+	n->path = mem_alloc(plen + strlen(name) + 2);
+	if (NULL == n->path) {
+		fprintf(stderr, "Failed to allocate ramdisk tree!\n");
+		return 1;
+	}
+	img->nnodes++;
+	sprintf(n->path, "%s/%s", img->nodes[parent].path, name);
+	n->name = n->path + plen + 1;
+	n->parent = parent;
+	n->links = 1;
+
+	if (st) {
+		n->st = *st;
+	} else if (0 != lstat(n->path, &n->st)) {
+		fprintf(stderr, "Failed to stat %s: %s\n", n->path,
+		        strerror(errno));
+		return 1;
+	}
+
+	if (S_ISDIR(n->st.st_mode)) {
+		n->links = 2;
+		img->nodes[parent].links++;
+	} else if (S_ISREG(n->st.st_mode)) {
+		/* Further names of a file share the inode of the first. */
+		for (i = 0; n->st.st_nlink > 1 && i < img->nnodes - 1; i++) {
+			if (img->nodes[i].st.st_ino == n->st.st_ino &&
+			    img->nodes[i].st.st_dev == n->st.st_dev &&
+			    !img->nodes[i].hardlink) {
+				n->hardlink = 1;
+				n->ino = img->nodes[i].ino;
+				img->nodes[i].links++;
+				return 0;
+			}
+		}
+		if ((uint64_t)n->st.st_size > EXT2_MAX_FILE) {
+			fprintf(stderr, "File too large for ext2: %s\n",
+			        n->path);
+			return 1;
+		}
+		n->size = n->st.st_size;
+		if (n->size && 0 != ext2_load_file(n))
+			return 1;
+		fs->in_bytes += n->size;
+	} else if (S_ISLNK(n->st.st_mode)) {
+		n->data = ext2_buf(img, n->st.st_size + 1);
+		if (NULL == n->data)
+			return 1;
+		len = readlink(n->path, n->data, n->st.st_size + 1);
+		if (len < 0 || len > n->st.st_size) {
+			fprintf(stderr, "Failed to read link %s\n", n->path);
+			return 1;
+		}
+		n->size = len;
+	} else if (!S_ISCHR(n->st.st_mode) && !S_ISBLK(n->st.st_mode) &&
+	           !S_ISFIFO(n->st.st_mode) && !S_ISSOCK(n->st.st_mode)) {
+		fprintf(stderr, "Unsupported file type: %s\n", n->path);
+		return 1;
+	}
+
+	/* Short link targets live in the inode itself. */
+	if (!S_ISLNK(n->st.st_mode) || n->size >= EXT2_FAST_LINK)
+		n->nblocks = DIV_UP(n->size, EXT2_BLOCK);
+	n->nmeta = ext2_meta_blocks(n->nblocks);
+	n->ino = fs->next_ino++;
+	if ((uint32_t)n->st.st_mtime > fs->newest)
+		fs->newest = n->st.st_mtime;
+
+	return 0;
+}
+
+static int
+ext2_skip_dots(const struct dirent *de)
+{
+	return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+static int
+ext2_name_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Adds the entries of a directory, sorted so equal trees give equal
+ * images. The root gets a fresh lost+found in place of any own one.
+ */
+static int
+ext2_scan_dir(ext2_fs_t *fs, size_t dir)
+{
+	ext2_image_t *img = fs->img;
+	struct dirent **names = NULL;
+	struct stat lf;
+	int n, i, rv = 1;
+
+	n = scandir(img->nodes[dir].path, &names, ext2_skip_dots,
+	            ext2_name_cmp);
+	if (n < 0) {
+		fprintf(stderr, "Failed to read directory %s: %s\n",
+		        img->nodes[dir].path, strerror(errno));
+		return 1;
+	}
+
+	img->nodes[dir].first = img->nnodes;
+	if (0 == dir) {
+		lf = img->nodes[0].st;
+		lf.st_mode = S_IFDIR | 0700;
+		if (0 != ext2_add_node(fs, 0, "lost+found", &lf))
+			goto scan_failed;
+	}
+	for (i = 0; i < n; i++) {
+		if (0 == dir && 0 == strcmp(names[i]->d_name, "lost+found"))
+			continue;
+		if (0 != ext2_add_node(fs, dir, names[i]->d_name, NULL))
+			goto scan_failed;
+	}
+	img->nodes[dir].nchild = img->nnodes - img->nodes[dir].first;
+	rv = 0;
+
+scan_failed:
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+
+	return rv;
+}
+
+/*
+ * Sizes the filesystem for the used blocks and inodes plus the free
+ * space margin and sets up the group buffers and their extents.
+ */
+static int
+ext2_layout(ext2_fs_t *fs)
+{
+	ext2_image_t *img = fs->img;
+	uint64_t used = 0, spare, blocks = 0;
+	uint32_t inodes, ngroups, g, meta, last, start;
+	size_t i, itable_len;
+	ext2_super_t *sb;
+
+	for (i = 0; i < img->nnodes; i++) {
+		if (!img->nodes[i].hardlink)
+			used += img->nodes[i].nblocks + img->nodes[i].nmeta;
+	}
+	spare = used * RAMDISK_FREE_PERCENT / 100;
+	used += spare > RAMDISK_FREE_MIN ? spare : RAMDISK_FREE_MIN;
+	inodes = fs->next_ino - 1;
+	spare = inodes * RAMDISK_FREE_PERCENT / 100;
+	inodes += spare > RAMDISK_FREE_MIN ? spare : RAMDISK_FREE_MIN;
+
+	/* More groups mean more metadata, repeat until the count holds. */
+	for (ngroups = 1; ngroups != fs->ngroups; ) {
+		fs->ngroups = ngroups;
+		fs->ipg = DIV_UP(inodes, ngroups);
+		if (fs->ipg < EXT2_FIRST_INO + 1)
+			fs->ipg = EXT2_FIRST_INO + 1;
+		fs->ipg = DIV_UP(fs->ipg, EXT2_INODES_BLOCK) *
+		          EXT2_INODES_BLOCK;
+		if (fs->ipg > EXT2_GROUP) {
+			ngroups = DIV_UP(inodes, EXT2_GROUP);
+			continue;
+		}
+		fs->itable_blocks = fs->ipg / EXT2_INODES_BLOCK;
+		fs->gdt_blocks = DIV_UP(ngroups * sizeof(ext2_group_t),
+		                        EXT2_BLOCK);
+		blocks = 1 + used;
+		for (g = 0; g < ngroups; g++)
+			blocks += ext2_group_meta(fs, g);
+		ngroups = DIV_UP(blocks - 1, EXT2_GROUP);
+		if (ngroups < fs->ngroups)
+			ngroups = fs->ngroups;
+	}
+
+	/* A short last group still needs room past its own metadata. */
+	last = blocks - ext2_group_start(fs->ngroups - 1);
+	meta = ext2_group_meta(fs, fs->ngroups - 1);
+	if (last < meta + RAMDISK_FREE_MIN)
+		blocks += meta + RAMDISK_FREE_MIN - last;
+	if (blocks > UINT32_MAX / EXT2_BLOCK) {
+		fprintf(stderr, "Ramdisk tree too large!\n");
+		return 1;
+	}
+	fs->blocks_count = blocks;
+
+	fs->grp = ext2_buf(img, fs->ngroups * sizeof(ext2_grp_t));
+	fs->gdt = ext2_buf(img, fs->gdt_blocks * EXT2_BLOCK);
+	if (NULL == fs->grp || NULL == fs->gdt)
+		return 1;
+
+	for (g = 0; g < fs->ngroups; g++) {
+		start = ext2_group_start(g);
+		if (ext2_has_super(g)) {
+			sb = ext2_buf(img, sizeof(ext2_super_t));
+			if (NULL == sb)
+				return 1;
+			fs->grp[g].sb = sb;
+			if (0 != ext2_extent(fs, start, (char *)sb,
+			                     sizeof(ext2_super_t)) ||
+			    0 != ext2_extent(fs, start + 1, (char *)fs->gdt,
+			                     fs->gdt_blocks * EXT2_BLOCK))
+				return 1;
+			start += 1 + fs->gdt_blocks;
+		}
+
+		fs->grp[g].bbitmap = ext2_buf(img, EXT2_BLOCK);
+		fs->grp[g].ibitmap = ext2_buf(img, EXT2_BLOCK);
+		if (NULL == fs->grp[g].bbitmap || NULL == fs->grp[g].ibitmap)
+			return 1;
+		fs->gdt[g].bg_block_bitmap = htole32(start);
+		fs->gdt[g].bg_inode_bitmap = htole32(start + 1);
+		fs->gdt[g].bg_inode_table = htole32(start + 2);
+		if (0 != ext2_extent(fs, start, (char *)fs->grp[g].bbitmap,
+		                     EXT2_BLOCK) ||
+		    0 != ext2_extent(fs, start + 1, (char *)fs->grp[g].ibitmap,
+		                     EXT2_BLOCK))
+			return 1;
+
+		/* Inode table blocks past the used inodes stay zero runs. */
+		itable_len = 0;
+		if (fs->next_ino - 1 > g * fs->ipg)
+			itable_len = fs->next_ino - 1 - g * fs->ipg;
+		if (itable_len > fs->ipg)
+			itable_len = fs->ipg;
+		itable_len *= EXT2_INODE;
+		if (itable_len) {
+			fs->grp[g].itable = ext2_buf(img, itable_len);
+			if (NULL == fs->grp[g].itable ||
+			    0 != ext2_extent(fs, start + 2, fs->grp[g].itable,
+			                     itable_len))
+				return 1;
+		}
+
+		meta = ext2_group_meta(fs, g);
+		for (i = 0; i < meta; i++)
+			ext2_set_bit(fs->grp[g].bbitmap, i);
+	}
+
+	return 0;
+}
+
+/* Allocates the next free block past the group metadata. */
+static uint32_t
+ext2_alloc_block(ext2_fs_t *fs)
+{
+	uint32_t g = (fs->next_block - 1) / EXT2_GROUP;
+	uint32_t data = ext2_group_start(g) + ext2_group_meta(fs, g);
+
+	if (fs->next_block < data)
+		fs->next_block = data;
+	if (fs->next_block >= fs->blocks_count) {
+		fprintf(stderr, "Ramdisk layout out of blocks!\n");
+		return 0;
+	}
+	ext2_set_bit(fs->grp[g].bbitmap,
+	             fs->next_block - ext2_group_start(g));
+
+	return fs->next_block++;
+}
+
+/*
+ * Allocates a block tree of the given indirection depth, each indirect
+ * block right before the data blocks it maps.
+ */
+static int
+ext2_alloc_tree(ext2_fs_t *fs, ext2_node_t *n, int depth, uint32_t *blk)
+{
+	const char *src = n->data ? n->data : n->file.addr;
+	uint32_t *ptrs;
+	size_t off, i;
+
+	*blk = ext2_alloc_block(fs);
+	if (0 == *blk)
+		return 1;
+	if (0 == depth) {
+		off = (size_t)n->mapped++ * EXT2_BLOCK;
+		return ext2_extent(fs, *blk, src + off, n->size - off <
+		                   EXT2_BLOCK ? n->size - off : EXT2_BLOCK);
+	}
+
+	ptrs = ext2_buf(fs->img, EXT2_BLOCK);
+	if (NULL == ptrs || 0 != ext2_extent(fs, *blk, (char *)ptrs,
+	                                     EXT2_BLOCK))
+		return 1;
+	for (i = 0; i < EXT2_PTRS && n->mapped < n->nblocks; i++) {
+		if (0 != ext2_alloc_tree(fs, n, depth - 1, &ptrs[i]))
+			return 1;
+		ptrs[i] = htole32(ptrs[i]);
+	}
+
+	return 0;
+}
+
+static int
+ext2_alloc_node(ext2_fs_t *fs, ext2_node_t *n)
+{
+	int i;
+
+	if (S_ISDIR(n->st.st_mode)) {
+		n->size = (uint64_t)n->nblocks * EXT2_BLOCK;
+		n->data = ext2_buf(fs->img, n->size);
+		if (NULL == n->data)
+			return 1;
+		ext2_dir_fill(fs, n, n->data);
+	}
+
+	for (i = 0; i < EXT2_NDIR && n->mapped < n->nblocks; i++) {
+		if (0 != ext2_alloc_tree(fs, n, 0, &n->block[i]))
+			return 1;
+	}
+	for (i = 1; i <= 3 && n->mapped < n->nblocks; i++) {
+		if (0 != ext2_alloc_tree(fs, n, i, &n->block[EXT2_NDIR + i - 1]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the inode of a node. Everything is owned by root, the tree is
+ * usually staged by an unprivileged user.
+ */
+static void
+ext2_put_inode(ext2_fs_t *fs, const ext2_node_t *n)
+{
+	uint32_t g = (n->ino - 1) / fs->ipg;
+	uint32_t idx = (n->ino - 1) % fs->ipg;
+	ext2_inode_t *in;
+	unsigned maj, min;
+	int i;
+
+	in = (ext2_inode_t *)(fs->grp[g].itable + idx * EXT2_INODE);
+	ext2_set_bit(fs->grp[g].ibitmap, idx);
+	if (S_ISDIR(n->st.st_mode))
+		fs->grp[g].dirs++;
+
+	in->i_mode = htole16(n->st.st_mode);
+	in->i_size = htole32(n->size);
+	in->i_atime = htole32(n->st.st_mtime);
+	in->i_ctime = htole32(n->st.st_mtime);
+	in->i_mtime = htole32(n->st.st_mtime);
+	in->i_links_count = htole16(n->links);
+	in->i_blocks = htole32((n->nblocks + n->nmeta) * (EXT2_BLOCK / 512));
+
+	if (S_ISLNK(n->st.st_mode) && 0 == n->nblocks) {
+		memcpy(in->i_block, n->data, n->size);
+	} else if (S_ISCHR(n->st.st_mode) || S_ISBLK(n->st.st_mode)) {
+		/* Old 8:8 device encoding when it fits, the new one if not. */
+		maj = major(n->st.st_rdev);
+		min = minor(n->st.st_rdev);
+		if (maj < 256 && min < 256)
+			in->i_block[0] = htole32(maj << 8 | min);
+		else
+			in->i_block[1] = htole32((min & 0xff) | maj << 8 |
+			                         (min & ~0xffU) << 12);
+	} else {
+		for (i = 0; i < 15; i++)
+			in->i_block[i] = htole32(n->block[i]);
+	}
+}
+
+/* Bitmaps padding, group descriptors and superblocks. */
+static void
+ext2_finish(ext2_fs_t *fs)
+{
+	uint32_t g, i, size, free_blocks = 0, free_inodes = 0, nfree;
+	ext2_super_t sb;
+
+	/* Reserved inodes below the first regular one count as used. */
+	for (i = 1; i < EXT2_FIRST_INO; i++)
+		ext2_set_bit(fs->grp[(i - 1) / fs->ipg].ibitmap,
+		             (i - 1) % fs->ipg);
+
+	for (g = 0; g < fs->ngroups; g++) {
+		size = ext2_group_size(fs, g);
+		for (i = size; i < EXT2_BLOCK * 8; i++)
+			ext2_set_bit(fs->grp[g].bbitmap, i);
+		for (i = fs->ipg; i < EXT2_BLOCK * 8; i++)
+			ext2_set_bit(fs->grp[g].ibitmap, i);
+
+		for (i = 0, nfree = 0; i < size; i++)
+			nfree += !(fs->grp[g].bbitmap[i / 8] & 1 << (i % 8));
+		fs->gdt[g].bg_free_blocks_count = htole16(nfree);
+		free_blocks += nfree;
+		for (i = 0, nfree = 0; i < fs->ipg; i++)
+			nfree += !(fs->grp[g].ibitmap[i / 8] & 1 << (i % 8));
+		fs->gdt[g].bg_free_inodes_count = htole16(nfree);
+		free_inodes += nfree;
+		fs->gdt[g].bg_used_dirs_count = htole16(fs->grp[g].dirs);
+	}
+
+	memset(&sb, 0, sizeof(ext2_super_t));
+	sb.s_inodes_count = htole32(fs->ipg * fs->ngroups);
+	sb.s_blocks_count = htole32(fs->blocks_count);
+	sb.s_free_blocks_count = htole32(free_blocks);
+	sb.s_free_inodes_count = htole32(free_inodes);
+	sb.s_first_data_block = htole32(1);
+	sb.s_blocks_per_group = htole32(EXT2_GROUP);
+	sb.s_frags_per_group = htole32(EXT2_GROUP);
+	sb.s_inodes_per_group = htole32(fs->ipg);
+	sb.s_wtime = htole32(fs->newest);
+	sb.s_max_mnt_count = htole16(0xffff);
+	sb.s_magic = htole16(EXT2_MAGIC);
+	sb.s_state = htole16(1);
+	sb.s_errors = htole16(1);
+	sb.s_lastcheck = htole32(fs->newest);
+	sb.s_rev_level = htole32(1);
+	sb.s_first_ino = htole32(EXT2_FIRST_INO);
+	sb.s_inode_size = htole16(EXT2_INODE);
+	sb.s_feature_incompat = htole32(EXT2_FTYPE);
+	sb.s_feature_ro_compat = htole32(EXT2_SPARSE_SUPER);
+
+	/* The copies only differ in their group number. */
+	for (g = 0; g < fs->ngroups; g++) {
+		if (NULL == fs->grp[g].sb)
+			continue;
+		sb.s_block_group_nr = htole16(g);
+		memcpy(fs->grp[g].sb, &sb, sizeof(ext2_super_t));
+	}
+}
+
+static int
+ext2_extent_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const ext2_extent_t *)a)->blk;
+	uint32_t y = ((const ext2_extent_t *)b)->blk;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Turns the extents into the image map, gaps become zero segments. */
+static int
+ext2_map(ext2_fs_t *fs)
+{
+	sparse_map_t *map = &fs->img->map;
+	uint64_t pos = 0, off, end;
+	size_t i;
+
+	qsort(fs->ext, fs->next, sizeof(ext2_extent_t), ext2_extent_cmp);
+	for (i = 0; i < fs->next; i++) {
+		off = (uint64_t)fs->ext[i].blk * EXT2_BLOCK;
+		end = off + DIV_UP(fs->ext[i].len, EXT2_BLOCK) * EXT2_BLOCK;
+		if (0 != sparse_push(map, NULL, off - pos) ||
+		    0 != sparse_push(map, fs->ext[i].data, fs->ext[i].len) ||
+		    0 != sparse_push(map, NULL, end - off - fs->ext[i].len))
+			return 1;
+		pos = end;
+	}
+	fs->img->len = (size_t)fs->blocks_count * EXT2_BLOCK;
+
+	return sparse_push(map, NULL, fs->img->len - pos);
+}
+
+/*
+ * Lays out an ext2 filesystem holding the tree under dir, see
+ * ext2_image_t. Nothing is copied, file contents stay in their
+ * mappings until the image has been compressed.
+ */
+int
+ext2_build(const char *dir, ext2_image_t *img)
+{
+	ext2_fs_t fs;
+	ext2_node_t *root;
+	uint64_t start;
+	size_t i;
+	int rv = 1;
+
+	memset(&fs, 0, sizeof(ext2_fs_t));
+	memset(img, 0, sizeof(ext2_image_t));
+	fs.img = img;
+	fs.next_ino = EXT2_FIRST_INO;
+	fs.next_block = 1;
+
+	start = stats_begin();
+	img->nodes = mem_alloc(sizeof(ext2_node_t));
+	if (NULL == img->nodes) {
+		fprintf(stderr, "Failed to allocate ramdisk tree!\n");
+		goto build_failed;
+	}
+	img->nodes_alloc = img->nnodes = 1;
+	root = &img->nodes[0];
+	memset(root, 0, sizeof(ext2_node_t));
+	root->path = mem_alloc(strlen(dir) + 1);
+	if (NULL == root->path) {
+		fprintf(stderr, "Failed to allocate ramdisk tree!\n");
+		goto build_failed;
+	}
+	strcpy(root->path, dir);
+	root->ino = EXT2_ROOT_INO;
+	root->links = 2;
+	if (0 != stat(dir, &root->st)) {
+		fprintf(stderr, "Failed to stat %s: %s\n", dir,
+		        strerror(errno));
+		goto build_failed;
+	}
+	if (!S_ISDIR(root->st.st_mode)) {
+		fprintf(stderr, "Not a directory: %s\n", dir);
+		goto build_failed;
+	}
+	fs.newest = root->st.st_mtime;
+
+	/* Children get appended past the scanned node, breadth first. */
+	for (i = 0; i < img->nnodes; i++) {
+		if (!S_ISDIR(img->nodes[i].st.st_mode))
+			continue;
+		if (1 != i && 0 != ext2_scan_dir(&fs, i))
+			goto build_failed;
+		img->nodes[i].nblocks = ext2_dir_fill(&fs, &img->nodes[i],
+		                                      NULL);
+		img->nodes[i].nmeta = ext2_meta_blocks(img->nodes[i].nblocks);
+	}
+
+	if (0 != ext2_layout(&fs))
+		goto build_failed;
+	for (i = 0; i < img->nnodes; i++) {
+		if (img->nodes[i].hardlink)
+			continue;
+		if (0 != ext2_alloc_node(&fs, &img->nodes[i]))
+			goto build_failed;
+		ext2_put_inode(&fs, &img->nodes[i]);
+	}
+	ext2_finish(&fs);
+	if (0 != ext2_map(&fs))
+		goto build_failed;
+
+	rv = 0;
+
+build_failed:
+	stats_end(STATS_EXT2, start, fs.in_bytes, img->len);
+	mem_free(fs.ext);
+	if (0 != rv)
+		ext2_free(img);
+
+	return rv;
+}
+
+void
+ext2_free(ext2_image_t *img)
+{
+	size_t i;
+
+	for (i = 0; i < img->nnodes; i++) {
+		loader_unload(&img->nodes[i].file);
+		mem_free(img->nodes[i].path);
+	}
+	for (i = 0; i < img->nbufs; i++)
+		mem_free(img->bufs[i]);
+	mem_free(img->nodes);
+	mem_free(img->bufs);
+	sparse_free(&img->map);
+	memset(img, 0, sizeof(ext2_image_t));
+}
+
+static int
+ext2_free_add(ext2_free_t *f, uint64_t off, uint64_t len, size_t max)
+{
+	ext2_range_t *tmp;
+
+	if (off >= max)
+		return 0;
+	if (len > max - off)
+		len = max - off;
+	if (f->n && f->r[f->n - 1].off + f->r[f->n - 1].len == off) {
+		f->r[f->n - 1].len += len;
+		return 0;
+	}
+	if (f->n == f->alloc) {
+		f->alloc = f->alloc ? f->alloc * 2 : 256;
+		tmp = mem_realloc(f->r, f->alloc * sizeof(ext2_range_t));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate ramdisk scrub!\n");
+			return 1;
+		}
+		f->r = tmp;
+	}
+	f->r[f->n].off = off;
+	f->r[f->n].len = len;
+	f->n++;
+
+	return 0;
+}
+
+/* Adds the runs of clear bits of a bitmap as ranges of unit bytes. */
+static int
+ext2_free_bits(ext2_free_t *f, const uint8_t *bitmap, uint32_t nbits,
+               uint64_t base, uint64_t unit, size_t max)
+{
+	uint32_t i, run;
+
+	for (i = 0; i < nbits; i += run) {
+		for (run = 0; i + run < nbits &&
+		     !(bitmap[(i + run) / 8] & 1 << ((i + run) % 8)); run++)
+			;
+		if (run && 0 != ext2_free_add(f, base + i * unit,
+		                              run * unit, max))
+			return 1;
+		if (0 == run)
+			run = 1;
+	}
+
+	return 0;
+}
+
+static int
+ext2_range_cmp(const void *a, const void *b)
+{
+	uint64_t x = ((const ext2_range_t *)a)->off;
+	uint64_t y = ((const ext2_range_t *)b)->off;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Collects the free blocks and unused inode table slots of the ext2
+ * filesystem in data. A filesystem the bitmaps cannot be trusted for
+ * is reported and leaves f empty.
+ */
+static int
+ext2_free_space(const char *data, size_t len, ext2_free_t *f)
+{
+	const ext2_super_t *sb = (const ext2_super_t *)(data + 1024);
+	const ext2_group_t *gd;
+	uint64_t bs, first, blocks, bpg, ipg, isz, g, ngroups, size;
+	uint64_t bb, ib, it;
+
+	if (len < 2048 || EXT2_MAGIC != le16toh(sb->s_magic) ||
+	    le32toh(sb->s_log_block_size) > 6)
+		goto free_unsupported;
+	/* Bitmaps of other features may be stale or checksummed. */
+	if ((le32toh(sb->s_feature_incompat) & ~EXT2_FTYPE) ||
+	    (le32toh(sb->s_feature_ro_compat) &
+	     ~(EXT2_SPARSE_SUPER | EXT2_LARGE_FILE)) ||
+	    !(le16toh(sb->s_state) & EXT2_VALID_FS))
+		goto free_unsupported;
+
+	bs = 1024 << le32toh(sb->s_log_block_size);
+	first = le32toh(sb->s_first_data_block);
+	blocks = le32toh(sb->s_blocks_count);
+	bpg = le32toh(sb->s_blocks_per_group);
+	ipg = le32toh(sb->s_inodes_per_group);
+	isz = le32toh(sb->s_rev_level) ? le16toh(sb->s_inode_size) : 128;
+	if (0 == bpg || bpg > bs * 8 || 0 == ipg || ipg > bs * 8 ||
+	    isz < 128 || isz > bs || first >= blocks)
+		goto free_unsupported;
+	ngroups = DIV_UP(blocks - first, bpg);
+	if ((first + 1) * bs + ngroups * sizeof(ext2_group_t) > len)
+		goto free_unsupported;
+
+	for (g = 0; g < ngroups; g++) {
+		gd = (const ext2_group_t *)(data + (first + 1) * bs) + g;
+		bb = le32toh(gd->bg_block_bitmap);
+		ib = le32toh(gd->bg_inode_bitmap);
+		it = le32toh(gd->bg_inode_table);
+		size = g + 1 < ngroups ? bpg : blocks - first - g * bpg;
+		if ((bb + 1) * bs > len || (ib + 1) * bs > len ||
+		    it * bs + ipg * isz > len)
+			goto free_unsupported;
+		if (0 != ext2_free_bits(f, (const uint8_t *)data + bb * bs,
+		                        size, (first + g * bpg) * bs, bs,
+		                        len) ||
+		    0 != ext2_free_bits(f, (const uint8_t *)data + ib * bs,
+		                        ipg, it * bs, isz, len))
+			return 1;
+	}
+	qsort(f->r, f->n, sizeof(ext2_range_t), ext2_range_cmp);
+
+	return 0;
+
+free_unsupported:
+	fprintf(stderr, "Ramdisk is not a clean ext2 filesystem, "
+	        "not scrubbing it\n");
+	f->n = 0;
+	return 0;
+}
+
+/*
+ * Turns the free blocks and unused inode table slots of the ext2 image
+ * data, described by map, into zero segments. The image itself is not
+ * touched, only what the compressor gets to see. Filesystems whose
+ * bitmaps cannot be trusted are left as they are. The number of data
+ * bytes zeroed is returned in scrubbed.
+ */
+int
+ext2_scrub(const char *data, size_t len, sparse_map_t *map,
+           size_t *scrubbed)
+{
+	sparse_map_t out;
+	ext2_free_t f;
+	uint64_t pos = 0, cur, end, next;
+	size_t i, r = 0;
+	const char *src;
+	int rv = 1;
+
+	memset(&out, 0, sizeof(sparse_map_t));
+	memset(&f, 0, sizeof(ext2_free_t));
+	*scrubbed = 0;
+
+	if (0 != ext2_free_space(data, len, &f))
+		goto scrub_failed;
+
+	for (i = 0; i < map->nsegs; pos = end, i++) {
+		end = pos + map->segs[i].len;
+		for (cur = pos; cur < end; cur = next) {
+			while (r < f.n && f.r[r].off + f.r[r].len <= cur)
+				r++;
+			src = map->segs[i].data;
+			if (r < f.n && f.r[r].off <= cur) {
+				next = f.r[r].off + f.r[r].len;
+				if (next > end)
+					next = end;
+				if (src)
+					*scrubbed += next - cur;
+				src = NULL;
+			} else {
+				next = r < f.n && f.r[r].off < end ?
+				       f.r[r].off : end;
+			}
+			if (0 != sparse_push(&out, src ? src + (cur - pos) :
+			                     NULL, next - cur))
+				goto scrub_failed;
+		}
+	}
+
+	sparse_free(map);
+	*map = out;
+	memset(&out, 0, sizeof(sparse_map_t));
+	rv = 0;
+
+scrub_failed:
+	sparse_free(&out);
+	mem_free(f.r);
+
+	return rv;
+}
@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _EXT2_H_
+#define _EXT2_H_
+
+#include <stddef.h>
+
+#include "sparse.h"
+
+struct ext2_node;
+
+/*
+ * Ext2 filesystem laid out in memory from a directory tree. The map
+ * describes the image, metadata comes from the buffers kept here, file
+ * contents from their mappings and free blocks are zero segments.
+ */
+typedef struct ext2_image
+{
+	sparse_map_t	map;
+	size_t		len;		/* image bytes */
+	struct ext2_node *nodes;	/* tree entries, own the mappings */
+	size_t		nnodes;
+	size_t		nodes_alloc;
+	void		**bufs;		/* metadata blocks */
+	size_t		nbufs;
+	size_t		bufs_alloc;
+} ext2_image_t;
+
+int  ext2_build(const char *, ext2_image_t *);
+void ext2_free(ext2_image_t *);
+int  ext2_scrub(const char *, size_t, sparse_map_t *, size_t *);
+
+#endif /* _EXT2_H_ */
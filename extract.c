@@ -0,0 +1,654 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "arena.h"
+#include "check.h"
+#include "extract.h"
+#include "layout.h"
+#include "manifest.h"
+#include "mem.h"
+#include "pool.h"
+#include "sha256.h"
+#include "store.h"
+#include "stream.h"
+#include "util.h"
+#include "config.h"
+
+/* Pool worker of a checksum job, also run inline. */
+void
+crc_job_run(void *arg)
+{
+	crc_job_t *job = arg;
+
+	if (!job->hash) {
+		job->crc = cksum(job->data, job->len);
+		return;
+	}
+	job->crc = cksum_final(cksum_sha256(0, &job->sha, job->data,
+	                                    job->len), job->len);
+	sha256_update(&job->sha, job->tail, job->tail_len);
+}
+
+/*
+ * Makes the job also hash the image file of len bytes at image, in the
+ * same pass as the checksum. The header is hashed right away and the
+ * digest is ready once the job has been waited for.
+ */
+void
+crc_job_hash(crc_job_t *job, const char *image, size_t len)
+{
+	const boost_hdr_t *hdr = (const boost_hdr_t *)image;
+
+	job->hash = 1;
+	sha256_init(&job->sha);
+	sha256_update(&job->sha, image, sizeof(boost_hdr_t));
+	job->tail = image + sizeof(boost_hdr_t) + hdr->image_size;
+	job->tail_len = len - sizeof(boost_hdr_t) - hdr->image_size;
+}
+
+/*
+ * Starts checksumming the data section on a worker thread. When no
+ * thread is available, the checksum is computed right away instead.
+ */
+void
+crc_job_start(crc_job_t *job, const void *data, size_t len)
+{
+	job->data = data;
+	job->len = len;
+	job->pool = pool_create(1);
+	if (NULL == job->pool || 0 != pool_submit(job->pool, crc_job_run, job))
+		crc_job_run(job);
+}
+
+void
+crc_job_wait(crc_job_t *job)
+{
+	if (NULL != job->pool) {
+		pool_wait(job->pool);
+		pool_destroy(job->pool);
+		job->pool = NULL;
+	}
+}
+
+int
+crc_job_finish(crc_job_t *job, boost_hdr_t hdr)
+{
+	crc_job_wait(job);
+
+	return boost_check_crc(hdr, job->crc);
+}
+
+/*
+ * Extracts the wanted parts of a zlib image without holding the
+ * payload in full, it is inflated through a small buffer and split
+ * into the component files on the fly. Inflate stops as soon as the
+ * last wanted part is complete, which makes kernel only extracts
+ * cheap. The image checksum, when verified, is computed on another
+ * thread meanwhile. With man set the image is hashed in that same
+ * pass, the parts as they are written, and the digests go to the
+ * manifest; raw images are split the same way then.
+ */
+static int
+boost_extract_stream(boost_hdr_t hdr, const char *data, unsigned parts,
+                     int verify, const boost_manifest_t *man)
+{
+	extract_stream_t es;
+	crc_job_t crc_job;
+	uint8_t digest[SHA256_LEN];
+	size_t len = 0, i;
+	char *buf = NULL;
+	int zlib = !!(hdr.flags & BOOST_FLAG_ZLIB);
+	int rv = 1;
+
+	if (zlib && !mem_fits(STREAM_BUF_SIZE + zlib_inflate_mem())) {
+		fprintf(stderr, "Memory budget too small to extract the "
+		        "image!\n");
+		return 1;
+	}
+
+	memset(&es, 0, sizeof(extract_stream_t));
+	memset(&crc_job, 0, sizeof(crc_job_t));
+	es.pending = parts;
+	es.total = zlib ? swap_bytes_be(((uint32_t *)data)[0]) :
+	           hdr.image_size;
+	es.cap_off = 0;
+	es.cap_len = sizeof(uint32_t);
+	es.digest = NULL != man;
+	if (es.total < sizeof(uint32_t)) {
+		fprintf(stderr, "Invalid unpacked image size!\n");
+		return 1;
+	}
+
+	if (zlib) {
+		buf = mem_alloc(STREAM_BUF_SIZE);
+		if (NULL == buf)
+			return 1;
+	}
+
+	if (NULL != man)
+		crc_job_hash(&crc_job, man->addr, man->len);
+	if (verify || NULL != man)
+		crc_job_start(&crc_job, data, hdr.image_size);
+	extract_stream_begin(&es, &hdr, data, buf);
+	if (!zlib) {
+		if (0 != extract_stream_sink(&es, data, hdr.image_size) &&
+		    !es.done)
+			goto extract_stream_failed;
+	} else {
+		if (0 != zlib_decompress_stream(data + 4, hdr.image_size - 4,
+		                                buf, STREAM_BUF_SIZE,
+		                                extract_stream_sink, &es, &len,
+		                                NULL) && !es.done)
+			goto extract_stream_failed;
+		if (0 != extract_stream_end(&es) && !es.done)
+			goto extract_stream_failed;
+		if (!es.done && len != es.total) {
+			fprintf(stderr, "Unpacked size mismatch!\n");
+			goto extract_stream_failed;
+		}
+	}
+	if (verify && 0 != crc_job_finish(&crc_job, hdr)) {
+		goto extract_stream_failed;
+	}
+	if (zlib)
+		printf("Zlib unpack\t: OK\n");
+	if (NULL != man) {
+		crc_job_wait(&crc_job);
+		sha256_final(&crc_job.sha, digest);
+		if (0 != extract_manifest(man->path, man->image, digest, &es))
+			goto extract_stream_failed;
+	}
+	rv = 0;
+
+extract_stream_failed:
+	crc_job_wait(&crc_job);
+	/* Never leave partial or unverified files behind. */
+	for (i = 0; i < es.nparts; i++) {
+		if (es.parts[i].fd >= 0)
+			close(es.parts[i].fd);
+		if (rv && -1 != es.parts[i].fd)
+			unlink(es.parts[i].name->filename);
+	}
+	extract_stream_free(&es);
+	mem_free(buf);
+
+	return rv;
+}
+
+/*
+ * Extract --manifest, see boost_extract_stream(). The image file is
+ * bounds checked first, its digest covers all of it.
+ */
+int
+boost_extract_manifest(const boost_manifest_t *man, unsigned parts,
+                       int verify)
+{
+	boost_hdr_t hdr;
+
+	if (man->len < sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		return 1;
+	}
+	memcpy(&hdr, man->addr, sizeof(boost_hdr_t));
+	if (hdr.image_size > man->len - sizeof(boost_hdr_t) ||
+	    ((hdr.flags & BOOST_FLAG_ZLIB) &&
+	     hdr.image_size < sizeof(uint32_t))) {
+		fprintf(stderr, "Image data exceeds the file!\n");
+		return 1;
+	}
+
+	return boost_extract_stream(hdr, man->addr + sizeof(boost_hdr_t),
+	                            parts, verify, man);
+}
+
+/* Components of an extract --store, committed once the image checks. */
+typedef struct store_side
+{
+	extract_stream_t es;
+	const char	*dir;
+	store_obj_t	objs[INDEX_PARTS];
+	unsigned	started;	/* parts with an object begun */
+} store_side_t;
+
+static int
+store_part_sink(void *ctx, int part, uint64_t off, const char *buf,
+                size_t len)
+{
+	store_side_t *s = ctx;
+
+	(void)off;
+	if (!(s->started & BOOST_PART(part))) {
+		if (0 != store_obj_begin(s->dir, &s->objs[part],
+		                         s->es.layout.parts[part].len))
+			return 1;
+		s->started |= BOOST_PART(part);
+	}
+
+	return store_obj_write(&s->objs[part], buf, len);
+}
+
+/* Adds the components to the store and writes the image manifest. */
+static int
+store_side_commit(store_side_t *s, const char *image, const uint8_t *digest)
+{
+	const store_obj_t *objs[INDEX_PARTS];
+	const char *names[INDEX_PARTS];
+	char hex[SHA256_HEX_LEN];
+	extract_part_t *p;
+	size_t i;
+	int dup;
+
+	for (i = 0; i < s->es.nparts; i++) {
+		p = &s->es.parts[i];
+		if (!(s->started & BOOST_PART(p->index))) {
+			if (0 != store_obj_begin(s->dir, &s->objs[p->index], 0))
+				return 1;
+			s->started |= BOOST_PART(p->index);
+		}
+		part_print_offset(p->name, &p->part);
+		if (0 != store_obj_commit(s->dir, &s->objs[p->index],
+		                          p->name->filename, &dup)) {
+			printf("Writing %s\t: Failed\n", p->name->tag);
+			return 1;
+		}
+		sha256_hex(s->objs[p->index].digest, hex);
+		printf("Writing %s\t: OK (%s %.12s)\n", p->name->tag,
+		       dup ? "shared" : "stored", hex);
+		objs[i] = &s->objs[p->index];
+		names[i] = p->name->filename;
+	}
+
+	return store_manifest(s->dir, image, digest, names, objs,
+	                      s->es.nparts);
+}
+
+/*
+ * Extracts the wanted parts of the image file of file_len bytes at file
+ * into the content addressed store at dir, see store.h. Components are
+ * hashed as they come out of inflate and only added once the image
+ * checksum holds, the familiar file names are then linked to the
+ * stored objects. The image file is hashed for the manifest meanwhile.
+ */
+int
+boost_extract_store(const char *file, size_t file_len, const char *image,
+                    const char *dir, unsigned parts, int verify)
+{
+	const char *data = file + sizeof(boost_hdr_t);
+	uint8_t digest[SHA256_LEN];
+	store_side_t s;
+	crc_job_t crc_job;
+	boost_hdr_t hdr;
+	size_t len = 0, i;
+	char *buf = NULL;
+	int zlib, rv = 1;
+
+	if (file_len < sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		return 1;
+	}
+	memcpy(&hdr, file, sizeof(boost_hdr_t));
+	if (hdr.image_size > file_len - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image data exceeds the file!\n");
+		return 1;
+	}
+	zlib = !!(hdr.flags & BOOST_FLAG_ZLIB);
+
+	memset(&s, 0, sizeof(store_side_t));
+	memset(&crc_job, 0, sizeof(crc_job_t));
+	s.dir = dir;
+	s.es.pending = parts;
+	s.es.cap_off = 0;
+	s.es.cap_len = sizeof(uint32_t);
+	s.es.sink = store_part_sink;
+	s.es.sink_ctx = &s;
+
+	if (zlib && hdr.image_size < sizeof(uint32_t)) {
+		printf("Image too small to hold zlib data!\n");
+		return 1;
+	}
+	s.es.total = zlib ? swap_bytes_be(((uint32_t *)data)[0]) :
+	             hdr.image_size;
+	if (s.es.total < sizeof(uint32_t)) {
+		fprintf(stderr, "Invalid unpacked image size!\n");
+		return 1;
+	}
+	if (0 != store_init(dir))
+		return 1;
+
+	crc_job_hash(&crc_job, file, file_len);
+	crc_job_start(&crc_job, data, hdr.image_size);
+	if (!zlib) {
+		extract_stream_begin(&s.es, &hdr, data, NULL);
+		if (0 != extract_stream_sink(&s.es, data, hdr.image_size) &&
+		    !s.es.done)
+			goto extract_store_failed;
+	} else {
+		if (!mem_fits(STREAM_BUF_SIZE + zlib_inflate_mem())) {
+			fprintf(stderr, "Memory budget too small to extract "
+			        "the image!\n");
+			goto extract_store_failed;
+		}
+		buf = mem_alloc(STREAM_BUF_SIZE);
+		if (NULL == buf)
+			goto extract_store_failed;
+		extract_stream_begin(&s.es, &hdr, data, buf);
+		if (0 != zlib_decompress_stream(data + 4, hdr.image_size - 4,
+		                                buf, STREAM_BUF_SIZE,
+		                                extract_stream_sink, &s.es,
+		                                &len, NULL) && !s.es.done)
+			goto extract_store_failed;
+		if (0 != extract_stream_end(&s.es) && !s.es.done)
+			goto extract_store_failed;
+		if (!s.es.done && len != s.es.total) {
+			fprintf(stderr, "Unpacked size mismatch!\n");
+			goto extract_store_failed;
+		}
+	}
+	if (verify && 0 != crc_job_finish(&crc_job, hdr))
+		goto extract_store_failed;
+	if (zlib)
+		printf("Zlib unpack\t: OK\n");
+
+	crc_job_wait(&crc_job);
+	sha256_final(&crc_job.sha, digest);
+	rv = store_side_commit(&s, image, digest);
+
+extract_store_failed:
+	crc_job_wait(&crc_job);
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (s.started & BOOST_PART(i))
+			store_obj_abort(&s.objs[i]);
+	}
+	extract_stream_free(&s.es);
+	mem_free(buf);
+
+	return rv;
+}
+
+/* Writes the wanted parts of a payload held in memory. */
+static int
+extract_parts(const char *data, const image_layout_t *layout, unsigned parts)
+{
+	const part_name_t *name;
+	const index_part_t *p;
+	int i;
+
+	/* Nothing to select from, the payload is written whole. */
+	if (INDEX_LAYOUT_UNKNOWN == layout->type) {
+		printf("Warning: unknown image format!\n");
+		parts = BOOST_PART(INDEX_KERNEL);
+	}
+
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (!(parts & BOOST_PART(i)))
+			continue;
+		name = &part_names[layout->type][i];
+		p = &layout->parts[i];
+		part_print_offset(name, p);
+		if (0 != write_to_file(data + p->off, p->len, name->filename)) {
+			printf("Writing %s\t: Failed\n", name->tag);
+			return 1;
+		}
+		printf("Writing %s\t: OK\n", name->tag);
+	}
+
+	return 0;
+}
+
+/*
+ * Extracts the wanted parts of an image. Images with a chunk table are
+ * inflated on all cores at once, when they fit into memory in full.
+ */
+int
+boost_extract(boost_hdr_t hdr, void *data, const zlib_chunks_t *chunks,
+              unsigned parts, int verify)
+{
+	uint32_t data_crc = 0;
+	arena_t arena = { NULL, 0, 0, 0, 0 };
+	image_layout_t layout;
+	crc_job_t crc_job;
+	void *payload = NULL;
+	size_t len = 0, cap, workers;
+	int rv = 0;
+
+	if (hdr.flags & BOOST_FLAG_ZLIB) {
+		if (hdr.image_size < sizeof(uint32_t)) {
+			printf("Image too small to hold zlib data!\n");
+			return 1;
+		}
+		/*
+		 * The data section starts with the unpacked size, which sizes
+		 * the output buffer, followed by the actual zlib stream. The
+		 * image checksum is gathered while inflating.
+		 */
+		cap = swap_bytes_be(((uint32_t *)data)[0]);
+		if (0 == cap || cap > MAX_IMAGE_BUF_SIZE)
+			cap = MAX_IMAGE_BUF_SIZE;
+		workers = chunks ? pool_default_threads() : 1;
+		if (BOOST_ALL_PARTS != parts ||
+		    !mem_fits(cap + workers * zlib_inflate_mem()))
+			return boost_extract_stream(hdr, data, parts, verify,
+			                            NULL);
+		arena_plan(&arena, cap);
+		if (0 != arena_reserve(&arena))
+			return 1;
+		payload = arena_alloc(&arena, cap);
+
+		if (NULL != chunks) {
+			memset(&crc_job, 0, sizeof(crc_job_t));
+			if (verify)
+				crc_job_start(&crc_job, data, hdr.image_size);
+			rv = zlib_decompress_chunks(data + 4, hdr.image_size - 4,
+			                            chunks, payload, cap, &len);
+			if (verify && 0 != crc_job_finish(&crc_job, hdr))
+				rv = 1;
+		} else {
+			data_crc = cksum_update(0, data, sizeof(uint32_t));
+			rv = zlib_decompress_into(data + 4, hdr.image_size - 4,
+			                          payload, cap, &len,
+			                          verify ? &data_crc : NULL);
+			data_crc = cksum_final(data_crc, hdr.image_size);
+			if (verify && 0 != boost_check_crc(hdr, data_crc))
+				rv = 1;
+		}
+		if (0 != rv) {
+			arena_release(&arena);
+			return 1;
+		}
+		data = payload;
+		if (NULL != chunks)
+			printf("Zlib unpack\t: OK (%zu chunks)\n",
+			       chunks->nchunks);
+		else
+			printf("Zlib unpack\t: OK\n");
+	} else {
+		if (verify && 0 != boost_check(hdr, data)) {
+			return 1;
+		}
+		len = hdr.image_size;
+	}
+
+	if (0 != boost_layout_read(&hdr, len, payload_mem_read, data,
+	                           &layout)) {
+		/* Unsplittable payloads are still written out whole. */
+		memset(&layout, 0, sizeof(image_layout_t));
+		layout.parts[INDEX_KERNEL].len = len;
+	}
+	rv = extract_parts(data, &layout, parts);
+	arena_release(&arena);
+
+	return rv;
+}
+
+/* Payload read back through an index, for boost_layout_read(). */
+typedef struct index_reader
+{
+	const image_index_t	*idx;
+	const char	*stream;
+	size_t		len;
+} index_reader_t;
+
+static int
+index_payload_read(void *ctx, uint64_t off, void *buf, size_t len)
+{
+	index_reader_t *r = ctx;
+
+	return index_read(r->idx, r->stream, r->len, off, buf, len);
+}
+
+/*
+ * Builds the random access index of a zlib image and writes it to the
+ * sidecar filename, with the component boundaries read back through
+ * the index itself.
+ */
+int
+boost_index(boost_hdr_t hdr, const void *data, size_t span,
+            const char *filename)
+{
+	const char *stream = (const char *)data + sizeof(uint32_t);
+	index_reader_t reader;
+	image_index_t idx;
+	size_t len, i;
+	int rv = 1;
+
+	if (!(hdr.flags & BOOST_FLAG_ZLIB) ||
+	    hdr.image_size < sizeof(uint32_t)) {
+		fprintf(stderr, "Only zlib compressed images can be "
+		        "indexed!\n");
+		return 1;
+	}
+	if (0 != boost_check(hdr, data))
+		return 1;
+
+	len = hdr.image_size - sizeof(uint32_t);
+	if (0 != index_build(stream, len, span, &idx))
+		return 1;
+	idx.image_checksum = hdr.image_checksum;
+	idx.image_size = hdr.image_size;
+
+	reader.idx = &idx;
+	reader.stream = stream;
+	reader.len = len;
+	if (0 != boost_layout_read(&hdr, idx.total, index_payload_read,
+	                           &reader, &idx.layout))
+		goto index_failed;
+
+	printf("Index points\t: %zu, every %zukB\n", idx.npoints,
+	       span / 1024);
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (NULL != part_names[idx.layout.type][i].filename)
+			part_print_offset(&part_names[idx.layout.type][i],
+			                  &idx.layout.parts[i]);
+	}
+	if (0 != index_save(&idx, filename)) {
+		printf("Writing %s\t: Failed\n", filename);
+		goto index_failed;
+	}
+	printf("Writing %s\t: OK\n", filename);
+	rv = 0;
+
+index_failed:
+	index_free(&idx);
+
+	return rv;
+}
+
+/*
+ * Extracts the wanted components of a zlib image through its index,
+ * each one inflated from the checkpoint closest to its start. The
+ * image checksum covers the compressed data, so when verified it is
+ * computed on another thread meanwhile.
+ */
+int
+boost_extract_index(boost_hdr_t hdr, const void *data,
+                    const image_index_t *idx, unsigned parts, int verify)
+{
+	const char *stream = (const char *)data + sizeof(uint32_t);
+	const part_name_t *name;
+	const index_part_t *part;
+	crc_job_t crc_job;
+	size_t len, i;
+	char *buf;
+	int fd, rv = 1;
+
+	buf = mem_alloc(STREAM_BUF_SIZE);
+	if (NULL == buf)
+		return 1;
+
+	memset(&crc_job, 0, sizeof(crc_job_t));
+	if (verify)
+		crc_job_start(&crc_job, data, hdr.image_size);
+
+	len = hdr.image_size - sizeof(uint32_t);
+	if (INDEX_LAYOUT_UNKNOWN == idx->layout.type) {
+		printf("Warning: unknown image format!\n");
+		parts = BOOST_PART(INDEX_KERNEL);
+	}
+	for (i = 0; i < INDEX_PARTS; i++) {
+		name = &part_names[idx->layout.type][i];
+		part = &idx->layout.parts[i];
+		if (NULL == name->filename || !(parts & BOOST_PART(i)))
+			continue;
+
+		part_print_offset(name, part);
+		fd = create_file(name->filename);
+		if (-1 == fd) {
+			printf("Writing %s\t: Failed\n", name->tag);
+			goto extract_index_failed;
+		}
+		rv = index_extract(idx, stream, len, part->off, part->len,
+		                   buf, STREAM_BUF_SIZE, boost_stream_write,
+		                   &fd);
+		if (0 != close(fd)) {
+			perror("Close failed");
+			rv = 1;
+		}
+		if (0 != rv) {
+			printf("Writing %s\t: Failed\n", name->tag);
+			unlink(name->filename);
+			goto extract_index_failed;
+		}
+		printf("Writing %s\t: OK\n", name->tag);
+	}
+	if (verify && 0 != crc_job_finish(&crc_job, hdr))
+		goto extract_index_failed;
+	rv = 0;
+
+extract_index_failed:
+	crc_job_wait(&crc_job);
+	mem_free(buf);
+
+	return rv;
+}
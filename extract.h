@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _EXTRACT_H_
+#define _EXTRACT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boost.h"
+#include "pool.h"
+#include "sha256.h"
+
+/* Image checksum, computed on a worker thread during the inflate. */
+typedef struct crc_job
+{
+	const char	*data;
+	size_t		len;
+	uint32_t	crc;
+	pool_t		*pool;
+	int		hash;		/* SHA-256 of the whole image too */
+	sha256_t	sha;
+	const char	*tail;		/* file bytes behind the data section */
+	size_t		tail_len;
+} crc_job_t;
+
+void crc_job_run(void *);
+void crc_job_hash(crc_job_t *, const char *, size_t);
+void crc_job_start(crc_job_t *, const void *, size_t);
+void crc_job_wait(crc_job_t *);
+int  crc_job_finish(crc_job_t *, boost_hdr_t);
+
+#endif /* _EXTRACT_H_ */
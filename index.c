@@ -0,0 +1,520 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "index.h"
+#include "loader.h"
+#include "mem.h"
+#include "stats.h"
+
+#define INDEX_MAGIC	"BIDX"
+#define INDEX_VERSION	1
+
+/*
+ * Sidecar file layout, in host byte order like the image header. Each
+ * point record is followed by its deflated window.
+ */
+typedef struct index_file_hdr
+{
+	char		magic[4];
+	uint32_t	version;
+	uint32_t	image_checksum;
+	uint32_t	image_size;
+	uint64_t	total;
+	uint32_t	span;
+	uint32_t	layout;
+	index_part_t	parts[INDEX_PARTS];
+	uint32_t	npoints;
+	uint32_t	reserved;
+} index_file_hdr_t;
+
+typedef struct index_file_point
+{
+	uint64_t	out;
+	uint64_t	in;
+	uint32_t	bits;
+	uint32_t	window_len;	/* deflated window bytes */
+} index_file_point_t;
+
+/* Payload bytes of history stored with a point at out. */
+static size_t
+index_window_len(uint64_t out)
+{
+	return out < INDEX_WINDOW ? out : INDEX_WINDOW;
+}
+
+/*
+ * Records a checkpoint. The inflate output window is circular, left is
+ * the room remaining in it, so the newest bytes sit before that room
+ * and the older ones after it.
+ */
+static int
+index_add_point(image_index_t *idx, int bits, uint64_t in, uint64_t out,
+                size_t left, const unsigned char *window)
+{
+	index_point_t *tmp, *p;
+	size_t wlen = index_window_len(out);
+	size_t have = INDEX_WINDOW - left;
+
+	if (idx->npoints == idx->alloc) {
+		idx->alloc = idx->alloc ? idx->alloc * 2 : 8;
+		tmp = mem_realloc(idx->points,
+		                  idx->alloc * sizeof(index_point_t));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate index points!\n");
+			return 1;
+		}
+		idx->points = tmp;
+	}
+
+	p = &idx->points[idx->npoints];
+	p->out = out;
+	p->in = in;
+	p->bits = bits;
+	p->window = NULL;
+	if (wlen) {
+		p->window = mem_alloc(wlen);
+		if (NULL == p->window)
+			return 1;
+		if (wlen > have) {
+			memcpy(p->window, window + INDEX_WINDOW - (wlen - have),
+			       wlen - have);
+			memcpy(p->window + wlen - have, window, have);
+		} else {
+			memcpy(p->window, window + have - wlen, wlen);
+		}
+	}
+	idx->npoints++;
+
+	return 0;
+}
+
+/*
+ * Inflates the whole zlib stream once and records a checkpoint at the
+ * first deflate block boundary after every span payload bytes, see
+ * zran.c in the zlib examples.
+ */
+int
+index_build(const char *data, size_t len, size_t span, image_index_t *idx)
+{
+	unsigned char *window;
+	uint64_t totin = 0, totout = 0, last = 0;
+	uint64_t start;
+	z_stream zs;
+	int ret, rv = 1;
+
+	memset(idx, 0, sizeof(image_index_t));
+	idx->span = span;
+
+	window = mem_alloc(INDEX_WINDOW);
+	if (NULL == window)
+		return 1;
+
+	start = stats_begin();
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != inflateInit(&zs)) {
+		fprintf(stderr, "Failed to init zlib decompressor!\n");
+		goto build_failed;
+	}
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+
+	for (;;) {
+		if (0 == zs.avail_out) {
+			zs.next_out = window;
+			zs.avail_out = INDEX_WINDOW;
+		}
+		totin += zs.avail_in;
+		totout += zs.avail_out;
+		ret = inflate(&zs, Z_BLOCK);
+		totin -= zs.avail_in;
+		totout -= zs.avail_out;
+		if (Z_STREAM_END == ret)
+			break;
+		if (Z_OK != ret) {
+			fprintf(stderr, "Failed to index zlib stream: %s\n",
+			        zs.msg ? zs.msg : "truncated data");
+			goto build_failed;
+		}
+
+		/* At a block boundary which is not the end of the stream. */
+		if ((zs.data_type & 128) && !(zs.data_type & 64) &&
+		    (0 == totout || totout - last >= span)) {
+			if (0 != index_add_point(idx, zs.data_type & 7, totin,
+			                         totout, zs.avail_out, window))
+				goto build_failed;
+			last = totout;
+		}
+	}
+	idx->total = totout;
+	stats_end(STATS_INFLATE, start, totin, totout);
+	rv = 0;
+
+build_failed:
+	inflateEnd(&zs);
+	mem_free(window);
+	if (rv)
+		index_free(idx);
+
+	return rv;
+}
+
+/*
+ * Inflates n payload bytes starting at off and hands them to sink in
+ * pieces of at most buf_len bytes. Decoding starts at the closest
+ * checkpoint before off, so only the bytes from there are inflated.
+ * data and len describe the zlib stream the index was built for.
+ */
+int
+index_extract(const image_index_t *idx, const char *data, size_t len,
+              uint64_t off, uint64_t n, void *buf, size_t buf_len,
+              zlib_sink_t sink, void *ctx)
+{
+	const index_point_t *p;
+	uint64_t skip, start;
+	size_t lo, hi, mid, got, take;
+	z_stream zs;
+	int ret, rv = 1;
+
+	if (0 == idx->npoints || off + n > idx->total) {
+		fprintf(stderr, "Index does not cover the requested range!\n");
+		return 1;
+	}
+
+	/* Last point at or before off. */
+	lo = 0;
+	hi = idx->npoints;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (idx->points[mid].out <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	p = &idx->points[lo];
+	if (p->in > len || (p->bits && 0 == p->in)) {
+		fprintf(stderr, "Index does not match the image!\n");
+		return 1;
+	}
+
+	start = stats_begin();
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != inflateInit2(&zs, -MAX_WBITS)) {
+		fprintf(stderr, "Failed to init zlib decompressor!\n");
+		return 1;
+	}
+	if (p->bits && Z_OK != inflatePrime(&zs, p->bits,
+	    (unsigned char)data[p->in - 1] >> (8 - p->bits))) {
+		goto extract_failed;
+	}
+	if (p->window && Z_OK != inflateSetDictionary(&zs, p->window,
+	    index_window_len(p->out))) {
+		goto extract_failed;
+	}
+	zs.next_in = (Bytef *)data + p->in;
+	zs.avail_in = len - p->in;
+
+	skip = off - p->out;
+	while (n > 0) {
+		zs.next_out = buf;
+		zs.avail_out = buf_len;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (Z_OK != ret && Z_STREAM_END != ret)
+			break;
+		got = buf_len - zs.avail_out;
+
+		take = 0;
+		if (skip >= got) {
+			skip -= got;
+		} else {
+			take = got - skip < n ? got - skip : n;
+			if (0 != sink(ctx, (char *)buf + skip, take))
+				goto extract_failed;
+			skip = 0;
+			n -= take;
+		}
+		if (Z_STREAM_END == ret)
+			break;
+	}
+	if (n > 0) {
+		fprintf(stderr, "Failed to inflate from index: %s\n",
+		        zs.msg ? zs.msg : "truncated data");
+		goto extract_failed;
+	}
+	stats_end(STATS_INFLATE, start, len - p->in - zs.avail_in,
+	          zs.total_out);
+	rv = 0;
+
+extract_failed:
+	inflateEnd(&zs);
+
+	return rv;
+}
+
+typedef struct index_cursor
+{
+	char	*dst;
+} index_cursor_t;
+
+static int
+index_copy(void *ctx, const char *buf, size_t len)
+{
+	index_cursor_t *c = ctx;
+
+	memcpy(c->dst, buf, len);
+	c->dst += len;
+
+	return 0;
+}
+
+/* Reads n payload bytes at off into out. */
+int
+index_read(const image_index_t *idx, const char *data, size_t len,
+           uint64_t off, void *out, size_t n)
+{
+	index_cursor_t c = { out };
+	char buf[4096];
+
+	return index_extract(idx, data, len, off, n, buf, sizeof(buf),
+	                     index_copy, &c);
+}
+
+/* Name of the sidecar index of image, image.idx. */
+int
+index_path(const char *image, char *path, size_t size)
+{
+	if ((size_t)snprintf(path, size, "%s.idx", image) >= size) {
+		fprintf(stderr, "Index file name too long!\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the index to filename. It goes to a temporary file first
+ * which is renamed over any previous index once complete.
+ */
+int
+index_save(const image_index_t *idx, const char *filename)
+{
+	index_file_hdr_t fh;
+	index_file_point_t fp;
+	char tmp_name[PATH_MAX];
+	unsigned char *zbuf = NULL;
+	uLongf zlen;
+	size_t i;
+	int fd = -1;
+	int rv = 1;
+
+	if ((size_t)snprintf(tmp_name, sizeof(tmp_name), "%s.tmp",
+	                     filename) >= sizeof(tmp_name)) {
+		fprintf(stderr, "Index file name too long!\n");
+		return 1;
+	}
+
+	memset(&fh, 0, sizeof(index_file_hdr_t));
+	memcpy(fh.magic, INDEX_MAGIC, sizeof(fh.magic));
+	fh.version = INDEX_VERSION;
+	fh.image_checksum = idx->image_checksum;
+	fh.image_size = idx->image_size;
+	fh.total = idx->total;
+	fh.span = idx->span;
+	fh.layout = idx->layout.type;
+	memcpy(fh.parts, idx->layout.parts, sizeof(fh.parts));
+	fh.npoints = idx->npoints;
+
+	zbuf = mem_alloc(compressBound(INDEX_WINDOW));
+	if (NULL == zbuf)
+		return 1;
+
+	unlink(tmp_name);
+	fd = create_file(tmp_name);
+	if (-1 == fd)
+		goto save_failed;
+	if (0 != write_all(fd, (char *)&fh, sizeof(index_file_hdr_t)))
+		goto save_failed;
+
+	for (i = 0; i < idx->npoints; i++) {
+		memset(&fp, 0, sizeof(index_file_point_t));
+		fp.out = idx->points[i].out;
+		fp.in = idx->points[i].in;
+		fp.bits = idx->points[i].bits;
+		zlen = 0;
+		if (idx->points[i].window) {
+			zlen = compressBound(INDEX_WINDOW);
+			if (Z_OK != compress2(zbuf, &zlen,
+			                      idx->points[i].window,
+			                      index_window_len(fp.out),
+			                      Z_BEST_COMPRESSION)) {
+				fprintf(stderr, "Failed to compress index "
+				        "window!\n");
+				goto save_failed;
+			}
+		}
+		fp.window_len = zlen;
+		if (0 != write_all(fd, (char *)&fp,
+		                   sizeof(index_file_point_t)) ||
+		    0 != write_all(fd, (char *)zbuf, zlen))
+			goto save_failed;
+	}
+
+	if (0 != close(fd)) {
+		perror("Close failed");
+		fd = -1;
+		goto save_failed;
+	}
+	fd = -1;
+	if (0 != rename(tmp_name, filename)) {
+		perror("Failed to rename index file");
+		goto save_failed;
+	}
+	rv = 0;
+
+save_failed:
+	if (-1 != fd)
+		close(fd);
+	if (rv)
+		unlink(tmp_name);
+	mem_free(zbuf);
+
+	return rv;
+}
+
+/* Reads a sidecar index, returns 1 when missing or malformed. */
+int
+index_load(const char *filename, image_index_t *idx)
+{
+	const index_file_hdr_t *fh;
+	index_file_point_t fp;
+	struct stat st;
+	loaded_t file;
+	uLongf wlen;
+	size_t pos, i;
+	int malformed = 0;
+	int fd;
+	int rv = 1;
+
+	memset(idx, 0, sizeof(image_index_t));
+	fd = open(filename, O_RDONLY);
+	if (-1 == fd)
+		return 1;
+	memset(&file, 0, sizeof(loaded_t));
+	if (0 != fstat(fd, &st) ||
+	    (size_t)st.st_size < sizeof(index_file_hdr_t) ||
+	    0 != loader_load(fd, st.st_size, &file)) {
+		close(fd);
+		fprintf(stderr, "Failed to read index %s\n", filename);
+		return 1;
+	}
+	close(fd);
+
+	fh = (const index_file_hdr_t *)file.addr;
+	if (0 != memcmp(fh->magic, INDEX_MAGIC, sizeof(fh->magic)) ||
+	    INDEX_VERSION != fh->version) {
+		fprintf(stderr, "Unsupported index %s\n", filename);
+		goto load_failed;
+	}
+	idx->image_checksum = fh->image_checksum;
+	idx->image_size = fh->image_size;
+	idx->total = fh->total;
+	idx->span = fh->span;
+	idx->layout.type = fh->layout;
+	memcpy(idx->layout.parts, fh->parts, sizeof(idx->layout.parts));
+
+	idx->points = mem_alloc(fh->npoints * sizeof(index_point_t));
+	if (NULL == idx->points && fh->npoints)
+		goto load_failed;
+	idx->alloc = fh->npoints;
+
+	pos = sizeof(index_file_hdr_t);
+	malformed = 1;
+	for (i = 0; i < fh->npoints; i++) {
+		if (file.len - pos < sizeof(index_file_point_t))
+			goto load_failed;
+		memcpy(&fp, file.addr + pos, sizeof(index_file_point_t));
+		pos += sizeof(index_file_point_t);
+		if (file.len - pos < fp.window_len || fp.bits > 7 ||
+		    fp.out > idx->total)
+			goto load_failed;
+
+		idx->points[i].out = fp.out;
+		idx->points[i].in = fp.in;
+		idx->points[i].bits = fp.bits;
+		idx->points[i].window = NULL;
+		idx->npoints++;
+		wlen = index_window_len(fp.out);
+		if (0 == wlen)
+			continue;
+		idx->points[i].window = mem_alloc(wlen);
+		if (NULL == idx->points[i].window) {
+			malformed = 0;
+			goto load_failed;
+		}
+		if (Z_OK != uncompress(idx->points[i].window, &wlen,
+		                       (Bytef *)file.addr + pos,
+		                       fp.window_len) ||
+		    wlen != index_window_len(fp.out))
+			goto load_failed;
+		pos += fp.window_len;
+	}
+	rv = 0;
+
+load_failed:
+	if (rv && malformed)
+		fprintf(stderr, "Malformed index %s\n", filename);
+	loader_unload(&file);
+	if (rv)
+		index_free(idx);
+
+	return rv;
+}
+
+void
+index_free(image_index_t *idx)
+{
+	size_t i;
+
+	for (i = 0; i < idx->npoints; i++)
+		mem_free(idx->points[i].window);
+	mem_free(idx->points);
+	idx->points = NULL;
+	idx->npoints = idx->alloc = 0;
+}
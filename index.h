@@ -0,0 +1,102 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/* Bytes of history inflate needs to resume at a checkpoint. */
+#define INDEX_WINDOW	32768
+
+/* Payload components an index records, in stream order. */
+#define INDEX_KERNEL	0
+#define INDEX_BCODE	1
+#define INDEX_RAMDISK	2
+#define INDEX_PARTS	3
+
+/* Payload layouts, they select the names of the component files. */
+#define INDEX_LAYOUT_UNKNOWN	0
+#define INDEX_LAYOUT_NEW	1
+#define INDEX_LAYOUT_LEGACY	2
+
+/*
+ * Inflate checkpoint. Decoding can resume at byte in of the zlib
+ * stream, after feeding the low bits of the byte before it, given the
+ * payload bytes preceding out as dictionary.
+ */
+typedef struct index_point
+{
+	uint64_t	out;		/* payload offset */
+	uint64_t	in;		/* zlib stream offset */
+	int		bits;		/* bits of byte in - 1 still to decode */
+	unsigned char	*window;	/* min(out, INDEX_WINDOW) bytes */
+} index_point_t;
+
+/* Component of the payload, zero length when absent. */
+typedef struct index_part
+{
+	uint64_t	off;
+	uint64_t	len;
+} index_part_t;
+
+/* Where the components sit in the payload. */
+typedef struct image_layout
+{
+	uint32_t	type;		/* INDEX_LAYOUT_* */
+	index_part_t	parts[INDEX_PARTS];
+} image_layout_t;
+
+/* Random access index of the zlib stream of one image. */
+typedef struct image_index
+{
+	uint32_t	image_checksum;	/* image the index belongs to */
+	uint32_t	image_size;
+	uint64_t	total;		/* unpacked payload size */
+	uint32_t	span;		/* payload bytes between checkpoints */
+	image_layout_t	layout;
+	index_point_t	*points;
+	size_t		npoints;
+	size_t		alloc;
+} image_index_t;
+
+int  index_build(const char *, size_t, size_t, image_index_t *);
+int  index_extract(const image_index_t *, const char *, size_t, uint64_t,
+                   uint64_t, void *, size_t, zlib_sink_t, void *);
+int  index_read(const image_index_t *, const char *, size_t, uint64_t,
+                void *, size_t);
+int  index_save(const image_index_t *, const char *);
+int  index_load(const char *, image_index_t *);
+void index_free(image_index_t *);
+int  index_path(const char *, char *, size_t);
+
+#endif /* _INDEX_H_ */
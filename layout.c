@@ -0,0 +1,344 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "layout.h"
+#include "util.h"
+#include "config.h"
+
+const part_name_t part_names[][INDEX_PARTS] = {
+	[INDEX_LAYOUT_UNKNOWN] = {
+		{ "payload.bin", NULL, "payload.bin", 0 },
+	},
+	[INDEX_LAYOUT_NEW] = {
+		{ "Image", "Kernel image", "uImage", 1 },
+		{ "bcode", "Bootstrap image", "bcode", 0 },
+		{ "initrd.ext2", "RAM disk image", "initrd", 1 },
+	},
+	[INDEX_LAYOUT_LEGACY] = {
+		{ "Image", "Kernel image", "uImage", 1 },
+		{ "bcode-legacy", "Bootstrap image", "bcode", 0 },
+		{ "initrd.ext2", "RAM disk image", "initrd", 1 },
+	},
+};
+
+/* File name of a component of the given layout, NULL when it has none. */
+const char *
+boost_part_filename(uint32_t layout, int part)
+{
+	return part_names[layout][part].filename;
+}
+
+/* Prints the offset line of a part, if its name has one. */
+void
+part_print_offset(const part_name_t *name, const index_part_t *part)
+{
+	if (NULL == name->descr)
+		return;
+	printf("%s\t: offset = 0x%08llx, size = %llu%s\n", name->descr,
+	       (unsigned long long)part->off,
+	       (unsigned long long)part->len / (name->kb ? 1024 : 1),
+	       name->kb ? "kB" : "B");
+}
+
+/*
+ * Finds the probe window of a payload: the bootcode header a new image
+ * keeps right before the branch target, followed by the instruction at
+ * the target. Returns the length of the window and stores its offset
+ * in *off, or returns 0 when the payload has no such window.
+ */
+size_t
+layout_probe_window(uint32_t first_instr, uint64_t total, uint64_t *off)
+{
+	uint64_t target;
+
+	if (!IS_ARM_BRANCH(first_instr))
+		return 0;
+	target = BRANCHL_2_OFFSET(first_instr);
+	if (target < STARTUP_BYTES + sizeof(bcode_hdr_t) || target > total)
+		return 0;
+	*off = target - sizeof(bcode_hdr_t);
+
+	return total - target < sizeof(uint32_t) ? sizeof(bcode_hdr_t) :
+	       LAYOUT_PROBE_LEN;
+}
+
+/*
+ * Returns the layout shown by the contents of the probe window. A new
+ * image has a bootcode header there whose offset points back at it.
+ * Legacy images have no header, so their bootcode is accepted when it
+ * fits the payload and starts with an unconditional instruction.
+ */
+uint32_t
+layout_probe(uint32_t first_instr, const char *window, size_t len,
+             uint64_t total)
+{
+	uint64_t target = BRANCHL_2_OFFSET(first_instr);
+	bcode_hdr_t bcode;
+	uint32_t entry;
+
+	if (len < sizeof(bcode_hdr_t))
+		return INDEX_LAYOUT_UNKNOWN;
+	memcpy(&bcode, window, sizeof(bcode_hdr_t));
+	if ((bcode.magic & BCODE_MAGIC_MASK) == BCODE_MAGIC) {
+		/* A broken header still is no legacy bootcode. */
+		if (bcode.bcode_off == target - sizeof(bcode_hdr_t) &&
+		    bcode.ramdisk_size <= total - target)
+			return INDEX_LAYOUT_NEW;
+		return INDEX_LAYOUT_UNKNOWN;
+	}
+
+	if (len < LAYOUT_PROBE_LEN ||
+	    target < LEGACY_BCODE_START_OFFSET + sizeof(uint32_t) ||
+	    target - LEGACY_BCODE_START_OFFSET + LEGACY_BCODE_SIZE > total)
+		return INDEX_LAYOUT_UNKNOWN;
+	memcpy(&entry, window + sizeof(bcode_hdr_t), sizeof(uint32_t));
+	if ((entry & ARM_COND_MASK) == ARM_COND_AL)
+		return INDEX_LAYOUT_LEGACY;
+
+	return INDEX_LAYOUT_UNKNOWN;
+}
+
+/*
+ * Returns the layout of a payload starting with first_instr, given its
+ * probe window. The window contents decide, the image version is only
+ * used when they are inconclusive. A payload without a bootcode header
+ * is never taken for a new image, so plain kernels stay whole.
+ */
+uint32_t
+layout_type(const boost_hdr_t *hdr, uint32_t first_instr, const char *window,
+            size_t len, uint64_t total)
+{
+	uint32_t type = layout_probe(first_instr, window, len, total);
+	uint32_t magic;
+
+	if (INDEX_LAYOUT_UNKNOWN != type)
+		return type;
+	if (boost_is_legacy(hdr))
+		return INDEX_LAYOUT_LEGACY;
+	if (len < sizeof(uint32_t))
+		return INDEX_LAYOUT_UNKNOWN;
+	memcpy(&magic, window, sizeof(uint32_t));
+
+	return (magic & BCODE_MAGIC_MASK) == BCODE_MAGIC ? INDEX_LAYOUT_NEW :
+	       INDEX_LAYOUT_UNKNOWN;
+}
+
+/*
+ * Derives the component layout of a total bytes payload from its first
+ * instruction, for images of the given type. For new images the
+ * bootcode and ramdisk are left empty, their boundary follows from the
+ * bootcode header at the offset stored in the bootcode part, see
+ * boost_layout_bcode().
+ */
+int
+boost_layout(uint32_t type, uint32_t first_instr, uint64_t total,
+             image_layout_t *layout)
+{
+	uint64_t bcode_off;
+
+	memset(layout, 0, sizeof(image_layout_t));
+	if (!IS_ARM_BRANCH(first_instr) || INDEX_LAYOUT_UNKNOWN == type) {
+		layout->type = INDEX_LAYOUT_UNKNOWN;
+		layout->parts[INDEX_KERNEL].len = total;
+		return 0;
+	}
+
+	if (INDEX_LAYOUT_LEGACY == type) {
+		bcode_off = BRANCHL_2_OFFSET(first_instr) -
+		            LEGACY_BCODE_START_OFFSET;
+		if (bcode_off < 4 || bcode_off + LEGACY_BCODE_SIZE > total) {
+			fprintf(stderr, "Invalid legacy image layout!\n");
+			return 1;
+		}
+		layout->type = INDEX_LAYOUT_LEGACY;
+		layout->parts[INDEX_KERNEL].off = 4;
+		layout->parts[INDEX_KERNEL].len = bcode_off - 4;
+		layout->parts[INDEX_BCODE].off = bcode_off;
+		layout->parts[INDEX_BCODE].len = LEGACY_BCODE_SIZE;
+		layout->parts[INDEX_RAMDISK].off = bcode_off + LEGACY_BCODE_SIZE;
+		layout->parts[INDEX_RAMDISK].len = total - bcode_off -
+		                                   LEGACY_BCODE_SIZE;
+		return 0;
+	}
+
+	bcode_off = BRANCHL_2_OFFSET(first_instr) - sizeof(bcode_hdr_t);
+	if (bcode_off < STARTUP_BYTES ||
+	    bcode_off + sizeof(bcode_hdr_t) > total) {
+		fprintf(stderr, "Invalid image layout!\n");
+		return 1;
+	}
+	layout->type = INDEX_LAYOUT_NEW;
+	layout->parts[INDEX_KERNEL].off = STARTUP_BYTES;
+	layout->parts[INDEX_KERNEL].len = bcode_off - STARTUP_BYTES;
+	layout->parts[INDEX_BCODE].off = bcode_off;
+	layout->parts[INDEX_RAMDISK].off = total;
+
+	return 0;
+}
+
+/* Completes a new image layout given its bootcode header. */
+int
+boost_layout_bcode(image_layout_t *layout, const bcode_hdr_t *bcode)
+{
+	index_part_t *b = &layout->parts[INDEX_BCODE];
+	index_part_t *r = &layout->parts[INDEX_RAMDISK];
+	uint64_t total = r->off;
+
+	if (bcode->ramdisk_size > total - b->off - sizeof(bcode_hdr_t)) {
+		fprintf(stderr, "Invalid ramdisk size!\n");
+		return 1;
+	}
+	r->off = total - bcode->ramdisk_size;
+	r->len = bcode->ramdisk_size;
+	b->len = r->off - b->off;
+
+	return 0;
+}
+
+/*
+ * Finds the component layout of a total bytes payload, fetching its
+ * bytes through read. Only the first instruction and the few bytes
+ * around the branch target are read. A payload that cannot be split
+ * is returned as one part of unknown layout, while a broken bootcode
+ * header is an error.
+ */
+int
+boost_layout_read(const boost_hdr_t *hdr, uint64_t total, payload_read_t read,
+                  void *ctx, image_layout_t *layout)
+{
+	char window[LAYOUT_PROBE_LEN];
+	uint32_t first_instr = 0;
+	bcode_hdr_t bcode;
+	uint64_t off = 0;
+	size_t len;
+
+	if (total >= sizeof(uint32_t) &&
+	    0 != read(ctx, 0, &first_instr, sizeof(uint32_t)))
+		return 1;
+	len = layout_probe_window(first_instr, total, &off);
+	if (0 != len && 0 != read(ctx, off, window, len))
+		return 1;
+	if (0 != boost_layout(layout_type(hdr, first_instr, window, len,
+	                                  total),
+	                      first_instr, total, layout)) {
+		/* The branch leads nowhere, the payload is one part. */
+		memset(layout, 0, sizeof(image_layout_t));
+		layout->parts[INDEX_KERNEL].len = total;
+		return 0;
+	}
+	if (INDEX_LAYOUT_NEW != layout->type)
+		return 0;
+
+	/* The window starts with the bootcode header then. */
+	memcpy(&bcode, window, sizeof(bcode_hdr_t));
+
+	return boost_layout_bcode(layout, &bcode);
+}
+
+/* Reads from a payload held in memory, ctx points at it. */
+int
+payload_mem_read(void *ctx, uint64_t off, void *buf, size_t len)
+{
+	memcpy(buf, (const char *)ctx + off, len);
+
+	return 0;
+}
+
+/* Takes the first instruction and the window, then ends the inflate. */
+int
+stream_probe_sink(void *ctx, const char *buf, size_t len)
+{
+	stream_probe_t *p = ctx;
+	uint64_t from, to;
+	size_t n;
+
+	if (p->pos < sizeof(uint32_t)) {
+		n = sizeof(uint32_t) - p->pos;
+		n = n < len ? n : len;
+		memcpy((char *)&p->first_instr + p->pos, buf, n);
+		p->pos += n;
+		buf += n;
+		len -= n;
+		if (p->pos < sizeof(uint32_t))
+			return 0;
+		p->len = layout_probe_window(p->first_instr, p->total,
+		                             &p->off);
+		if (0 == p->len)
+			return 1;
+	}
+
+	from = p->pos > p->off ? p->pos : p->off;
+	to = p->pos + len < p->off + p->len ? p->pos + len : p->off + p->len;
+	if (from < to)
+		memcpy(p->window + (from - p->off), buf + (from - p->pos),
+		       to - from);
+	p->pos += len;
+
+	return p->pos >= p->off + p->len;
+}
+
+/* Layout type of the payload the probe p has seen. */
+uint32_t
+stream_probe_type(const boost_hdr_t *hdr, stream_probe_t *p)
+{
+	/* A window cut short by the end of the payload tells nothing. */
+	if (p->pos < p->off + p->len)
+		p->len = 0;
+
+	return layout_type(hdr, p->first_instr, p->window, p->len, p->total);
+}
+
+/*
+ * Returns the layout type of the data section of a streamed extract.
+ * For zlib images the payload is inflated through buf up to the branch
+ * target first, see extract_stream_begin() for when that is needed.
+ */
+uint32_t
+stream_layout_type(const boost_hdr_t *hdr, const char *data, char *buf)
+{
+	stream_probe_t p;
+	size_t len = 0;
+
+	memset(&p, 0, sizeof(stream_probe_t));
+	if (!(hdr->flags & BOOST_FLAG_ZLIB)) {
+		p.total = hdr->image_size;
+		stream_probe_sink(&p, data, hdr->image_size);
+	} else {
+		p.total = swap_bytes_be(((const uint32_t *)data)[0]);
+		zlib_decompress_stream(data + 4, hdr->image_size - 4, buf,
+		                       STREAM_BUF_SIZE, stream_probe_sink, &p,
+		                       &len, NULL);
+	}
+
+	return stream_probe_type(hdr, &p);
+}
@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boost.h"
+#include "index.h"
+
+#define IS_ARM_BRANCH(ins) (((ins) & 0x0e000000) == 0x0a000000)
+
+#define OFFSET_2_BRANCHL(off) ((0xeb << 24) | \
+	(((off - 8) >> 2) & 0x00ffffff))
+#define BRANCHL_2_OFFSET(br) (((br & 0x00ffffff) << 2) + 8)
+
+/* Condition field of ARM instructions, AL executes always. */
+#define ARM_COND_MASK	0xf0000000
+#define ARM_COND_AL	0xe0000000
+
+/* Bootcode header before the branch target and the instruction at it. */
+#define LAYOUT_PROBE_LEN	(sizeof(bcode_hdr_t) + sizeof(uint32_t))
+
+/* Output file and report lines of one payload component. */
+typedef struct part_name
+{
+	const char	*filename;
+	const char	*descr;		/* offset line, NULL for none */
+	const char	*tag;		/* name in the "Writing" line */
+	int		kb;		/* size printed in kB */
+} part_name_t;
+
+/* Probe window of a payload as it comes out of inflate. */
+typedef struct stream_probe
+{
+	uint64_t	total;
+	uint64_t	pos;
+	uint32_t	first_instr;
+	uint64_t	off;
+	size_t		len;		/* window, 0 until known */
+	char		window[LAYOUT_PROBE_LEN];
+} stream_probe_t;
+
+extern const part_name_t part_names[][INDEX_PARTS];
+
+void     part_print_offset(const part_name_t *, const index_part_t *);
+size_t   layout_probe_window(uint32_t, uint64_t, uint64_t *);
+uint32_t layout_probe(uint32_t, const char *, size_t, uint64_t);
+uint32_t layout_type(const boost_hdr_t *, uint32_t, const char *, size_t,
+                     uint64_t);
+int      boost_layout(uint32_t, uint32_t, uint64_t, image_layout_t *);
+int      boost_layout_bcode(image_layout_t *, const bcode_hdr_t *);
+int      boost_is_legacy(const boost_hdr_t *);
+int      payload_mem_read(void *, uint64_t, void *, size_t);
+int      stream_probe_sink(void *, const char *, size_t);
+uint32_t stream_probe_type(const boost_hdr_t *, stream_probe_t *);
+uint32_t stream_layout_type(const boost_hdr_t *, const char *, char *);
+
+#endif /* _LAYOUT_H_ */
@@ -0,0 +1,406 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "loader.h"
+#include "mem.h"
+#include "stats.h"
+#include "util.h"
+#include "config.h"
+
+/* Alignment of read buffers, satisfies O_DIRECT on common devices. */
+#define LOADER_ALIGN		(4*1024)
+
+#define LOADER_ROUND(x)		(((x) + LOADER_ALIGN - 1) & \
+				 ~((size_t)LOADER_ALIGN - 1))
+
+/* Filesystem magics auto mode cares about, see statfs(2). */
+#define NFS_MAGIC		0x6969
+#define SMB_MAGIC		0x517b
+#define CIFS_MAGIC		0xff534d42
+#define FUSE_MAGIC		0x65735546
+#define TMPFS_MAGIC		0x01021994
+#define RAMFS_MAGIC		0x858458f6
+
+/*
+ * Input loading strategy. Mappings fault pages in lazily, so their
+ * cost shows up in the phases touching the data rather than in load.
+ */
+typedef struct loader
+{
+	const char	*name;
+	int		(*load)(int, size_t, loaded_t *);
+} loader_t;
+
+static int loader_auto(int, size_t, loaded_t *);
+static int loader_mmap(int, size_t, loaded_t *);
+static int loader_populate(int, size_t, loaded_t *);
+static int loader_read(int, size_t, loaded_t *);
+static int loader_direct(int, size_t, loaded_t *);
+#ifdef HAVE_LIBURING
+static int loader_uring(int, size_t, loaded_t *);
+#endif
+
+/* The first entry is the default. */
+static const loader_t loaders[] = {
+	{ "auto", loader_auto },
+	{ "mmap", loader_mmap },
+	{ "populate", loader_populate },
+	{ "read", loader_read },
+	{ "direct", loader_direct },
+#ifdef HAVE_LIBURING
+	{ "uring", loader_uring },
+#endif
+};
+
+static const loader_t *loader = &loaders[0];
+
+int
+loader_set(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(loaders) / sizeof(loaders[0]); i++) {
+		if (0 == strcmp(loaders[i].name, name)) {
+			loader = &loaders[i];
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown input loader: %s\n", name);
+	return 1;
+}
+
+/* Space separated list of compiled in loaders. */
+const char *
+loader_list(void)
+{
+#ifdef HAVE_LIBURING
+	return "auto mmap populate read direct uring";
+#else
+	return "auto mmap populate read direct";
+#endif
+}
+
+/* Loads len bytes of fd with the selected strategy. */
+int
+loader_load(int fd, size_t len, loaded_t *lf)
+{
+	uint64_t start;
+	int rv;
+
+	memset(lf, 0, sizeof(loaded_t));
+	lf->len = len;
+
+	start = monotonic_ns();
+	rv = loader->load(fd, len, lf);
+	if (0 == rv)
+		stats_loader(lf->name, len, start);
+
+	return rv;
+}
+
+void
+loader_unload(loaded_t *lf)
+{
+	if (NULL == lf->addr)
+		return;
+
+	if (NULL != lf->buf.base) {
+		arena_release(&lf->buf);
+	} else if (-1 == munmap(lf->addr, lf->len)) {
+		perror("Failed to unmap input file");
+	}
+	lf->addr = NULL;
+}
+
+/*
+ * Picks a strategy by file size and filesystem. Small files are read
+ * in one go, sparse files and files already in memory are mapped so
+ * holes and cached pages are not copied, network filesystems are read
+ * sequentially and everything else is mapped and prefaulted.
+ */
+static int
+loader_auto(int fd, size_t len, loaded_t *lf)
+{
+	struct statfs fs;
+	struct stat st;
+
+	if (len <= LOADER_SMALL_FILE)
+		return loader_read(fd, len, lf);
+
+	if (0 == fstat(fd, &st) && (size_t)st.st_blocks * 512 < len)
+		return loader_mmap(fd, len, lf);
+
+	if (0 == fstatfs(fd, &fs)) {
+		switch ((unsigned long)fs.f_type) {
+		case TMPFS_MAGIC:
+		case RAMFS_MAGIC:
+			return loader_mmap(fd, len, lf);
+		case NFS_MAGIC:
+		case SMB_MAGIC:
+		case CIFS_MAGIC:
+		case FUSE_MAGIC:
+#ifdef HAVE_LIBURING
+			return loader_uring(fd, len, lf);
+#else
+			return loader_read(fd, len, lf);
+#endif
+		}
+	}
+
+	return loader_populate(fd, len, lf);
+}
+
+static int
+loader_map(int fd, size_t len, int flags, loaded_t *lf)
+{
+	void *addr;
+
+	addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE | flags, fd, 0);
+	if (MAP_FAILED == addr) {
+		perror("Failed to memory map input file");
+		return 1;
+	}
+	lf->addr = addr;
+
+	return 0;
+}
+
+static int
+loader_mmap(int fd, size_t len, loaded_t *lf)
+{
+	lf->name = "mmap";
+	return loader_map(fd, len, 0, lf);
+}
+
+/* Maps with all pages faulted in up front, read in big sequential runs. */
+static int
+loader_populate(int fd, size_t len, loaded_t *lf)
+{
+	lf->name = "populate";
+	if (0 != loader_map(fd, len, MAP_POPULATE, lf))
+		return 1;
+
+	/* Advisory only, not every filesystem supports these. */
+	madvise(lf->addr, len, MADV_SEQUENTIAL);
+	madvise(lf->addr, len, MADV_HUGEPAGE);
+
+	return 0;
+}
+
+/*
+ * Reserves an aligned read buffer. Buffers are charged against the
+ * memory budget, so when one does not fit the file is mapped instead.
+ */
+static int
+loader_buffer(size_t len, loaded_t *lf)
+{
+	memset(&lf->buf, 0, sizeof(arena_t));
+	arena_plan(&lf->buf, LOADER_ROUND(len));
+	if (!mem_fits(arena_growth(&lf->buf)))
+		return 1;
+	if (0 != arena_reserve(&lf->buf))
+		return 1;
+	lf->addr = arena_alloc(&lf->buf, LOADER_ROUND(len));
+
+	return 0;
+}
+
+/*
+ * Reads len bytes from offset off in chunks, asking the kernel to read
+ * the next chunk ahead while the current one is copied. With direct
+ * set lengths are rounded up to the alignment O_DIRECT requires.
+ */
+static int
+loader_pread(int fd, char *buf, size_t len, size_t off, int direct)
+{
+	size_t end = off + len, want;
+	ssize_t n;
+
+	while (off < end) {
+		want = end - off < LOADER_CHUNK ? end - off : LOADER_CHUNK;
+		if (direct)
+			want = LOADER_ROUND(want);
+		else if (off + want < end)
+			readahead(fd, off + want, LOADER_CHUNK);
+
+		n = pread(fd, buf, want, off);
+		if (-1 == n && EINTR == errno)
+			continue;
+		if (-1 == n)
+			return 1;
+		if (0 == n) {
+			errno = EIO;
+			return 1;
+		}
+		buf += n;
+		off += n;
+	}
+
+	return 0;
+}
+
+static int
+loader_read(int fd, size_t len, loaded_t *lf)
+{
+	if (0 != loader_buffer(len, lf)) {
+		arena_release(&lf->buf);
+		return loader_mmap(fd, len, lf);
+	}
+	lf->name = "read";
+
+	posix_fadvise(fd, 0, len, POSIX_FADV_SEQUENTIAL);
+	if (0 != loader_pread(fd, lf->addr, len, 0, 0)) {
+		perror("Failed to read input file");
+		loader_unload(lf);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads around the page cache. Filesystems refusing O_DIRECT get a
+ * buffered read instead.
+ */
+static int
+loader_direct(int fd, size_t len, loaded_t *lf)
+{
+	int flags, rv;
+
+	flags = fcntl(fd, F_GETFL);
+	if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_DIRECT))
+		return loader_read(fd, len, lf);
+
+	if (0 != loader_buffer(len, lf)) {
+		arena_release(&lf->buf);
+		fcntl(fd, F_SETFL, flags);
+		return loader_mmap(fd, len, lf);
+	}
+	lf->name = "direct";
+
+	rv = loader_pread(fd, lf->addr, len, 0, 1);
+	if (0 != rv && EINVAL == errno) {
+		fcntl(fd, F_SETFL, flags);
+		loader_unload(lf);
+		return loader_read(fd, len, lf);
+	}
+	fcntl(fd, F_SETFL, flags);
+	if (0 != rv) {
+		perror("Failed to read input file");
+		loader_unload(lf);
+		return 1;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Keeps up to LOADER_URING_DEPTH chunk reads in flight. Short reads
+ * are rare and finished synchronously.
+ */
+static int
+loader_uring(int fd, size_t len, loaded_t *lf)
+{
+	struct io_uring ring;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	size_t off = 0, pos, want;
+	unsigned inflight = 0;
+	int res, rv = 1;
+
+	if (0 != io_uring_queue_init(LOADER_URING_DEPTH, &ring, 0))
+		return loader_read(fd, len, lf);
+
+	if (0 != loader_buffer(len, lf)) {
+		arena_release(&lf->buf);
+		io_uring_queue_exit(&ring);
+		return loader_mmap(fd, len, lf);
+	}
+	lf->name = "uring";
+
+	while (off < len || inflight) {
+		while (inflight < LOADER_URING_DEPTH && off < len) {
+			sqe = io_uring_get_sqe(&ring);
+			if (NULL == sqe)
+				break;
+			want = len - off < LOADER_CHUNK ? len - off :
+			                                  LOADER_CHUNK;
+			io_uring_prep_read(sqe, fd, lf->addr + off, want, off);
+			io_uring_sqe_set_data(sqe, lf->addr + off);
+			off += want;
+			inflight++;
+		}
+		res = io_uring_submit_and_wait(&ring, 1);
+		if (res < 0) {
+			errno = -res;
+			goto uring_failed;
+		}
+		while (0 == io_uring_peek_cqe(&ring, &cqe)) {
+			pos = (char *)io_uring_cqe_get_data(cqe) - lf->addr;
+			want = len - pos < LOADER_CHUNK ? len - pos :
+			                                  LOADER_CHUNK;
+			res = cqe->res;
+			io_uring_cqe_seen(&ring, cqe);
+			inflight--;
+			if (res < 0) {
+				errno = -res;
+				goto uring_failed;
+			}
+			if ((size_t)res < want &&
+			    0 != loader_pread(fd, lf->addr + pos + res,
+			                      want - res, pos + res, 0))
+				goto uring_failed;
+		}
+	}
+	rv = 0;
+
+uring_failed:
+	io_uring_queue_exit(&ring);
+	if (0 != rv) {
+		perror("Failed to read input file");
+		loader_unload(lf);
+	}
+
+	return rv;
+}
+#endif
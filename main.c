@@ -34,6 +34,12 @@
 #include <errno.h>
 #include <stdio.h>
 
+#include "boost.h"
+#include "stats.h"
+#include "mem.h"
+#include "loader.h"
+#include "trace.h"
+#include "util.h"
 #include "cmd.h"
 #include "config.h"
 
@@ -42,22 +48,97 @@ void
 print_help(char *progname)
 {
 	printf("Psion/Teklogix NetBook Pro BooSt image tool, version %s\n"
-	       "Usage: %s [command] [command options]\n\n"
+	       "Usage: %s [global options] [command] [command options]\n\n"
 	       "Command syntax:\n"
-	       "  check filename\n"
+	       "  check filename [--sha256], also print the image digest\n"
+	       "  check --deep filename..., verify all in one bounded pass\n"
                "  create [create args]\n"
-	       "  extract filename\n"
-	       "  info filename\n\n"
+	       "  delta old new outfile, write the update from old to new\n"
+	       "  diff a b, compare two images without extracting them\n"
+	       "  extract filename [--only kernel|bcode|ramdisk] [--no-verify]\n"
+	       "          [--store dir], share components in a content store\n"
+	       "          [--manifest file], write SHA-256 sums of image and parts\n"
+	       "  index filename [-n MiB], write filename.idx for fast extract\n"
+	       "  info filename\n"
+	       "  mount filename dir [-f], read-only view of the components\n"
+	       "  patch old delta outfile, rebuild the new image\n"
+	       "  scan filename..., tell the layout from the contents\n\n"
 	       "Possible create paramaters:\n"
 	       "  -k kernel, path to kernel image\n"
 	       "  -b bootcode, path to boot code binary\n"
 	       "  -r ramdisk, path to ramdisk image\n"
+	       "  -R dir, build an ext2 ramdisk from a directory tree\n"
+	       "  --scrub-ramdisk, compress free ext2 blocks of -r as zeros\n"
 	       "  -o outfile, name of the output image\n"
 	       "  -d descr, image description\n"
 	       "  -v version, image version string\n"
 	       "  -l offset, memory load offset\n"
-	       "  -z, use zlib compression\n",
-	       VERSION_STR, basename(progname));
+	       "  -z, use zlib compression\n"
+	       "  -Z, use slow maximum compression (implies -z)\n"
+	       "  --optimize[=seconds], search for the smallest zlib stream\n"
+	       "  --chunks[=MiB], parallel decodable chunks (implies -z)\n"
+	       "  --verify, inflate and compare the image while writing it\n"
+	       "  --dry-run, compress but write nothing, print the size\n"
+	       "  --estimate, predict the size from samples (implies --dry-run)\n"
+	       "  --max-size size[k|M|G], fail when the image gets larger\n"
+	       "  --manifest file, write SHA-256 sums of image and parts\n"
+	       "  --watch, rebuild whenever an input changes\n\n"
+	       "Global options:\n"
+	       "  --stats[=json], print per-phase statistics to stderr\n"
+	       "  --trace file, write Chrome trace-event timeline to file\n"
+	       "  --backend name, compression backend (%s)\n"
+	       "  --max-memory size[k|M|G], cap buffer memory, streams when needed\n"
+	       "  --loader name, input loading strategy (%s)\n",
+	       VERSION_STR, basename(progname), zlib_backend_list(),
+	       loader_list());
+}
+
+/*
+ * Parses the extract options following the image name. Without --only
+ * all components are extracted.
+ */
+int
+parse_extract_args(int argc, char *argv[], unsigned *parts, int *verify,
+                   const char **store, const char **manifest)
+{
+	int i;
+
+	*parts = 0;
+	*verify = 1;
+	*store = NULL;
+	*manifest = NULL;
+	for (i = 3; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--only") && (++i < argc)) {
+			if (0 == strcmp(argv[i], "kernel")) {
+				*parts |= BOOST_PART(INDEX_KERNEL);
+			} else if (0 == strcmp(argv[i], "bcode")) {
+				*parts |= BOOST_PART(INDEX_BCODE);
+			} else if (0 == strcmp(argv[i], "ramdisk")) {
+				*parts |= BOOST_PART(INDEX_RAMDISK);
+			} else {
+				printf("Invalid component: %s\n", argv[i]);
+				return 1;
+			}
+		} else if (0 == strcmp(argv[i], "--no-verify")) {
+			*verify = 0;
+		} else if (0 == strcmp(argv[i], "--store") && (++i < argc)) {
+			*store = argv[i];
+		} else if (0 == strcmp(argv[i], "--manifest") &&
+		           (++i < argc)) {
+			*manifest = argv[i];
+		} else {
+			printf("Invalid extract arguments!\n");
+			return 1;
+		}
+	}
+	if (*store && *manifest) {
+		printf("--store already writes a manifest!\n");
+		return 1;
+	}
+	if (0 == *parts)
+		*parts = BOOST_ALL_PARTS;
+
+	return 0;
 }
 
 int
@@ -72,6 +153,8 @@ parse_create_args(int argc, char *argv[], create_args_t *args)
 			args->bcode = argv[i];
 		} else if ((0 == strncmp(argv[i], "-r", 2)) && (++i < argc)) {
 			args->ramdisk = argv[i];
+		} else if ((0 == strncmp(argv[i], "-R", 2)) && (++i < argc)) {
+			args->ramdisk_dir = argv[i];
 		} else if ((0 == strncmp(argv[i], "-o", 2)) && (++i < argc)) {
 			args->outfile = argv[i];
 		} else if ((0 == strncmp(argv[i], "-d", 2)) && (++i < argc)) {
@@ -87,12 +170,89 @@ parse_create_args(int argc, char *argv[], create_args_t *args)
 			}
 		} else if (0 == strncmp(argv[i], "-z", 2)) {
 			args->use_zlib = 1;
+		} else if (0 == strncmp(argv[i], "-Z", 2)) {
+			args->use_zlib = 1;
+			args->squeeze = 1;
+		} else if (0 == strcmp(argv[i], "--optimize")) {
+			args->use_zlib = 1;
+			args->optimize = DEFAULT_OPTIMIZE_BUDGET;
+		} else if (0 == strncmp(argv[i], "--optimize=", 11)) {
+			args->use_zlib = 1;
+			args->optimize = strtoul(argv[i] + 11, (char **)NULL, 10);
+			if (0 == args->optimize) {
+				printf("Invalid optimize time budget!\n");
+				return 1;
+			}
+		} else if (0 == strcmp(argv[i], "--chunks")) {
+			args->use_zlib = 1;
+			args->chunk_size = DEFAULT_CHUNK_SIZE;
+		} else if (0 == strncmp(argv[i], "--chunks=", 9)) {
+			args->use_zlib = 1;
+			args->chunk_size = strtoul(argv[i] + 9, (char **)NULL,
+			                           10) * 1024 * 1024;
+			if (0 == args->chunk_size ||
+			    args->chunk_size > MAX_IMAGE_BUF_SIZE) {
+				printf("Invalid chunk size!\n");
+				return 1;
+			}
+		} else if (0 == strcmp(argv[i], "--scrub-ramdisk")) {
+			args->scrub_ramdisk = 1;
+		} else if (0 == strcmp(argv[i], "--verify")) {
+			args->verify = 1;
+		} else if (0 == strcmp(argv[i], "--watch")) {
+			args->watch = 1;
+		} else if (0 == strcmp(argv[i], "--dry-run")) {
+			args->dry_run = 1;
+		} else if (0 == strcmp(argv[i], "--estimate")) {
+			args->dry_run = 1;
+			args->estimate = 1;
+		} else if (0 == strcmp(argv[i], "--manifest") && (++i < argc)) {
+			args->manifest = argv[i];
+		} else if (0 == strcmp(argv[i], "--max-size") && (++i < argc)) {
+			if (0 != mem_parse_size(argv[i], &args->max_size) ||
+			    0 == args->max_size) {
+				printf("Invalid maximum image size: %s\n",
+				       argv[i]);
+				return 1;
+			}
 		} else {
 			printf("Invalid create arguments!\n");
 			return 1;
 		}
 	}
 
+	if (args->watch && (args->squeeze || args->optimize ||
+	    args->chunk_size || args->verify || args->dry_run ||
+	    args->ramdisk_dir || args->manifest)) {
+		printf("--watch cannot be combined with -Z, --optimize, "
+		       "--chunks, --verify, --dry-run, -R or --manifest!\n");
+		return 1;
+	}
+
+	if (args->ramdisk && args->ramdisk_dir) {
+		printf("-r cannot be combined with -R!\n");
+		return 1;
+	}
+	if (args->scrub_ramdisk && args->ramdisk == NULL) {
+		printf("--scrub-ramdisk needs a ramdisk image (-r)!\n");
+		return 1;
+	}
+	if (args->ramdisk_dir && args->bcode == NULL) {
+		printf("-R needs a bootcode (-b) to carry the ramdisk!\n");
+		return 1;
+	}
+
+	if ((args->verify || args->manifest) && args->dry_run) {
+		printf("--verify and --manifest cannot be combined with "
+		       "--dry-run!\n");
+		return 1;
+	}
+
+	if (args->chunk_size && (args->squeeze || args->optimize)) {
+		printf("--chunks cannot be combined with -Z or --optimize!\n");
+		return 1;
+	}
+
 	if (args->kernel == NULL) {
 		printf("Kernel path has to be specified!\n");
 		return 1;
@@ -113,33 +273,157 @@ parse_create_args(int argc, char *argv[], create_args_t *args)
 	return 0;
 }
 
+/*
+ * Parses options preceding the command name. Returns the number of
+ * consumed arguments or -1 on error.
+ */
+int
+parse_global_args(int argc, char *argv[])
+{
+	size_t budget;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (0 == strcmp(argv[i], "--stats") ||
+		    0 == strcmp(argv[i], "--stats=text")) {
+			stats_init(STATS_TEXT);
+		} else if (0 == strcmp(argv[i], "--stats=json")) {
+			stats_init(STATS_JSON);
+		} else if (0 == strcmp(argv[i], "--trace") && (++i < argc)) {
+			if (0 != trace_open(argv[i]))
+				return -1;
+		} else if (0 == strcmp(argv[i], "--backend") && (++i < argc)) {
+			if (0 != zlib_set_backend(argv[i]))
+				return -1;
+		} else if (0 == strcmp(argv[i], "--loader") && (++i < argc)) {
+			if (0 != loader_set(argv[i]))
+				return -1;
+		} else if (0 == strcmp(argv[i], "--max-memory") &&
+		           (++i < argc)) {
+			if (0 != mem_parse_size(argv[i], &budget)) {
+				printf("Invalid memory size: %s\n", argv[i]);
+				return -1;
+			}
+			mem_set_budget(budget);
+		} else if (0 == strncmp(argv[i], "--", 2)) {
+			printf("Invalid global option: %s\n", argv[i]);
+			return -1;
+		} else {
+			break;
+		}
+	}
+
+	return i - 1;
+}
+
 int
 main(int argc, char *argv[])
 {
 	create_args_t create_args;
+	char *progname = argv[0];
+	char *endptr;
+	size_t span;
+	const char *store, *manifest;
+	unsigned parts;
+	int verify;
+	int nopts;
+	int rv;
+
+	nopts = parse_global_args(argc, argv);
+	if (nopts < 0) {
+		print_help(progname);
+		return 1;
+	}
+	argc -= nopts;
+	argv += nopts;
 
 	if (argc < 3) {
-		print_help(argv[0]);
+		print_help(progname);
 		return 1;
 	}
 
 	if (0 == strncmp(argv[1], "info", 4)) {
-		return cmd_info(argv[2]);
+		rv = cmd_info(argv[2]);
 	} else if (0 == strncmp(argv[1], "extract", 5)) {
-		return cmd_extract(argv[2]);
+		if (parse_extract_args(argc, argv, &parts, &verify, &store,
+		                       &manifest)) {
+			print_help(progname);
+			return 1;
+		}
+		rv = cmd_extract(argv[2], parts, verify, store, manifest);
 	} else if (0 == strncmp(argv[1], "check", 5)) {
-		return cmd_check(argv[2]);
+		if (0 == strcmp(argv[2], "--deep")) {
+			if (argc < 4) {
+				print_help(progname);
+				return 1;
+			}
+			rv = cmd_check_deep(argc - 3, argv + 3);
+		} else if (argc == 3) {
+			rv = cmd_check(argv[2], 0);
+		} else if (argc == 4 && 0 == strcmp(argv[3], "--sha256")) {
+			rv = cmd_check(argv[2], 1);
+		} else {
+			print_help(progname);
+			return 1;
+		}
+	} else if (0 == strncmp(argv[1], "index", 5)) {
+		span = DEFAULT_INDEX_SPAN;
+		if (argc > 4 && 0 == strcmp(argv[3], "-n")) {
+			span = strtoul(argv[4], &endptr, 10) * 1024 * 1024;
+			if (*endptr || 0 == span || span > UINT32_MAX) {
+				print_help(progname);
+				return 1;
+			}
+		} else if (argc > 3) {
+			print_help(progname);
+			return 1;
+		}
+		rv = cmd_index(argv[2], span);
+	} else if (0 == strncmp(argv[1], "mount", 5)) {
+		if (argc == 5 && 0 == strcmp(argv[4], "-f")) {
+			rv = cmd_mount(argv[2], argv[3], 1);
+		} else if (argc == 4) {
+			rv = cmd_mount(argv[2], argv[3], 0);
+		} else {
+			print_help(progname);
+			return 1;
+		}
+	} else if (0 == strncmp(argv[1], "scan", 4)) {
+		rv = cmd_scan(argc - 2, argv + 2);
+	} else if (0 == strncmp(argv[1], "diff", 4)) {
+		if (argc != 4) {
+			print_help(progname);
+			return 1;
+		}
+		rv = cmd_diff(argv[2], argv[3]);
+	} else if (0 == strncmp(argv[1], "delta", 5)) {
+		if (argc != 5) {
+			print_help(progname);
+			return 1;
+		}
+		rv = cmd_delta(argv[2], argv[3], argv[4]);
+	} else if (0 == strncmp(argv[1], "patch", 5)) {
+		if (argc != 5) {
+			print_help(progname);
+			return 1;
+		}
+		rv = cmd_patch(argv[2], argv[3], argv[4]);
 	} else if (0 == strncmp(argv[1], "create", 6)) {
 		memset(&create_args, 0, sizeof(create_args_t));
 		if (parse_create_args(argc, argv, &create_args)) {
-			print_help(argv[0]);
+			print_help(progname);
 			return 1;
 		}
-		return cmd_create(&create_args);
+		rv = cmd_create(&create_args);
 	} else {
-		print_help(argv[0]);
+		print_help(progname);
 		return 1;
 	}
 
-	return 0;
+	stats_report(argv[1]);
+	mem_report();
+	if (0 != trace_close())
+		rv = 1;
+
+	return rv;
 }
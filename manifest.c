@@ -0,0 +1,200 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "layout.h"
+#include "loader.h"
+#include "manifest.h"
+#include "pool.h"
+#include "sha256.h"
+#include "stats.h"
+#include "stream.h"
+#include "util.h"
+
+/* Size of the zero buffer create --manifest hashes zero segments with. */
+#define DIGEST_ZERO_BUF	(4*1024)
+
+/* Writes the manifest of an image and of the parts extracted from it. */
+int
+extract_manifest(const char *path, const char *image, const uint8_t *digest,
+                 const extract_stream_t *es)
+{
+	const uint8_t *digests[INDEX_PARTS + 1];
+	const char *names[INDEX_PARTS + 1];
+	size_t i;
+
+	names[0] = image;
+	digests[0] = digest;
+	for (i = 0; i < es->nparts; i++) {
+		names[i + 1] = es->parts[i].name->filename;
+		digests[i + 1] = es->parts[i].digest;
+	}
+
+	return sha256_manifest(path, names, digests, es->nparts + 1, 0);
+}
+
+
+/* Part sink of the splitter, so bad layouts are passed on whole. */
+static int
+create_digest_part(void *ctx, int part, uint64_t off, const char *buf,
+                   size_t len)
+{
+	(void)ctx;
+	(void)part;
+	(void)off;
+	(void)buf;
+	(void)len;
+
+	return 0;
+}
+
+/* Passes the payload to sink until it returns non zero, which is kept. */
+static int
+create_digest_feed(const create_digest_t *d, zlib_sink_t sink, void *ctx)
+{
+	static const char zeros[DIGEST_ZERO_BUF];
+	size_t i, off, n;
+	int rv;
+
+	for (i = 0; i < d->nsegs; i++) {
+		for (off = 0; off < d->segs[i].len; off += n) {
+			n = d->segs[i].len - off;
+			if (NULL == d->segs[i].data && n > sizeof(zeros))
+				n = sizeof(zeros);
+			rv = sink(ctx, NULL == d->segs[i].data ? zeros :
+			          d->segs[i].data + off, n);
+			if (0 != rv)
+				return rv;
+		}
+	}
+
+	return 0;
+}
+
+static void
+create_digest_run(void *arg)
+{
+	create_digest_t *d = arg;
+	stream_probe_t p;
+
+	/* Detect the layout from the contents, as extract will. */
+	memset(&p, 0, sizeof(stream_probe_t));
+	p.total = d->es.total;
+	create_digest_feed(d, stream_probe_sink, &p);
+	d->es.type = stream_probe_type(&d->hdr, &p);
+
+	d->rv = 0 != create_digest_feed(d, extract_stream_sink, &d->es) &&
+	        !d->es.done;
+}
+
+void
+create_digest_start(create_digest_t *d, const image_create_args_t *cargs,
+                    const segment_t *segs, size_t nsegs)
+{
+	memset(d, 0, sizeof(create_digest_t));
+	boost_setup_header(&d->hdr, 0, 0, cargs);
+	d->segs = segs;
+	d->nsegs = nsegs;
+	d->rv = 1;
+	d->es.pending = BOOST_ALL_PARTS;
+	d->es.total = segs_len(segs, nsegs);
+	d->es.cap_off = 0;
+	d->es.cap_len = sizeof(uint32_t);
+	d->es.sink = create_digest_part;
+	d->es.digest = 1;
+	d->pool = pool_create(1);
+	if (NULL == d->pool || 0 != pool_submit(d->pool, create_digest_run, d))
+		create_digest_run(d);
+}
+
+void
+create_digest_wait(create_digest_t *d)
+{
+	if (NULL != d->pool) {
+		pool_wait(d->pool);
+		pool_destroy(d->pool);
+		d->pool = NULL;
+	}
+}
+
+/*
+ * Writes the manifest once the component digests are in. The image
+ * digest is taken from the len bytes at image, or from outfile read
+ * back when image is NULL.
+ */
+int
+create_digest_finish(create_digest_t *d, const char *manifest,
+                     const char *outfile, const char *image, size_t len)
+{
+	uint8_t digest[SHA256_LEN];
+	struct stat st;
+	loaded_t file;
+	sha256_t sha;
+	uint64_t start;
+	int fd, rv;
+
+	create_digest_wait(d);
+	if (0 != d->rv) {
+		fprintf(stderr, "Failed to hash image components!\n");
+		return 1;
+	}
+	memset(&file, 0, sizeof(loaded_t));
+	if (NULL == image) {
+		fd = open(outfile, O_RDONLY);
+		if (-1 == fd || 0 != fstat(fd, &st) ||
+		    0 != loader_load(fd, st.st_size, &file)) {
+			fprintf(stderr, "Failed to load %s for hashing\n",
+			        outfile);
+			if (-1 != fd)
+				close(fd);
+			return 1;
+		}
+		close(fd);
+		image = file.addr;
+		len = st.st_size;
+	}
+
+	start = stats_begin();
+	sha256_init(&sha);
+	sha256_update(&sha, image, len);
+	sha256_final(&sha, digest);
+	stats_end(STATS_HASH, start, len, 0);
+
+	rv = extract_manifest(manifest, outfile, digest, &d->es);
+	loader_unload(&file);
+
+	return rv;
+}
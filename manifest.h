@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boost.h"
+#include "pool.h"
+#include "stream.h"
+#include "util.h"
+
+/*
+ * Component digests of create --manifest. The payload segments are run
+ * through the extract splitter on a worker thread while the image is
+ * compressed, so the digests are those of the files extract yields.
+ */
+typedef struct create_digest
+{
+	extract_stream_t es;
+	boost_hdr_t	hdr;		/* settings the layout depends on */
+	const segment_t	*segs;
+	size_t		nsegs;
+	pool_t		*pool;
+	int		rv;
+} create_digest_t;
+
+int  extract_manifest(const char *, const char *, const uint8_t *,
+                      const extract_stream_t *);
+void create_digest_start(create_digest_t *, const image_create_args_t *,
+                         const segment_t *, size_t);
+void create_digest_wait(create_digest_t *);
+int  create_digest_finish(create_digest_t *, const char *, const char *,
+                          const char *, size_t);
+
+#endif /* _MANIFEST_H_ */
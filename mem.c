@@ -0,0 +1,251 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mem.h"
+#include "stats.h"
+
+/* Size header in front of every buffer, keeps them 16 byte aligned. */
+#define MEM_HDR		16
+
+static size_t budget;		/* 0 = unlimited */
+static size_t current;
+static size_t peak;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parses sizes like 4096, 512k, 64M or 1G. */
+int
+mem_parse_size(const char *str, size_t *size)
+{
+	unsigned long long val;
+	char *end;
+
+	val = strtoull(str, &end, 0);
+	if (end == str)
+		return 1;
+
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		val <<= 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end || 0 == val)
+		return 1;
+
+	*size = val;
+	return 0;
+}
+
+void
+mem_set_budget(size_t size)
+{
+	budget = size;
+}
+
+size_t
+mem_budget(void)
+{
+	return budget;
+}
+
+/* Tells whether size more bytes could be charged right now. */
+int
+mem_fits(size_t size)
+{
+	int rv;
+
+	pthread_mutex_lock(&mem_lock);
+	rv = 0 == budget || (current <= budget && size <= budget - current);
+	pthread_mutex_unlock(&mem_lock);
+
+	return rv;
+}
+
+/* Bytes left in the budget, SIZE_MAX when there is none. */
+size_t
+mem_available(void)
+{
+	size_t rv;
+
+	pthread_mutex_lock(&mem_lock);
+	if (0 == budget)
+		rv = SIZE_MAX;
+	else
+		rv = current < budget ? budget - current : 0;
+	pthread_mutex_unlock(&mem_lock);
+
+	return rv;
+}
+
+/* Charges size bytes, returns 1 without charging if over budget. */
+int
+mem_charge(size_t size)
+{
+	int rv = 1;
+
+	pthread_mutex_lock(&mem_lock);
+	if (0 == budget || (current <= budget && size <= budget - current)) {
+		current += size;
+		if (current > peak)
+			peak = current;
+		rv = 0;
+	}
+	pthread_mutex_unlock(&mem_lock);
+
+	return rv;
+}
+
+void
+mem_uncharge(size_t size)
+{
+	pthread_mutex_lock(&mem_lock);
+	current -= size;
+	pthread_mutex_unlock(&mem_lock);
+}
+
+size_t
+mem_peak(void)
+{
+	size_t rv;
+
+	pthread_mutex_lock(&mem_lock);
+	rv = peak;
+	pthread_mutex_unlock(&mem_lock);
+
+	return rv;
+}
+
+/*
+ * malloc() charged against the budget. The size is kept in front of
+ * the buffer, so it has to be released with mem_free().
+ */
+void *
+mem_alloc(size_t size)
+{
+	char *p;
+
+	if (0 != mem_charge(size + MEM_HDR)) {
+		fprintf(stderr, "Allocation of %zu bytes exceeds the memory "
+		        "budget!\n", size);
+		return NULL;
+	}
+
+	p = malloc(size + MEM_HDR);
+	if (NULL == p) {
+		mem_uncharge(size + MEM_HDR);
+		return NULL;
+	}
+	stats_alloc(size);
+	*(size_t *)p = size + MEM_HDR;
+
+	return p + MEM_HDR;
+}
+
+/* realloc() of a mem_alloc() buffer, growth is charged as well. */
+void *
+mem_realloc(void *ptr, size_t size)
+{
+	size_t old_size, new_size = size + MEM_HDR;
+	char *p, *tmp;
+
+	if (NULL == ptr)
+		return mem_alloc(size);
+
+	p = (char *)ptr - MEM_HDR;
+	old_size = *(size_t *)p;
+	if (new_size > old_size && 0 != mem_charge(new_size - old_size)) {
+		fprintf(stderr, "Allocation of %zu bytes exceeds the memory "
+		        "budget!\n", size);
+		return NULL;
+	}
+
+	tmp = realloc(p, new_size);
+	if (NULL == tmp) {
+		if (new_size > old_size)
+			mem_uncharge(new_size - old_size);
+		return NULL;
+	}
+	if (new_size < old_size)
+		mem_uncharge(old_size - new_size);
+	else
+		stats_alloc(new_size - old_size);
+	*(size_t *)tmp = new_size;
+
+	return tmp + MEM_HDR;
+}
+
+void
+mem_free(void *ptr)
+{
+	char *p;
+
+	if (NULL == ptr)
+		return;
+
+	p = (char *)ptr - MEM_HDR;
+	mem_uncharge(*(size_t *)p);
+	free(p);
+}
+
+/* zlib allocator hooks, see z_stream.zalloc and z_stream.zfree. */
+void *
+mem_zalloc(void *opaque, unsigned items, unsigned size)
+{
+	(void)opaque;
+	return mem_alloc((size_t)items * size);
+}
+
+void
+mem_zfree(void *opaque, void *ptr)
+{
+	(void)opaque;
+	mem_free(ptr);
+}
+
+/* Prints the peak against the budget, if one was set. */
+void
+mem_report(void)
+{
+	if (0 == budget)
+		return;
+
+	fprintf(stderr, "Peak buffer memory: %zu kB of %zu kB budget\n",
+	        (mem_peak() + 1023) / 1024, budget / 1024);
+}
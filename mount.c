@@ -0,0 +1,526 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef HAVE_FUSE
+#define FUSE_USE_VERSION	31
+#include <fuse.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "boost.h"
+#include "index.h"
+#include "mem.h"
+#include "mount.h"
+#include "util.h"
+#include "config.h"
+
+/* Index of a compressed image, from its sidecar or its chunk table. */
+static int
+view_index(image_view_t *v, const char *image, size_t len,
+           const char *filename)
+{
+	char idx_name[PATH_MAX];
+	zlib_chunks_t chunks;
+	size_t i, end;
+
+	if (0 == index_path(filename, idx_name, sizeof(idx_name)) &&
+	    0 == access(idx_name, F_OK) && 0 == index_load(idx_name, &v->idx)) {
+		if (v->idx.image_checksum == v->hdr.image_checksum &&
+		    v->idx.image_size == v->hdr.image_size) {
+			printf("Index\t\t: %s, %zu checkpoints\n", idx_name,
+			       v->idx.npoints);
+			return 0;
+		}
+		fprintf(stderr, "Ignoring stale index %s\n", idx_name);
+		index_free(&v->idx);
+	}
+
+	/* Chunks inflate on their own, each start makes a checkpoint. */
+	if (0 == boost_find_chunks(v->hdr, image, len, &chunks) &&
+	    chunks.nchunks == zlib_chunks_count(v->total, chunks.chunk_size)) {
+		memset(&v->idx, 0, sizeof(image_index_t));
+		v->idx.points = mem_alloc(chunks.nchunks *
+		                          sizeof(index_point_t));
+		if (NULL == v->idx.points)
+			return 1;
+		memset(v->idx.points, 0, chunks.nchunks *
+		       sizeof(index_point_t));
+		for (i = 0; i < chunks.nchunks; i++) {
+			end = i + 1 < chunks.nchunks ? chunks.offsets[i + 1] :
+			      v->stream_len;
+			if (chunks.offsets[i] > end) {
+				fprintf(stderr, "Chunk table does not match "
+				        "the stream!\n");
+				index_free(&v->idx);
+				return 1;
+			}
+			v->idx.points[i].out = (uint64_t)i * chunks.chunk_size;
+			v->idx.points[i].in = chunks.offsets[i];
+		}
+		v->idx.npoints = v->idx.alloc = chunks.nchunks;
+		v->idx.total = v->total;
+		v->idx.span = chunks.chunk_size;
+		printf("Chunk table\t: %zu chunks\n", chunks.nchunks);
+		return 0;
+	}
+
+	/* One pass over the stream now, reads stay local afterwards. */
+	if (0 != index_build(v->stream, v->stream_len, DEFAULT_INDEX_SPAN,
+	                     &v->idx))
+		return 1;
+	printf("Index\t\t: built in memory, %zu checkpoints (run index to "
+	       "keep it)\n", v->idx.npoints);
+
+	return 0;
+}
+
+/* Drops the least recently used block, returns 0 when none is cached. */
+static int
+view_evict(image_view_t *v)
+{
+	view_block_t *lru = NULL;
+	size_t i;
+
+	for (i = 0; i < v->idx.npoints; i++) {
+		if (NULL != v->blocks[i].data &&
+		    (NULL == lru || v->blocks[i].used < lru->used))
+			lru = &v->blocks[i];
+	}
+	if (NULL == lru)
+		return 0;
+
+	mem_free(lru->data);
+	lru->data = NULL;
+	v->cached -= lru->len;
+
+	return 1;
+}
+
+/* Block holding payload offset off, inflated when not cached. */
+static view_block_t *
+view_block(image_view_t *v, uint64_t off, uint64_t *start)
+{
+	const index_point_t *p = v->idx.points;
+	view_block_t *b;
+	size_t lo = 0, hi = v->idx.npoints, mid;
+	uint64_t end;
+
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (p[mid].out <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	b = &v->blocks[lo];
+	*start = p[lo].out;
+	b->used = ++v->clock;
+	if (NULL != b->data)
+		return b;
+
+	end = lo + 1 < v->idx.npoints ? p[lo + 1].out : v->total;
+	b->len = end - p[lo].out;
+	while (v->cached > 0 && (v->cached + b->len > MOUNT_CACHE_SIZE ||
+	       !mem_fits(b->len)) && view_evict(v))
+		;
+	b->data = mem_alloc(b->len);
+	if (NULL == b->data)
+		return NULL;
+	if (0 != index_read(&v->idx, v->stream, v->stream_len, p[lo].out,
+	                    b->data, b->len)) {
+		mem_free(b->data);
+		b->data = NULL;
+		return NULL;
+	}
+	v->cached += b->len;
+
+	return b;
+}
+
+/* Copies n payload bytes at off to buf. */
+static int
+view_pread(image_view_t *v, uint64_t off, char *buf, size_t n)
+{
+	view_block_t *b;
+	uint64_t start;
+	size_t take;
+	int rv = 0;
+
+	if (NULL == v->stream) {
+		memcpy(buf, v->data + off, n);
+		return 0;
+	}
+
+	pthread_mutex_lock(&v->lock);
+	while (n > 0) {
+		b = view_block(v, off, &start);
+		if (NULL == b) {
+			rv = 1;
+			break;
+		}
+		take = start + b->len - off;
+		if (take > n)
+			take = n;
+		memcpy(buf, b->data + (off - start), take);
+		buf += take;
+		off += take;
+		n -= take;
+	}
+	pthread_mutex_unlock(&v->lock);
+
+	return rv;
+}
+
+static int
+view_payload_read(void *ctx, uint64_t off, void *buf, size_t n)
+{
+	return view_pread(ctx, off, buf, n);
+}
+
+/* Components as extract would name them. */
+static void
+view_layout(image_view_t *v, image_layout_t *layout)
+{
+	if (0 != boost_layout_read(&v->hdr, v->total, view_payload_read, v,
+	                           layout)) {
+		/* Still readable, as a whole. */
+		memset(layout, 0, sizeof(image_layout_t));
+		layout->parts[INDEX_KERNEL].len = v->total;
+	}
+}
+
+/* Writes a header string field as a JSON string. */
+static void
+json_string(FILE *f, const char *s, size_t size)
+{
+	size_t i, n = strnlen(s, size);
+
+	fputc('"', f);
+	for (i = 0; i < n; i++) {
+		if ('"' == s[i] || '\\' == s[i])
+			fprintf(f, "\\%c", s[i]);
+		else if ((unsigned char)s[i] < 0x20 ||
+		         (unsigned char)s[i] >= 0x7f)
+			fprintf(f, "\\u%04x", (unsigned char)s[i]);
+		else
+			fputc(s[i], f);
+	}
+	fputc('"', f);
+}
+
+/* The header and the layout as header.json. */
+static int
+view_json(image_view_t *v, uint32_t layout)
+{
+	static const char *layouts[] = { "unknown", "new", "legacy" };
+	const boost_hdr_t *h = &v->hdr;
+	const view_file_t *file;
+	FILE *f;
+	size_t i;
+
+	f = open_memstream(&v->json, &v->json_len);
+	if (NULL == f) {
+		perror("Failed to build header.json");
+		return 1;
+	}
+	fprintf(f, "{\n  \"image_id\": %u,\n  \"platform\": ", h->image_id);
+	json_string(f, (const char *)&h->platform_id, sizeof(uint32_t));
+	fprintf(f, ",\n  \"description\": ");
+	json_string(f, h->image_description, sizeof(h->image_description));
+	fprintf(f, ",\n  \"version\": ");
+	json_string(f, h->image_version, sizeof(h->image_version));
+	fprintf(f, ",\n  \"target_filename\": ");
+	json_string(f, h->target_filename, sizeof(h->target_filename));
+	fprintf(f, ",\n  \"load_offset\": %u,\n  \"flags\": %u,\n"
+	        "  \"compressed\": %s,\n  \"image_size\": %u,\n"
+	        "  \"image_checksum\": %u,\n  \"header_checksum\": %u,\n"
+	        "  \"payload_size\": %llu,\n  \"layout\": \"%s\",\n"
+	        "  \"components\": [", h->load_offset, h->flags,
+	        NULL != v->stream ? "true" : "false", h->image_size,
+	        h->image_checksum, h->checksum,
+	        (unsigned long long)v->total, layouts[layout]);
+	for (i = 1; i < v->nfiles; i++) {
+		file = &v->files[i];
+		fprintf(f, "%s\n    { \"name\": \"%s\", \"offset\": %llu, "
+		        "\"size\": %llu }", i > 1 ? "," : "", file->name,
+		        (unsigned long long)file->off,
+		        (unsigned long long)file->len);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	if (0 != fclose(f)) {
+		perror("Failed to build header.json");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens the view of the image file of len bytes at image, filename
+ * locates its sidecar index. Compressed images without an index or a
+ * chunk table get an index built in memory, one pass over the stream.
+ */
+int
+view_open(image_view_t *v, const char *image, size_t len,
+          const char *filename)
+{
+	image_layout_t layout;
+	size_t i;
+
+	memset(v, 0, sizeof(image_view_t));
+	pthread_mutex_init(&v->lock, NULL);
+	if (len < sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		return 1;
+	}
+	memcpy(&v->hdr, image, sizeof(boost_hdr_t));
+	v->data = image + sizeof(boost_hdr_t);
+	if (v->hdr.image_size > len - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image data exceeds the file!\n");
+		return 1;
+	}
+
+	if (v->hdr.flags & BOOST_FLAG_ZLIB) {
+		if (v->hdr.image_size < sizeof(uint32_t) + ZLIB_HDR_LEN) {
+			printf("Image too small to hold zlib data!\n");
+			return 1;
+		}
+		v->total = swap_bytes_be(((const uint32_t *)v->data)[0]);
+		v->stream = v->data + sizeof(uint32_t);
+		v->stream_len = v->hdr.image_size - sizeof(uint32_t);
+		if (0 != view_index(v, image, len, filename))
+			return 1;
+		if (v->idx.total != v->total || 0 == v->idx.npoints) {
+			fprintf(stderr, "Unpacked size mismatch!\n");
+			return 1;
+		}
+		v->blocks = mem_alloc(v->idx.npoints * sizeof(view_block_t));
+		if (NULL == v->blocks)
+			return 1;
+		memset(v->blocks, 0, v->idx.npoints * sizeof(view_block_t));
+	} else {
+		v->total = v->hdr.image_size;
+	}
+
+	view_layout(v, &layout);
+	v->files[v->nfiles++].name = "header.json";
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (NULL == boost_part_filename(layout.type, i))
+			continue;
+		v->files[v->nfiles].name = boost_part_filename(layout.type, i);
+		v->files[v->nfiles].off = layout.parts[i].off;
+		v->files[v->nfiles].len = layout.parts[i].len;
+		v->nfiles++;
+	}
+	if (0 != view_json(v, layout.type))
+		return 1;
+	v->files[0].text = v->json;
+	v->files[0].len = v->json_len;
+
+	return 0;
+}
+
+/* Number of the file called name, -1 when there is none. */
+int
+view_lookup(const image_view_t *v, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < v->nfiles; i++) {
+		if (0 == strcmp(v->files[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Reads up to size bytes at off of file i, returns their number. */
+ssize_t
+view_read(image_view_t *v, size_t i, char *buf, size_t size, uint64_t off)
+{
+	const view_file_t *file = &v->files[i];
+
+	if (off >= file->len)
+		return 0;
+	if (size > file->len - off)
+		size = file->len - off;
+	if (NULL != file->text) {
+		memcpy(buf, file->text + off, size);
+		return size;
+	}
+	if (0 != view_pread(v, file->off + off, buf, size))
+		return -1;
+
+	return size;
+}
+
+void
+view_close(image_view_t *v)
+{
+	size_t i;
+
+	for (i = 0; NULL != v->blocks && i < v->idx.npoints; i++)
+		mem_free(v->blocks[i].data);
+	mem_free(v->blocks);
+	index_free(&v->idx);
+	free(v->json);
+	pthread_mutex_destroy(&v->lock);
+	memset(v, 0, sizeof(image_view_t));
+}
+
+#ifdef HAVE_FUSE
+static image_view_t *
+mount_view(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static int
+mount_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	image_view_t *v = mount_view();
+	int i;
+
+	(void)fi;
+	memset(st, 0, sizeof(struct stat));
+	if (0 == strcmp(path, "/")) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		return 0;
+	}
+	i = view_lookup(v, path + 1);
+	if (-1 == i)
+		return -ENOENT;
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = v->files[i].len;
+
+	return 0;
+}
+
+static int
+mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t off, struct fuse_file_info *fi,
+              enum fuse_readdir_flags flags)
+{
+	image_view_t *v = mount_view();
+	size_t i;
+
+	(void)off;
+	(void)fi;
+	(void)flags;
+	if (0 != strcmp(path, "/"))
+		return -ENOENT;
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	for (i = 0; i < v->nfiles; i++)
+		filler(buf, v->files[i].name, NULL, 0, 0);
+
+	return 0;
+}
+
+static int
+mount_open(const char *path, struct fuse_file_info *fi)
+{
+	int i = view_lookup(mount_view(), path + 1);
+
+	if (-1 == i)
+		return -ENOENT;
+	if (O_RDONLY != (fi->flags & O_ACCMODE))
+		return -EROFS;
+	fi->fh = i;
+	/* Contents never change, the page cache may keep them. */
+	fi->keep_cache = 1;
+
+	return 0;
+}
+
+static int
+mount_read(const char *path, char *buf, size_t size, off_t off,
+           struct fuse_file_info *fi)
+{
+	ssize_t n;
+
+	(void)path;
+	n = view_read(mount_view(), fi->fh, buf, size, off);
+
+	return n < 0 ? -EIO : n;
+}
+
+static const struct fuse_operations mount_ops = {
+	.getattr	= mount_getattr,
+	.readdir	= mount_readdir,
+	.open		= mount_open,
+	.read		= mount_read,
+};
+#endif
+
+/*
+ * Mounts the image file of len bytes at image on dir, read-only, until
+ * it is unmounted. Runs in the foreground when asked to. The checksums
+ * are checked first, reads later only inflate what they touch.
+ */
+int
+mount_image(const char *image, size_t len, const char *filename,
+            const char *dir, int foreground)
+{
+#ifdef HAVE_FUSE
+	char *argv[] = { "boost-img", (char *)dir, "-o",
+	                 "ro,fsname=boost-img,subtype=boost-img", "-f", NULL };
+	image_view_t v;
+	int rv;
+
+	if (0 != view_open(&v, image, len, filename) ||
+	    0 != boost_check(v.hdr, v.data)) {
+		view_close(&v);
+		return 1;
+	}
+	rv = fuse_main(foreground ? 5 : 4, argv, &mount_ops, &v);
+	view_close(&v);
+
+	return 0 != rv;
+#else
+	(void)image;
+	(void)len;
+	(void)filename;
+	(void)dir;
+	(void)foreground;
+	fprintf(stderr, "Built without FUSE support, rebuild with "
+	        "'make WITH_FUSE=1'\n");
+
+	return 1;
+#endif
+}
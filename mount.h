@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _MOUNT_H_
+#define _MOUNT_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "boost.h"
+#include "index.h"
+
+/* File of a mounted image, a payload range or generated text. */
+typedef struct view_file
+{
+	const char	*name;
+	uint64_t	off;		/* payload offset */
+	uint64_t	len;
+	const char	*text;		/* file contents, NULL = payload */
+} view_file_t;
+
+/* Inflated payload from one index point up to the next. */
+typedef struct view_block
+{
+	char		*data;		/* NULL when not cached */
+	size_t		len;
+	uint64_t	used;		/* LRU stamp */
+} view_block_t;
+
+/*
+ * Read-only view of an image, its components are inflated on demand.
+ * Compressed payloads are read through an index, blocks between its
+ * points are cached up to MOUNT_CACHE_SIZE bytes.
+ */
+typedef struct image_view
+{
+	boost_hdr_t	hdr;
+	const char	*data;		/* data section */
+	const char	*stream;	/* zlib stream, NULL for raw images */
+	size_t		stream_len;
+	uint64_t	total;		/* payload bytes */
+	image_index_t	idx;
+	view_block_t	*blocks;	/* one per index point */
+	size_t		cached;		/* bytes held by blocks */
+	uint64_t	clock;
+	pthread_mutex_t	lock;
+	view_file_t	files[INDEX_PARTS + 1];
+	size_t		nfiles;
+	char		*json;
+	size_t		json_len;
+} image_view_t;
+
+int     view_open(image_view_t *, const char *, size_t, const char *);
+ssize_t view_read(image_view_t *, size_t, char *, size_t, uint64_t);
+int     view_lookup(const image_view_t *, const char *);
+void    view_close(image_view_t *);
+int     mount_image(const char *, size_t, const char *, const char *, int);
+
+#endif /* _MOUNT_H_ */
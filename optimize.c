@@ -0,0 +1,338 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include "optimize.h"
+#include "mem.h"
+#include "pool.h"
+#include "util.h"
+
+#define OPT_PENDING	0
+#define OPT_DONE	1
+#define OPT_SKIPPED	2
+#define OPT_FAILED	3
+#define OPT_REJECTED	4
+
+/* Size of the buffer used to compare inflated output with the input. */
+#define VERIFY_CHUNK	(64*1024)
+
+struct opt_search;
+
+typedef struct opt_candidate
+{
+	struct opt_search	*search;
+	zlib_params_t		params;
+	void			*out;
+	size_t			out_len;
+	double			time_ms;
+	int			status;
+} opt_candidate_t;
+
+typedef struct opt_search
+{
+	const segment_t		*segs;
+	size_t			nsegs;
+	uint64_t		deadline;
+	pthread_mutex_t		lock;
+	opt_candidate_t		*best;
+} opt_search_t;
+
+static const int opt_levels[] = { 9, 8, 7, 6, 5, 4 };
+static const int opt_mem_levels[] = { 9, 8 };
+static const int opt_window_bits[] = { 15, 14 };
+
+#define ARRAY_LEN(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *
+strategy_name(int strategy)
+{
+	switch (strategy) {
+	case Z_FILTERED:
+		return "filtered";
+	case Z_RLE:
+		return "rle";
+	default:
+		return "default";
+	}
+}
+
+/* Compares n inflated bytes with the input at segment *seg, *seg_off. */
+static int
+opt_compare(const segment_t *segs, size_t nsegs, size_t *seg,
+            size_t *seg_off, const unsigned char *buf, size_t n)
+{
+	size_t chunk;
+
+	for (; n > 0; buf += chunk, n -= chunk) {
+		if (*seg == nsegs)
+			return 1;
+		chunk = segs[*seg].len - *seg_off;
+		chunk = chunk < n ? chunk : n;
+		if (NULL == segs[*seg].data ? !buf_is_zero(buf, chunk) :
+		    0 != memcmp(buf, segs[*seg].data + *seg_off, chunk))
+			return 1;
+		*seg_off += chunk;
+		if (*seg_off == segs[*seg].len) {
+			(*seg)++;
+			*seg_off = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Inflates the candidate stream exactly like the bootloader does (plain
+ * inflateInit(), 32kB window) and compares the result with the input.
+ */
+static int
+opt_verify(const void *zdata, size_t zlen, const segment_t *segs,
+           size_t nsegs)
+{
+	unsigned char buf[VERIFY_CHUNK];
+	size_t seg = 0, seg_off = 0, n;
+	int ret = Z_OK;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(z_stream));
+	if (Z_OK != inflateInit(&zs))
+		return 1;
+	zs.next_in = (Bytef *)zdata;
+	zs.avail_in = zlen;
+
+	while (Z_OK == ret) {
+		zs.next_out = buf;
+		zs.avail_out = sizeof(buf);
+		ret = inflate(&zs, Z_NO_FLUSH);
+		n = sizeof(buf) - zs.avail_out;
+		if (0 != opt_compare(segs, nsegs, &seg, &seg_off, buf, n)) {
+			ret = Z_DATA_ERROR;
+			break;
+		}
+	}
+	inflateEnd(&zs);
+
+	/* Empty segments may trail the input. */
+	while (seg < nsegs && 0 == segs[seg].len)
+		seg++;
+
+	return (Z_STREAM_END == ret && seg == nsegs) ? 0 : 1;
+}
+
+/* Smaller stream wins, ties go to the candidate listed first. */
+static int
+opt_better(const opt_candidate_t *a, const opt_candidate_t *b)
+{
+	if (NULL == b)
+		return 1;
+	if (a->out_len != b->out_len)
+		return a->out_len < b->out_len;
+	return a < b;
+}
+
+static void
+opt_run(void *arg)
+{
+	opt_candidate_t *c = arg;
+	opt_search_t *s = c->search;
+	uint64_t start = monotonic_ns();
+	void *loser = NULL;
+
+	if (start >= s->deadline) {
+		c->status = OPT_SKIPPED;
+		return;
+	}
+
+	c->out = zlib_compress_segs(s->segs, s->nsegs, &c->params,
+	                            &c->out_len, NULL);
+	if (NULL == c->out) {
+		c->status = OPT_FAILED;
+		return;
+	}
+	if (0 != opt_verify(c->out, c->out_len, s->segs, s->nsegs)) {
+		c->status = OPT_REJECTED;
+		mem_free(c->out);
+		c->out = NULL;
+		return;
+	}
+	c->time_ms = (monotonic_ns() - start) / 1e6;
+	c->status = OPT_DONE;
+
+	pthread_mutex_lock(&s->lock);
+	if (opt_better(c, s->best)) {
+		if (s->best)
+			loser = s->best->out;
+		s->best = c;
+	} else {
+		loser = c->out;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	mem_free(loser);
+}
+
+/*
+ * The default parameters come first, the search starts from what plain
+ * -z produces and only takes something strictly smaller.
+ */
+static int
+opt_fill_candidates(opt_candidate_t *cands, opt_search_t *search)
+{
+	size_t w, l, m, st;
+	int n = 0;
+
+	zlib_default_params(&cands[n].params);
+	cands[n].search = search;
+	n++;
+
+	for (w = 0; w < ARRAY_LEN(opt_window_bits); w++) {
+		for (l = 0; l < ARRAY_LEN(opt_levels); l++) {
+			for (m = 0; m < ARRAY_LEN(opt_mem_levels); m++) {
+				for (st = 0; st < 2; st++) {
+					/* Same as the defaults. */
+					if (6 == opt_levels[l] && 0 == st &&
+					    8 == opt_mem_levels[m] &&
+					    MAX_WBITS == opt_window_bits[w])
+						continue;
+					cands[n].params.level = opt_levels[l];
+					cands[n].params.strategy =
+					    st ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+					cands[n].params.mem_level =
+					    opt_mem_levels[m];
+					cands[n].params.window_bits =
+					    opt_window_bits[w];
+					cands[n].search = search;
+					n++;
+				}
+			}
+		}
+	}
+
+	/* Run length encoding ignores level, only block size matters. */
+	for (m = 0; m < ARRAY_LEN(opt_mem_levels); m++) {
+		cands[n].params.level = Z_BEST_COMPRESSION;
+		cands[n].params.strategy = Z_RLE;
+		cands[n].params.mem_level = opt_mem_levels[m];
+		cands[n].params.window_bits = MAX_WBITS;
+		cands[n].search = search;
+		n++;
+	}
+
+	return n;
+}
+
+static void
+opt_report(const opt_candidate_t *cands, int n, const opt_candidate_t *best,
+           unsigned budget)
+{
+	static const char *status_str[] = {
+		"pending", "ok", "skipped", "failed", "rejected"
+	};
+	int i;
+
+	printf("Compression parameter search (%d candidates, budget %us):\n",
+	       n, budget);
+	printf("  Level Strategy MemLevel WBits       Size  Time [ms]  Status\n");
+	for (i = 0; i < n; i++) {
+		printf("  %5d %-8s %8d %5d ", cands[i].params.level,
+		       strategy_name(cands[i].params.strategy),
+		       cands[i].params.mem_level, cands[i].params.window_bits);
+		if (OPT_DONE == cands[i].status) {
+			printf("%10zu %10.1f  %s\n", cands[i].out_len,
+			       cands[i].time_ms,
+			       &cands[i] == best ? "best" : "ok");
+		} else {
+			printf("%10s %10s  %s\n", "-", "-",
+			       status_str[cands[i].status]);
+		}
+	}
+}
+
+/*
+ * Compresses segs with a range of deflate parameter combinations on a
+ * thread pool and returns the smallest stream accepted by a stock
+ * inflate. Zero runs are compressed the way plain -z does it. The
+ * default parameters always run, before the pool starts, so the result
+ * is never larger than the default stream. No new candidate is started
+ * once 'budget' seconds passed.
+ */
+void *
+zlib_optimize(const segment_t *segs, size_t nsegs, unsigned budget,
+              zlib_params_t *best, size_t *out_len)
+{
+	opt_candidate_t cands[1 + ARRAY_LEN(opt_window_bits) *
+	                      ARRAY_LEN(opt_levels) *
+	                      ARRAY_LEN(opt_mem_levels) * 2 +
+	                      ARRAY_LEN(opt_mem_levels)];
+	opt_search_t search;
+	pool_t *pool = NULL;
+	void *rv = NULL;
+	int i, n;
+
+	memset(cands, 0, sizeof(cands));
+	memset(&search, 0, sizeof(opt_search_t));
+	search.segs = segs;
+	search.nsegs = nsegs;
+	search.deadline = monotonic_ns() + budget * 1000000000ULL;
+	pthread_mutex_init(&search.lock, NULL);
+
+	n = opt_fill_candidates(cands, &search);
+	opt_run(&cands[0]);
+
+	/* Without a pool the defaults are all there is. */
+	pool = pool_create(0);
+	for (i = 1; i < n; i++) {
+		if (NULL == pool || 0 != pool_submit(pool, opt_run, &cands[i]))
+			cands[i].status = OPT_FAILED;
+	}
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	opt_report(cands, n, search.best, budget);
+
+	if (NULL == search.best) {
+		fprintf(stderr, "No compression candidate finished!\n");
+		goto optimize_done;
+	}
+
+	*best = search.best->params;
+	*out_len = search.best->out_len;
+	rv = search.best->out;
+
+optimize_done:
+	pthread_mutex_destroy(&search.lock);
+	return rv;
+}
@@ -0,0 +1,459 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "arena.h"
+#include "delta.h"
+#include "layout.h"
+#include "mem.h"
+#include "patch.h"
+#include "sparse.h"
+#include "util.h"
+#include "config.h"
+
+/* An image file taken apart for delta, see boost_delta_side(). */
+typedef struct delta_side
+{
+	uint32_t	mode;		/* DELTA_* */
+	uint32_t	chunk_size;
+	const char	*payload;
+	size_t		payload_len;
+	size_t		prefix_len;	/* file bytes before the payload */
+	size_t		body_len;	/* file bytes the payload encodes to */
+	image_layout_t	layout;
+	arena_t		arena;
+} delta_side_t;
+
+/* Treats the whole image file as the payload. */
+static void
+boost_delta_raw(const char *file, size_t len, delta_side_t *s)
+{
+	arena_release(&s->arena);
+	memset(s, 0, sizeof(delta_side_t));
+	s->mode = DELTA_RAW;
+	s->payload = file;
+	s->payload_len = s->body_len = len;
+	s->layout.type = INDEX_LAYOUT_UNKNOWN;
+	s->layout.parts[INDEX_KERNEL].len = len;
+}
+
+/*
+ * Finds the payload of an image file. A data section holding a length
+ * prefixed zlib stream is inflated, whatever the header flags say, so
+ * that deltas see the components rather than compressed data. Files
+ * that are not images at all are used as they are.
+ */
+static int
+boost_delta_side(const char *file, size_t len, delta_side_t *s)
+{
+	const unsigned char *p = (const unsigned char *)file +
+	                         sizeof(boost_hdr_t);
+	zlib_chunks_t chunks;
+	boost_hdr_t hdr;
+	size_t total, out_len = 0;
+	char *payload;
+
+	memset(s, 0, sizeof(delta_side_t));
+	boost_delta_raw(file, len, s);
+	if (len < sizeof(boost_hdr_t))
+		return 0;
+	memcpy(&hdr, file, sizeof(boost_hdr_t));
+	if (hdr.image_size > len - sizeof(boost_hdr_t))
+		return 0;
+
+	s->mode = DELTA_STORED;
+	s->payload = (const char *)p;
+	s->payload_len = s->body_len = hdr.image_size;
+	s->prefix_len = sizeof(boost_hdr_t);
+
+	/* Deflate method, no preset dictionary, valid header check. */
+	total = hdr.image_size > 6 ? swap_bytes_be(((uint32_t *)p)[0]) : 0;
+	if (0 != total && total <= MAX_IMAGE_BUF_SIZE &&
+	    8 == (p[4] & 0x0f) && !(p[5] & 0x20) &&
+	    0 == ((p[4] << 8) | p[5]) % 31) {
+		arena_plan(&s->arena, total);
+		if (0 != arena_reserve(&s->arena))
+			return 1;
+		payload = arena_alloc(&s->arena, total);
+		if (0 == zlib_decompress_into((const char *)p + 4,
+		                              hdr.image_size - 4, payload,
+		                              total, &out_len, NULL) &&
+		    out_len == total) {
+			s->mode = DELTA_ZLIB;
+			if (0 == boost_find_chunks(hdr, file, len, &chunks)) {
+				s->mode = DELTA_CHUNKS;
+				s->chunk_size = chunks.chunk_size;
+			}
+			s->payload = payload;
+			s->payload_len = total;
+			s->prefix_len += sizeof(uint32_t);
+			s->body_len -= sizeof(uint32_t);
+		} else {
+			arena_release(&s->arena);
+		}
+	}
+
+	if (0 != boost_layout_read(&hdr, s->payload_len, payload_mem_read,
+	                           (void *)s->payload, &s->layout)) {
+		memset(&s->layout, 0, sizeof(image_layout_t));
+		s->layout.parts[INDEX_KERNEL].len = s->payload_len;
+	}
+
+	return 0;
+}
+
+/*
+ * Segments a payload the way create handed it to the compressor, which
+ * switches to run length matching for long zero runs. Those only come
+ * from the ramdisk of new images, which create scans for zero pages.
+ */
+static int
+boost_delta_segs(const image_layout_t *layout, const char *payload,
+                 size_t len, sparse_map_t *map)
+{
+	const index_part_t *r = &layout->parts[INDEX_RAMDISK];
+
+	memset(map, 0, sizeof(sparse_map_t));
+	if (INDEX_LAYOUT_NEW != layout->type || 0 == r->len)
+		return sparse_push(map, payload, len);
+	if (0 != sparse_push(map, payload, r->off) ||
+	    0 != sparse_scan(map, payload + r->off, r->len) ||
+	    0 != sparse_push(map, payload + r->off + r->len,
+	                     len - r->off - r->len)) {
+		sparse_free(map);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Encodes a payload the way a data section in the given mode holds it. */
+static int
+boost_delta_body(uint32_t mode, uint32_t chunk_size,
+                 const image_layout_t *layout, const char *payload,
+                 size_t len, char *out, size_t cap, size_t *out_len)
+{
+	zlib_params_t params;
+	sparse_map_t map;
+	uint32_t *offsets;
+	int rv = 1;
+
+	zlib_default_params(&params);
+	if (DELTA_ZLIB == mode || DELTA_CHUNKS == mode) {
+		if (0 != boost_delta_segs(layout, payload, len, &map))
+			return 1;
+		if (DELTA_ZLIB == mode) {
+			rv = zlib_compress_into(map.segs, map.nsegs, &params,
+			                        out, cap, out_len, NULL);
+		} else {
+			offsets = mem_alloc(zlib_chunks_count(len, chunk_size) *
+			                    sizeof(uint32_t));
+			if (NULL != offsets)
+				rv = zlib_compress_chunks(map.segs, map.nsegs,
+				                          &params, chunk_size,
+				                          out, cap, out_len,
+				                          NULL, offsets);
+			mem_free(offsets);
+		}
+		sparse_free(&map);
+		return rv;
+	}
+
+	if (len > cap)
+		return 1;
+	memcpy(out, payload, len);
+	*out_len = len;
+
+	return 0;
+}
+
+static size_t
+boost_delta_bound(uint32_t mode, uint32_t chunk_size, size_t len)
+{
+	if (DELTA_CHUNKS == mode)
+		return zlib_chunks_bound(len, chunk_size);
+
+	return zlib_compress_bound(len) > len ? zlib_compress_bound(len) : len;
+}
+
+/*
+ * Splits the new payload at its component boundaries, each component
+ * preferring matches from the same component of the old payload.
+ */
+static size_t
+boost_delta_regions(const delta_side_t *old, const delta_side_t *cur,
+                    delta_region_t *r)
+{
+	const index_part_t *part;
+	uint64_t pos = 0;
+	size_t n = 0, i;
+
+	for (i = 0; i < INDEX_PARTS; i++) {
+		part = &cur->layout.parts[i];
+		if (0 == part->len || part->off < pos)
+			continue;
+		if (part->off > pos) {
+			r[n].off = pos;
+			r[n].len = part->off - pos;
+			r[n].old_off = 0;
+			r[n++].old_len = old->payload_len;
+		}
+		r[n].off = part->off;
+		r[n].len = part->len;
+		if (old->layout.type == cur->layout.type &&
+		    0 != old->layout.parts[i].len) {
+			r[n].old_off = old->layout.parts[i].off;
+			r[n++].old_len = old->layout.parts[i].len;
+		} else {
+			r[n].old_off = 0;
+			r[n++].old_len = old->payload_len;
+		}
+		pos = part->off + part->len;
+	}
+	if (pos < cur->payload_len) {
+		r[n].off = pos;
+		r[n].len = cur->payload_len - pos;
+		r[n].old_off = 0;
+		r[n++].old_len = old->payload_len;
+	}
+
+	return n;
+}
+
+/* Seconds it takes to send len bytes over the slow field links. */
+static double
+boost_link_time(size_t len)
+{
+	return len * 10.0 / DELTA_LINK_BAUD;
+}
+
+/*
+ * Writes the delta turning the old image file into the new one. Both
+ * payloads are compared component by component. The new image is
+ * rebuilt by recompressing its payload, so the delta only works on
+ * the payload when that reproduces the image bit-exactly. Otherwise
+ * the raw image files are compared.
+ */
+int
+boost_delta(const char *old, size_t old_len, const char *cur,
+            size_t cur_len, const char *outfile)
+{
+	delta_region_t regions[2 * INDEX_PARTS + 1];
+	delta_side_t os, ns;
+	delta_image_t img;
+	delta_t d;
+	char *body = NULL;
+	size_t cap, body_len = 0, nregions, delta_len;
+	uint64_t start, elapsed;
+	int rv = 1;
+
+	memset(&d, 0, sizeof(delta_t));
+	memset(&os, 0, sizeof(delta_side_t));
+	memset(&ns, 0, sizeof(delta_side_t));
+	if (0 != boost_delta_side(old, old_len, &os) ||
+	    0 != boost_delta_side(cur, cur_len, &ns))
+		goto delta_failed;
+
+	if (DELTA_ZLIB == ns.mode || DELTA_CHUNKS == ns.mode) {
+		cap = boost_delta_bound(ns.mode, ns.chunk_size, ns.payload_len);
+		body = mem_alloc(cap);
+		if (NULL == body)
+			goto delta_failed;
+		if (0 != boost_delta_body(ns.mode, ns.chunk_size, &ns.layout,
+		                          ns.payload, ns.payload_len, body, cap,
+		                          &body_len) ||
+		    body_len != ns.body_len ||
+		    0 != memcmp(body, cur + ns.prefix_len, body_len)) {
+			printf("New image does not recompress bit-exactly, "
+			       "comparing raw files\n");
+			boost_delta_raw(old, old_len, &os);
+			boost_delta_raw(cur, cur_len, &ns);
+		}
+		mem_free(body);
+	}
+	if (DELTA_RAW == ns.mode && DELTA_RAW != os.mode)
+		boost_delta_raw(old, old_len, &os);
+
+	memset(&img, 0, sizeof(delta_image_t));
+	img.old_checksum = cksum(old, old_len);
+	img.old_size = old_len;
+	img.new_checksum = cksum(cur, cur_len);
+	img.new_size = cur_len;
+	img.mode = ns.mode;
+	img.chunk_size = ns.chunk_size;
+	if (DELTA_ZLIB == ns.mode)
+		strncpy(img.backend, zlib_backend_name(),
+		        sizeof(img.backend) - 1);
+	img.payload_len = ns.payload_len;
+	img.prefix = cur;
+	img.prefix_len = ns.prefix_len;
+	img.suffix = cur + ns.prefix_len + ns.body_len;
+	img.suffix_len = cur_len - ns.prefix_len - ns.body_len;
+
+	nregions = boost_delta_regions(&os, &ns, regions);
+	start = monotonic_ns();
+	if (0 != delta_encode(os.payload, os.payload_len, ns.payload,
+	                      ns.payload_len, regions, nregions, &d))
+		goto delta_failed;
+	elapsed = monotonic_ns() - start;
+	if (0 != delta_save(&img, &d, outfile)) {
+		fprintf(stderr, "Failed to write %s\n", outfile);
+		goto delta_failed;
+	}
+
+	delta_len = delta_size(&img, &d);
+	printf("Old image\t: %zu bytes\n", old_len);
+	printf("New image\t: %zu bytes\n", cur_len);
+	printf("Delta\t\t: %zu bytes, %.1f%% of the new image\n", delta_len,
+	       cur_len ? 100.0 * delta_len / cur_len : 0.0);
+	printf("Matching\t: %.1f MB in %.3f s, %.1f MB/s\n",
+	       ns.payload_len / 1e6, elapsed / 1e9,
+	       elapsed ? ns.payload_len * 1e3 / elapsed : 0.0);
+	printf("Transfer\t: %.1f s instead of %.1f s at %d baud\n",
+	       boost_link_time(delta_len), boost_link_time(cur_len),
+	       DELTA_LINK_BAUD);
+	rv = 0;
+
+delta_failed:
+	delta_free(&d);
+	arena_release(&os.arena);
+	arena_release(&ns.arena);
+
+	return rv;
+}
+
+/*
+ * Rebuilds the new image from the old one and a delta written by
+ * boost_delta(). The result is only written out when its checksum
+ * matches the one of the image the delta was made from.
+ */
+int
+boost_patch(const char *old, size_t old_len, const char *delta,
+            size_t delta_len, const char *outfile)
+{
+	image_layout_t layout;
+	delta_side_t os;
+	delta_image_t img;
+	boost_hdr_t hdr;
+	delta_t d;
+	char *payload = NULL, *image = NULL;
+	size_t cap, body_len = 0, len;
+	uint64_t start, elapsed;
+	int rv = 1;
+
+	memset(&os, 0, sizeof(delta_side_t));
+	if (0 != delta_parse(delta, delta_len, &img, &d))
+		return 1;
+	if (old_len != img.old_size || cksum(old, old_len) != img.old_checksum) {
+		fprintf(stderr, "Delta was not made for this image!\n");
+		return 1;
+	}
+	if (DELTA_ZLIB == img.mode &&
+	    0 != strcmp(img.backend, zlib_backend_name()) &&
+	    0 != zlib_set_backend(img.backend)) {
+		fprintf(stderr, "Delta needs the %s backend!\n", img.backend);
+		return 1;
+	}
+	if (DELTA_CHUNKS == img.mode && 0 == img.chunk_size) {
+		fprintf(stderr, "Malformed delta file!\n");
+		return 1;
+	}
+
+	if (DELTA_RAW == img.mode)
+		boost_delta_raw(old, old_len, &os);
+	else if (0 != boost_delta_side(old, old_len, &os))
+		return 1;
+
+	start = monotonic_ns();
+	cap = boost_delta_bound(img.mode, img.chunk_size, img.payload_len);
+	payload = mem_alloc(img.payload_len + 1);
+	image = mem_alloc(img.prefix_len + cap + img.suffix_len);
+	if (NULL == payload || NULL == image) {
+		fprintf(stderr, "Out of memory while patching!\n");
+		goto patch_failed;
+	}
+	if (0 != delta_decode(os.payload, os.payload_len, &d, payload,
+	                      img.payload_len)) {
+		fprintf(stderr, "Failed to apply delta!\n");
+		goto patch_failed;
+	}
+	/* The header of the new image comes with the prefix. */
+	memset(&layout, 0, sizeof(image_layout_t));
+	layout.parts[INDEX_KERNEL].len = img.payload_len;
+	if (DELTA_RAW != img.mode && img.prefix_len >= sizeof(boost_hdr_t)) {
+		memcpy(&hdr, img.prefix, sizeof(boost_hdr_t));
+		if (0 != boost_layout_read(&hdr, img.payload_len,
+		                           payload_mem_read, payload, &layout)) {
+			memset(&layout, 0, sizeof(image_layout_t));
+			layout.parts[INDEX_KERNEL].len = img.payload_len;
+		}
+	}
+	if (0 != boost_delta_body(img.mode, img.chunk_size, &layout, payload,
+	                          img.payload_len, image + img.prefix_len,
+	                          cap, &body_len)) {
+		fprintf(stderr, "Failed to apply delta!\n");
+		goto patch_failed;
+	}
+	memcpy(image, img.prefix, img.prefix_len);
+	memcpy(image + img.prefix_len + body_len, img.suffix, img.suffix_len);
+	len = img.prefix_len + body_len + img.suffix_len;
+	elapsed = monotonic_ns() - start;
+
+	if (len != img.new_size || cksum(image, len) != img.new_checksum) {
+		fprintf(stderr, "Patched image does not match, expected %u "
+		        "bytes with checksum %u\n", img.new_size,
+		        img.new_checksum);
+		goto patch_failed;
+	}
+	/* Only reports the CRCs, the file checksum vouches for them. */
+	if (DELTA_RAW != img.mode)
+		boost_check(*(boost_hdr_t *)image, image + sizeof(boost_hdr_t));
+	if (0 != write_to_file(image, len, outfile)) {
+		fprintf(stderr, "Failed to write %s\n", outfile);
+		goto patch_failed;
+	}
+
+	printf("Patched image\t: %zu bytes from %zu bytes of delta\n", len,
+	       delta_len);
+	printf("Rebuilding\t: %.1f MB in %.3f s, %.1f MB/s\n",
+	       img.payload_len / 1e6, elapsed / 1e9,
+	       elapsed ? img.payload_len * 1e3 / elapsed : 0.0);
+	rv = 0;
+
+patch_failed:
+	mem_free(payload);
+	mem_free(image);
+	arena_release(&os.arena);
+
+	return rv;
+}
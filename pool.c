@@ -0,0 +1,205 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "pool.h"
+#include "trace.h"
+
+typedef struct pool_job
+{
+	struct pool_job	*next;
+	pool_fn_t	fn;
+	void		*arg;
+} pool_job_t;
+
+/* Fixed size pool of workers consuming a FIFO job queue. */
+struct pool
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	job_ready;
+	pthread_cond_t	all_done;
+	pool_job_t	*head;
+	pool_job_t	*tail;
+	int		queued;
+	int		running;
+	int		shutdown;
+	int		nthreads;
+	pthread_t	*threads;
+};
+
+int
+pool_default_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+static void *
+pool_worker(void *arg)
+{
+	pool_t *pool = arg;
+	pool_job_t *job;
+
+	trace_thread_name("worker");
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (NULL == pool->head && !pool->shutdown)
+			pthread_cond_wait(&pool->job_ready, &pool->lock);
+		if (NULL == pool->head)
+			break;
+
+		job = pool->head;
+		pool->head = job->next;
+		if (NULL == pool->head)
+			pool->tail = NULL;
+		pool->queued--;
+		pool->running++;
+		TRACE_COUNTER("pool queue", pool->queued);
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job->arg);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->running--;
+		if (0 == pool->running && NULL == pool->head)
+			pthread_cond_broadcast(&pool->all_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+pool_t *
+pool_create(int nthreads)
+{
+	pool_t *pool;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = pool_default_threads();
+
+	pool = calloc(1, sizeof(pool_t));
+	if (NULL == pool) {
+		fprintf(stderr, "Out of memory while creating thread pool!\n");
+		return NULL;
+	}
+	pool->threads = calloc(nthreads, sizeof(pthread_t));
+	if (NULL == pool->threads) {
+		fprintf(stderr, "Out of memory while creating thread pool!\n");
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_ready, NULL);
+	pthread_cond_init(&pool->all_done, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (0 != pthread_create(&pool->threads[i], NULL,
+		                        pool_worker, pool)) {
+			fprintf(stderr, "Failed to start worker thread!\n");
+			break;
+		}
+		pool->nthreads++;
+	}
+
+	if (0 == pool->nthreads) {
+		pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+int
+pool_submit(pool_t *pool, pool_fn_t fn, void *arg)
+{
+	pool_job_t *job;
+
+	job = malloc(sizeof(pool_job_t));
+	if (NULL == job) {
+		fprintf(stderr, "Out of memory while queueing job!\n");
+		return 1;
+	}
+	job->next = NULL;
+	job->fn = fn;
+	job->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pool->queued++;
+	TRACE_COUNTER("pool queue", pool->queued);
+	pthread_cond_signal(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/* Blocks until the queue is drained and no job is running. */
+void
+pool_wait(pool_t *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (NULL != pool->head || 0 != pool->running)
+		pthread_cond_wait(&pool->all_done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_destroy(pool_t *pool)
+{
+	int i;
+
+	if (NULL == pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->job_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->job_ready);
+	pthread_cond_destroy(&pool->all_done);
+	free(pool->threads);
+	free(pool);
+}
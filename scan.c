@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "arena.h"
+#include "layout.h"
+#include "mem.h"
+#include "scan.h"
+#include "util.h"
+#include "config.h"
+
+/* Eight payload words at a time, for the bootcode magic scan. */
+typedef uint32_t wvec_t __attribute__((vector_size(32), may_alias));
+typedef int32_t mvec_t __attribute__((vector_size(32)));
+
+/* Bootcode headers found in a payload by bcode_scan(). */
+typedef struct bcode_scan
+{
+	uint64_t	magics;		/* words carrying the magic */
+	uint64_t	headers;	/* of those, self consistent headers */
+	uint64_t	hdr_off;	/* the one at the target, else the first */
+} bcode_scan_t;
+
+static void
+bcode_scan_words(const char *payload, size_t len, size_t from, size_t to,
+                 uint64_t target, bcode_scan_t *scan)
+{
+	bcode_hdr_t b;
+	size_t off;
+
+	for (off = from; off < to; off += sizeof(uint32_t)) {
+		memcpy(&b.magic, payload + off, sizeof(uint32_t));
+		if ((b.magic & BCODE_MAGIC_MASK) != BCODE_MAGIC)
+			continue;
+		scan->magics++;
+		if (len - off < sizeof(bcode_hdr_t))
+			continue;
+		memcpy(&b, payload + off, sizeof(bcode_hdr_t));
+		if (b.bcode_off != off ||
+		    b.ramdisk_size > len - off - sizeof(bcode_hdr_t))
+			continue;
+		scan->headers++;
+		if (UINT64_MAX == scan->hdr_off ||
+		    off + sizeof(bcode_hdr_t) == target)
+			scan->hdr_off = off;
+	}
+}
+
+/*
+ * Finds the bootcode magic in the 4 byte aligned words of a len bytes
+ * payload, 32 words per step, and the headers among them whose offset
+ * points back at them. Only steps with a hit are checked word by word.
+ */
+static void
+bcode_scan(const char *payload, size_t len, uint64_t target,
+           bcode_scan_t *scan)
+{
+	wvec_t v[4], mask = { 0 }, magic = { 0 };
+	mvec_t hit;
+	size_t off, end = len & ~(size_t)3;
+	unsigned i;
+	int any;
+
+	memset(scan, 0, sizeof(bcode_scan_t));
+	scan->hdr_off = UINT64_MAX;
+	mask += BCODE_MAGIC_MASK;
+	magic += BCODE_MAGIC;
+
+	for (off = 0; off + sizeof(v) <= end; off += sizeof(v)) {
+		memcpy(v, payload + off, sizeof(v));
+		hit = ((v[0] & mask) == magic) | ((v[1] & mask) == magic) |
+		      ((v[2] & mask) == magic) | ((v[3] & mask) == magic);
+		for (any = 0, i = 0; i < sizeof(mvec_t) / sizeof(int32_t); i++)
+			any |= hit[i];
+		if (any)
+			bcode_scan_words(payload, len, off, off + sizeof(v),
+			                 target, scan);
+	}
+	bcode_scan_words(payload, len, off, end, target, scan);
+}
+
+/*
+ * Tells the layout of an image from the contents of its payload,
+ * whatever the image version says, and points out where the two
+ * disagree. The payload is inflated in full, the scan for bootcode
+ * headers then runs at memory speed.
+ */
+int
+boost_scan(const char *image, size_t len)
+{
+	static const char *layouts[] = { "unknown", "new", "legacy" };
+	const char *data = image + sizeof(boost_hdr_t);
+	arena_t arena = { NULL, 0, 0, 0, 0 };
+	const char *payload = data;
+	bcode_scan_t scan;
+	boost_hdr_t hdr;
+	uint32_t first_instr = 0, type, hint;
+	uint64_t target = 0, off = 0;
+	size_t total, out_len = 0, n;
+	char *buf;
+
+	if (len < sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Failed to read BooSt header!\n");
+		return 1;
+	}
+	memcpy(&hdr, image, sizeof(boost_hdr_t));
+	if (hdr.image_size > len - sizeof(boost_hdr_t)) {
+		fprintf(stderr, "Image data exceeds the file!\n");
+		return 1;
+	}
+
+	total = hdr.image_size;
+	if (hdr.flags & BOOST_FLAG_ZLIB) {
+		if (hdr.image_size < sizeof(uint32_t)) {
+			printf("Image too small to hold zlib data!\n");
+			return 1;
+		}
+		total = swap_bytes_be(((const uint32_t *)data)[0]);
+		if (0 == total || total > MAX_IMAGE_BUF_SIZE) {
+			fprintf(stderr, "Invalid unpacked image size!\n");
+			return 1;
+		}
+		if (!mem_fits(total + zlib_inflate_mem())) {
+			fprintf(stderr, "Memory budget too small to scan the "
+			        "image!\n");
+			return 1;
+		}
+		arena_plan(&arena, total);
+		if (0 != arena_reserve(&arena))
+			return 1;
+		buf = arena_alloc(&arena, total);
+		if (0 != zlib_decompress_into(data + 4, hdr.image_size - 4, buf,
+		                              total, &out_len, NULL) ||
+		    out_len != total) {
+			fprintf(stderr, "Unpacked size mismatch!\n");
+			arena_release(&arena);
+			return 1;
+		}
+		payload = buf;
+	}
+
+	if (total >= sizeof(uint32_t))
+		memcpy(&first_instr, payload, sizeof(uint32_t));
+	if (IS_ARM_BRANCH(first_instr))
+		target = BRANCHL_2_OFFSET(first_instr);
+	bcode_scan(payload, total, target, &scan);
+
+	/* A header right before the target makes a new image. */
+	type = INDEX_LAYOUT_UNKNOWN;
+	n = layout_probe_window(first_instr, total, &off);
+	if (0 != n && scan.hdr_off == off)
+		type = INDEX_LAYOUT_NEW;
+	else if (0 != n)
+		type = layout_probe(first_instr, payload + off, n, total);
+	hint = boost_is_legacy(&hdr) ? INDEX_LAYOUT_LEGACY : INDEX_LAYOUT_NEW;
+
+	printf("Payload\t\t: %zu bytes\n", total);
+	if (IS_ARM_BRANCH(first_instr))
+		printf("Branch target\t: 0x%08llx\n",
+		       (unsigned long long)target);
+	else
+		printf("Branch target\t: none\n");
+	printf("Bootcode magic\t: %llu words, %llu headers",
+	       (unsigned long long)scan.magics,
+	       (unsigned long long)scan.headers);
+	if (UINT64_MAX != scan.hdr_off)
+		printf(", at 0x%08llx", (unsigned long long)scan.hdr_off);
+	printf("\n");
+
+	if (!IS_ARM_BRANCH(first_instr))
+		printf("Layout\t\t: unknown (no branch)\n");
+	else if (INDEX_LAYOUT_UNKNOWN == type &&
+	         INDEX_LAYOUT_UNKNOWN == layout_type(&hdr, first_instr,
+	                                             payload + off, n, total))
+		printf("Layout\t\t: unknown (no bootcode)\n");
+	else if (INDEX_LAYOUT_UNKNOWN == type)
+		printf("Layout\t\t: unknown, %s by the image version\n",
+		       layouts[hint]);
+	else
+		printf("Layout\t\t: %s\n", layouts[type]);
+	if (INDEX_LAYOUT_UNKNOWN != type && hint != type)
+		printf("Warning: image version \"%.*s\" suggests a %s "
+		       "layout!\n", (int)sizeof(hdr.image_version),
+		       hdr.image_version, layouts[hint]);
+	arena_release(&arena);
+
+	return 0;
+}
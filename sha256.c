@@ -0,0 +1,342 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_NI	1
+#endif
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	((x) >> (n) | (x) << (32 - (n)))
+
+/* Compresses n consecutive 64 byte blocks into the state. */
+static void
+sha256_blocks_generic(uint32_t *h, const uint8_t *p, size_t n)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (; n; n--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t)p[4 * i] << 24 |
+			       (uint32_t)p[4 * i + 1] << 16 |
+			       (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+		for (i = 16; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^
+			        w[i - 15] >> 3) +
+			       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^
+			        w[i - 2] >> 10);
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
+		e = h[4]; f = h[5]; g = h[6]; k = h[7];
+		for (i = 0; i < 64; i++) {
+			t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			k = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+	}
+}
+
+#ifdef SHA256_NI
+/*
+ * Block function on the SHA extensions. The state is kept as ABEF and
+ * CDGH halves, the layout sha256rnds2 works on, and each step does four
+ * rounds, its message words computed by sha256msg1/2 from the previous
+ * four steps.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_ni(uint32_t *h, const uint8_t *p, size_t n)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                     0x0405060700010203ULL);
+	__m128i abef, cdgh, abef_save, cdgh_save, msg, tmp, w[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)),
+	                         0x1b);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+	for (; n; n--, p += 64) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				       (const __m128i *)(p + 16 * i)), bswap);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[i & 3],
+				                           w[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(
+				      w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(tmp,
+				                                w[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128(
+			      (const __m128i *)(sha256_k + 4 * i)));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh,
+			                             _mm_shuffle_epi32(msg, 0x0e));
+		}
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+static void (*sha256_blocks)(uint32_t *, const uint8_t *, size_t) =
+	sha256_blocks_generic;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+/* Picks the block function once, by what the CPU offers. */
+static void
+sha256_select(void)
+{
+#ifdef SHA256_NI
+	unsigned a, b, c, d;
+
+	if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_1) &&
+	    (c & bit_SSSE3) && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+	    (b & bit_SHA)) {
+		sha256_blocks = sha256_blocks_ni;
+	}
+#endif
+}
+
+void
+sha256_init(sha256_t *s)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	pthread_once(&sha256_once, sha256_select);
+	memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+}
+
+void
+sha256_update(sha256_t *s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = s->len % 64, n;
+
+	s->len += len;
+	if (used) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(s->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_blocks(s->h, s->buf, 1);
+	}
+
+	/* Whole blocks straight from the input. */
+	sha256_blocks(s->h, p, len / 64);
+	p += len & ~(size_t)63;
+	memcpy(s->buf, p, len % 64);
+}
+
+void
+sha256_final(sha256_t *s, uint8_t *digest)
+{
+	size_t used = s->len % 64;
+	uint64_t bits = s->len * 8;
+	int i;
+
+	s->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(s->buf + used, 0, 64 - used);
+		sha256_blocks(s->h, s->buf, 1);
+		used = 0;
+	}
+	memset(s->buf + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		s->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_blocks(s->h, s->buf, 1);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void
+sha256_hex(const uint8_t *digest, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < SHA256_LEN; i++) {
+		hex[2 * i] = digits[digest[i] >> 4];
+		hex[2 * i + 1] = digits[digest[i] & 0xf];
+	}
+	hex[2 * SHA256_LEN] = '\0';
+}
+
+/* The lines of a manifest, in sha256sum format. */
+static void
+manifest_print(FILE *f, const char *names[], const uint8_t *digests[],
+               size_t n)
+{
+	char hex[SHA256_HEX_LEN];
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		sha256_hex(digests[i], hex);
+		fprintf(f, "%s  %s\n", hex, names[i]);
+	}
+}
+
+/*
+ * Writes n digests with their names in sha256sum format to path. The
+ * file is replaced as a whole, never left half written. With excl set
+ * an existing file is left alone and that fails.
+ */
+int
+sha256_manifest(const char *path, const char *names[],
+                const uint8_t *digests[], size_t n, int excl)
+{
+	char tmp[PATH_MAX];
+	FILE *f = NULL;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (-1 == fd || NULL == (f = fdopen(fd, "w"))) {
+		fprintf(stderr, "Failed to create %s: %s\n", path,
+		        strerror(errno));
+		if (-1 != fd) {
+			close(fd);
+			unlink(tmp);
+		}
+		return 1;
+	}
+	manifest_print(f, names, digests, n);
+	if (0 != fclose(f) || 0 != chmod(tmp, 0644) ||
+	    0 != (excl ? link(tmp, path) : rename(tmp, path))) {
+		fprintf(stderr, "Failed to write %s: %s\n", path,
+		        strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	if (excl)
+		unlink(tmp);
+	printf("Manifest\t: %s\n", path);
+
+	return 0;
+}
+
+/*
+ * Compares the manifest at path with the one sha256_manifest() would
+ * write. Returns 0 when they are the same, 1 when not or when it
+ * cannot be read.
+ */
+int
+sha256_manifest_cmp(const char *path, const char *names[],
+                    const uint8_t *digests[], size_t n)
+{
+	char *want = NULL, *have = NULL;
+	size_t want_len = 0, have_len;
+	FILE *f;
+	int rv = 1;
+
+	f = open_memstream(&want, &want_len);
+	if (NULL == f) {
+		perror("Failed to buffer manifest");
+		return 1;
+	}
+	manifest_print(f, names, digests, n);
+	if (0 != fclose(f)) {
+		perror("Failed to buffer manifest");
+		goto manifest_cmp_done;
+	}
+
+	f = fopen(path, "r");
+	if (NULL == f) {
+		fprintf(stderr, "Failed to read %s: %s\n", path,
+		        strerror(errno));
+		goto manifest_cmp_done;
+	}
+	have = malloc(want_len + 1);
+	if (NULL != have) {
+		have_len = fread(have, 1, want_len + 1, f);
+		rv = have_len != want_len || 0 != memcmp(have, want, want_len);
+	}
+	fclose(f);
+
+manifest_cmp_done:
+	free(have);
+	free(want);
+
+	return rv;
+}
@@ -0,0 +1,151 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "sparse.h"
+#include "stats.h"
+
+/* Granularity of the zero scan inside data extents. */
+#define SPARSE_PAGE_SIZE	(4*1024)
+
+/* Appends a segment, merged with the previous one when alike. */
+int
+sparse_push(sparse_map_t *map, const char *data, size_t len)
+{
+	segment_t *last = map->nsegs ? &map->segs[map->nsegs - 1] : NULL;
+	segment_t *tmp;
+
+	if (0 == len)
+		return 0;
+	if (NULL == data)
+		map->zero_bytes += len;
+
+	/* Merge with the previous segment when both are alike. */
+	if (last && ((NULL == data && NULL == last->data) ||
+	             (data && last->data && last->data + last->len == data))) {
+		last->len += len;
+		return 0;
+	}
+
+	if (map->nsegs == map->alloc) {
+		map->alloc = map->alloc ? map->alloc * 2 : 16;
+		tmp = realloc(map->segs, map->alloc * sizeof(segment_t));
+		if (NULL == tmp) {
+			fprintf(stderr, "Failed to allocate segment list!\n");
+			return 1;
+		}
+		map->segs = tmp;
+	}
+	map->segs[map->nsegs].data = data;
+	map->segs[map->nsegs].len = len;
+	map->nsegs++;
+
+	return 0;
+}
+
+/*
+ * Splits a data extent into data and all-zero pages, pages counting
+ * from data. Also lays out payloads again the way create saw them.
+ */
+int
+sparse_scan(sparse_map_t *map, const char *data, size_t len)
+{
+	size_t chunk;
+
+	for (; len; data += chunk, len -= chunk) {
+		chunk = len < SPARSE_PAGE_SIZE ? len : SPARSE_PAGE_SIZE;
+		if (0 != sparse_push(map, buf_is_zero(data, chunk) ?
+		                     NULL : data, chunk))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Describes the file mapped at base as a list of segments. Holes are
+ * located with SEEK_DATA/SEEK_HOLE and never faulted in, data extents
+ * are scanned for zero pages. Filesystems without hole reporting are
+ * simply scanned as a whole.
+ */
+int
+sparse_map(int fd, const char *base, size_t len, sparse_map_t *map)
+{
+	off_t data, hole, off = 0;
+	uint64_t start;
+	size_t total = len;
+	int rv = 1;
+
+	map->segs = NULL;
+	map->nsegs = map->alloc = map->zero_bytes = 0;
+
+	start = stats_begin();
+	while ((size_t)off < len) {
+		data = lseek(fd, off, SEEK_DATA);
+		if (-1 == data) {
+			if (ENXIO != errno)
+				data = off;	/* no hole reporting */
+			else
+				data = len;	/* trailing hole */
+		}
+		if ((size_t)data > len)
+			data = len;
+		if (0 != sparse_push(map, NULL, data - off))
+			goto sparse_map_fail;
+		if ((size_t)data == len)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (-1 == hole || (size_t)hole > len)
+			hole = len;
+		if (0 != sparse_scan(map, base + data, hole - data))
+			goto sparse_map_fail;
+		off = hole;
+	}
+	rv = 0;
+
+sparse_map_fail:
+	stats_end(STATS_SCAN, start, total, total - map->zero_bytes);
+	if (rv)
+		sparse_free(map);
+
+	return rv;
+}
+
+void
+sparse_free(sparse_map_t *map)
+{
+	free(map->segs);
+	map->segs = NULL;
+	map->nsegs = map->alloc = map->zero_bytes = 0;
+}
@@ -0,0 +1,1114 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Maximum compression deflate encoder.
+ *
+ * The input is cut into segments which are processed in parallel. For
+ * every segment all useful (length, distance) pairs are collected once,
+ * then the segment is parsed repeatedly with a shortest path search over
+ * a bit cost model derived from the previous parse. The cheapest parse
+ * is split into blocks wherever separate Huffman trees pay off. Finally
+ * all blocks are encoded serially as the smallest of dynamic, fixed or
+ * stored blocks and wrapped into a regular zlib stream.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <zlib.h>
+
+#include "squeeze.h"
+#include "mem.h"
+#include "stats.h"
+#include "trace.h"
+#include "pool.h"
+
+#define SQZ_WINDOW	32768
+#define SQZ_WMASK	(SQZ_WINDOW - 1)
+#define SQZ_MIN_MATCH	3
+#define SQZ_MAX_MATCH	258
+#define SQZ_HASH_BITS	16
+#define SQZ_HASH_SIZE	(1 << SQZ_HASH_BITS)
+/* Hash chain entries visited per position. */
+#define SQZ_MAX_CHAIN	1024
+/* Matches remembered per position, longest ones are kept. */
+#define SQZ_CACHE	8
+/* Unit of parallel work. */
+#define SQZ_SEGMENT	(1024*1024)
+/* Parse iterations per segment and how many may fail to improve. */
+#define SQZ_ITERATIONS	15
+#define SQZ_MAX_STALL	3
+/* Block splitting limits, per segment. */
+#define SQZ_MAX_BLOCKS	32
+#define SQZ_MIN_BLOCK	1024
+#define SQZ_SPLIT_TRIES	9
+
+#define SQZ_NUM_LL	288
+#define SQZ_NUM_D	30
+#define SQZ_NUM_CL	19
+#define SQZ_END_BLOCK	256
+#define SQZ_STORED_MAX	65535
+
+typedef struct sqz_sym
+{
+	uint16_t	litlen;	/* literal byte or match length */
+	uint16_t	dist;	/* 0 for literals */
+} sqz_sym_t;
+
+typedef struct sqz_match
+{
+	uint16_t	len;
+	uint16_t	dist;
+} sqz_match_t;
+
+/* Bit costs of every symbol, indexed by length and distance code. */
+typedef struct sqz_model
+{
+	float		lit[256];
+	float		len[SQZ_MAX_MATCH + 1];
+	float		dist[SQZ_NUM_D];
+} sqz_model_t;
+
+typedef struct sqz_segment
+{
+	const unsigned char	*data;	/* whole input */
+	size_t			total;
+	size_t			start;
+	size_t			end;
+	sqz_sym_t		*syms;
+	size_t			nsyms;
+	size_t			splits[SQZ_MAX_BLOCKS + 1];
+	int			nblocks;
+	int			failed;
+} sqz_segment_t;
+
+typedef struct sqz_writer
+{
+	unsigned char	*buf;
+	size_t		len;
+	size_t		cap;
+	uint32_t	bits;
+	int		nbits;
+	int		failed;
+} sqz_writer_t;
+
+static const uint16_t len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[SQZ_NUM_D] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+	12289, 16385, 24577
+};
+static const uint8_t dist_extra[SQZ_NUM_D] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t cl_order[SQZ_NUM_CL] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Length code (0..28) of every match length. */
+static uint8_t len_code[SQZ_MAX_MATCH + 1];
+
+static void
+sqz_init_tables(void)
+{
+	int code, l;
+
+	for (code = 0; code < 29; code++) {
+		for (l = len_base[code];
+		     l < len_base[code] + (1 << len_extra[code]) &&
+		     l <= SQZ_MAX_MATCH; l++) {
+			len_code[l] = code;
+		}
+	}
+	/* 258 has its own code although 227 + 31 would cover it. */
+	len_code[SQZ_MAX_MATCH] = 28;
+}
+
+static int
+sqz_dist_code(unsigned dist)
+{
+	unsigned d = dist - 1;
+	int l;
+
+	if (d < 4)
+		return d;
+	l = 31 - __builtin_clz(d);
+	return 2 * l + ((d >> (l - 1)) & 1);
+}
+
+/*
+ * Length limited Huffman code lengths using the package-merge
+ * algorithm. Unused symbols get length 0.
+ */
+typedef struct pm_node
+{
+	uint64_t	weight;
+	int		leaf;	/* symbol, or -1 for packages */
+	int		child;	/* first of two nodes in the previous level */
+} pm_node_t;
+
+static int
+pm_cmp(const void *a, const void *b)
+{
+	const pm_node_t *na = a, *nb = b;
+
+	if (na->weight != nb->weight)
+		return na->weight < nb->weight ? -1 : 1;
+	return na->leaf - nb->leaf;
+}
+
+static void
+pm_count(const pm_node_t *levels, int nper, int level, int idx,
+         uint8_t *lens)
+{
+	const pm_node_t *node = &levels[level * nper + idx];
+
+	if (node->leaf >= 0) {
+		lens[node->leaf]++;
+		return;
+	}
+	pm_count(levels, nper, level - 1, node->child, lens);
+	pm_count(levels, nper, level - 1, node->child + 1, lens);
+}
+
+static int
+sqz_huff_lengths(const uint32_t *freq, int n, int maxbits, uint8_t *lens)
+{
+	pm_node_t leaves[SQZ_NUM_LL];
+	pm_node_t *levels = NULL;
+	int nleaves = 0, nper, count, prev, i, j, k, l;
+
+	memset(lens, 0, n);
+	for (i = 0; i < n; i++) {
+		if (freq[i]) {
+			leaves[nleaves].weight = freq[i];
+			leaves[nleaves].leaf = i;
+			leaves[nleaves].child = -1;
+			nleaves++;
+		}
+	}
+	if (0 == nleaves)
+		return 0;
+	if (1 == nleaves) {
+		lens[leaves[0].leaf] = 1;
+		return 0;
+	}
+	qsort(leaves, nleaves, sizeof(pm_node_t), pm_cmp);
+
+	nper = 2 * nleaves;
+	levels = malloc(sizeof(pm_node_t) * nper * maxbits);
+	if (NULL == levels)
+		return 1;
+
+	memcpy(levels, leaves, sizeof(pm_node_t) * nleaves);
+	prev = nleaves;
+	for (l = 1; l < maxbits; l++) {
+		pm_node_t *cur = &levels[l * nper];
+		pm_node_t *last = &levels[(l - 1) * nper];
+		int npkg = prev / 2;
+
+		/* Merge the leaves with pairs of the previous level. */
+		i = 0;
+		j = 0;
+		count = 0;
+		while (i < nleaves || j < npkg) {
+			uint64_t pw = 0;
+
+			if (j < npkg)
+				pw = last[2 * j].weight + last[2 * j + 1].weight;
+			if (i < nleaves &&
+			    (j >= npkg || leaves[i].weight <= pw)) {
+				cur[count++] = leaves[i++];
+			} else {
+				cur[count].weight = pw;
+				cur[count].leaf = -1;
+				cur[count].child = 2 * j;
+				count++;
+				j++;
+			}
+		}
+		prev = count;
+	}
+
+	for (k = 0; k < 2 * nleaves - 2; k++)
+		pm_count(levels, nper, maxbits - 1, k, lens);
+
+	free(levels);
+	return 0;
+}
+
+/* Canonical codes, bit reversed for the LSB first bit writer. */
+static void
+sqz_huff_codes(const uint8_t *lens, int n, uint16_t *codes)
+{
+	uint16_t bl_count[16], next[16];
+	int i, b;
+	uint16_t code = 0, c, r;
+
+	memset(bl_count, 0, sizeof(bl_count));
+	for (i = 0; i < n; i++)
+		bl_count[lens[i]]++;
+	bl_count[0] = 0;
+	for (b = 1; b < 16; b++) {
+		code = (code + bl_count[b - 1]) << 1;
+		next[b] = code;
+	}
+	for (i = 0; i < n; i++) {
+		if (0 == lens[i]) {
+			codes[i] = 0;
+			continue;
+		}
+		c = next[lens[i]]++;
+		for (r = 0, b = 0; b < lens[i]; b++) {
+			r = (r << 1) | (c & 1);
+			c >>= 1;
+		}
+		codes[i] = r;
+	}
+}
+
+/*
+ * Match finder. For each position of the segment the shortest distance
+ * reaching every match length is recorded in the cache.
+ */
+static inline uint32_t
+sqz_hash(const unsigned char *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+	return (v * 2654435761u) >> (32 - SQZ_HASH_BITS);
+}
+
+static int
+sqz_find_matches(const sqz_segment_t *seg, const uint16_t *run,
+                 sqz_match_t *cache)
+{
+	const unsigned char *d = seg->data;
+	sqz_match_t found[SQZ_MAX_MATCH];
+	int32_t *head = NULL, *prev = NULL;
+	size_t dict, pos, maxlen, l;
+	int32_t p, last;
+	int nfound, chain, best, k;
+	uint32_t h;
+
+	head = malloc(sizeof(int32_t) * SQZ_HASH_SIZE);
+	prev = malloc(sizeof(int32_t) * SQZ_WINDOW);
+	if (NULL == head || NULL == prev) {
+		free(head);
+		free(prev);
+		return 1;
+	}
+	memset(head, 0xff, sizeof(int32_t) * SQZ_HASH_SIZE);
+	memset(prev, 0xff, sizeof(int32_t) * SQZ_WINDOW);
+
+	/* Earlier input serves as the dictionary. */
+	dict = seg->start > SQZ_WINDOW ? seg->start - SQZ_WINDOW : 0;
+	for (pos = dict; pos < seg->start; pos++) {
+		if (pos + SQZ_MIN_MATCH > seg->total)
+			break;
+		h = sqz_hash(d + pos);
+		prev[pos & SQZ_WMASK] = head[h];
+		head[h] = pos;
+	}
+
+	for (pos = seg->start; pos < seg->end; pos++) {
+		sqz_match_t *slot = &cache[(pos - seg->start) * SQZ_CACHE];
+
+		memset(slot, 0, sizeof(sqz_match_t) * SQZ_CACHE);
+		maxlen = seg->end - pos;
+		if (maxlen > SQZ_MAX_MATCH)
+			maxlen = SQZ_MAX_MATCH;
+		if (pos + SQZ_MIN_MATCH > seg->total)
+			continue;
+		h = sqz_hash(d + pos);
+
+		if (maxlen < SQZ_MIN_MATCH) {
+			/* Too close to the segment end for a match. */
+		} else if (pos > 0 && d[pos - 1] == d[pos] &&
+		           run[pos - seg->start] >= maxlen) {
+			/* Inside a long run distance one reaches everything. */
+			slot[0].len = maxlen;
+			slot[0].dist = 1;
+		} else {
+			nfound = 0;
+			best = SQZ_MIN_MATCH - 1;
+			chain = SQZ_MAX_CHAIN;
+			p = head[h];
+			last = pos;
+			while (p >= 0 && p < last && pos - p <= SQZ_WINDOW &&
+			       chain-- > 0) {
+				if (d[p + best] == d[pos + best]) {
+					for (l = 0; l < maxlen &&
+					     d[p + l] == d[pos + l]; l++)
+						;
+					if ((int)l > best) {
+						found[nfound].len = l;
+						found[nfound].dist = pos - p;
+						nfound++;
+						best = l;
+						if (l == maxlen)
+							break;
+					}
+				}
+				last = p;
+				p = prev[p & SQZ_WMASK];
+			}
+			k = nfound > SQZ_CACHE ? nfound - SQZ_CACHE : 0;
+			memcpy(slot, found + k,
+			       sizeof(sqz_match_t) * (nfound - k));
+		}
+
+		prev[pos & SQZ_WMASK] = head[h];
+		head[h] = pos;
+	}
+
+	free(head);
+	free(prev);
+	return 0;
+}
+
+static void
+sqz_model_fixed(sqz_model_t *m)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		m->lit[i] = i < 144 ? 8 : 9;
+	for (i = SQZ_MIN_MATCH; i <= SQZ_MAX_MATCH; i++)
+		m->len[i] = (len_code[i] < 24 ? 7 : 8) + len_extra[len_code[i]];
+	for (i = 0; i < SQZ_NUM_D; i++)
+		m->dist[i] = 5 + dist_extra[i];
+}
+
+static void
+sqz_count(const sqz_sym_t *syms, size_t a, size_t b, uint32_t *llfreq,
+          uint32_t *dfreq)
+{
+	size_t i;
+
+	memset(llfreq, 0, sizeof(uint32_t) * SQZ_NUM_LL);
+	memset(dfreq, 0, sizeof(uint32_t) * SQZ_NUM_D);
+	for (i = a; i < b; i++) {
+		if (0 == syms[i].dist) {
+			llfreq[syms[i].litlen]++;
+		} else {
+			llfreq[257 + len_code[syms[i].litlen]]++;
+			dfreq[sqz_dist_code(syms[i].dist)]++;
+		}
+	}
+	llfreq[SQZ_END_BLOCK] = 1;
+}
+
+/* Entropy based costs; unseen symbols are priced as if seen once. */
+static void
+sqz_model_from_stats(const uint32_t *llfreq, const uint32_t *dfreq,
+                     sqz_model_t *m)
+{
+	float llcost[SQZ_NUM_LL], dcost[SQZ_NUM_D];
+	double lltotal = 0, dtotal = 0;
+	int i;
+
+	for (i = 0; i < SQZ_NUM_LL; i++)
+		lltotal += llfreq[i];
+	for (i = 0; i < SQZ_NUM_D; i++)
+		dtotal += dfreq[i];
+	for (i = 0; i < SQZ_NUM_LL; i++)
+		llcost[i] = log2(lltotal) - (llfreq[i] ? log2(llfreq[i]) : 0);
+	for (i = 0; i < SQZ_NUM_D; i++)
+		dcost[i] = dtotal ? log2(dtotal) -
+		           (dfreq[i] ? log2(dfreq[i]) : 0) : 5;
+
+	for (i = 0; i < 256; i++)
+		m->lit[i] = llcost[i];
+	for (i = SQZ_MIN_MATCH; i <= SQZ_MAX_MATCH; i++)
+		m->len[i] = llcost[257 + len_code[i]] + len_extra[len_code[i]];
+	for (i = 0; i < SQZ_NUM_D; i++)
+		m->dist[i] = dcost[i] + dist_extra[i];
+}
+
+/* Shortest path through the segment under the given cost model. */
+static size_t
+sqz_parse(const sqz_segment_t *seg, const sqz_match_t *cache,
+          const uint16_t *run, const sqz_model_t *m, double *cost,
+          uint16_t *blen, uint16_t *bdist, sqz_sym_t *syms)
+{
+	const unsigned char *d = seg->data;
+	size_t n = seg->end - seg->start;
+	size_t i, j, k, nsyms = 0;
+	const sqz_match_t *slot;
+	double c, mc;
+	int e, from;
+
+	cost[0] = 0;
+	for (i = 1; i <= n; i++)
+		cost[i] = HUGE_VAL;
+
+	for (i = 0; i < n; i++) {
+		/* Skip through the middle of long runs, only 258/1 fits. */
+		if (run[i] > 2 * SQZ_MAX_MATCH && i > SQZ_MAX_MATCH &&
+		    run[i - SQZ_MAX_MATCH] > SQZ_MAX_MATCH) {
+			mc = m->len[SQZ_MAX_MATCH] + m->dist[0];
+			for (k = 0; k < SQZ_MAX_MATCH; k++, i++) {
+				cost[i + SQZ_MAX_MATCH] = cost[i] + mc;
+				blen[i + SQZ_MAX_MATCH] = SQZ_MAX_MATCH;
+				bdist[i + SQZ_MAX_MATCH] = 1;
+			}
+		}
+
+		c = cost[i] + m->lit[d[seg->start + i]];
+		if (c < cost[i + 1]) {
+			cost[i + 1] = c;
+			blen[i + 1] = 1;
+		}
+
+		slot = &cache[i * SQZ_CACHE];
+		from = SQZ_MIN_MATCH;
+		for (e = 0; e < SQZ_CACHE && slot[e].len; e++) {
+			mc = cost[i] + m->dist[sqz_dist_code(slot[e].dist)];
+			for (k = from; k <= slot[e].len; k++) {
+				c = mc + m->len[k];
+				if (c < cost[i + k]) {
+					cost[i + k] = c;
+					blen[i + k] = k;
+					bdist[i + k] = slot[e].dist;
+				}
+			}
+			from = slot[e].len + 1;
+		}
+	}
+
+	/* Walk back from the end, then reverse into forward order. */
+	for (j = n; j > 0; j -= blen[j]) {
+		if (1 == blen[j]) {
+			syms[nsyms].litlen = d[seg->start + j - 1];
+			syms[nsyms].dist = 0;
+		} else {
+			syms[nsyms].litlen = blen[j];
+			syms[nsyms].dist = bdist[j];
+		}
+		nsyms++;
+	}
+	for (i = 0; i < nsyms / 2; i++) {
+		sqz_sym_t t = syms[i];
+		syms[i] = syms[nsyms - 1 - i];
+		syms[nsyms - 1 - i] = t;
+	}
+
+	return nsyms;
+}
+
+/*
+ * Run length encodes the code length sequence of a dynamic block
+ * header. Each entry is the symbol in the low byte, repeat count above.
+ */
+static int
+sqz_rle_lengths(const uint8_t *ll, int hlit, const uint8_t *dl, int hdist,
+                uint16_t *out)
+{
+	uint8_t seq[SQZ_NUM_LL + SQZ_NUM_D];
+	int n = hlit + hdist, nout = 0, i = 0, r, take;
+
+	memcpy(seq, ll, hlit);
+	memcpy(seq + hlit, dl, hdist);
+
+	while (i < n) {
+		for (r = 1; i + r < n && seq[i + r] == seq[i]; r++)
+			;
+		if (0 == seq[i] && r >= 3) {
+			take = r > 138 ? 138 : r;
+			out[nout++] = (take >= 11 ? 18 : 17) | (take << 8);
+			i += take;
+		} else if (0 != seq[i] && r >= 4) {
+			/* Literal length first, then repeats of it. */
+			out[nout++] = seq[i];
+			i++;
+			r--;
+			while (r >= 3) {
+				take = r > 6 ? 6 : r;
+				out[nout++] = 16 | (take << 8);
+				i += take;
+				r -= take;
+			}
+		} else {
+			out[nout++] = seq[i];
+			i++;
+		}
+	}
+
+	return nout;
+}
+
+typedef struct sqz_tree
+{
+	uint8_t		ll[SQZ_NUM_LL];
+	uint8_t		dl[SQZ_NUM_D];
+	uint8_t		cl[SQZ_NUM_CL];
+	uint16_t	rle[SQZ_NUM_LL + SQZ_NUM_D];
+	int		nrle;
+	int		hlit;
+	int		hdist;
+	int		hclen;
+	size_t		header_bits;
+} sqz_tree_t;
+
+static int
+sqz_build_tree(const uint32_t *llfreq, const uint32_t *dfreq, sqz_tree_t *t)
+{
+	uint32_t dfix[SQZ_NUM_D], clfreq[SQZ_NUM_CL];
+	int i, used = 0;
+
+	/* Keep the distance code complete, old inflaters insist on it. */
+	memcpy(dfix, dfreq, sizeof(dfix));
+	for (i = 0; i < SQZ_NUM_D; i++)
+		used += !!dfix[i];
+	if (used < 2) {
+		if (!dfix[0])
+			dfix[0] = 1;
+		else
+			dfix[1] = 1;
+		if (0 == used)
+			dfix[1] = 1;
+	}
+
+	if (sqz_huff_lengths(llfreq, SQZ_NUM_LL, 15, t->ll) ||
+	    sqz_huff_lengths(dfix, SQZ_NUM_D, 15, t->dl))
+		return 1;
+
+	for (t->hlit = 286; t->hlit > 257 && !t->ll[t->hlit - 1]; t->hlit--)
+		;
+	for (t->hdist = 30; t->hdist > 1 && !t->dl[t->hdist - 1]; t->hdist--)
+		;
+
+	t->nrle = sqz_rle_lengths(t->ll, t->hlit, t->dl, t->hdist, t->rle);
+	memset(clfreq, 0, sizeof(clfreq));
+	for (i = 0; i < t->nrle; i++)
+		clfreq[t->rle[i] & 0xff]++;
+	/* The code length code has to be complete. */
+	used = 0;
+	for (i = 0; i < SQZ_NUM_CL; i++)
+		used += !!clfreq[i];
+	if (used < 2)
+		clfreq[clfreq[0] ? 1 : 0] = 1;
+	if (sqz_huff_lengths(clfreq, SQZ_NUM_CL, 7, t->cl))
+		return 1;
+
+	for (t->hclen = SQZ_NUM_CL; t->hclen > 4 &&
+	     !t->cl[cl_order[t->hclen - 1]]; t->hclen--)
+		;
+
+	t->header_bits = 5 + 5 + 4 + 3 * t->hclen;
+	for (i = 0; i < t->nrle; i++) {
+		int sym = t->rle[i] & 0xff;
+
+		t->header_bits += t->cl[sym];
+		if (16 == sym)
+			t->header_bits += 2;
+		else if (17 == sym)
+			t->header_bits += 3;
+		else if (18 == sym)
+			t->header_bits += 7;
+	}
+
+	return 0;
+}
+
+static size_t
+sqz_data_bits(const uint32_t *llfreq, const uint32_t *dfreq,
+              const uint8_t *ll, const uint8_t *dl)
+{
+	size_t bits = 0;
+	int i;
+
+	for (i = 0; i < 286; i++) {
+		bits += (size_t)llfreq[i] * ll[i];
+		if (i > 256)
+			bits += (size_t)llfreq[i] * len_extra[i - 257];
+	}
+	for (i = 0; i < SQZ_NUM_D; i++)
+		bits += (size_t)dfreq[i] * (dl[i] + dist_extra[i]);
+
+	return bits;
+}
+
+static void
+sqz_fixed_lengths(uint8_t *ll, uint8_t *dl)
+{
+	int i;
+
+	for (i = 0; i < SQZ_NUM_LL; i++)
+		ll[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (i = 0; i < SQZ_NUM_D; i++)
+		dl[i] = 5;
+}
+
+/* Size of symbols [a, b) as a dynamic block, or ~0 on failure. */
+static size_t
+sqz_block_cost(const sqz_sym_t *syms, size_t a, size_t b)
+{
+	uint32_t llfreq[SQZ_NUM_LL], dfreq[SQZ_NUM_D];
+	sqz_tree_t tree;
+
+	sqz_count(syms, a, b, llfreq, dfreq);
+	if (sqz_build_tree(llfreq, dfreq, &tree))
+		return (size_t)-1;
+
+	return 3 + tree.header_bits +
+	       sqz_data_bits(llfreq, dfreq, tree.ll, tree.dl);
+}
+
+/* Best split point of [a, b), narrowing down on a few probes. */
+static size_t
+sqz_find_split(const sqz_sym_t *syms, size_t a, size_t b, size_t *cost)
+{
+	size_t lo = a + 1, hi = b, best = 0, best_cost = (size_t)-1;
+	size_t probe[SQZ_SPLIT_TRIES], c, step;
+	int i, bi;
+
+	while (hi - lo > SQZ_SPLIT_TRIES) {
+		step = (hi - lo) / (SQZ_SPLIT_TRIES + 1);
+		bi = -1;
+		for (i = 0; i < SQZ_SPLIT_TRIES; i++) {
+			probe[i] = lo + (i + 1) * step;
+			c = sqz_block_cost(syms, a, probe[i]) +
+			    sqz_block_cost(syms, probe[i], b);
+			if (c < best_cost) {
+				best_cost = c;
+				best = probe[i];
+				bi = i;
+			}
+		}
+		if (bi < 0)
+			break;
+		lo = bi > 0 ? probe[bi - 1] : lo;
+		hi = bi < SQZ_SPLIT_TRIES - 1 ? probe[bi + 1] : hi;
+	}
+
+	*cost = best_cost;
+	return best;
+}
+
+static int
+sqz_size_cmp(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Greedily splits the largest block that still benefits from its own
+ * Huffman trees until no split pays off or the block limit is hit.
+ */
+static void
+sqz_split_blocks(sqz_segment_t *seg)
+{
+	int tried[SQZ_MAX_BLOCKS];
+	size_t a, b, split, cost, whole, len, best_len;
+	int i, pick;
+
+	seg->splits[0] = 0;
+	seg->splits[1] = seg->nsyms;
+	seg->nblocks = 1;
+	memset(tried, 0, sizeof(tried));
+
+	while (seg->nblocks < SQZ_MAX_BLOCKS) {
+		pick = -1;
+		best_len = 0;
+		for (i = 0; i < seg->nblocks; i++) {
+			len = seg->splits[i + 1] - seg->splits[i];
+			if (!tried[i] && len >= 2 * SQZ_MIN_BLOCK &&
+			    len > best_len) {
+				best_len = len;
+				pick = i;
+			}
+		}
+		if (pick < 0)
+			break;
+
+		a = seg->splits[pick];
+		b = seg->splits[pick + 1];
+		tried[pick] = 1;
+		whole = sqz_block_cost(seg->syms, a, b);
+		split = sqz_find_split(seg->syms, a, b, &cost);
+		if (0 == split || cost >= whole)
+			continue;
+
+		seg->splits[seg->nblocks + 1] = split;
+		seg->nblocks++;
+		qsort(seg->splits, seg->nblocks + 1, sizeof(size_t),
+		      sqz_size_cmp);
+		/* Block indices shifted, both halves are new. */
+		for (i = seg->nblocks - 1; i > pick + 1; i--)
+			tried[i] = tried[i - 1];
+		tried[pick] = 0;
+		tried[pick + 1] = 0;
+	}
+}
+
+static void
+sqz_segment_run(void *arg)
+{
+	sqz_segment_t *seg = arg;
+	size_t n = seg->end - seg->start, best_cost = (size_t)-1;
+	uint32_t llfreq[SQZ_NUM_LL], dfreq[SQZ_NUM_D];
+	sqz_match_t *cache = NULL;
+	sqz_sym_t *tmp = NULL, *swap;
+	uint16_t *run = NULL, *blen = NULL, *bdist = NULL;
+	double *cost = NULL;
+	sqz_model_t model;
+	uint64_t start;
+	size_t i, nsyms, c;
+	int it, stall = 0;
+
+	start = TRACE_BEGIN();
+
+	cache = malloc(sizeof(sqz_match_t) * SQZ_CACHE * n);
+	run = malloc(sizeof(uint16_t) * n);
+	blen = malloc(sizeof(uint16_t) * (n + 1));
+	bdist = malloc(sizeof(uint16_t) * (n + 1));
+	cost = malloc(sizeof(double) * (n + 1));
+	tmp = malloc(sizeof(sqz_sym_t) * n);
+	seg->syms = malloc(sizeof(sqz_sym_t) * n);
+	stats_alloc(sizeof(sqz_match_t) * SQZ_CACHE * n);
+	if (!cache || !run || !blen || !bdist || !cost || !tmp || !seg->syms)
+		goto segment_failed;
+
+	/* Length of the run of identical bytes starting at each byte. */
+	run[n - 1] = 1;
+	for (i = n - 1; i > 0; i--) {
+		if (seg->data[seg->start + i - 1] == seg->data[seg->start + i]
+		    && run[i] < 0xffff)
+			run[i - 1] = run[i] + 1;
+		else
+			run[i - 1] = 1;
+	}
+
+	if (sqz_find_matches(seg, run, cache))
+		goto segment_failed;
+
+	sqz_model_fixed(&model);
+	for (it = 0; it < SQZ_ITERATIONS && stall < SQZ_MAX_STALL; it++) {
+		nsyms = sqz_parse(seg, cache, run, &model, cost, blen, bdist,
+		                  tmp);
+		c = sqz_block_cost(tmp, 0, nsyms);
+		if (c < best_cost) {
+			best_cost = c;
+			swap = seg->syms;
+			seg->syms = tmp;
+			tmp = swap;
+			seg->nsyms = nsyms;
+			stall = 0;
+		} else {
+			stall++;
+		}
+		sqz_count(seg->syms, 0, seg->nsyms, llfreq, dfreq);
+		sqz_model_from_stats(llfreq, dfreq, &model);
+	}
+
+	sqz_split_blocks(seg);
+	goto segment_done;
+
+segment_failed:
+	seg->failed = 1;
+segment_done:
+	free(cache);
+	free(run);
+	free(blen);
+	free(bdist);
+	free(cost);
+	free(tmp);
+	TRACE_END("squeeze segment", start);
+}
+
+static void
+sqz_put_bits(sqz_writer_t *w, uint32_t value, int n)
+{
+	unsigned char *tmp;
+
+	if (w->failed)
+		return;
+
+	w->bits |= value << w->nbits;
+	w->nbits += n;
+	while (w->nbits >= 8) {
+		if (w->len == w->cap) {
+			tmp = mem_realloc(w->buf, w->cap * 2);
+			if (NULL == tmp) {
+				w->failed = 1;
+				return;
+			}
+			w->buf = tmp;
+			w->cap *= 2;
+		}
+		w->buf[w->len++] = w->bits & 0xff;
+		w->bits >>= 8;
+		w->nbits -= 8;
+	}
+}
+
+static void
+sqz_flush_bits(sqz_writer_t *w)
+{
+	if (w->nbits > 0)
+		sqz_put_bits(w, 0, 8 - w->nbits);
+}
+
+static void
+sqz_put_symbols(sqz_writer_t *w, const sqz_sym_t *syms, size_t a, size_t b,
+                const uint8_t *ll, const uint8_t *dl)
+{
+	uint16_t llcode[SQZ_NUM_LL], dcode[SQZ_NUM_D];
+	int lc, dc;
+	size_t i;
+
+	sqz_huff_codes(ll, SQZ_NUM_LL, llcode);
+	sqz_huff_codes(dl, SQZ_NUM_D, dcode);
+
+	for (i = a; i < b; i++) {
+		if (0 == syms[i].dist) {
+			sqz_put_bits(w, llcode[syms[i].litlen],
+			             ll[syms[i].litlen]);
+			continue;
+		}
+		lc = len_code[syms[i].litlen];
+		sqz_put_bits(w, llcode[257 + lc], ll[257 + lc]);
+		sqz_put_bits(w, syms[i].litlen - len_base[lc], len_extra[lc]);
+		dc = sqz_dist_code(syms[i].dist);
+		sqz_put_bits(w, dcode[dc], dl[dc]);
+		sqz_put_bits(w, syms[i].dist - dist_base[dc], dist_extra[dc]);
+	}
+	sqz_put_bits(w, llcode[SQZ_END_BLOCK], ll[SQZ_END_BLOCK]);
+}
+
+static void
+sqz_put_dynamic(sqz_writer_t *w, const sqz_tree_t *t)
+{
+	uint16_t clcode[SQZ_NUM_CL];
+	int i, sym;
+
+	sqz_huff_codes(t->cl, SQZ_NUM_CL, clcode);
+	sqz_put_bits(w, t->hlit - 257, 5);
+	sqz_put_bits(w, t->hdist - 1, 5);
+	sqz_put_bits(w, t->hclen - 4, 4);
+	for (i = 0; i < t->hclen; i++)
+		sqz_put_bits(w, t->cl[cl_order[i]], 3);
+	for (i = 0; i < t->nrle; i++) {
+		sym = t->rle[i] & 0xff;
+		sqz_put_bits(w, clcode[sym], t->cl[sym]);
+		if (16 == sym)
+			sqz_put_bits(w, (t->rle[i] >> 8) - 3, 2);
+		else if (17 == sym)
+			sqz_put_bits(w, (t->rle[i] >> 8) - 3, 3);
+		else if (18 == sym)
+			sqz_put_bits(w, (t->rle[i] >> 8) - 11, 7);
+	}
+}
+
+static void
+sqz_put_stored(sqz_writer_t *w, const unsigned char *data, size_t len,
+               int final)
+{
+	size_t chunk;
+
+	do {
+		chunk = len > SQZ_STORED_MAX ? SQZ_STORED_MAX : len;
+		len -= chunk;
+		sqz_put_bits(w, final && 0 == len, 1);
+		sqz_put_bits(w, 0, 2);
+		sqz_flush_bits(w);
+		sqz_put_bits(w, chunk, 16);
+		sqz_put_bits(w, ~chunk & 0xffff, 16);
+		while (chunk--)
+			sqz_put_bits(w, *data++, 8);
+	} while (len);
+}
+
+/* Emits symbols [a, b) covering 'len' input bytes at 'data'. */
+static int
+sqz_put_block(sqz_writer_t *w, const sqz_sym_t *syms, size_t a, size_t b,
+              const unsigned char *data, size_t len, int final)
+{
+	uint32_t llfreq[SQZ_NUM_LL], dfreq[SQZ_NUM_D];
+	uint8_t fll[SQZ_NUM_LL], fdl[SQZ_NUM_D];
+	size_t dyn_bits, fix_bits, stored_bits;
+	sqz_tree_t tree;
+
+	sqz_count(syms, a, b, llfreq, dfreq);
+	if (sqz_build_tree(llfreq, dfreq, &tree))
+		return 1;
+	sqz_fixed_lengths(fll, fdl);
+
+	dyn_bits = 3 + tree.header_bits +
+	           sqz_data_bits(llfreq, dfreq, tree.ll, tree.dl);
+	fix_bits = 3 + sqz_data_bits(llfreq, dfreq, fll, fdl);
+	stored_bits = ((len + SQZ_STORED_MAX - 1) / SQZ_STORED_MAX) * 40 +
+	              len * 8 + 7;
+
+	if (stored_bits < dyn_bits && stored_bits < fix_bits) {
+		sqz_put_stored(w, data, len, final);
+	} else if (fix_bits <= dyn_bits) {
+		sqz_put_bits(w, final, 1);
+		sqz_put_bits(w, 1, 2);
+		sqz_put_symbols(w, syms, a, b, fll, fdl);
+	} else {
+		sqz_put_bits(w, final, 1);
+		sqz_put_bits(w, 2, 2);
+		sqz_put_dynamic(w, &tree);
+		sqz_put_symbols(w, syms, a, b, tree.ll, tree.dl);
+	}
+
+	return w->failed;
+}
+
+static int
+sqz_put_segment(sqz_writer_t *w, const sqz_segment_t *seg, int last)
+{
+	const unsigned char *p = seg->data + seg->start;
+	size_t i, a, b, bytes;
+	int blk;
+
+	for (blk = 0; blk < seg->nblocks; blk++) {
+		a = seg->splits[blk];
+		b = seg->splits[blk + 1];
+		for (bytes = 0, i = a; i < b; i++)
+			bytes += seg->syms[i].dist ? seg->syms[i].litlen : 1;
+		if (sqz_put_block(w, seg->syms, a, b, p, bytes,
+		                  last && blk == seg->nblocks - 1))
+			return 1;
+		p += bytes;
+	}
+
+	return 0;
+}
+
+/*
+ * Compresses data into a zlib stream (32kB window, maximum compression
+ * level flag) readable by any inflate implementation.
+ */
+void *
+squeeze_compress(const char *data, size_t len, size_t *out_len)
+{
+	sqz_segment_t *segs = NULL;
+	sqz_writer_t w;
+	pool_t *pool = NULL;
+	size_t nsegs, i;
+	uint32_t adler;
+	uint64_t start;
+	int failed = 0;
+
+	start = stats_begin();
+	sqz_init_tables();
+
+	memset(&w, 0, sizeof(sqz_writer_t));
+	w.cap = len / 2 + 1024;
+	w.buf = mem_alloc(w.cap);
+	nsegs = (len + SQZ_SEGMENT - 1) / SQZ_SEGMENT;
+	segs = calloc(nsegs ? nsegs : 1, sizeof(sqz_segment_t));
+	if (NULL == w.buf || NULL == segs) {
+		fprintf(stderr, "Out of memory while allocating squeeze "
+		        "buffers!\n");
+		goto squeeze_failed;
+	}
+
+	for (i = 0; i < nsegs; i++) {
+		segs[i].data = (const unsigned char *)data;
+		segs[i].total = len;
+		segs[i].start = i * SQZ_SEGMENT;
+		segs[i].end = segs[i].start + SQZ_SEGMENT < len ?
+		              segs[i].start + SQZ_SEGMENT : len;
+	}
+
+	pool = pool_create(0);
+	if (NULL == pool)
+		goto squeeze_failed;
+	for (i = 0; i < nsegs; i++) {
+		if (0 != pool_submit(pool, sqz_segment_run, &segs[i]))
+			segs[i].failed = 1;
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+
+	/* zlib header: deflate, 32kB window, maximum compression. */
+	sqz_put_bits(&w, 0x78, 8);
+	sqz_put_bits(&w, 0xda, 8);
+
+	for (i = 0; i < nsegs && !failed; i++) {
+		failed = segs[i].failed ||
+		         sqz_put_segment(&w, &segs[i], i == nsegs - 1);
+	}
+	if (failed) {
+		fprintf(stderr, "Squeeze compression failed!\n");
+		goto squeeze_failed;
+	}
+	if (0 == nsegs) {
+		/* Empty input, a single final fixed block with EOB only. */
+		sqz_put_bits(&w, 1, 1);
+		sqz_put_bits(&w, 1, 2);
+		sqz_put_bits(&w, 0, 7);
+	}
+	sqz_flush_bits(&w);
+
+	adler = adler32(adler32(0, NULL, 0), (const Bytef *)data, len);
+	sqz_put_bits(&w, (adler >> 24) & 0xff, 8);
+	sqz_put_bits(&w, (adler >> 16) & 0xff, 8);
+	sqz_put_bits(&w, (adler >> 8) & 0xff, 8);
+	sqz_put_bits(&w, adler & 0xff, 8);
+	if (w.failed) {
+		fprintf(stderr, "Out of memory while writing squeeze "
+		        "output!\n");
+		goto squeeze_failed;
+	}
+
+	for (i = 0; i < nsegs; i++)
+		free(segs[i].syms);
+	free(segs);
+
+	*out_len = w.len;
+	stats_end(STATS_DEFLATE, start, len, w.len);
+	return w.buf;
+
+squeeze_failed:
+	if (NULL != segs) {
+		for (i = 0; i < nsegs; i++)
+			free(segs[i].syms);
+		free(segs);
+	}
+	mem_free(w.buf);
+	return NULL;
+}
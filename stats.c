@@ -0,0 +1,295 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "mem.h"
+
+typedef struct phase_stats
+{
+	uint64_t	calls;
+	uint64_t	time_ns;
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+} phase_stats_t;
+
+/* Per input loader strategy totals. */
+typedef struct loader_stats
+{
+	const char	*name;
+	uint64_t	files;
+	uint64_t	time_ns;
+	uint64_t	bytes;
+} loader_stats_t;
+
+#define STATS_MAX_LOADERS	8
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+	"load",
+	"scan",
+	"assemble",
+	"deflate",
+	"inflate",
+	"cksum",
+	"write",
+	"match",
+	"ext2",
+	"hash",
+};
+
+static int stats_mode = STATS_OFF;
+static uint64_t stats_start_ns;
+static phase_stats_t phases[STATS_PHASE_COUNT];
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+static loader_stats_t loaders[STATS_MAX_LOADERS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+tv_ms(struct timeval tv)
+{
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+void
+stats_init(int mode)
+{
+	memset(phases, 0, sizeof(phases));
+	alloc_count = 0;
+	alloc_bytes = 0;
+	memset(loaders, 0, sizeof(loaders));
+	stats_mode = mode;
+	stats_start_ns = monotonic_ns();
+}
+
+int
+stats_enabled(void)
+{
+	return stats_mode != STATS_OFF;
+}
+
+/*
+ * Returns the phase start timestamp which has to be handed back to
+ * stats_end() along with the phase, which also records it as a trace
+ * span. When both statistics and tracing are disabled this is a no-op.
+ */
+uint64_t
+stats_begin(void)
+{
+	if (STATS_OFF == stats_mode && !trace_enabled)
+		return 0;
+
+	return monotonic_ns();
+}
+
+void
+stats_end(stats_phase_t phase, uint64_t start, size_t bytes_in,
+          size_t bytes_out)
+{
+	TRACE_END(phase_names[phase], start);
+
+	if (STATS_OFF == stats_mode)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	phases[phase].calls++;
+	phases[phase].time_ns += monotonic_ns() - start;
+	phases[phase].bytes_in += bytes_in;
+	phases[phase].bytes_out += bytes_out;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void
+stats_alloc(size_t size)
+{
+	if (STATS_OFF == stats_mode)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	alloc_count++;
+	alloc_bytes += size;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Accounts one input file read by the named loader. Mapping loaders
+ * fault lazily, so the time only covers setting up the mapping.
+ */
+void
+stats_loader(const char *name, size_t bytes, uint64_t start)
+{
+	int i;
+
+	if (STATS_OFF == stats_mode)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < STATS_MAX_LOADERS; i++) {
+		if (NULL == loaders[i].name || loaders[i].name == name)
+			break;
+	}
+	if (i < STATS_MAX_LOADERS) {
+		loaders[i].name = name;
+		loaders[i].files++;
+		loaders[i].time_ns += monotonic_ns() - start;
+		loaders[i].bytes += bytes;
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static double
+loader_mbps(const loader_stats_t *l)
+{
+	if (0 == l->time_ns)
+		return 0.0;
+	return l->bytes / (l->time_ns / 1e9) / (1024.0 * 1024.0);
+}
+
+/* Ratio of uncompressed to compressed bytes seen by zlib. */
+static double
+compression_ratio(void)
+{
+	phase_stats_t *d = &phases[STATS_DEFLATE];
+	phase_stats_t *i = &phases[STATS_INFLATE];
+
+	if (d->bytes_out)
+		return (double)d->bytes_in / d->bytes_out;
+	if (i->bytes_in)
+		return (double)i->bytes_out / i->bytes_in;
+
+	return 0.0;
+}
+
+static void
+report_text(const char *command, double wall_ms, const struct rusage *ru)
+{
+	int i;
+
+	fprintf(stderr, "Statistics for '%s':\n", command);
+	fprintf(stderr, "  %-10s %6s %12s %12s %12s\n",
+	        "Phase", "Calls", "Time [ms]", "Bytes in", "Bytes out");
+	for (i = 0; i < STATS_PHASE_COUNT; i++) {
+		if (0 == phases[i].calls)
+			continue;
+		fprintf(stderr, "  %-10s %6llu %12.3f %12llu %12llu\n",
+		        phase_names[i],
+		        (unsigned long long)phases[i].calls,
+		        phases[i].time_ns / 1e6,
+		        (unsigned long long)phases[i].bytes_in,
+		        (unsigned long long)phases[i].bytes_out);
+	}
+	for (i = 0; i < STATS_MAX_LOADERS && loaders[i].name; i++) {
+		fprintf(stderr, "  Loader %-10s : %llu files, %llu bytes, "
+		        "%.3f ms, %.1f MB/s\n", loaders[i].name,
+		        (unsigned long long)loaders[i].files,
+		        (unsigned long long)loaders[i].bytes,
+		        loaders[i].time_ns / 1e6, loader_mbps(&loaders[i]));
+	}
+	fprintf(stderr, "  Backend           : %s\n", zlib_backend_name());
+	fprintf(stderr, "  Compression ratio : %.3f\n", compression_ratio());
+	fprintf(stderr, "  Allocations       : %llu (%llu bytes)\n",
+	        (unsigned long long)alloc_count,
+	        (unsigned long long)alloc_bytes);
+	fprintf(stderr, "  Wall time         : %.3f ms\n", wall_ms);
+	fprintf(stderr, "  CPU time          : user %.3f ms, sys %.3f ms\n",
+	        tv_ms(ru->ru_utime), tv_ms(ru->ru_stime));
+	fprintf(stderr, "  Peak buffers      : %zu kB\n", mem_peak() / 1024);
+	fprintf(stderr, "  Peak RSS          : %ld kB\n", ru->ru_maxrss);
+	fprintf(stderr, "  Page faults       : minor %ld, major %ld\n",
+	        ru->ru_minflt, ru->ru_majflt);
+}
+
+static void
+report_json(const char *command, double wall_ms, const struct rusage *ru)
+{
+	int i, first = 1;
+
+	fprintf(stderr, "{\"command\":\"%s\",\"wall_ms\":%.3f,\"phases\":{",
+	        command, wall_ms);
+	for (i = 0; i < STATS_PHASE_COUNT; i++) {
+		if (0 == phases[i].calls)
+			continue;
+		fprintf(stderr, "%s\"%s\":{\"calls\":%llu,\"ms\":%.3f,"
+		        "\"bytes_in\":%llu,\"bytes_out\":%llu}",
+		        first ? "" : ",", phase_names[i],
+		        (unsigned long long)phases[i].calls,
+		        phases[i].time_ns / 1e6,
+		        (unsigned long long)phases[i].bytes_in,
+		        (unsigned long long)phases[i].bytes_out);
+		first = 0;
+	}
+	fprintf(stderr, "},\"loaders\":{");
+	for (i = 0; i < STATS_MAX_LOADERS && loaders[i].name; i++) {
+		fprintf(stderr, "%s\"%s\":{\"files\":%llu,\"bytes\":%llu,"
+		        "\"ms\":%.3f,\"mb_per_s\":%.1f}", i ? "," : "",
+		        loaders[i].name,
+		        (unsigned long long)loaders[i].files,
+		        (unsigned long long)loaders[i].bytes,
+		        loaders[i].time_ns / 1e6, loader_mbps(&loaders[i]));
+	}
+	fprintf(stderr, "},\"backend\":\"%s\",\"compression_ratio\":%.3f,"
+	        "\"allocations\":{\"count\":%llu,\"bytes\":%llu},"
+	        "\"peak_buffers\":%zu,"
+	        "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld,"
+	        "\"minor_faults\":%ld,\"major_faults\":%ld}\n",
+	        zlib_backend_name(), compression_ratio(),
+	        (unsigned long long)alloc_count,
+	        (unsigned long long)alloc_bytes, mem_peak(),
+	        tv_ms(ru->ru_utime), tv_ms(ru->ru_stime), ru->ru_maxrss,
+	        ru->ru_minflt, ru->ru_majflt);
+}
+
+void
+stats_report(const char *command)
+{
+	struct rusage ru;
+	double wall_ms;
+
+	if (STATS_OFF == stats_mode)
+		return;
+
+	wall_ms = (monotonic_ns() - stats_start_ns) / 1e6;
+	memset(&ru, 0, sizeof(struct rusage));
+	if (0 != getrusage(RUSAGE_SELF, &ru)) {
+		perror("Failed to read resource usage");
+	}
+
+	if (STATS_JSON == stats_mode) {
+		report_json(command, wall_ms, &ru);
+	} else {
+		report_text(command, wall_ms, &ru);
+	}
+}
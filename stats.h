@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output format of the statistics report. */
+#define STATS_OFF	0
+#define STATS_TEXT	1
+#define STATS_JSON	2
+
+/* Instrumented processing phases. */
+typedef enum stats_phase
+{
+	STATS_LOAD = 0,		/* open/fstat/mmap of input files */
+	STATS_SCAN,		/* hole and zero page scan of inputs */
+	STATS_ASSEMBLE,		/* copying components into the payload */
+	STATS_DEFLATE,		/* zlib compression */
+	STATS_INFLATE,		/* zlib decompression */
+	STATS_CKSUM,		/* POSIX cksum calculation */
+	STATS_WRITE,		/* writing output files */
+	STATS_MATCH,		/* delta matching of two payloads */
+	STATS_EXT2,		/* ramdisk layout of create -R */
+	STATS_HASH,		/* SHA-256 of components */
+	STATS_PHASE_COUNT
+} stats_phase_t;
+
+void     stats_init(int);
+int      stats_enabled(void);
+uint64_t stats_begin(void);
+void     stats_end(stats_phase_t, uint64_t, size_t, size_t);
+void     stats_alloc(size_t);
+void     stats_loader(const char *, size_t, uint64_t);
+void     stats_report(const char *);
+
+#endif /* _STATS_H_ */
@@ -0,0 +1,296 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "mem.h"
+#include "stats.h"
+#include "store.h"
+#include "util.h"
+
+/*
+ * Layout of a store:
+ *
+ *   objects/ab/cdef...	components, named by their SHA-256
+ *   manifests/SHA.sha256	digests of the image with SHA-256 SHA and
+ *				of its components, in sha256sum format
+ */
+
+static int
+store_mkdir(const char *path)
+{
+	if (0 != mkdir(path, 0755) && EEXIST != errno) {
+		fprintf(stderr, "Failed to create %s: %s\n", path,
+		        strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+store_init(const char *dir)
+{
+	char path[PATH_MAX];
+
+	if (0 != store_mkdir(dir))
+		return 1;
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	if (0 != store_mkdir(path))
+		return 1;
+	snprintf(path, sizeof(path), "%s/manifests", dir);
+
+	return store_mkdir(path);
+}
+
+static int
+store_tmp(const char *dir, store_obj_t *obj)
+{
+	snprintf(obj->tmp, sizeof(obj->tmp), "%s/tmp-XXXXXX", dir);
+	obj->fd = mkstemp(obj->tmp);
+	if (-1 == obj->fd) {
+		fprintf(stderr, "Failed to create %s: %s\n", obj->tmp,
+		        strerror(errno));
+		obj->tmp[0] = '\0';
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Starts an object of len bytes. */
+int
+store_obj_begin(const char *dir, store_obj_t *obj, uint64_t len)
+{
+	memset(obj, 0, sizeof(store_obj_t));
+	obj->fd = -1;
+	sha256_init(&obj->sha);
+
+	if (0 == len)
+		return 0;
+	if (len <= STORE_MEM_MAX && mem_fits(len)) {
+		obj->buf = mem_alloc(len);
+		if (NULL != obj->buf) {
+			obj->buf_len = len;
+			return 0;
+		}
+	}
+
+	return store_tmp(dir, obj);
+}
+
+int
+store_obj_write(store_obj_t *obj, const char *data, size_t len)
+{
+	uint64_t start;
+
+	start = stats_begin();
+	sha256_update(&obj->sha, data, len);
+	stats_end(STATS_HASH, start, len, 0);
+
+	if (-1 != obj->fd)
+		return write_all(obj->fd, data, len);
+	if (obj->len + len > obj->buf_len) {
+		fprintf(stderr, "Store object larger than announced!\n");
+		return 1;
+	}
+	memcpy(obj->buf + obj->len, data, len);
+	obj->len += len;
+
+	return 0;
+}
+
+/*
+ * Puts name next to an object. A hard link shares the object outright,
+ * across filesystems or where links are refused a reflink still shares
+ * its blocks. Only when neither works the bytes are copied.
+ */
+static int
+store_place(const char *path, const store_obj_t *obj, const char *name)
+{
+	ssize_t n;
+	int src, dst, rv = 1;
+
+	if (0 == link(path, name))
+		return 0;
+	if (EEXIST == errno) {
+		fprintf(stderr, "Failed to create %s: %s\n", name,
+		        strerror(errno));
+		return 1;
+	}
+
+	dst = create_file(name);
+	if (-1 == dst)
+		return 1;
+	src = open(path, O_RDONLY);
+	if (-1 == src) {
+		fprintf(stderr, "Failed to open %s: %s\n", path,
+		        strerror(errno));
+		goto place_failed;
+	}
+#ifdef FICLONE
+	if (0 == ioctl(dst, FICLONE, src)) {
+		rv = 0;
+		goto place_failed;
+	}
+#endif
+	if (NULL != obj->buf) {
+		rv = write_all(dst, obj->buf, obj->len);
+		goto place_failed;
+	}
+	do {
+		n = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0);
+	} while (n > 0);
+	if (0 != n) {
+		perror("Failed to copy store object");
+		goto place_failed;
+	}
+	rv = 0;
+
+place_failed:
+	if (-1 != src)
+		close(src);
+	if (0 != close(dst)) {
+		perror("Close failed");
+		rv = 1;
+	}
+	if (0 != rv)
+		unlink(name);
+
+	return rv;
+}
+
+/*
+ * Finishes an object, adds it to the store unless already there and
+ * puts name next to it. Sets dup when the store had it.
+ */
+int
+store_obj_commit(const char *dir, store_obj_t *obj, const char *name,
+                 int *dup)
+{
+	char hex[SHA256_HEX_LEN];
+	char path[PATH_MAX];
+	struct stat st;
+	int rv;
+
+	sha256_final(&obj->sha, obj->digest);
+	sha256_hex(obj->digest, hex);
+
+	snprintf(path, sizeof(path), "%s/objects/%.2s", dir, hex);
+	if (0 != store_mkdir(path))
+		return 1;
+	snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, hex, hex + 2);
+
+	*dup = 0 == stat(path, &st);
+	if (!*dup) {
+		if (-1 == obj->fd && (0 != store_tmp(dir, obj) ||
+		    0 != write_all(obj->fd, obj->buf, obj->len)))
+			return 1;
+		/* Shared by every image holding it, keep it unchanged. */
+		if (0 != fchmod(obj->fd, S_IRUSR | S_IRGRP | S_IROTH)) {
+			perror("Failed to protect store object");
+			return 1;
+		}
+		if (0 != link(obj->tmp, path)) {
+			if (EEXIST != errno) {
+				fprintf(stderr, "Failed to store %s: %s\n",
+				        path, strerror(errno));
+				return 1;
+			}
+			*dup = 1;
+		}
+	}
+	rv = store_place(path, obj, name);
+	store_obj_abort(obj);
+
+	return rv;
+}
+
+/* Drops what is left of an object, the temporary file included. */
+void
+store_obj_abort(store_obj_t *obj)
+{
+	if (-1 != obj->fd) {
+		close(obj->fd);
+		obj->fd = -1;
+	}
+	if ('\0' != obj->tmp[0]) {
+		unlink(obj->tmp);
+		obj->tmp[0] = '\0';
+	}
+	mem_free(obj->buf);
+	obj->buf = NULL;
+}
+
+/*
+ * Writes the manifest of image, its digest and those of its n
+ * components under their file names. Manifests are named by the image
+ * digest, so images sharing a name keep one each. An existing manifest
+ * is never replaced by a different one.
+ */
+int
+store_manifest(const char *dir, const char *image, const uint8_t *digest,
+               const char *names[], const store_obj_t *objs[], size_t n)
+{
+	const uint8_t *digests[n + 1];
+	const char *lines[n + 1];
+	char path[PATH_MAX], hex[SHA256_HEX_LEN];
+	size_t i;
+
+	sha256_hex(digest, hex);
+	snprintf(path, sizeof(path), "%s/manifests/%s.sha256", dir, hex);
+	lines[0] = image;
+	digests[0] = digest;
+	for (i = 0; i < n; i++) {
+		lines[i + 1] = names[i];
+		digests[i + 1] = objs[i]->digest;
+	}
+
+	if (0 == access(path, F_OK)) {
+		if (0 != sha256_manifest_cmp(path, lines, digests, n + 1)) {
+			fprintf(stderr, "Manifest %s differs, not replaced!\n",
+			        path);
+			return 1;
+		}
+		printf("Manifest\t: %s (unchanged)\n", path);
+		return 0;
+	}
+
+	return sha256_manifest(path, lines, digests, n + 1, 1);
+}
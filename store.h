@@ -0,0 +1,64 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/*
+ * Object of the content addressed store of extract --store, hashed
+ * while written. Small objects are held in memory until their digest
+ * is known, so duplicates never get written at all, larger ones go to
+ * a temporary file in the store.
+ */
+typedef struct store_obj
+{
+	sha256_t	sha;
+	uint64_t	len;
+	char		*buf;
+	size_t		buf_len;
+	int		fd;		/* -1 while in memory */
+	char		tmp[PATH_MAX];
+	uint8_t		digest[SHA256_LEN];
+} store_obj_t;
+
+int  store_init(const char *);
+int  store_obj_begin(const char *, store_obj_t *, uint64_t);
+int  store_obj_write(store_obj_t *, const char *, size_t);
+int  store_obj_commit(const char *, store_obj_t *, const char *, int *);
+void store_obj_abort(store_obj_t *);
+int  store_manifest(const char *, const char *, const uint8_t *,
+                    const char *[], const store_obj_t *[], size_t);
+
+#endif /* _STORE_H_ */
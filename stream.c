@@ -0,0 +1,334 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "config.h"
+#include "layout.h"
+#include "mem.h"
+#include "stream.h"
+#include "util.h"
+
+/* Adds part i if wanted, empty parts are written right away. */
+static int
+extract_add_part(extract_stream_t *es, int i)
+{
+	extract_part_t *p;
+
+	if (!(es->pending & BOOST_PART(i)))
+		return 0;
+
+	p = &es->parts[es->nparts++];
+	p->name = &part_names[es->layout.type][i];
+	p->part = es->layout.parts[i];
+	p->index = i;
+	p->fd = -1;
+	if (es->digest)
+		sha256_init(&p->sha);
+	if (0 != p->part.len)
+		return 0;
+
+	if (es->digest)
+		sha256_final(&p->sha, p->digest);
+	es->pending &= ~BOOST_PART(i);
+	if (NULL != es->sink) {
+		p->fd = -2;
+		return 0;
+	}
+	part_print_offset(p->name, &p->part);
+	if (0 != write_to_file(NULL, 0, p->name->filename)) {
+		printf("Writing %s\t: Failed\n", p->name->tag);
+		return 1;
+	}
+	p->fd = -2;
+	printf("Writing %s\t: OK\n", p->name->tag);
+
+	return 0;
+}
+
+static int
+extract_part_write(extract_stream_t *es, extract_part_t *p, size_t pos,
+                   const char *buf, size_t len)
+{
+	size_t from, to, end = p->part.off + p->part.len;
+
+	from = pos > p->part.off ? pos : p->part.off;
+	to = pos + len < end ? pos + len : end;
+	if (from >= to)
+		return 0;
+
+	if (es->digest) {
+		sha256_update(&p->sha, buf + (from - pos), to - from);
+		if (to == end)
+			sha256_final(&p->sha, p->digest);
+	}
+	if (NULL != es->sink) {
+		if (to == end)
+			p->fd = -2;
+		return es->sink(es->sink_ctx, p->index, from - p->part.off,
+		                buf + (from - pos), to - from);
+	}
+	if (-1 == p->fd) {
+		part_print_offset(p->name, &p->part);
+		p->fd = create_file(p->name->filename);
+		if (-1 == p->fd) {
+			printf("Writing %s\t: Failed\n", p->name->tag);
+			return 1;
+		}
+	}
+	if (0 != write_all(p->fd, buf + (from - pos), to - from)) {
+		printf("Writing %s\t: Failed\n", p->name->tag);
+		return 1;
+	}
+	if (to == end) {
+		if (0 != close(p->fd)) {
+			perror("Close failed");
+			p->fd = -2;
+			return 1;
+		}
+		p->fd = -2;
+		printf("Writing %s\t: OK\n", p->name->tag);
+	}
+
+	return 0;
+}
+
+/* Sets up the parts once the first instruction is known. */
+static int
+extract_stream_layout(extract_stream_t *es)
+{
+	es->cap_off = SIZE_MAX;
+	if (0 != boost_layout(es->type, es->cap.first_instr, es->total,
+	                      &es->layout)) {
+		/* No parts to go by, the payload is passed on whole. */
+		memset(&es->layout, 0, sizeof(image_layout_t));
+		es->layout.parts[INDEX_KERNEL].len = es->total;
+	}
+
+	switch (es->layout.type) {
+	case INDEX_LAYOUT_UNKNOWN:
+		/* Nothing to select from, the payload is written whole. */
+		if (NULL == es->sink)
+			printf("Warning: unknown image format!\n");
+		es->pending = BOOST_PART(INDEX_KERNEL);
+		return extract_add_part(es, INDEX_KERNEL);
+	case INDEX_LAYOUT_LEGACY:
+		return extract_add_part(es, INDEX_KERNEL) ||
+		       extract_add_part(es, INDEX_BCODE) ||
+		       extract_add_part(es, INDEX_RAMDISK);
+	default:
+		/* Bootcode end follows from the ramdisk size in its header. */
+		if (es->pending & ~BOOST_PART(INDEX_KERNEL)) {
+			es->cap_off = es->layout.parts[INDEX_BCODE].off;
+			es->cap_len = sizeof(bcode_hdr_t);
+		}
+		return extract_add_part(es, INDEX_KERNEL);
+	}
+}
+
+static int
+extract_stream_bcode(extract_stream_t *es)
+{
+	es->cap_off = SIZE_MAX;
+	if (0 != boost_layout_bcode(&es->layout, &es->cap.bcode))
+		return 1;
+
+	return extract_add_part(es, INDEX_BCODE) ||
+	       extract_add_part(es, INDEX_RAMDISK);
+}
+
+/* Writes out n payload bytes at pos, stops once all parts are done. */
+static int
+extract_stream_write(extract_stream_t *es, size_t pos, const char *data,
+                     size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < es->nparts; i++) {
+		if (0 != extract_part_write(es, &es->parts[i], pos, data, n))
+			return 1;
+		if (-2 == es->parts[i].fd)
+			es->pending &= ~BOOST_PART(es->parts[i].index);
+	}
+
+	/* Ends the inflate early, the rest of the payload is not needed. */
+	if (0 == es->pending && SIZE_MAX == es->cap_off && !es->strict) {
+		es->done = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Passes len payload bytes on to the parts, 1 once done or failed. */
+static int
+extract_stream_feed(extract_stream_t *es, const char *buf, size_t len)
+{
+	const char *data;
+	size_t n, pos;
+	int rv;
+
+	while (len > 0) {
+		n = len;
+		data = buf;
+		pos = es->pos;
+		if (es->pos < es->cap_off) {
+			/* Stop short of the capture window. */
+			if (es->cap_off - es->pos < n)
+				n = es->cap_off - es->pos;
+		} else {
+			if (es->cap_off + es->cap_len - es->pos < n)
+				n = es->cap_off + es->cap_len - es->pos;
+			memcpy((char *)&es->cap + (es->pos - es->cap_off),
+			       buf, n);
+			es->pos += n;
+			buf += n;
+			len -= n;
+			if (es->pos != es->cap_off + es->cap_len)
+				continue;
+
+			/* Window complete, replay it once parts are known. */
+			pos = es->cap_off;
+			if (0 == pos)
+				rv = extract_stream_layout(es);
+			else
+				rv = extract_stream_bcode(es);
+			if (0 != rv)
+				return 1;
+			data = (const char *)&es->cap;
+			if (0 != extract_stream_write(es, pos, data,
+			                              es->pos - pos))
+				return 1;
+			continue;
+		}
+
+		if (0 != extract_stream_write(es, pos, data, n))
+			return 1;
+		es->pos += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Settles the type from the probe and replays the bytes held back. */
+static int
+extract_stream_settle(extract_stream_t *es)
+{
+	int rv;
+
+	es->type = stream_probe_type(es->hdr, &es->probe);
+	es->probing = 0;
+	rv = extract_stream_feed(es, es->held, es->held_len);
+	extract_stream_free(es);
+
+	return rv;
+}
+
+/* Inflate sink of a streamed extract, ctx is the extract_stream_t. */
+int
+extract_stream_sink(void *ctx, const char *buf, size_t len)
+{
+	extract_stream_t *es = ctx;
+	size_t cap;
+	char *tmp;
+
+	if (!es->probing)
+		return extract_stream_feed(es, buf, len);
+
+	/* Nothing is written before the probe window has passed. */
+	if (es->held_len + len > es->held_cap) {
+		cap = es->held_cap < STREAM_BUF_SIZE ?
+		      STREAM_BUF_SIZE : es->held_cap * 2;
+		if (cap > es->total)
+			cap = es->total;
+		if (cap < es->held_len + len)
+			cap = es->held_len + len;
+		tmp = mem_realloc(es->held, cap);
+		if (NULL == tmp)
+			return 1;
+		es->held = tmp;
+		es->held_cap = cap;
+	}
+	memcpy(es->held + es->held_len, buf, len);
+	es->held_len += len;
+	if (0 == stream_probe_sink(&es->probe, buf, len))
+		return 0;
+
+	return extract_stream_settle(es);
+}
+
+/*
+ * Settles the layout type of a streamed extract before its payload
+ * goes through extract_stream_sink(). Raw payloads are probed in
+ * place. Zlib payloads are probed as they inflate, the sink holding
+ * back its output until the branch target is decoded, so the payload
+ * is inflated once; only when the held bytes might not fit the memory
+ * budget is the probe window inflated through buf first.
+ */
+void
+extract_stream_begin(extract_stream_t *es, const boost_hdr_t *hdr,
+                     const char *data, char *buf)
+{
+	if (!(hdr->flags & BOOST_FLAG_ZLIB) ||
+	    !mem_fits(es->total + STREAM_BUF_SIZE + zlib_inflate_mem())) {
+		es->type = stream_layout_type(hdr, data, buf);
+		return;
+	}
+
+	es->hdr = hdr;
+	memset(&es->probe, 0, sizeof(stream_probe_t));
+	es->probe.total = es->total;
+	es->probing = 1;
+}
+
+/* Flushes what a payload shorter than its probe window left held. */
+int
+extract_stream_end(extract_stream_t *es)
+{
+	if (!es->probing)
+		return 0;
+
+	return extract_stream_settle(es);
+}
+
+/* Releases the held bytes of an extract that did not get to the end. */
+void
+extract_stream_free(extract_stream_t *es)
+{
+	mem_free(es->held);
+	es->held = NULL;
+	es->held_len = 0;
+	es->held_cap = 0;
+}
@@ -0,0 +1,96 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boost.h"
+#include "index.h"
+#include "layout.h"
+#include "sha256.h"
+
+/* One output file of a streamed extract. */
+typedef struct extract_part
+{
+	const part_name_t	*name;
+	index_part_t	part;
+	int		index;		/* INDEX_KERNEL and friends */
+	int		fd;
+	sha256_t	sha;		/* running digest, with es->digest */
+	uint8_t		digest[SHA256_LEN];
+} extract_part_t;
+
+/* Receives the bytes of component part at offset off within it. */
+typedef int (*part_sink_t)(void *ctx, int part, uint64_t off,
+                           const char *buf, size_t len);
+
+/*
+ * State of a streamed extract. Parts are only known once the first
+ * instruction and, for new images, the bootcode header have passed,
+ * so those bytes are captured and replayed before anything that
+ * depends on them is written.
+ */
+typedef struct extract_stream
+{
+	uint32_t	type;		/* see extract_stream_begin() */
+	image_layout_t	layout;
+	extract_part_t	parts[INDEX_PARTS];
+	size_t		nparts;
+	unsigned	pending;	/* wanted parts not written yet */
+	int		done;		/* all wanted parts written */
+	size_t		total;
+	size_t		pos;
+	size_t		cap_off;	/* capture window, SIZE_MAX when none */
+	size_t		cap_len;
+	union {
+		uint32_t	first_instr;
+		bcode_hdr_t	bcode;
+	} cap;
+	part_sink_t	sink;		/* replaces the files when set */
+	void		*sink_ctx;
+	int		strict;		/* sink wants a valid layout and all */
+	int		digest;		/* SHA-256 of each part as it passes */
+	const boost_hdr_t *hdr;
+	stream_probe_t	probe;
+	int		probing;	/* output held until the type is known */
+	char		*held;
+	size_t		held_len;
+	size_t		held_cap;
+} extract_stream_t;
+
+void extract_stream_begin(extract_stream_t *, const boost_hdr_t *,
+                          const char *, char *);
+int  extract_stream_sink(void *, const char *, size_t);
+int  extract_stream_end(extract_stream_t *);
+void extract_stream_free(extract_stream_t *);
+
+#endif /* _STREAM_H_ */
@@ -0,0 +1,231 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_SPAN	'X'
+#define TRACE_CNTR	'C'
+
+typedef struct trace_event
+{
+	const char	*name;
+	uint64_t	ts;
+	int64_t		arg;	/* span duration or counter value */
+	char		type;
+} trace_event_t;
+
+/* Per-thread event ring, registered globally on first use. */
+typedef struct trace_ring
+{
+	struct trace_ring	*next;
+	const char		*thread_name;
+	pid_t			tid;
+	uint64_t		head;
+	trace_event_t		events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+int trace_enabled = 0;
+
+static char *trace_filename;
+static uint64_t trace_start_ns;
+static trace_ring_t *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t *thread_ring;
+
+static trace_ring_t *
+trace_get_ring(void)
+{
+	trace_ring_t *ring = thread_ring;
+
+	if (NULL != ring)
+		return ring;
+
+	ring = calloc(1, sizeof(trace_ring_t));
+	if (NULL == ring)
+		return NULL;
+	ring->tid = gettid();
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+static void
+trace_record(char type, const char *name, uint64_t ts, int64_t arg)
+{
+	trace_ring_t *ring = trace_get_ring();
+	trace_event_t *ev;
+
+	if (NULL == ring)
+		return;
+
+	ev = &ring->events[ring->head % TRACE_RING_EVENTS];
+	ev->name = name;
+	ev->ts = ts;
+	ev->arg = arg;
+	ev->type = type;
+	ring->head++;
+}
+
+int
+trace_open(const char *filename)
+{
+	trace_filename = strdup(filename);
+	if (NULL == trace_filename) {
+		fprintf(stderr, "Out of memory while enabling tracing!\n");
+		return 1;
+	}
+
+	trace_start_ns = monotonic_ns();
+	trace_enabled = 1;
+	trace_thread_name("main");
+
+	return 0;
+}
+
+void
+trace_thread_name(const char *name)
+{
+	trace_ring_t *ring;
+
+	if (!trace_enabled)
+		return;
+
+	ring = trace_get_ring();
+	if (NULL != ring)
+		ring->thread_name = name;
+}
+
+/* Records a span which started at 'start' and ends now. */
+void
+trace_span(const char *name, uint64_t start)
+{
+	uint64_t now = monotonic_ns();
+
+	trace_record(TRACE_SPAN, name, start, now - start);
+}
+
+void
+trace_counter(const char *name, int64_t value)
+{
+	trace_record(TRACE_CNTR, name, monotonic_ns(), value);
+}
+
+static void
+trace_write_ring(FILE *f, const trace_ring_t *ring, pid_t pid, int *first)
+{
+	const trace_event_t *ev;
+	uint64_t i = 0;
+
+	if (ring->head > TRACE_RING_EVENTS)
+		i = ring->head - TRACE_RING_EVENTS;
+
+	if (ring->thread_name) {
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		        "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+		        *first ? "" : ",", pid, ring->tid, ring->thread_name);
+		*first = 0;
+	}
+
+	for (; i < ring->head; i++) {
+		ev = &ring->events[i % TRACE_RING_EVENTS];
+		if (ev->ts < trace_start_ns)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+		        "\"pid\":%d,\"tid\":%d,", *first ? "" : ",",
+		        ev->name, ev->type, (ev->ts - trace_start_ns) / 1e3,
+		        pid, ring->tid);
+		if (TRACE_SPAN == ev->type) {
+			fprintf(f, "\"dur\":%.3f}", ev->arg / 1e3);
+		} else {
+			fprintf(f, "\"args\":{\"value\":%lld}}",
+			        (long long)ev->arg);
+		}
+		*first = 0;
+	}
+}
+
+/*
+ * Disables tracing and dumps all buffered events in Chrome trace-event
+ * JSON format. Must be called once all worker threads are done.
+ */
+int
+trace_close(void)
+{
+	trace_ring_t *ring, *next;
+	pid_t pid = getpid();
+	int first = 1;
+	int rv = 0;
+	FILE *f;
+
+	if (!trace_enabled)
+		return 0;
+	trace_enabled = 0;
+
+	f = fopen(trace_filename, "w");
+	if (NULL == f) {
+		perror("Failed to create trace file");
+		rv = 1;
+	} else {
+		fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+		for (ring = rings; ring; ring = ring->next) {
+			trace_write_ring(f, ring, pid, &first);
+		}
+		fprintf(f, "\n]}\n");
+		if (0 != fclose(f)) {
+			perror("Failed to close trace file");
+			rv = 1;
+		}
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = next) {
+		next = ring->next;
+		free(ring);
+	}
+	rings = NULL;
+	pthread_mutex_unlock(&rings_lock);
+	thread_ring = NULL;
+
+	free(trace_filename);
+	trace_filename = NULL;
+
+	return rv;
+}
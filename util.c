@@ -28,15 +28,101 @@
  */
 
 #include <sys/stat.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
+#include <math.h>
 #include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 #include "util.h"
+#include "pool.h"
+#include "mem.h"
+#include "stats.h"
+#include "trace.h"
 #include "config.h"
 
+/* Amount of input handed to zlib per call, one trace span each. */
+#define ZLIB_BLOCK_SIZE	(1024*1024)
+
+/* Fixed part of zlib stream state plus allocation overhead. */
+#define ZLIB_STATE_SLACK	(12*1024)
+
+/* Smallest window zlib accepts for zlib wrapped streams. */
+#define ZLIB_MIN_WBITS		9
+
+/* Piece size of memcpy_cksum(), small enough to stay in L1. */
+#define CKSUM_COPY_CHUNK	(4*1024)
+
+/* Granularity at which cksum_update() looks for zero runs. */
+#define CKSUM_ZERO_CHUNK	(4*1024)
+
+/* Largest prime below 2^16, the Adler-32 modulus. */
+#define ZLIB_ADLER_BASE		65521
+
+/* Empty stored block a full flush ends with, plus bit padding. */
+#define ZLIB_FLUSH_SLACK	16
+
+/* Size of the shared zero page zero segments are fed from. */
+#define ZERO_PAGE_SIZE		(64*1024)
+
+/* Zero segments from this size on are compressed with Z_RLE. */
+#define ZERO_RLE_MIN		(64*1024)
+
+/* Vector type of the zero scan, lowered to whatever the target has. */
+typedef uint64_t zvec_t __attribute__((vector_size(32), may_alias));
+
+/*
+ * Compression backend. All backends produce and accept plain zlib
+ * streams, they only differ in speed.
+ */
+typedef struct zlib_backend
+{
+	const char	*name;
+	int		(*compress)(const segment_t *, size_t,
+			            const zlib_params_t *, void *, size_t,
+			            size_t *, uint32_t *);
+	int		(*decompress)(const char *, size_t, void *, size_t,
+			              size_t *, uint32_t *);
+} zlib_backend_t;
+
+static int zlib_deflate_segs(const segment_t *, size_t, const zlib_params_t *,
+                             void *, size_t, size_t *, uint32_t *);
+static int zlib_inflate_buf(const char *, size_t, void *, size_t, size_t *,
+                            uint32_t *);
+static int zlib_deflate_run(const segment_t *, size_t, const zlib_params_t *,
+                            int, char *, size_t, zlib_sink_t, void *,
+                            size_t *, uint32_t *);
+static int zlib_inflate_run(const char *, size_t, char *, size_t,
+                            zlib_sink_t, void *, size_t *, uint32_t *);
+#ifdef HAVE_LIBDEFLATE
+static int libdeflate_compress_segs(const segment_t *, size_t,
+                                    const zlib_params_t *, void *, size_t,
+                                    size_t *, uint32_t *);
+static int libdeflate_decompress_buf(const char *, size_t, void *, size_t,
+                                     size_t *, uint32_t *);
+#endif
+
+/* The first entry is the default. */
+static const zlib_backend_t backends[] = {
+#ifdef HAVE_LIBDEFLATE
+	{ "libdeflate", libdeflate_compress_segs, libdeflate_decompress_buf },
+#endif
+	{ "zlib", zlib_deflate_segs, zlib_inflate_buf },
+};
+
+static const zlib_backend_t *backend = &backends[0];
+
+/* Source of zero segment input, never written to. */
+static char zero_page[ZERO_PAGE_SIZE];
+
 uint32_t swap_bytes_be(uint32_t arg)
 {
 	uint32_t ret;
@@ -50,45 +136,85 @@ uint32_t swap_bytes_be(uint32_t arg)
 	return ret;
 }
 
+uint64_t
+monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int
+zlib_set_backend(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (0 == strcmp(backends[i].name, name)) {
+			backend = &backends[i];
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown compression backend: %s\n", name);
+	return 1;
+}
+
+const char *
+zlib_backend_name(void)
+{
+	return backend->name;
+}
+
+/* Space separated list of compiled in backends. */
+const char *
+zlib_backend_list(void)
+{
+#ifdef HAVE_LIBDEFLATE
+	return "libdeflate zlib";
+#else
+	return "zlib";
+#endif
+}
+
 void *
 zlib_decompress(const char *data, size_t len, size_t *out_len)
+{
+	return zlib_decompress_cksum(data, len, out_len, NULL);
+}
+
+/*
+ * Decompresses and, when crc is given, feeds all len input bytes into
+ * the running cksum CRC in the same pass, whether inflate succeeds or not.
+ */
+void *
+zlib_decompress_cksum(const char *data, size_t len, size_t *out_len,
+                      uint32_t *crc)
 {
 	char *out_buf = NULL;
 	char *tmp_ptr = NULL;
-	z_stream zs;
 
-	memset(&zs, 0, sizeof(z_stream));
-	if (Z_OK != inflateInit(&zs)) {
-		fprintf(stderr, "Failed to init zlib decompressor!\n");
-		return NULL;
-	}
-	zs.next_in = (Bytef *)data;
-	zs.avail_in = len;
-
-	out_buf = malloc(MAX_IMAGE_BUF_SIZE);
+	out_buf = mem_alloc(MAX_IMAGE_BUF_SIZE);
 	if (NULL == out_buf) {
 		fprintf(stderr, "Out of memory while allocating output "
 		        "decompress buffer!\n");
-		goto decompress_failed;
-	}
-	zs.next_out = (Bytef *)out_buf;
-	zs.avail_out = MAX_IMAGE_BUF_SIZE;
-
-	if (Z_STREAM_END != inflate(&zs, Z_FINISH)) {
-		fprintf(stderr, "Zlib decompression failed: %s\n", zs.msg);
-		goto decompress_failed;
+		if (crc)
+			*crc = cksum_update(*crc, data, len);
+		return NULL;
 	}
 
-	*out_len = MAX_IMAGE_BUF_SIZE - zs.avail_out;
-	if (Z_OK != inflateEnd(&zs)) {
-		fprintf(stderr, "Failed to close zlib decompressor!\n");
+	if (0 != zlib_decompress_into(data, len, out_buf, MAX_IMAGE_BUF_SIZE,
+	                              out_len, crc)) {
+		mem_free(out_buf);
+		return NULL;
 	}
 
 	if (MAX_IMAGE_BUF_SIZE == *out_len) {
 		return out_buf;
 	}
 
-	tmp_ptr = realloc(out_buf, *out_len);
+	tmp_ptr = mem_realloc(out_buf, *out_len);
 	if (NULL == tmp_ptr) {
 		fprintf(stderr, "Shrinking of output image buffer failed!\n");
 	} else {
@@ -96,10 +222,115 @@ zlib_decompress(const char *data, size_t len, size_t *out_len)
 	}
 
 	return out_buf;
+}
+
+/* Decompresses into a caller provided buffer of cap bytes. */
+int
+zlib_decompress_into(const char *data, size_t len, void *out, size_t cap,
+                     size_t *out_len, uint32_t *crc)
+{
+	uint64_t start;
+	int rv;
+
+	start = stats_begin();
+	rv = backend->decompress(data, len, out, cap, out_len, crc);
+	if (0 == rv)
+		stats_end(STATS_INFLATE, start, len, *out_len);
+
+	return rv;
+}
+
+static int
+zlib_inflate_buf(const char *data, size_t len, void *out, size_t cap,
+                 size_t *out_len, uint32_t *crc)
+{
+	return zlib_inflate_run(data, len, out, cap, NULL, NULL, out_len, crc);
+}
+
+/*
+ * Decompresses in pieces of buf_len bytes which are handed to sink as
+ * they fill up, for when the payload does not fit in memory. Always
+ * uses zlib, whatever the selected backend.
+ */
+int
+zlib_decompress_stream(const char *data, size_t len, void *buf,
+                       size_t buf_len, zlib_sink_t sink, void *ctx,
+                       size_t *out_len, uint32_t *crc)
+{
+	uint64_t start;
+	int rv;
+
+	start = stats_begin();
+	rv = zlib_inflate_run(data, len, buf, buf_len, sink, ctx, out_len,
+	                      crc);
+	stats_end(STATS_INFLATE, start, len, *out_len);
+
+	return rv;
+}
+
+/*
+ * Inflates into out, which either takes the whole payload or, given a
+ * sink, is drained into it every time it fills up.
+ */
+static int
+zlib_inflate_run(const char *data, size_t len, char *out, size_t cap,
+                 zlib_sink_t sink, void *ctx, size_t *out_len, uint32_t *crc)
+{
+	uint64_t block_start;
+	size_t remaining = len, crc_done = 0;
+	int ret = Z_OK;
+	int rv = 1;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != inflateInit(&zs)) {
+		fprintf(stderr, "Failed to init zlib decompressor!\n");
+		goto decompress_failed;
+	}
+	zs.next_in = (Bytef *)data;
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = cap;
+
+	while (Z_OK == ret) {
+		if (0 == zs.avail_in) {
+			if (0 == remaining)
+				break;
+			zs.avail_in = remaining < ZLIB_BLOCK_SIZE ?
+			              remaining : ZLIB_BLOCK_SIZE;
+			remaining -= zs.avail_in;
+		}
+		block_start = TRACE_BEGIN();
+		ret = inflate(&zs, Z_NO_FLUSH);
+		TRACE_END("inflate block", block_start);
+		TRACE_COUNTER("inflate buffer", zs.total_out);
+		if (crc) {
+			*crc = cksum_update(*crc, data + crc_done,
+			                    zs.total_in - crc_done);
+			crc_done = zs.total_in;
+		}
+		if (sink && (0 == zs.avail_out || Z_STREAM_END == ret)) {
+			if (0 != sink(ctx, out, cap - zs.avail_out))
+				goto decompress_failed;
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = cap;
+		}
+	}
+	if (Z_STREAM_END != ret) {
+		fprintf(stderr, "Zlib decompression failed: %s\n",
+		        zs.msg ? zs.msg : 0 == zs.avail_out ?
+		        "output buffer too small" : "truncated stream");
+		goto decompress_failed;
+	}
+
+	rv = 0;
 
 decompress_failed:
-	if (NULL != out_buf) {
-		free(out_buf);
+	/* Also set when a sink ends the inflate early. */
+	*out_len = zs.total_out;
+	if (crc) {
+		*crc = cksum_update(*crc, data + crc_done, len - crc_done);
 	}
 
 	if (NULL != zs.next_in) {
@@ -108,48 +339,135 @@ decompress_failed:
 		}
 	}
 
-	return NULL;
+	return rv;
+}
+
+void
+zlib_default_params(zlib_params_t *params)
+{
+	params->level = Z_DEFAULT_COMPRESSION;
+	params->strategy = Z_DEFAULT_STRATEGY;
+	params->mem_level = 8;
+	params->window_bits = MAX_WBITS;
+}
+
+/*
+ * Memory deflate allocates for its state, see zconf.h. The slack
+ * covers the fixed size part and allocation headers.
+ */
+size_t
+zlib_deflate_mem(const zlib_params_t *params)
+{
+	return ((size_t)1 << (params->window_bits + 2)) +
+	       ((size_t)1 << (params->mem_level + 9)) + ZLIB_STATE_SLACK;
+}
+
+/* Memory inflate allocates for its state and a full window. */
+size_t
+zlib_inflate_mem(void)
+{
+	return ((size_t)1 << MAX_WBITS) + ZLIB_STATE_SLACK;
+}
+
+/*
+ * Shrinks the hash table and window until deflate fits into avail
+ * bytes, always cutting the larger of the two. Returns 1 if even the
+ * smallest settings do not fit.
+ */
+int
+zlib_fit_params(zlib_params_t *params, size_t avail)
+{
+	while (zlib_deflate_mem(params) > avail) {
+		if (params->window_bits > ZLIB_MIN_WBITS &&
+		    params->window_bits + 2 >= params->mem_level + 9) {
+			params->window_bits--;
+		} else if (params->mem_level > 1) {
+			params->mem_level--;
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Upper bound of the zlib stream any backend produces for len input
+ * bytes with default parameters.
+ */
+size_t
+zlib_compress_bound(size_t len)
+{
+	size_t bound = compressBound(len);
+#ifdef HAVE_LIBDEFLATE
+	size_t ld_bound = libdeflate_zlib_compress_bound(NULL, len);
+
+	if (ld_bound > bound)
+		bound = ld_bound;
+#endif
+	return bound;
 }
 
 void *
 zlib_compress(const char *data, size_t len, size_t *out_len)
+{
+	zlib_params_t params;
+
+	zlib_default_params(&params);
+	return zlib_compress_params(data, len, &params, out_len);
+}
+
+void *
+zlib_compress_params(const char *data, size_t len,
+                     const zlib_params_t *params, size_t *out_len)
+{
+	return zlib_compress_cksum(data, len, params, out_len, NULL);
+}
+
+/*
+ * Compresses and, when crc is given, feeds the produced stream into the
+ * running cksum CRC while it is still hot in cache.
+ */
+void *
+zlib_compress_cksum(const char *data, size_t len, const zlib_params_t *params,
+                    size_t *out_len, uint32_t *crc)
+{
+	segment_t seg = { data, len };
+
+	return zlib_compress_segs(&seg, 1, params, out_len, crc);
+}
+
+/*
+ * Compresses the concatenation of segs into one zlib stream. Zero
+ * segments are never materialised, the compressor reads them from a
+ * shared zero page.
+ */
+void *
+zlib_compress_segs(const segment_t *segs, size_t nsegs,
+                   const zlib_params_t *params, size_t *out_len,
+                   uint32_t *crc)
 {
 	char *out_buf = NULL;
 	char *tmp_ptr = NULL;
-	z_stream zs;
 
-	memset(&zs, 0, sizeof(z_stream));
-	if (Z_OK != deflateInit(&zs, Z_DEFAULT_COMPRESSION)) {
-		fprintf(stderr, "Failed to init zlib compressor!\n");
-		return NULL;
-	}
-	zs.next_in = (Bytef *)data;
-	zs.avail_in = len;
-
-	out_buf = malloc(MAX_IMAGE_BUF_SIZE);
+	out_buf = mem_alloc(MAX_IMAGE_BUF_SIZE);
 	if (NULL == out_buf) {
 		fprintf(stderr, "Out of memory while allocating output "
 		                "compression buffer!\n");
-		goto compress_failed;
-	}
-	zs.next_out = (Bytef *)out_buf;
-	zs.avail_out = MAX_IMAGE_BUF_SIZE;
-
-	if (Z_STREAM_END != deflate(&zs, Z_FINISH)) {
-		fprintf(stderr, "Zlib compression failed: %s\n", zs.msg);
-		goto compress_failed;
+		return NULL;
 	}
 
-	*out_len = MAX_IMAGE_BUF_SIZE - zs.avail_out;
-	if (Z_OK != deflateEnd(&zs)) {
-		fprintf(stderr, "Failed to close zlib compressor!\n");
+	if (0 != zlib_compress_into(segs, nsegs, params, out_buf,
+	                            MAX_IMAGE_BUF_SIZE, out_len, crc)) {
+		mem_free(out_buf);
+		return NULL;
 	}
 
 	if (MAX_IMAGE_BUF_SIZE == *out_len) {
 		return out_buf;
 	}
 
-	tmp_ptr = realloc(out_buf, *out_len);
+	tmp_ptr = mem_realloc(out_buf, *out_len);
 	if (NULL == tmp_ptr) {
 		fprintf(stderr, "Shrinking of output image buffer failed!\n");
 	} else {
@@ -157,129 +475,1278 @@ zlib_compress(const char *data, size_t len, size_t *out_len)
 	}
 
 	return out_buf;
+}
+
+/*
+ * Compresses segs into a caller provided buffer of cap bytes, size it
+ * with zlib_compress_bound() to be safe.
+ */
+int
+zlib_compress_into(const segment_t *segs, size_t nsegs,
+                   const zlib_params_t *params, void *out, size_t cap,
+                   size_t *out_len, uint32_t *crc)
+{
+	uint64_t start;
+	int rv;
+
+	start = stats_begin();
+	rv = backend->compress(segs, nsegs, params, out, cap, out_len, crc);
+	if (0 == rv)
+		stats_end(STATS_DEFLATE, start, segs_len(segs, nsegs),
+		          *out_len);
+
+	return rv;
+}
+
+size_t
+segs_len(const segment_t *segs, size_t nsegs)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < nsegs; i++)
+		len += segs[i].len;
+
+	return len;
+}
+
+/* Copies segs into one freshly allocated buffer, free with mem_free(). */
+void *
+segs_flatten(const segment_t *segs, size_t nsegs, size_t *out_len)
+{
+	char *buf, *p;
+	size_t i;
+
+	*out_len = segs_len(segs, nsegs);
+	buf = mem_alloc(*out_len);
+	if (NULL == buf) {
+		fprintf(stderr, "Failed to allocate flat input buffer!\n");
+		return NULL;
+	}
+
+	for (p = buf, i = 0; i < nsegs; p += segs[i].len, i++) {
+		if (segs[i].data)
+			memcpy(p, segs[i].data, segs[i].len);
+		else
+			memset(p, 0, segs[i].len);
+	}
+
+	return buf;
+}
+
+static int
+zlib_deflate_segs(const segment_t *segs, size_t nsegs,
+                  const zlib_params_t *params, void *out, size_t cap,
+                  size_t *out_len, uint32_t *crc)
+{
+	return zlib_deflate_run(segs, nsegs, params, Z_FINISH, out, cap, NULL,
+	                        NULL, out_len, crc);
+}
+
+/*
+ * Compresses segs in pieces of buf_len bytes which are handed to sink
+ * as they fill up, for when the image does not fit in memory. Always
+ * uses zlib, whatever the selected backend.
+ */
+int
+zlib_compress_stream(const segment_t *segs, size_t nsegs,
+                     const zlib_params_t *params, void *buf, size_t buf_len,
+                     zlib_sink_t sink, void *ctx, size_t *out_len,
+                     uint32_t *crc)
+{
+	uint64_t start;
+	int rv;
+
+	start = stats_begin();
+	rv = zlib_deflate_run(segs, nsegs, params, Z_FINISH, buf, buf_len, sink,
+	                      ctx, out_len, crc);
+	if (0 == rv)
+		stats_end(STATS_DEFLATE, start, segs_len(segs, nsegs),
+		          *out_len);
+
+	return rv;
+}
+
+/*
+ * Deflates into out, which either takes the whole stream or, given a
+ * sink, is drained into it every time it fills up.
+ */
+static int
+zlib_deflate_run(const segment_t *segs, size_t nsegs,
+                 const zlib_params_t *params, int flush, char *out,
+                 size_t cap, zlib_sink_t sink, void *ctx, size_t *out_len,
+                 uint32_t *crc)
+{
+	uint64_t block_start;
+	size_t remaining, crc_done = 0;
+	size_t seg = 0, seg_off = 0, chunk;
+	int ret = Z_OK, rle = 0, want_rle;
+	int rv = 1;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != deflateInit2(&zs, params->level, Z_DEFLATED,
+	                         params->window_bits, params->mem_level,
+	                         params->strategy)) {
+		fprintf(stderr, "Failed to init zlib compressor!\n");
+		return 1;
+	}
+	zs.next_in = (Bytef *)zero_page;
+	remaining = segs_len(segs, nsegs);
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = cap;
+
+	/*
+	 * Feeding the input in blocks does not change the output stream.
+	 * Long zero runs are the exception: the match finder would crawl
+	 * through them, so the stream switches to run length matching for
+	 * their duration, which yields the same 258 byte matches at a
+	 * fraction of the cost.
+	 */
+	while (Z_OK == ret && 0 != zs.avail_out) {
+		while (0 == zs.avail_in && seg < nsegs) {
+			want_rle = NULL == segs[seg].data &&
+			           segs[seg].len >= ZERO_RLE_MIN;
+			if (0 == seg_off && want_rle != rle) {
+				ret = deflateParams(&zs, params->level,
+				                    want_rle ? Z_RLE :
+				                    params->strategy);
+				/*
+				 * The switch flushes what deflate still holds,
+				 * which may fill the buffer. It is retried
+				 * once the sink drained it.
+				 */
+				if (Z_BUF_ERROR == ret && sink &&
+				    0 == zs.avail_out) {
+					ret = Z_OK;
+					break;
+				}
+				if (Z_OK != ret)
+					break;
+			}
+			rle = want_rle;
+			chunk = segs[seg].len - seg_off;
+			if (segs[seg].data) {
+				chunk = chunk < ZLIB_BLOCK_SIZE ?
+				        chunk : ZLIB_BLOCK_SIZE;
+				zs.next_in = (Bytef *)segs[seg].data + seg_off;
+			} else {
+				chunk = chunk < ZERO_PAGE_SIZE ?
+				        chunk : ZERO_PAGE_SIZE;
+				zs.next_in = (Bytef *)zero_page;
+			}
+			zs.avail_in = chunk;
+			remaining -= chunk;
+			seg_off += chunk;
+			if (seg_off == segs[seg].len) {
+				seg++;
+				seg_off = 0;
+			}
+		}
+		if (Z_OK == ret && 0 != zs.avail_out) {
+			block_start = TRACE_BEGIN();
+			ret = deflate(&zs, remaining ? Z_NO_FLUSH : flush);
+			TRACE_END("deflate block", block_start);
+		}
+		/* Other flushes end the input without finishing the stream. */
+		if (Z_FINISH != flush && Z_OK == ret && 0 == remaining &&
+		    0 == zs.avail_in && 0 != zs.avail_out)
+			ret = Z_STREAM_END;
+		TRACE_COUNTER("deflate buffer", zs.total_out);
+		if (crc) {
+			*crc = cksum_update(*crc, out + crc_done,
+			                    cap - zs.avail_out - crc_done);
+			crc_done = cap - zs.avail_out;
+		}
+		if (sink && (0 == zs.avail_out || Z_STREAM_END == ret)) {
+			if (0 != sink(ctx, out, cap - zs.avail_out))
+				goto compress_failed;
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = cap;
+			crc_done = 0;
+		}
+	}
+	if (Z_STREAM_END != ret) {
+		fprintf(stderr, "Zlib compression failed: %s\n",
+		        zs.msg ? zs.msg : "output buffer too small");
+		goto compress_failed;
+	}
+
+	*out_len = zs.total_out;
+	rv = 0;
 
 compress_failed:
-	if (NULL != out_buf) {
-		free(out_buf);
+	/* A stream left at a flush point counts as freed prematurely. */
+	if (Z_OK != deflateEnd(&zs) && 0 == rv && Z_FINISH == flush) {
+		fprintf(stderr, "Failed to close zlib compressor!\n");
 	}
 
-	if (NULL != zs.next_in) {
-		if (Z_OK != deflateEnd(&zs)) {
-			fprintf(stderr, "Failed to close zlib compressor!\n");
+	return rv;
+}
+
+/* One chunk of a chunked stream, deflated or inflated on its own. */
+typedef struct zlib_chunk_job
+{
+	const segment_t	*segs;		/* deflate input */
+	size_t		nsegs;
+	const zlib_params_t *params;
+	int		last;
+	const char	*in;		/* inflate input */
+	size_t		in_len;
+	char		*out;
+	size_t		cap;
+	size_t		out_len;
+	uint32_t	adler;
+	int		failed;
+} zlib_chunk_job_t;
+
+/* Adler-32 continued over len zero bytes, which only move the sum B. */
+static uint32_t
+adler32_zeros(uint32_t adler, size_t len)
+{
+	uint32_t a = adler & 0xffff, b = adler >> 16;
+
+	b = (b + (uint64_t)(len % ZLIB_ADLER_BASE) * a) % ZLIB_ADLER_BASE;
+
+	return (b << 16) | a;
+}
+
+static void
+zlib_chunk_deflate(void *arg)
+{
+	zlib_chunk_job_t *job = arg;
+	zlib_params_t raw = *job->params;
+	size_t i;
+
+	job->adler = adler32(0, NULL, 0);
+	for (i = 0; i < job->nsegs; i++) {
+		if (job->segs[i].data)
+			job->adler = adler32(job->adler,
+			                     (const Bytef *)job->segs[i].data,
+			                     job->segs[i].len);
+		else
+			job->adler = adler32_zeros(job->adler,
+			                           job->segs[i].len);
+	}
+
+	/* Raw deflate, only the whole stream carries the zlib wrapper. */
+	raw.window_bits = -raw.window_bits;
+	job->failed = zlib_deflate_run(job->segs, job->nsegs, &raw,
+	                               job->last ? Z_FINISH : Z_FULL_FLUSH,
+	                               job->out, job->cap, NULL, NULL,
+	                               &job->out_len, NULL);
+}
+
+static void
+zlib_chunk_inflate(void *arg)
+{
+	zlib_chunk_job_t *job = arg;
+	unsigned char probe;
+	z_stream zs;
+	int ret;
+
+	job->failed = 1;
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != inflateInit2(&zs, -MAX_WBITS))
+		return;
+	zs.next_in = (Bytef *)job->in;
+	zs.avail_in = job->in_len;
+	zs.next_out = (Bytef *)job->out;
+	zs.avail_out = job->cap;
+
+	/*
+	 * A chunk has to fill its share of the output exactly. All but
+	 * the last end on a flush point, which a further inflate call
+	 * has to consume without producing anything.
+	 */
+	ret = inflate(&zs, Z_NO_FLUSH);
+	job->out_len = job->cap - zs.avail_out;
+	if (!job->last && Z_OK == ret && 0 == zs.avail_out) {
+		zs.next_out = &probe;
+		zs.avail_out = 1;
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (Z_BUF_ERROR == ret)
+			ret = Z_OK;
+		job->failed = Z_OK != ret || 0 == zs.avail_out ||
+		              0 != zs.avail_in;
+	} else if (job->last) {
+		job->failed = Z_STREAM_END != ret || 0 != zs.avail_out ||
+		              0 != zs.avail_in;
+	}
+	inflateEnd(&zs);
+
+	if (!job->failed)
+		job->adler = adler32(adler32(0, NULL, 0),
+		                     (const Bytef *)job->out, job->out_len);
+}
+
+/* Runs the chunk jobs on all cores, or one by one without a pool. */
+static int
+zlib_chunks_run(zlib_chunk_job_t *jobs, size_t njobs, pool_fn_t fn)
+{
+	pool_t *pool;
+	size_t i;
+
+	pool = pool_create(0);
+	for (i = 0; i < njobs; i++) {
+		if (NULL == pool || 0 != pool_submit(pool, fn, &jobs[i]))
+			fn(&jobs[i]);
+	}
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].failed)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Writes the zlib header deflate would for params to p. */
+static void
+zlib_put_header(const zlib_params_t *params, unsigned char *p)
+{
+	unsigned flg, level;
+
+	level = params->level == Z_DEFAULT_COMPRESSION ? 6 : params->level;
+	flg = level < 2 || params->strategy >= Z_HUFFMAN_ONLY ? 0 :
+	      level < 6 ? 1 : level == 6 ? 2 : 3;
+	p[0] = ((params->window_bits - 8) << 4) | Z_DEFLATED;
+	flg <<= 6;
+	flg += 31 - ((p[0] << 8) + flg) % 31;
+	p[1] = flg;
+}
+
+size_t
+zlib_chunks_count(size_t len, size_t chunk_size)
+{
+	return len ? (len + chunk_size - 1) / chunk_size : 1;
+}
+
+/* Upper bound of the stream zlib_compress_chunks() produces. */
+size_t
+zlib_chunks_bound(size_t len, size_t chunk_size)
+{
+	return ZLIB_HDR_LEN + sizeof(uint32_t) +
+	       zlib_chunks_count(len, chunk_size) *
+	       (compressBound(chunk_size) + ZLIB_FLUSH_SLACK);
+}
+
+/*
+ * Compresses segs into one zlib stream made of chunk_size pieces which
+ * were deflated independently, each ending on a full flush point so
+ * that no match reaches back into the previous one. Any inflate reads
+ * the result as a single stream, while the stream offsets of the
+ * chunks, stored to offsets, let them be inflated in parallel too.
+ * Always uses zlib, whatever the selected backend.
+ */
+int
+zlib_compress_chunks(const segment_t *segs, size_t nsegs,
+                     const zlib_params_t *params, size_t chunk_size,
+                     void *out, size_t cap, size_t *out_len, uint32_t *crc,
+                     uint32_t *offsets)
+{
+	zlib_chunk_job_t *jobs = NULL;
+	segment_t *slices = NULL;
+	unsigned char *p = out;
+	size_t total, nchunks, slot, want, take, pos;
+	size_t seg = 0, seg_off = 0, n = 0, i;
+	uint32_t adler;
+	uint64_t start;
+	int rv = 1;
+
+	start = stats_begin();
+	total = segs_len(segs, nsegs);
+	nchunks = zlib_chunks_count(total, chunk_size);
+	slot = compressBound(chunk_size) + ZLIB_FLUSH_SLACK;
+	if (cap < zlib_chunks_bound(total, chunk_size)) {
+		fprintf(stderr, "Output buffer too small for chunks!\n");
+		return 1;
+	}
+
+	jobs = mem_alloc(nchunks * sizeof(zlib_chunk_job_t));
+	slices = mem_alloc((nsegs + nchunks) * sizeof(segment_t));
+	if (NULL == jobs || NULL == slices) {
+		fprintf(stderr, "Out of memory while allocating chunks!\n");
+		goto chunks_failed;
+	}
+	memset(jobs, 0, nchunks * sizeof(zlib_chunk_job_t));
+
+	/* Cut the segments at chunk boundaries. */
+	for (i = 0; i < nchunks; i++) {
+		jobs[i].segs = slices + n;
+		jobs[i].params = params;
+		jobs[i].last = i == nchunks - 1;
+		jobs[i].out = (char *)p + ZLIB_HDR_LEN + i * slot;
+		jobs[i].cap = slot;
+		want = total - i * chunk_size < chunk_size ?
+		       total - i * chunk_size : chunk_size;
+		while (want) {
+			take = segs[seg].len - seg_off < want ?
+			       segs[seg].len - seg_off : want;
+			if (take) {
+				slices[n].data = segs[seg].data ?
+				                 segs[seg].data + seg_off : NULL;
+				slices[n++].len = take;
+			}
+			want -= take;
+			seg_off += take;
+			if (seg_off == segs[seg].len) {
+				seg++;
+				seg_off = 0;
+			}
 		}
+		jobs[i].nsegs = slices + n - jobs[i].segs;
+	}
+
+	if (0 != zlib_chunks_run(jobs, nchunks, zlib_chunk_deflate)) {
+		fprintf(stderr, "Chunked compression failed!\n");
+		goto chunks_failed;
+	}
+
+	zlib_put_header(params, p);
+
+	/* Close the gaps between the chunk slots. */
+	adler = adler32(0, NULL, 0);
+	pos = ZLIB_HDR_LEN;
+	for (i = 0; i < nchunks; i++) {
+		memmove(p + pos, jobs[i].out, jobs[i].out_len);
+		offsets[i] = pos;
+		pos += jobs[i].out_len;
+		adler = adler32_combine(adler, jobs[i].adler,
+		                        segs_len(jobs[i].segs, jobs[i].nsegs));
+	}
+	p[pos++] = adler >> 24;
+	p[pos++] = adler >> 16;
+	p[pos++] = adler >> 8;
+	p[pos++] = adler;
+
+	*out_len = pos;
+	if (crc)
+		*crc = cksum_update(*crc, out, pos);
+	stats_end(STATS_DEFLATE, start, total, pos);
+	rv = 0;
+
+chunks_failed:
+	mem_free(slices);
+	mem_free(jobs);
+
+	return rv;
+}
+
+/*
+ * Deflates the stale pieces of a stream on all cores, each on its own
+ * like the chunks of zlib_compress_chunks(), so that the others can be
+ * kept. Every piece but the last ends on a full flush point.
+ */
+int
+zlib_compress_pieces(zlib_piece_t *pieces, size_t n,
+                     const zlib_params_t *params)
+{
+	zlib_chunk_job_t *jobs;
+	size_t njobs = 0, in = 0, out = 0, i;
+	uint64_t start;
+	int rv = 1;
+
+	start = stats_begin();
+	jobs = mem_alloc(n * sizeof(zlib_chunk_job_t));
+	if (NULL == jobs)
+		return 1;
+	memset(jobs, 0, n * sizeof(zlib_chunk_job_t));
+
+	for (i = 0; i < n; i++) {
+		if (!pieces[i].stale)
+			continue;
+		mem_free(pieces[i].data);
+		pieces[i].data = NULL;
+		jobs[njobs].segs = pieces[i].segs;
+		jobs[njobs].nsegs = pieces[i].nsegs;
+		jobs[njobs].params = params;
+		jobs[njobs].last = i == n - 1;
+		jobs[njobs].cap = compressBound(segs_len(pieces[i].segs,
+		                                         pieces[i].nsegs)) +
+		                  ZLIB_FLUSH_SLACK;
+		jobs[njobs].out = mem_alloc(jobs[njobs].cap);
+		if (NULL == jobs[njobs].out)
+			goto pieces_failed;
+		njobs++;
+	}
+
+	if (0 != zlib_chunks_run(jobs, njobs, zlib_chunk_deflate)) {
+		fprintf(stderr, "Piece compression failed!\n");
+		goto pieces_failed;
+	}
+
+	for (njobs = 0, i = 0; i < n; i++) {
+		if (!pieces[i].stale)
+			continue;
+		pieces[i].data = jobs[njobs].out;
+		pieces[i].len = jobs[njobs].out_len;
+		pieces[i].in_len = segs_len(pieces[i].segs, pieces[i].nsegs);
+		pieces[i].adler = jobs[njobs].adler;
+		pieces[i].crc = cksum_update(0, pieces[i].data,
+		                             pieces[i].len);
+		pieces[i].stale = 0;
+		in += pieces[i].in_len;
+		out += pieces[i].len;
+		jobs[njobs++].out = NULL;
+	}
+	stats_end(STATS_DEFLATE, start, in, out);
+	rv = 0;
+
+pieces_failed:
+	for (i = 0; i < n; i++)
+		mem_free(jobs[i].out);
+	mem_free(jobs);
+
+	return rv;
+}
+
+/*
+ * Frames the pieces as one zlib stream: head and tail take its header
+ * and trailer, the pieces go in between. The running cksum CRC at crc
+ * is advanced over the whole stream from the CRCs of the pieces, with
+ * cksum_zeros() shifting it past each. Returns the stream length.
+ */
+size_t
+zlib_join_pieces(const zlib_piece_t *pieces, size_t n,
+                 const zlib_params_t *params, char *head, char *tail,
+                 uint32_t *crc)
+{
+	uint32_t adler = adler32(0, NULL, 0);
+	size_t len = ZLIB_HDR_LEN + sizeof(uint32_t), i;
+
+	zlib_put_header(params, (unsigned char *)head);
+	*crc = cksum_update(*crc, head, ZLIB_HDR_LEN);
+	for (i = 0; i < n; i++) {
+		*crc = cksum_zeros(*crc, pieces[i].len) ^ pieces[i].crc;
+		adler = adler32_combine(adler, pieces[i].adler,
+		                        pieces[i].in_len);
+		len += pieces[i].len;
 	}
+	tail[0] = adler >> 24;
+	tail[1] = adler >> 16;
+	tail[2] = adler >> 8;
+	tail[3] = adler;
+	*crc = cksum_update(*crc, tail, sizeof(uint32_t));
 
-	return NULL;
+	return len;
 }
 
+void
+zlib_free_pieces(zlib_piece_t *pieces, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		mem_free(pieces[i].data);
+		pieces[i].data = NULL;
+		pieces[i].stale = 1;
+	}
+}
+
+/*
+ * Inflates a stream written by zlib_compress_chunks() with all chunks
+ * at once. cap is the exact unpacked size, every chunk but the last
+ * has to inflate to chunk_size bytes. Always uses zlib, whatever the
+ * selected backend.
+ */
+int
+zlib_decompress_chunks(const char *data, size_t len,
+                       const zlib_chunks_t *chunks, void *out, size_t cap,
+                       size_t *out_len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	zlib_chunk_job_t *jobs = NULL;
+	size_t end, i;
+	uint32_t adler;
+	uint64_t start;
+	int rv = 1;
+
+	*out_len = 0;
+	if (len < ZLIB_HDR_LEN + sizeof(uint32_t) ||
+	    (p[0] & 0x0f) != Z_DEFLATED || 0 != ((p[0] << 8) | p[1]) % 31 ||
+	    (p[1] & 0x20) ||
+	    chunks->nchunks != zlib_chunks_count(cap, chunks->chunk_size) ||
+	    chunks->offsets[0] != ZLIB_HDR_LEN) {
+		fprintf(stderr, "Chunk table does not match the stream!\n");
+		return 1;
+	}
+	for (i = 0; i < chunks->nchunks; i++) {
+		end = i + 1 < chunks->nchunks ? chunks->offsets[i + 1] :
+		      len - sizeof(uint32_t);
+		if (end < chunks->offsets[i] || end > len - sizeof(uint32_t)) {
+			fprintf(stderr, "Chunk table does not match the "
+			        "stream!\n");
+			return 1;
+		}
+	}
+
+	start = stats_begin();
+	jobs = mem_alloc(chunks->nchunks * sizeof(zlib_chunk_job_t));
+	if (NULL == jobs) {
+		fprintf(stderr, "Out of memory while allocating chunks!\n");
+		return 1;
+	}
+	memset(jobs, 0, chunks->nchunks * sizeof(zlib_chunk_job_t));
+	for (i = 0; i < chunks->nchunks; i++) {
+		jobs[i].last = i == chunks->nchunks - 1;
+		jobs[i].in = data + chunks->offsets[i];
+		jobs[i].in_len = (jobs[i].last ? len - sizeof(uint32_t) :
+		                  chunks->offsets[i + 1]) - chunks->offsets[i];
+		jobs[i].out = (char *)out + i * chunks->chunk_size;
+		jobs[i].cap = jobs[i].last ? cap - i * chunks->chunk_size :
+		              chunks->chunk_size;
+	}
+
+	if (0 != zlib_chunks_run(jobs, chunks->nchunks, zlib_chunk_inflate)) {
+		fprintf(stderr, "Zlib decompression failed: corrupt chunk\n");
+		goto decompress_chunks_failed;
+	}
+
+	adler = adler32(0, NULL, 0);
+	for (i = 0; i < chunks->nchunks; i++)
+		adler = adler32_combine(adler, jobs[i].adler, jobs[i].out_len);
+	p += len - sizeof(uint32_t);
+	if (adler != ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3])) {
+		fprintf(stderr, "Zlib decompression failed: incorrect data "
+		        "check\n");
+		goto decompress_chunks_failed;
+	}
+
+	*out_len = cap;
+	rv = 0;
+
+decompress_chunks_failed:
+	stats_end(STATS_INFLATE, start, len, *out_len);
+	mem_free(jobs);
+
+	return rv;
+}
+
+/* One sampled block of zlib_estimate(). */
+typedef struct zlib_sample_job
+{
+	const segment_t	*segs;
+	size_t		nsegs;
+	size_t		off;		/* block position in the input */
+	size_t		len;
+	const zlib_params_t *params;
+	size_t		out_len;	/* raw deflate bytes */
+	int		failed;
+} zlib_sample_job_t;
+
+/* Copies len input bytes at off into buf, zero segments included. */
+static void
+segs_gather(const segment_t *segs, size_t off, size_t len, char *buf)
+{
+	size_t seg = 0, take, pos;
+
+	while (off >= segs[seg].len) {
+		off -= segs[seg].len;
+		seg++;
+	}
+	for (pos = 0; pos < len; seg++, off = 0) {
+		take = segs[seg].len - off < len - pos ?
+		       segs[seg].len - off : len - pos;
+		if (NULL == segs[seg].data)
+			memset(buf + pos, 0, take);
+		else
+			memcpy(buf + pos, segs[seg].data + off, take);
+		pos += take;
+	}
+}
+
+/*
+ * Deflates one block the way it would be within the whole stream, the
+ * window before it is preset as dictionary.
+ */
+static void
+zlib_sample_deflate(void *arg)
+{
+	zlib_sample_job_t *job = arg;
+	size_t window, cap;
+	z_stream zs;
+	char *buf;
+
+	job->failed = 1;
+	window = (size_t)1 << job->params->window_bits;
+	window = job->off < window ? job->off : window;
+	cap = compressBound(job->len);
+	buf = mem_alloc(window + job->len + cap);
+	if (NULL == buf)
+		return;
+	segs_gather(job->segs, job->off - window, window + job->len, buf);
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs.zalloc = mem_zalloc;
+	zs.zfree = mem_zfree;
+	if (Z_OK != deflateInit2(&zs, job->params->level, Z_DEFLATED,
+	                         -job->params->window_bits,
+	                         job->params->mem_level,
+	                         job->params->strategy)) {
+		mem_free(buf);
+		return;
+	}
+	if (0 == window ||
+	    Z_OK == deflateSetDictionary(&zs, (Bytef *)buf, window)) {
+		zs.next_in = (Bytef *)buf + window;
+		zs.avail_in = job->len;
+		zs.next_out = (Bytef *)buf + window + job->len;
+		zs.avail_out = cap;
+		if (Z_STREAM_END == deflate(&zs, Z_FINISH)) {
+			job->out_len = zs.total_out;
+			job->failed = 0;
+		}
+	}
+	deflateEnd(&zs);
+	mem_free(buf);
+}
+
+/*
+ * Predicts the size of the zlib stream segs compress to without
+ * compressing all of it. Up to nsamples blocks of block bytes, spread
+ * evenly over the input, are deflated on all cores and the ratio of
+ * the sample is extrapolated. The interval is the 95% one of a ratio
+ * estimator, with the variance taken from successive differences as
+ * suits a systematic sample of input that changes along the way. When
+ * the samples cover the whole input the interval is empty. Always uses
+ * zlib, whatever the selected backend.
+ */
+int
+zlib_estimate(const segment_t *segs, size_t nsegs,
+              const zlib_params_t *params, size_t block, size_t nsamples,
+              zlib_estimate_t *est)
+{
+	zlib_sample_job_t *jobs;
+	size_t total, nblocks, i;
+	double ratio, dev, prev, var, se, in = 0, out = 0;
+	uint64_t start;
+	pool_t *pool;
+	int rv = 1;
+
+	memset(est, 0, sizeof(zlib_estimate_t));
+	start = stats_begin();
+	total = segs_len(segs, nsegs);
+	nblocks = total ? (total + block - 1) / block : 0;
+	if (nsamples > nblocks)
+		nsamples = nblocks;
+	if (0 == nsamples) {
+		est->size = est->low = est->high = ZLIB_HDR_LEN +
+		                                   sizeof(uint32_t) + 2;
+		return 0;
+	}
+
+	jobs = mem_alloc(nsamples * sizeof(zlib_sample_job_t));
+	if (NULL == jobs)
+		return 1;
+	memset(jobs, 0, nsamples * sizeof(zlib_sample_job_t));
+
+	/* Systematic sample, one block from the middle of each stride. */
+	pool = pool_create(0);
+	for (i = 0; i < nsamples; i++) {
+		jobs[i].segs = segs;
+		jobs[i].nsegs = nsegs;
+		jobs[i].params = params;
+		jobs[i].off = (2 * i + 1) * nblocks / (2 * nsamples) * block;
+		jobs[i].len = total - jobs[i].off < block ?
+		              total - jobs[i].off : block;
+		if (NULL == pool || 0 != pool_submit(pool, zlib_sample_deflate,
+		                                     &jobs[i]))
+			zlib_sample_deflate(&jobs[i]);
+	}
+	if (NULL != pool) {
+		pool_wait(pool);
+		pool_destroy(pool);
+	}
+
+	for (i = 0; i < nsamples; i++) {
+		if (jobs[i].failed) {
+			fprintf(stderr, "Sample compression failed!\n");
+			goto estimate_failed;
+		}
+		in += jobs[i].len;
+		out += jobs[i].out_len;
+	}
+	ratio = out / in;
+	for (var = 0, prev = 0, i = 0; i < nsamples; i++) {
+		dev = jobs[i].out_len - ratio * jobs[i].len;
+		if (i > 0)
+			var += (dev - prev) * (dev - prev);
+		prev = dev;
+	}
+	var = nsamples > 1 ? var / (2 * (nsamples - 1)) : 0;
+	se = nblocks * sqrt((1.0 - (double)nsamples / nblocks) * var /
+	                    nsamples);
+
+	est->nsamples = nsamples;
+	est->sampled = in;
+	est->size = ZLIB_HDR_LEN + sizeof(uint32_t) + ratio * total + 0.5;
+	est->low = est->size > 1.96 * se ? est->size - 1.96 * se : 0;
+	est->high = est->size + 1.96 * se + 0.5;
+	stats_end(STATS_DEFLATE, start, in, out);
+	rv = 0;
+
+estimate_failed:
+	mem_free(jobs);
+
+	return rv;
+}
+
+#ifdef HAVE_LIBDEFLATE
+/*
+ * libdeflate only knows compression levels (it goes up to 12), so
+ * requests for other zlib tuning are served by zlib itself.
+ */
+static int
+libdeflate_compress_segs(const segment_t *segs, size_t nsegs,
+                         const zlib_params_t *params, void *out, size_t cap,
+                         size_t *out_len, uint32_t *crc)
+{
+	struct libdeflate_compressor *c = NULL;
+	char *flat = NULL;
+	const char *data;
+	size_t len;
+	int level;
+
+	if (Z_DEFAULT_STRATEGY != params->strategy ||
+	    8 != params->mem_level || MAX_WBITS != params->window_bits) {
+		return zlib_deflate_segs(segs, nsegs, params, out, cap,
+		                         out_len, crc);
+	}
+
+	/* libdeflate wants the whole input in one buffer. */
+	if (1 == nsegs && NULL != segs[0].data) {
+		data = segs[0].data;
+		len = segs[0].len;
+	} else {
+		flat = segs_flatten(segs, nsegs, &len);
+		if (NULL == flat)
+			return 1;
+		data = flat;
+	}
+
+	level = Z_DEFAULT_COMPRESSION == params->level ? 6 : params->level;
+	c = libdeflate_alloc_compressor(level);
+	if (NULL == c) {
+		fprintf(stderr, "Failed to init libdeflate compressor!\n");
+		mem_free(flat);
+		return 1;
+	}
+
+	*out_len = libdeflate_zlib_compress(c, data, len, out, cap);
+	if (0 == *out_len) {
+		fprintf(stderr, "Libdeflate compression failed!\n");
+	} else if (crc) {
+		*crc = cksum_update(*crc, out, *out_len);
+	}
+
+	libdeflate_free_compressor(c);
+	mem_free(flat);
+	return 0 == *out_len;
+}
+
+static int
+libdeflate_decompress_buf(const char *data, size_t len, void *out,
+                          size_t cap, size_t *out_len, uint32_t *crc)
+{
+	struct libdeflate_decompressor *d = NULL;
+	enum libdeflate_result res;
+	size_t in_len;
+
+	if (crc)
+		*crc = cksum_update(*crc, data, len);
+
+	d = libdeflate_alloc_decompressor();
+	if (NULL == d) {
+		fprintf(stderr, "Failed to init libdeflate decompressor!\n");
+		return 1;
+	}
+
+	/* Data may be followed by padding, so let libdeflate report usage. */
+	res = libdeflate_zlib_decompress_ex(d, data, len, out, cap, &in_len,
+	                                    out_len);
+	if (LIBDEFLATE_SUCCESS != res) {
+		fprintf(stderr, "Libdeflate decompression failed (%d)\n", res);
+	}
+
+	libdeflate_free_decompressor(d);
+	return LIBDEFLATE_SUCCESS != res;
+}
+#endif /* HAVE_LIBDEFLATE */
+
 int
 write_to_file(const char *data, size_t len, const char *filename)
 {
-	int written = 0;
+	uint64_t start;
 	int fd = -1;
 	int rv = 0;
 
+	start = stats_begin();
+
+	fd = create_file(filename);
+	if (-1 == fd) {
+		return 1;
+	}
+
+	rv = write_all(fd, data, len);
+
+	if (-1 == close(fd)) {
+		perror("Close failed");
+		rv = 1;
+	}
+
+	stats_end(STATS_WRITE, start, len, rv ? 0 : len);
+
+	return rv;
+}
+
+/* Creates a new output file, refusing to overwrite existing ones. */
+int
+create_file(const char *filename)
+{
+	int fd;
+
 	fd = open(filename, O_RDWR | O_CREAT | O_EXCL,
 	          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	if (-1 == fd) {
 		perror("Failed to create file");
-		return 1;
 	}
 
+	return fd;
+}
+
+/* Writes all len bytes, resuming after short writes. */
+int
+write_all(int fd, const char *data, size_t len)
+{
+	ssize_t written;
+
 	while (len != 0) {
 		written = write(fd, data, len);
 		if (-1 == written) {
+			if (EINTR == errno)
+				continue;
 			perror("Write failed");
-			rv = 1;
-			break;
+			return 1;
 		}
+		data += written;
 		len -= written;
 	}
 
-	if (-1 == close(fd)) {
-		perror("Close failed");
-		rv = 1;
+	return 0;
+}
+
+/*
+ * POSIX cksum CRC tables. crctab is the classic byte table, crc_slices
+ * are derived from it to process eight bytes per step.
+ */
+static uint32_t const crctab[]={
+	0x00000000,0x04C11DB7,0x09823B6E,0x0D4326D9,
+	0x130476DC,0x17C56B6B,0x1A864DB2,0x1E475005,
+	0x2608EDB8,0x22C9F00F,0x2F8AD6D6,0x2B4BCB61,
+	0x350C9B64,0x31CD86D3,0x3C8EA00A,0x384FBDBD,
+	0x4C11DB70,0x48D0C6C7,0x4593E01E,0x4152FDA9,
+	0x5F15ADAC,0x5BD4B01B,0x569796C2,0x52568B75,
+	0x6A1936C8,0x6ED82B7F,0x639B0DA6,0x675A1011,
+	0x791D4014,0x7DDC5DA3,0x709F7B7A,0x745E66CD,
+	0x9823B6E0,0x9CE2AB57,0x91A18D8E,0x95609039,
+	0x8B27C03C,0x8FE6DD8B,0x82A5FB52,0x8664E6E5,
+	0xBE2B5B58,0xBAEA46EF,0xB7A96036,0xB3687D81,
+	0xAD2F2D84,0xA9EE3033,0xA4AD16EA,0xA06C0B5D,
+	0xD4326D90,0xD0F37027,0xDDB056FE,0xD9714B49,
+	0xC7361B4C,0xC3F706FB,0xCEB42022,0xCA753D95,
+	0xF23A8028,0xF6FB9D9F,0xFBB8BB46,0xFF79A6F1,
+	0xE13EF6F4,0xE5FFEB43,0xE8BCCD9A,0xEC7DD02D,
+	0x34867077,0x30476DC0,0x3D044B19,0x39C556AE,
+	0x278206AB,0x23431B1C,0x2E003DC5,0x2AC12072,
+	0x128E9DCF,0x164F8078,0x1B0CA6A1,0x1FCDBB16,
+	0x018AEB13,0x054BF6A4,0x0808D07D,0x0CC9CDCA,
+	0x7897AB07,0x7C56B6B0,0x71159069,0x75D48DDE,
+	0x6B93DDDB,0x6F52C06C,0x6211E6B5,0x66D0FB02,
+	0x5E9F46BF,0x5A5E5B08,0x571D7DD1,0x53DC6066,
+	0x4D9B3063,0x495A2DD4,0x44190B0D,0x40D816BA,
+	0xACA5C697,0xA864DB20,0xA527FDF9,0xA1E6E04E,
+	0xBFA1B04B,0xBB60ADFC,0xB6238B25,0xB2E29692,
+	0x8AAD2B2F,0x8E6C3698,0x832F1041,0x87EE0DF6,
+	0x99A95DF3,0x9D684044,0x902B669D,0x94EA7B2A,
+	0xE0B41DE7,0xE4750050,0xE9362689,0xEDF73B3E,
+	0xF3B06B3B,0xF771768C,0xFA325055,0xFEF34DE2,
+	0xC6BCF05F,0xC27DEDE8,0xCF3ECB31,0xCBFFD686,
+	0xD5B88683,0xD1799B34,0xDC3ABDED,0xD8FBA05A,
+	0x690CE0EE,0x6DCDFD59,0x608EDB80,0x644FC637,
+	0x7A089632,0x7EC98B85,0x738AAD5C,0x774BB0EB,
+	0x4F040D56,0x4BC510E1,0x46863638,0x42472B8F,
+	0x5C007B8A,0x58C1663D,0x558240E4,0x51435D53,
+	0x251D3B9E,0x21DC2629,0x2C9F00F0,0x285E1D47,
+	0x36194D42,0x32D850F5,0x3F9B762C,0x3B5A6B9B,
+	0x0315D626,0x07D4CB91,0x0A97ED48,0x0E56F0FF,
+	0x1011A0FA,0x14D0BD4D,0x19939B94,0x1D528623,
+	0xF12F560E,0xF5EE4BB9,0xF8AD6D60,0xFC6C70D7,
+	0xE22B20D2,0xE6EA3D65,0xEBA91BBC,0xEF68060B,
+	0xD727BBB6,0xD3E6A601,0xDEA580D8,0xDA649D6F,
+	0xC423CD6A,0xC0E2D0DD,0xCDA1F604,0xC960EBB3,
+	0xBD3E8D7E,0xB9FF90C9,0xB4BCB610,0xB07DABA7,
+	0xAE3AFBA2,0xAAFBE615,0xA7B8C0CC,0xA379DD7B,
+	0x9B3660C6,0x9FF77D71,0x92B45BA8,0x9675461F,
+	0x8832161A,0x8CF30BAD,0x81B02D74,0x857130C3,
+	0x5D8A9099,0x594B8D2E,0x5408ABF7,0x50C9B640,
+	0x4E8EE645,0x4A4FFBF2,0x470CDD2B,0x43CDC09C,
+	0x7B827D21,0x7F436096,0x7200464F,0x76C15BF8,
+	0x68860BFD,0x6C47164A,0x61043093,0x65C52D24,
+	0x119B4BE9,0x155A565E,0x18197087,0x1CD86D30,
+	0x029F3D35,0x065E2082,0x0B1D065B,0x0FDC1BEC,
+	0x3793A651,0x3352BBE6,0x3E119D3F,0x3AD08088,
+	0x2497D08D,0x2056CD3A,0x2D15EBE3,0x29D4F654,
+	0xC5A92679,0xC1683BCE,0xCC2B1D17,0xC8EA00A0,
+	0xD6AD50A5,0xD26C4D12,0xDF2F6BCB,0xDBEE767C,
+	0xE3A1CBC1,0xE760D676,0xEA23F0AF,0xEEE2ED18,
+	0xF0A5BD1D,0xF464A0AA,0xF9278673,0xFDE69BC4,
+	0x89B8FD09,0x8D79E0BE,0x803AC667,0x84FBDBD0,
+	0x9ABC8BD5,0x9E7D9662,0x933EB0BB,0x97FFAD0C,
+	0xAFB010B1,0xAB710D06,0xA6322BDF,0xA2F33668,
+	0xBCB4666D,0xB8757BDA,0xB5365D03,0xB1F740B4
+};
+
+static uint32_t crc_slices[8][256];
+static pthread_once_t crc_slices_once = PTHREAD_ONCE_INIT;
+
+/*
+ * GF(2) operators advancing the CRC register over 2^k zero bytes,
+ * column i is the image of register bit i.
+ */
+static uint32_t crc_zero_ops[64][32];
+static pthread_once_t crc_zero_ops_once = PTHREAD_ONCE_INIT;
+
+static void
+crc_slices_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc_slices[0][i] = crctab[i];
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			crc_slices[k][i] = (crc_slices[k - 1][i] << 8) ^
+			                   crctab[crc_slices[k - 1][i] >> 24];
+		}
 	}
+}
 
-	return rv;
+static uint32_t
+gf2_times(const uint32_t *op, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, op++) {
+		if (vec & 1)
+			sum ^= *op;
+	}
+
+	return sum;
 }
 
-uint32_t cksum(const char * buf, size_t len)
+static void
+gf2_square(uint32_t *sq, const uint32_t *op)
 {
-	static uint32_t const crctab[]={
-		0x00000000,0x04C11DB7,0x09823B6E,0x0D4326D9,
-		0x130476DC,0x17C56B6B,0x1A864DB2,0x1E475005,
-		0x2608EDB8,0x22C9F00F,0x2F8AD6D6,0x2B4BCB61,
-		0x350C9B64,0x31CD86D3,0x3C8EA00A,0x384FBDBD,
-		0x4C11DB70,0x48D0C6C7,0x4593E01E,0x4152FDA9,
-		0x5F15ADAC,0x5BD4B01B,0x569796C2,0x52568B75,
-		0x6A1936C8,0x6ED82B7F,0x639B0DA6,0x675A1011,
-		0x791D4014,0x7DDC5DA3,0x709F7B7A,0x745E66CD,
-		0x9823B6E0,0x9CE2AB57,0x91A18D8E,0x95609039,
-		0x8B27C03C,0x8FE6DD8B,0x82A5FB52,0x8664E6E5,
-		0xBE2B5B58,0xBAEA46EF,0xB7A96036,0xB3687D81,
-		0xAD2F2D84,0xA9EE3033,0xA4AD16EA,0xA06C0B5D,
-		0xD4326D90,0xD0F37027,0xDDB056FE,0xD9714B49,
-		0xC7361B4C,0xC3F706FB,0xCEB42022,0xCA753D95,
-		0xF23A8028,0xF6FB9D9F,0xFBB8BB46,0xFF79A6F1,
-		0xE13EF6F4,0xE5FFEB43,0xE8BCCD9A,0xEC7DD02D,
-		0x34867077,0x30476DC0,0x3D044B19,0x39C556AE,
-		0x278206AB,0x23431B1C,0x2E003DC5,0x2AC12072,
-		0x128E9DCF,0x164F8078,0x1B0CA6A1,0x1FCDBB16,
-		0x018AEB13,0x054BF6A4,0x0808D07D,0x0CC9CDCA,
-		0x7897AB07,0x7C56B6B0,0x71159069,0x75D48DDE,
-		0x6B93DDDB,0x6F52C06C,0x6211E6B5,0x66D0FB02,
-		0x5E9F46BF,0x5A5E5B08,0x571D7DD1,0x53DC6066,
-		0x4D9B3063,0x495A2DD4,0x44190B0D,0x40D816BA,
-		0xACA5C697,0xA864DB20,0xA527FDF9,0xA1E6E04E,
-		0xBFA1B04B,0xBB60ADFC,0xB6238B25,0xB2E29692,
-		0x8AAD2B2F,0x8E6C3698,0x832F1041,0x87EE0DF6,
-		0x99A95DF3,0x9D684044,0x902B669D,0x94EA7B2A,
-		0xE0B41DE7,0xE4750050,0xE9362689,0xEDF73B3E,
-		0xF3B06B3B,0xF771768C,0xFA325055,0xFEF34DE2,
-		0xC6BCF05F,0xC27DEDE8,0xCF3ECB31,0xCBFFD686,
-		0xD5B88683,0xD1799B34,0xDC3ABDED,0xD8FBA05A,
-		0x690CE0EE,0x6DCDFD59,0x608EDB80,0x644FC637,
-		0x7A089632,0x7EC98B85,0x738AAD5C,0x774BB0EB,
-		0x4F040D56,0x4BC510E1,0x46863638,0x42472B8F,
-		0x5C007B8A,0x58C1663D,0x558240E4,0x51435D53,
-		0x251D3B9E,0x21DC2629,0x2C9F00F0,0x285E1D47,
-		0x36194D42,0x32D850F5,0x3F9B762C,0x3B5A6B9B,
-		0x0315D626,0x07D4CB91,0x0A97ED48,0x0E56F0FF,
-		0x1011A0FA,0x14D0BD4D,0x19939B94,0x1D528623,
-		0xF12F560E,0xF5EE4BB9,0xF8AD6D60,0xFC6C70D7,
-		0xE22B20D2,0xE6EA3D65,0xEBA91BBC,0xEF68060B,
-		0xD727BBB6,0xD3E6A601,0xDEA580D8,0xDA649D6F,
-		0xC423CD6A,0xC0E2D0DD,0xCDA1F604,0xC960EBB3,
-		0xBD3E8D7E,0xB9FF90C9,0xB4BCB610,0xB07DABA7,
-		0xAE3AFBA2,0xAAFBE615,0xA7B8C0CC,0xA379DD7B,
-		0x9B3660C6,0x9FF77D71,0x92B45BA8,0x9675461F,
-		0x8832161A,0x8CF30BAD,0x81B02D74,0x857130C3,
-		0x5D8A9099,0x594B8D2E,0x5408ABF7,0x50C9B640,
-		0x4E8EE645,0x4A4FFBF2,0x470CDD2B,0x43CDC09C,
-		0x7B827D21,0x7F436096,0x7200464F,0x76C15BF8,
-		0x68860BFD,0x6C47164A,0x61043093,0x65C52D24,
-		0x119B4BE9,0x155A565E,0x18197087,0x1CD86D30,
-		0x029F3D35,0x065E2082,0x0B1D065B,0x0FDC1BEC,
-		0x3793A651,0x3352BBE6,0x3E119D3F,0x3AD08088,
-		0x2497D08D,0x2056CD3A,0x2D15EBE3,0x29D4F654,
-		0xC5A92679,0xC1683BCE,0xCC2B1D17,0xC8EA00A0,
-		0xD6AD50A5,0xD26C4D12,0xDF2F6BCB,0xDBEE767C,
-		0xE3A1CBC1,0xE760D676,0xEA23F0AF,0xEEE2ED18,
-		0xF0A5BD1D,0xF464A0AA,0xF9278673,0xFDE69BC4,
-		0x89B8FD09,0x8D79E0BE,0x803AC667,0x84FBDBD0,
-		0x9ABC8BD5,0x9E7D9662,0x933EB0BB,0x97FFAD0C,
-		0xAFB010B1,0xAB710D06,0xA6322BDF,0xA2F33668,
-		0xBCB4666D,0xB8757BDA,0xB5365D03,0xB1F740B4
-	};
-	uint32_t crc;
+	int i;
+
+	for (i = 0; i < 32; i++)
+		sq[i] = gf2_times(op, op[i]);
+}
+
+static void
+crc_zero_ops_init(void)
+{
+	uint32_t bit[32], tmp[32];
+	int i, k;
+
+	/* One zero bit shifts the register left and folds in the poly. */
+	for (i = 0; i < 31; i++)
+		bit[i] = 1U << (i + 1);
+	bit[31] = crctab[1];
+
+	gf2_square(tmp, bit);			/* 2 bits */
+	gf2_square(bit, tmp);			/* 4 bits */
+	gf2_square(crc_zero_ops[0], bit);	/* 8 bits */
+	for (k = 1; k < 64; k++)
+		gf2_square(crc_zero_ops[k], crc_zero_ops[k - 1]);
+}
+
+/*
+ * Advances a running cksum CRC over len zero bytes in O(log len)
+ * steps, without touching any memory.
+ */
+uint32_t
+cksum_zeros(uint32_t crc, size_t len)
+{
+	int k;
+
+	pthread_once(&crc_zero_ops_once, crc_zero_ops_init);
+
+	for (k = 0; len; len >>= 1, k++) {
+		if (len & 1)
+			crc = gf2_times(crc_zero_ops[k], crc);
+	}
+
+	return crc;
+}
+
+/* Tells whether all len bytes at buf are zero. */
+int
+buf_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	const zvec_t *v;
+	zvec_t acc;
 	size_t i;
 
-	for (crc=0,i=0; i<len; i++) {
-		crc=(crc<<8)^crctab[((unsigned char)buf[i])^(crc>>24)];
+	for (; len && ((uintptr_t)p % sizeof(zvec_t)); len--, p++) {
+		if (*p)
+			return 0;
 	}
-	for (; len; len>>=8) {
-		crc=(crc<<8)^crctab[((unsigned char)len)^(crc>>24)];
+
+	/* Or together 128 bytes at a time, bail out on the first hit. */
+	v = (const zvec_t *)p;
+	for (; len >= 4 * sizeof(zvec_t); len -= 4 * sizeof(zvec_t), v += 4) {
+		acc = v[0] | v[1] | v[2] | v[3];
+		for (i = 0; i < sizeof(zvec_t) / sizeof(uint64_t); i++) {
+			if (acc[i])
+				return 0;
+		}
 	}
-	return crc^0xFFFFFFFF;
+
+	for (p = (const unsigned char *)v; len; len--, p++) {
+		if (*p)
+			return 0;
+	}
+
+	return 1;
+}
+
+static uint32_t
+cksum_slices(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t hi;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		hi = crc ^ ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		            (uint32_t)p[2] << 8 | p[3]);
+		crc = crc_slices[7][hi >> 24] ^
+		      crc_slices[6][(hi >> 16) & 0xff] ^
+		      crc_slices[5][(hi >> 8) & 0xff] ^
+		      crc_slices[4][hi & 0xff] ^
+		      crc_slices[3][p[4]] ^ crc_slices[2][p[5]] ^
+		      crc_slices[1][p[6]] ^ crc_slices[0][p[7]];
+	}
+	for (; len; len--, p++) {
+		crc = (crc << 8) ^ crctab[*p ^ (crc >> 24)];
+	}
+
+	return crc;
+}
+
+/*
+ * Feeds buf into a running cksum CRC, starting from 0. The result is
+ * only meaningful after cksum_final(). Runs of zero chunks are skipped
+ * with cksum_zeros(), which pays off on sparse payloads.
+ */
+uint32_t
+cksum_update(uint32_t crc, const char *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	size_t zeros = 0, chunk;
+
+	pthread_once(&crc_slices_once, crc_slices_init);
+
+	while (len) {
+		chunk = len < CKSUM_ZERO_CHUNK ? len : CKSUM_ZERO_CHUNK;
+		if (CKSUM_ZERO_CHUNK == chunk && buf_is_zero(p, chunk)) {
+			zeros += chunk;
+		} else {
+			if (zeros)
+				crc = cksum_zeros(crc, zeros);
+			zeros = 0;
+			crc = cksum_slices(crc, p, chunk);
+		}
+		p += chunk;
+		len -= chunk;
+	}
+	if (zeros)
+		crc = cksum_zeros(crc, zeros);
+
+	return crc;
+}
+
+/* Appends the total length as cksum does and returns the final value. */
+uint32_t
+cksum_final(uint32_t crc, size_t total)
+{
+	for (; total; total >>= 8) {
+		crc = (crc << 8) ^ crctab[((unsigned char)total) ^ (crc >> 24)];
+	}
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+/* memcpy which also feeds the copied bytes into a running cksum CRC. */
+void *
+memcpy_cksum(void *dst, const void *src, size_t len, uint32_t *crc)
+{
+	char *d = dst;
+	const char *s = src;
+	size_t chunk;
+
+	/* Checksum each piece right after copying, while it is in L1. */
+	while (len) {
+		chunk = len < CKSUM_COPY_CHUNK ? len : CKSUM_COPY_CHUNK;
+		memcpy(d, s, chunk);
+		*crc = cksum_update(*crc, d, chunk);
+		d += chunk;
+		s += chunk;
+		len -= chunk;
+	}
+
+	return dst;
+}
+
+/*
+ * Feeds buf to both the cksum CRC and a SHA-256 context, a piece at a
+ * time so the second pass reads from L1 rather than memory.
+ */
+uint32_t
+cksum_sha256(uint32_t crc, sha256_t *sha, const char *buf, size_t len)
+{
+	size_t chunk, total = len;
+	uint64_t start;
+
+	start = stats_begin();
+	while (len) {
+		chunk = len < CKSUM_COPY_CHUNK ? len : CKSUM_COPY_CHUNK;
+		crc = cksum_update(crc, buf, chunk);
+		sha256_update(sha, buf, chunk);
+		buf += chunk;
+		len -= chunk;
+	}
+	stats_end(STATS_HASH, start, total, 0);
+
+	return crc;
+}
+
+uint32_t cksum(const char * buf, size_t len)
+{
+	uint32_t crc;
+	uint64_t start;
+
+	start = stats_begin();
+	crc = cksum_final(cksum_update(0, buf, len), len);
+	stats_end(STATS_CKSUM, start, len, 0);
+
+	return crc;
 }
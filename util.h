@@ -31,11 +31,127 @@
 #define _UTIL_H_
 
 #include <inttypes.h>
+#include <stddef.h>
+
+#include "sha256.h"
+
+/* Size of the zlib stream header. */
+#define ZLIB_HDR_LEN		2
+
+/* Deflate tuning knobs, see deflateInit2(). */
+typedef struct zlib_params
+{
+	int	level;
+	int	strategy;
+	int	mem_level;
+	int	window_bits;
+} zlib_params_t;
+
+/* Piece of compressor input, data == NULL stands for len zero bytes. */
+typedef struct segment
+{
+	const char	*data;
+	size_t		len;
+} segment_t;
+
+/* Chunk table of a stream written by zlib_compress_chunks(). */
+typedef struct zlib_chunks
+{
+	size_t		chunk_size;
+	size_t		nchunks;
+	const uint32_t	*offsets;	/* stream offset of each chunk */
+} zlib_chunks_t;
+
+/* Compressed size prediction of zlib_estimate(). */
+typedef struct zlib_estimate
+{
+	size_t		size;		/* zlib stream bytes */
+	size_t		low;		/* 95% confidence interval */
+	size_t		high;
+	size_t		sampled;	/* input bytes compressed */
+	size_t		nsamples;
+} zlib_estimate_t;
+
+/* Separately deflated piece of a stream, see zlib_compress_pieces(). */
+typedef struct zlib_piece
+{
+	const segment_t	*segs;		/* input, only read when stale */
+	size_t		nsegs;
+	int		stale;		/* data does not match the input */
+	char		*data;		/* raw deflate output */
+	size_t		len;
+	size_t		in_len;
+	uint32_t	adler;		/* of the input */
+	uint32_t	crc;		/* running cksum CRC of data */
+} zlib_piece_t;
+
+/* Consumer of streamed (de)compressor output, non-zero aborts. */
+typedef int (*zlib_sink_t)(void *ctx, const char *buf, size_t len);
 
 uint32_t swap_bytes_be(uint32_t);
+uint64_t monotonic_ns(void);
 void *zlib_decompress(const char *data, size_t len, size_t *out_len);
+void *zlib_decompress_cksum(const char *data, size_t len, size_t *out_len,
+                            uint32_t *crc);
+int  zlib_decompress_into(const char *data, size_t len, void *out, size_t cap,
+                          size_t *out_len, uint32_t *crc);
 void *zlib_compress(const char *data, size_t len, size_t *out_len);
+void *zlib_compress_params(const char *data, size_t len,
+                           const zlib_params_t *params, size_t *out_len);
+void *zlib_compress_cksum(const char *data, size_t len,
+                          const zlib_params_t *params, size_t *out_len,
+                          uint32_t *crc);
+void *zlib_compress_segs(const segment_t *segs, size_t nsegs,
+                         const zlib_params_t *params, size_t *out_len,
+                         uint32_t *crc);
+int  zlib_compress_into(const segment_t *segs, size_t nsegs,
+                        const zlib_params_t *params, void *out, size_t cap,
+                        size_t *out_len, uint32_t *crc);
+size_t zlib_compress_bound(size_t len);
+int  zlib_compress_stream(const segment_t *segs, size_t nsegs,
+                          const zlib_params_t *params, void *buf,
+                          size_t buf_len, zlib_sink_t sink, void *ctx,
+                          size_t *out_len, uint32_t *crc);
+int  zlib_decompress_stream(const char *data, size_t len, void *buf,
+                            size_t buf_len, zlib_sink_t sink, void *ctx,
+                            size_t *out_len, uint32_t *crc);
+int  zlib_compress_chunks(const segment_t *segs, size_t nsegs,
+                          const zlib_params_t *params, size_t chunk_size,
+                          void *out, size_t cap, size_t *out_len,
+                          uint32_t *crc, uint32_t *offsets);
+int  zlib_decompress_chunks(const char *data, size_t len,
+                            const zlib_chunks_t *chunks, void *out,
+                            size_t cap, size_t *out_len);
+size_t zlib_chunks_bound(size_t len, size_t chunk_size);
+int  zlib_compress_pieces(zlib_piece_t *pieces, size_t n,
+                          const zlib_params_t *params);
+size_t zlib_join_pieces(const zlib_piece_t *pieces, size_t n,
+                        const zlib_params_t *params, char *head, char *tail,
+                        uint32_t *crc);
+void zlib_free_pieces(zlib_piece_t *pieces, size_t n);
+int  zlib_estimate(const segment_t *segs, size_t nsegs,
+                   const zlib_params_t *params, size_t block,
+                   size_t nsamples, zlib_estimate_t *est);
+size_t zlib_chunks_count(size_t len, size_t chunk_size);
+size_t zlib_deflate_mem(const zlib_params_t *params);
+size_t zlib_inflate_mem(void);
+int  zlib_fit_params(zlib_params_t *params, size_t avail);
+size_t segs_len(const segment_t *segs, size_t nsegs);
+void *segs_flatten(const segment_t *segs, size_t nsegs, size_t *out_len);
+int  buf_is_zero(const void *buf, size_t len);
+void zlib_default_params(zlib_params_t *params);
+int  zlib_set_backend(const char *name);
+const char *zlib_backend_name(void);
+const char *zlib_backend_list(void);
 int  write_to_file(const char *data, size_t len, const char *filename);
+int  create_file(const char *filename);
+int  write_all(int fd, const char *data, size_t len);
 uint32_t cksum(const char *buf, size_t len);
+uint32_t cksum_update(uint32_t crc, const char *buf, size_t len);
+uint32_t cksum_final(uint32_t crc, size_t total);
+uint32_t cksum_zeros(uint32_t crc, size_t len);
+void *memcpy_cksum(void *dst, const void *src, size_t len, uint32_t *crc);
+uint32_t cksum_sha256(uint32_t crc, sha256_t *sha, const char *buf,
+                      size_t len);
 
 #endif /* _UTIL_H_ */
@@ -0,0 +1,215 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "loader.h"
+#include "mem.h"
+#include "pool.h"
+#include "util.h"
+#include "verify.h"
+#include "config.h"
+
+/* Compares the inflated payload with the segments, up to a mismatch. */
+static int
+create_verify_sink(void *ctx, const char *buf, size_t len)
+{
+	create_verify_t *v = ctx;
+	const segment_t *s;
+	size_t n, i;
+
+	while (len > 0) {
+		if (v->seg == v->nsegs) {
+			v->mismatch = v->pos;
+			return 1;
+		}
+		s = &v->segs[v->seg];
+		n = s->len - v->seg_off < len ? s->len - v->seg_off : len;
+		if (NULL == s->data ? !buf_is_zero(buf, n) :
+		    0 != memcmp(buf, s->data + v->seg_off, n)) {
+			for (i = 0; i < n; i++)
+				if (buf[i] != (NULL == s->data ? 0 :
+				               s->data[v->seg_off + i]))
+					break;
+			v->mismatch = v->pos + i;
+			return 1;
+		}
+		v->pos += n;
+		v->seg_off += n;
+		buf += n;
+		len -= n;
+		if (v->seg_off == s->len) {
+			v->seg++;
+			v->seg_off = 0;
+		}
+	}
+
+	return 0;
+}
+
+static void
+create_verify_run(void *arg)
+{
+	create_verify_t *v = arg;
+	size_t len = 0;
+	char *buf;
+
+	if (!v->compressed) {
+		v->failed = create_verify_sink(v, v->data, v->len);
+	} else {
+		buf = mem_alloc(STREAM_BUF_SIZE);
+		if (NULL == buf) {
+			v->failed = 1;
+			return;
+		}
+		v->failed = zlib_decompress_stream(v->data, v->len, buf,
+		                                   STREAM_BUF_SIZE,
+		                                   create_verify_sink, v,
+		                                   &len, NULL);
+		mem_free(buf);
+	}
+}
+
+/* Starts the compare, inline when no worker thread is available. */
+void
+create_verify_start(create_verify_t *v, const char *data, size_t len,
+                    int compressed, const segment_t *segs, size_t nsegs)
+{
+	memset(v, 0, sizeof(create_verify_t));
+	v->data = data;
+	v->len = len;
+	v->compressed = compressed;
+	v->segs = segs;
+	v->nsegs = nsegs;
+	v->mismatch = UINT64_MAX;
+	v->pool = pool_create(1);
+	if (NULL == v->pool || 0 != pool_submit(v->pool, create_verify_run, v))
+		create_verify_run(v);
+}
+
+void
+create_verify_wait(create_verify_t *v)
+{
+	if (NULL != v->pool) {
+		pool_wait(v->pool);
+		pool_destroy(v->pool);
+		v->pool = NULL;
+	}
+}
+
+/*
+ * Waits for the compare and reads the header of the written image back
+ * through the page cache, the checksum and size fields must come back
+ * as set and the header checksum must hold over what was read.
+ */
+int
+create_verify_finish(create_verify_t *v, const char *outfile,
+                     const boost_hdr_t *hdr)
+{
+	boost_hdr_t back;
+	ssize_t len = -1;
+	int fd;
+
+	create_verify_wait(v);
+	if (UINT64_MAX != v->mismatch) {
+		printf("Verify\t\t: Failed (payload differs at 0x%08llx)\n",
+		       (unsigned long long)v->mismatch);
+		return 1;
+	}
+	if (v->failed) {
+		printf("Verify\t\t: Failed (stream broken after %llu "
+		       "bytes)\n", (unsigned long long)v->pos);
+		return 1;
+	}
+	if (v->pos != segs_len(v->segs, v->nsegs)) {
+		printf("Verify\t\t: Failed (payload short, %llu of %zu "
+		       "bytes)\n", (unsigned long long)v->pos,
+		       segs_len(v->segs, v->nsegs));
+		return 1;
+	}
+
+	fd = open(outfile, O_RDONLY);
+	if (-1 != fd) {
+		len = pread(fd, &back, sizeof(boost_hdr_t), 0);
+		close(fd);
+	}
+	if (sizeof(boost_hdr_t) != len ||
+	    back.checksum != hdr->checksum ||
+	    back.image_checksum != hdr->image_checksum ||
+	    back.image_size != hdr->image_size ||
+	    cksum((const char *)&back, BOOST_HEADER_CRC_BYTES) !=
+	    back.checksum) {
+		printf("Verify\t\t: Failed (header read back differs)\n");
+		return 1;
+	}
+	printf("Verify\t\t: OK (%llu bytes compared)\n",
+	       (unsigned long long)v->pos);
+
+	return 0;
+}
+
+/* Verifies an image written by boost_write_stream(), from the file. */
+int
+create_verify_file(const char *outfile, const boost_hdr_t *hdr,
+                   const segment_t *segs, size_t nsegs, int compressed)
+{
+	create_verify_t v;
+	struct stat st;
+	loaded_t image;
+	size_t skip;
+	int fd, rv = 1;
+
+	fd = open(outfile, O_RDONLY);
+	if (-1 == fd) {
+		perror("Failed to open image for verify");
+		return 1;
+	}
+	skip = sizeof(boost_hdr_t) + (compressed ? sizeof(uint32_t) : 0);
+	if (0 != fstat(fd, &st) ||
+	    (size_t)st.st_size < skip ||
+	    0 != loader_load(fd, st.st_size, &image)) {
+		fprintf(stderr, "Failed to load image for verify\n");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	create_verify_start(&v, image.addr + skip, st.st_size - skip,
+	                    compressed, segs, nsegs);
+	rv = create_verify_finish(&v, outfile, hdr);
+	loader_unload(&image);
+
+	return rv;
+}
@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boost.h"
+#include "pool.h"
+#include "util.h"
+
+/*
+ * Round trip check of create --verify. The data section just produced
+ * is inflated on a worker thread while the image is written, and
+ * compared against the segments it was made from.
+ */
+typedef struct create_verify
+{
+	const char	*data;		/* zlib stream or raw payload */
+	size_t		len;
+	int		compressed;
+	const segment_t	*segs;
+	size_t		nsegs;
+	size_t		seg;		/* compare position */
+	size_t		seg_off;
+	uint64_t	pos;
+	uint64_t	mismatch;	/* payload offset, UINT64_MAX none */
+	int		failed;
+	pool_t		*pool;
+} create_verify_t;
+
+void create_verify_start(create_verify_t *, const char *, size_t, int,
+                         const segment_t *, size_t);
+void create_verify_wait(create_verify_t *);
+int  create_verify_finish(create_verify_t *, const char *,
+                          const boost_hdr_t *);
+int  create_verify_file(const char *, const boost_hdr_t *,
+                        const segment_t *, size_t, int);
+
+#endif /* _VERIFY_H_ */
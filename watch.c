@@ -0,0 +1,401 @@
+/*-
+ * Copyright (c) 2011 Peter Tworek
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of any co-contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+
+#include "boost.h"
+#include "loader.h"
+#include "ext2.h"
+#include "sparse.h"
+#include "util.h"
+#include "watch.h"
+#include "config.h"
+
+/* One input of a watched create, kept loaded between rebuilds. */
+typedef struct watch_input
+{
+	const char	*path;
+	char		name[NAME_MAX + 1];
+	int		wd;		/* watch of the directory */
+	int		fd;
+	loaded_t	file;
+	sparse_map_t	map;		/* ramdisk only */
+	int		scrub;		/* ramdisk free blocks as zeros */
+	int		part;		/* INDEX_KERNEL and friends */
+} watch_input_t;
+
+static volatile sig_atomic_t watch_stop;
+
+static void
+watch_signal(int sig)
+{
+	(void)sig;
+	watch_stop = 1;
+}
+
+static void
+watch_unload(watch_input_t *in)
+{
+	sparse_free(&in->map);
+	loader_unload(&in->file);
+	if (-1 != in->fd && 0 != close(in->fd))
+		perror("Failed to close input file");
+	in->fd = -1;
+}
+
+static int
+watch_load(watch_input_t *in)
+{
+	struct stat st;
+	size_t scrubbed;
+
+	watch_unload(in);
+	in->fd = open(in->path, O_RDONLY);
+	if (-1 == in->fd) {
+		fprintf(stderr, "Failed to open %s: %s\n", in->path,
+		        strerror(errno));
+		return 1;
+	}
+	if (0 != fstat(in->fd, &st) ||
+	    0 != loader_load(in->fd, st.st_size, &in->file)) {
+		fprintf(stderr, "Failed to load %s\n", in->path);
+		return 1;
+	}
+	/* Ramdisks are mostly free blocks, keep their zeros out of RAM. */
+	if (INDEX_RAMDISK == in->part &&
+	    0 != sparse_map(in->fd, in->file.addr, st.st_size, &in->map))
+		return 1;
+	if (in->scrub) {
+		if (0 != ext2_scrub(in->file.addr, st.st_size, &in->map,
+		                    &scrubbed))
+			return 1;
+		printf("Ramdisk scrub\t: %zu kB of stale free space "
+		       "zeroed\n", scrubbed / 1024);
+	}
+
+	return 0;
+}
+
+/*
+ * Watches the directory of the input rather than the file itself, as
+ * editors and build systems tend to replace files instead of writing
+ * them in place.
+ */
+static int
+watch_add(int ifd, watch_input_t *in)
+{
+	char dir[PATH_MAX];
+	const char *slash;
+
+	slash = strrchr(in->path, '/');
+	if (NULL == slash) {
+		strcpy(dir, ".");
+		slash = in->path - 1;
+	} else if ((size_t)(slash - in->path) >= sizeof(dir)) {
+		fprintf(stderr, "Path too long: %s\n", in->path);
+		return 1;
+	} else if (slash == in->path) {
+		strcpy(dir, "/");
+	} else {
+		memcpy(dir, in->path, slash - in->path);
+		dir[slash - in->path] = '\0';
+	}
+	if (strlen(slash + 1) >= sizeof(in->name)) {
+		fprintf(stderr, "Path too long: %s\n", in->path);
+		return 1;
+	}
+	strcpy(in->name, slash + 1);
+
+	in->wd = inotify_add_watch(ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (-1 == in->wd) {
+		fprintf(stderr, "Failed to watch %s: %s\n", dir,
+		        strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Collects the inputs named by pending events into changed. Returns
+ * how many events were about inputs, -1 on errors.
+ */
+static int
+watch_read(int ifd, watch_input_t *inputs, size_t n, unsigned *changed)
+{
+	union {
+		struct inotify_event	ev;
+		char			buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t len;
+	size_t off, i;
+	int hits = 0;
+
+	len = read(ifd, u.buf, sizeof(u.buf));
+	if (len <= 0)
+		return EINTR == errno || EAGAIN == errno ? 0 : -1;
+
+	for (off = 0; off < (size_t)len; off += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)(u.buf + off);
+		for (i = 0; i < n; i++) {
+			if (ev->wd == inputs[i].wd && ev->len &&
+			    0 == strcmp(ev->name, inputs[i].name)) {
+				*changed |= BOOST_PART(inputs[i].part);
+				hits++;
+			}
+		}
+	}
+
+	return hits;
+}
+
+/*
+ * Waits for inputs to change. Once one does, events are taken in until
+ * WATCH_DEBOUNCE_MS pass without any, so that a file written in several
+ * steps or several files saved at once cause one rebuild.
+ */
+static int
+watch_wait(int ifd, watch_input_t *inputs, size_t n, unsigned *changed)
+{
+	struct pollfd pfd = { ifd, POLLIN, 0 };
+	int seen = 0;
+	int rv;
+
+	while (!watch_stop) {
+		rv = poll(&pfd, 1, seen ? WATCH_DEBOUNCE_MS : -1);
+		if (-1 == rv && EINTR != errno) {
+			perror("Failed to wait for input changes");
+			return 1;
+		}
+		if (0 == rv)
+			return 0;
+		if (rv > 0) {
+			rv = watch_read(ifd, inputs, n, changed);
+			if (rv < 0) {
+				perror("Failed to read input changes");
+				return 1;
+			}
+			seen |= rv > 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Moves the freshly written image over outfile in one step, readers
+ * see either the old image or the new one. Like create the first
+ * build does not replace an existing file.
+ */
+static int
+watch_publish(const char *tmp_name, const char *outfile, int first)
+{
+	if (0 == renameat2(AT_FDCWD, tmp_name, AT_FDCWD, outfile,
+	                   first ? RENAME_NOREPLACE : 0))
+		return 0;
+
+	/* Filesystems without RENAME_NOREPLACE, link() does the same. */
+	if (first && (EINVAL == errno || ENOSYS == errno) &&
+	    0 == link(tmp_name, outfile)) {
+		unlink(tmp_name);
+		return 0;
+	}
+	fprintf(stderr, "Failed to publish %s: %s\n", outfile,
+	        strerror(errno));
+	unlink(tmp_name);
+
+	return 1;
+}
+
+static void
+watch_print_changed(unsigned changed)
+{
+	static const char *names[INDEX_PARTS] = {
+		[INDEX_KERNEL] = "kernel",
+		[INDEX_BCODE] = "bcode",
+		[INDEX_RAMDISK] = "ramdisk",
+	};
+	const char *sep = "";
+	int i;
+
+	for (i = 0; i < INDEX_PARTS; i++) {
+		if (changed & BOOST_PART(i)) {
+			printf("%s%s", sep, names[i]);
+			sep = ", ";
+		}
+	}
+}
+
+/*
+ * create --watch. Builds the image, then rebuilds it whenever one of
+ * the inputs changes until interrupted. Unchanged inputs stay loaded
+ * and their deflated components are reused, see boost_create_pieces(),
+ * so a rebuild costs about as much as deflating what changed. Failed
+ * rebuilds leave the last image in place.
+ */
+int
+watch_create(const create_args_t *args)
+{
+	char tmp_name[PATH_MAX];
+	watch_input_t inputs[INDEX_PARTS];
+	image_create_args_t cargs;
+	boost_pieces_t pieces;
+	struct sigaction sa;
+	unsigned changed = 0;
+	uint64_t start;
+	size_t n = 0, i;
+	int first = 1;
+	int ifd, rv = 1;
+
+	if ((size_t)snprintf(tmp_name, sizeof(tmp_name), "%s.tmp",
+	                     args->outfile) >= sizeof(tmp_name)) {
+		fprintf(stderr, "Output file name too long!\n");
+		return 1;
+	}
+
+	memset(inputs, 0, sizeof(inputs));
+	memset(&pieces, 0, sizeof(boost_pieces_t));
+	inputs[n].path = args->kernel;
+	inputs[n++].part = INDEX_KERNEL;
+	if (args->bcode) {
+		inputs[n].path = args->bcode;
+		inputs[n++].part = INDEX_BCODE;
+	}
+	if (args->ramdisk) {
+		inputs[n].path = args->ramdisk;
+		inputs[n].scrub = args->scrub_ramdisk;
+		inputs[n++].part = INDEX_RAMDISK;
+	}
+	for (i = 0; i < n; i++) {
+		inputs[i].fd = -1;
+		inputs[i].wd = -1;
+		changed |= BOOST_PART(inputs[i].part);
+	}
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == ifd) {
+		perror("Failed to init inotify");
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (0 != watch_add(ifd, &inputs[i]))
+			goto watch_failed;
+	}
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = watch_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	memset(&cargs, 0, sizeof(image_create_args_t));
+	cargs.use_zlib = args->use_zlib;
+	cargs.max_size = args->max_size;
+	cargs.load_offset = args->load_offset;
+	cargs.image_descr = args->image_descr;
+	cargs.image_version = args->image_version;
+
+	printf("Watching for changes, interrupt to stop\n");
+	while (!watch_stop) {
+		start = monotonic_ns();
+		for (i = 0; i < n; i++) {
+			if ((changed & BOOST_PART(inputs[i].part)) &&
+			    0 != watch_load(&inputs[i]))
+				break;
+		}
+		if (i < n) {
+			/* Retried with the next change, the input may be
+			 * in the middle of being written. */
+			watch_unload(&inputs[i]);
+			if (first)
+				goto watch_failed;
+		} else {
+			for (i = 0; i < n; i++) {
+				switch (inputs[i].part) {
+				case INDEX_KERNEL:
+					cargs.kernel = (uint32_t *)
+					               inputs[i].file.addr;
+					cargs.kernel_len = inputs[i].file.len;
+					break;
+				case INDEX_BCODE:
+					cargs.bcode = (uint32_t *)
+					              inputs[i].file.addr;
+					cargs.bcode_len = inputs[i].file.len;
+					break;
+				default:
+					cargs.ramdisk = (uint32_t *)
+					                inputs[i].file.addr;
+					cargs.ramdisk_len = inputs[i].file.len;
+					cargs.ramdisk_segs = inputs[i].map.segs;
+					cargs.ramdisk_nsegs =
+						inputs[i].map.nsegs;
+					break;
+				}
+			}
+
+			unlink(tmp_name);
+			if (0 == boost_create_pieces(tmp_name, &cargs, changed,
+			                             &pieces) &&
+			    0 == watch_publish(tmp_name, args->outfile,
+			                       first)) {
+				printf("Rebuilt %s\t: ", args->outfile);
+				watch_print_changed(changed);
+				printf(" changed, %zukB deflated in %.1f ms\n",
+				       pieces.deflated / 1024,
+				       (monotonic_ns() - start) / 1e6);
+				first = 0;
+				changed = 0;
+			} else if (first) {
+				goto watch_failed;
+			}
+		}
+		fflush(stdout);
+
+		if (0 != watch_wait(ifd, inputs, n, &changed))
+			goto watch_failed;
+	}
+	rv = 0;
+
+watch_failed:
+	zlib_free_pieces(pieces.piece, BOOST_PIECES);
+	for (i = 0; i < n; i++)
+		watch_unload(&inputs[i]);
+	close(ifd);
+
+	return rv;
+}